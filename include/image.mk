@@ -395,6 +395,32 @@ define Device/Build/check_size
 	}
 endef
 
+ifdef CONFIG_IMAGE_CACHE
+IMAGE_CACHE_DIR ?= $(TMP_DIR)/image-cache
+
+# Run the build commands $(1) for $@ unless an image built by the same
+# commands from the same inputs is in the cache
+define Device/Build/cached
+$(if $(shell $(SCRIPT_DIR)/image-cache.sh lookup $(IMAGE_CACHE_DIR) $@ '$(subst ','\'',$(strip $(1)))' $^),
+	@echo "Using cached $(notdir $@)",
+	@rm -f $@
+$(1)
+	@$(SCRIPT_DIR)/image-cache.sh store $(IMAGE_CACHE_DIR) $@)
+endef
+
+# Keep the cache within the configured size and age, once per image build
+Device/Build/cache_prune = \
+	$(SCRIPT_DIR)/image-cache.sh prune $(IMAGE_CACHE_DIR) \
+		$(CONFIG_IMAGE_CACHE_SIZE) $(CONFIG_IMAGE_CACHE_AGE)
+else
+define Device/Build/cached
+	@rm -f $@
+$(1)
+endef
+
+Device/Build/cache_prune :=
+endif
+
 define Device/Build/compile
   $$(_COMPILE_TARGET): $(KDIR)/$(1)
   $(eval $(call Device/Export,$(KDIR)/$(1)))
@@ -414,9 +440,7 @@ define Device/Build/kernel
       install: $(KDIR)/$$(KERNEL_IMAGE)
     endif
     $(KDIR)/$$(KERNEL_IMAGE): $(KDIR)/$$(KERNEL_NAME)
-	@rm -f $$@
-	$$(call concat_cmd,$$(KERNEL))
-	$$(if $$(KERNEL_SIZE),$$(call Device/Build/check_size,$$(KERNEL_SIZE)))
+	$$(call Device/Build/cached,$$(call concat_cmd,$$(KERNEL))$$(if $$(KERNEL_SIZE),$$(call Device/Build/check_size,$$(KERNEL_SIZE))))
   endif
 endef
 
@@ -426,9 +450,8 @@ define Device/Build/image
   $(eval $(call Device/Export,$(KDIR)/tmp/$(KERNEL_INITRAMFS_IMAGE),$(1)))
   $(eval $(call Device/Export,$(KDIR)/tmp/$(call IMAGE_NAME,$(1),$(2)),$(1)))
   $(KDIR)/tmp/$(call IMAGE_NAME,$(1),$(2)): $(KDIR)/$$(KERNEL_IMAGE) $(KDIR)/root.$(1)
-	@rm -f $$@
 	[ -f $$(word 1,$$^) -a -f $$(word 2,$$^) ]
-	$$(call concat_cmd,$(if $(IMAGE/$(2)/$(1)),$(IMAGE/$(2)/$(1)),$(IMAGE/$(2))))
+	$$(call Device/Build/cached,$$(call concat_cmd,$(if $(IMAGE/$(2)/$(1)),$(IMAGE/$(2)/$(1)),$(IMAGE/$(2)))))
 
   .IGNORE: $(BIN_DIR)/$(call IMAGE_NAME,$(1),$(2))
   $(BIN_DIR)/$(call IMAGE_NAME,$(1),$(2)): $(KDIR)/tmp/$(call IMAGE_NAME,$(1),$(2))
@@ -476,9 +499,11 @@ define BuildImage
     image_prepare: compile
 		mkdir -p $(KDIR)/tmp
 		$(call Image/Prepare)
+		$(call Device/Build/cache_prune)
   else
     image_prepare:
 		mkdir -p $(KDIR)/tmp
+		$(call Device/Build/cache_prune)
   endif
 
   mkfs_prepare: image_prepare
@@ -216,6 +216,29 @@ struct crypt_op {
 	caddr_t		iv;
 };
 
+/*
+ * Asynchronous operations.  CIOCCRYPTM submits a vector of them, each
+ * op gets the error it was refused with in status, or 0 if it was
+ * queued.  Queued ops do not block, their results are read() from the
+ * file as struct crypt_result, which is when dst and mac are written.
+ * The file polls readable while results are waiting.
+ */
+struct crypt_aop {
+	struct crypt_op	cop;
+	u_int32_t	id;		/* returned in the result */
+	int		status;		/* returns: 0 if queued, or errno */
+};
+
+struct crypt_mop {
+	u_int		count;		/* number of ops in reqs */
+	struct crypt_aop *reqs;
+};
+
+struct crypt_result {
+	u_int32_t	id;
+	int		status;		/* 0, or errno of the op */
+};
+
 /*
  * Parameters for looking up a crypto driver/device by
  * device name or by id.  The latter are returned for
@@ -273,6 +296,7 @@ struct crypt_kop {
 #define CIOCGSESSION2	_IOWR('c', 106, struct session2_op)
 #define CIOCKEY2	_IOWR('c', 107, struct crypt_kop)
 #define CIOCFINDDEV	_IOWR('c', 108, struct crypt_find_op)
+#define CIOCCRYPTM	_IOWR('c', 109, struct crypt_mop)
 
 struct cryptotstat {
 	struct timespec	acc;		/* total accumulated time */
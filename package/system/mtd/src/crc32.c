@@ -37,7 +37,22 @@
  *      polynomial $edb88320
  */
 
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define CRC32_PCLMUL 1
+#endif
+
+#ifdef __ARM_FEATURE_CRC32
+#include <arm_acle.h>
+#endif
+
+#include "crc32.h"
 
 const uint32_t crc32_table[256] = {
 	0x00000000L, 0x77073096L, 0xee0e612cL, 0x990951baL, 0x076dc419L,
@@ -93,3 +108,225 @@ const uint32_t crc32_table[256] = {
 	0x5d681b02L, 0x2a6f2b94L, 0xb40bbe37L, 0xc30c8ea1L, 0x5a05df1bL,
 	0x2d02ef8dL
 };
+
+
+/*
+ * Tables for slicing-by-8: crc32_slice[k][n] is the CRC of byte n
+ * followed by k zero bytes. Generated from crc32_table at startup.
+ */
+static uint32_t crc32_slice[8][256];
+
+static uint32_t (*crc32_impl)(uint32_t val, const unsigned char *s, size_t len);
+
+static inline uint32_t
+crc32_bytes(uint32_t val, const unsigned char *s, size_t len)
+{
+	while (len--)
+		val = crc32_table[(val ^ *s++) & 0xff] ^ (val >> 8);
+	return val;
+}
+
+static uint32_t
+crc32_sb8(uint32_t val, const unsigned char *s, size_t len)
+{
+	uint32_t w1, w2;
+
+	while (len && ((uintptr_t) s & 7)) {
+		val = crc32_table[(val ^ *s++) & 0xff] ^ (val >> 8);
+		len--;
+	}
+
+	for (; len >= 8; s += 8, len -= 8) {
+		memcpy(&w1, s, 4);
+		memcpy(&w2, s + 4, 4);
+		w1 = le32toh(w1) ^ val;
+		w2 = le32toh(w2);
+		val = crc32_slice[7][w1 & 0xff] ^
+		      crc32_slice[6][(w1 >> 8) & 0xff] ^
+		      crc32_slice[5][(w1 >> 16) & 0xff] ^
+		      crc32_slice[4][w1 >> 24] ^
+		      crc32_slice[3][w2 & 0xff] ^
+		      crc32_slice[2][(w2 >> 8) & 0xff] ^
+		      crc32_slice[1][(w2 >> 16) & 0xff] ^
+		      crc32_slice[0][w2 >> 24];
+	}
+
+	return crc32_bytes(val, s, len);
+}
+
+#ifdef __ARM_FEATURE_CRC32
+/* ARMv8 CRC32 instructions use the same (reflected) polynomial */
+static uint32_t
+crc32_armv8(uint32_t val, const unsigned char *s, size_t len)
+{
+	uint64_t d;
+	uint32_t w;
+
+	while (len && ((uintptr_t) s & 7)) {
+		val = __crc32b(val, *s++);
+		len--;
+	}
+
+	for (; len >= 8; s += 8, len -= 8) {
+		memcpy(&d, s, 8);
+		val = __crc32d(val, d);
+	}
+
+	if (len >= 4) {
+		memcpy(&w, s, 4);
+		val = __crc32w(val, w);
+		s += 4;
+		len -= 4;
+	}
+
+	while (len--)
+		val = __crc32b(val, *s++);
+
+	return val;
+}
+#endif
+
+#ifdef CRC32_PCLMUL
+/*
+ * Carry-less multiplication folding as described in Intel's "Fast CRC
+ * Computation for Generic Polynomials Using PCLMULQDQ Instruction".
+ * The constants match the kernel's crc32-pclmul_asm.S. Requires
+ * len >= 64 and a multiple of 16.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t
+crc32_pclmul_fold(uint32_t val, const unsigned char *s, size_t len)
+{
+	const __m128i k1k2 = _mm_set_epi64x(0x1c6e41596ULL, 0x154442bd4ULL);
+	const __m128i k3k4 = _mm_set_epi64x(0x0ccaa009eULL, 0x1751997d0ULL);
+	const __m128i k5 = _mm_set_epi64x(0, 0x163cd6124ULL);
+	const __m128i poly = _mm_set_epi64x(0x1f7011641ULL, 0x1db710641ULL);
+	const __m128i mask32 = _mm_set_epi32(0, 0, 0, ~0);
+	__m128i x1, x2, x3, x4, t1, t2, t3, t4;
+
+	x1 = _mm_loadu_si128((const __m128i *) s);
+	x2 = _mm_loadu_si128((const __m128i *) (s + 16));
+	x3 = _mm_loadu_si128((const __m128i *) (s + 32));
+	x4 = _mm_loadu_si128((const __m128i *) (s + 48));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(val));
+	s += 64;
+	len -= 64;
+
+	/* fold four 128 bit lanes at a time */
+	for (; len >= 64; s += 64, len -= 64) {
+		t1 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+		t2 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+		t3 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+		t4 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, t1),
+				   _mm_loadu_si128((const __m128i *) s));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, t2),
+				   _mm_loadu_si128((const __m128i *) (s + 16)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, t3),
+				   _mm_loadu_si128((const __m128i *) (s + 32)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, t4),
+				   _mm_loadu_si128((const __m128i *) (s + 48)));
+	}
+
+	/* fold the four lanes into one */
+	t1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, t1), x2);
+	t1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, t1), x3);
+	t1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, t1), x4);
+
+	for (; len >= 16; s += 16, len -= 16) {
+		t1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, t1),
+				   _mm_loadu_si128((const __m128i *) s));
+	}
+
+	/* 128 -> 64 bits */
+	t1 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), t1);
+
+	/* 64 -> 32 bits */
+	t1 = _mm_and_si128(x1, mask32);
+	x1 = _mm_srli_si128(x1, 4);
+	x1 = _mm_xor_si128(x1, _mm_clmulepi64_si128(t1, k5, 0x00));
+
+	/* Barrett reduction */
+	t1 = _mm_and_si128(x1, mask32);
+	t1 = _mm_clmulepi64_si128(t1, poly, 0x10);
+	t1 = _mm_and_si128(t1, mask32);
+	t1 = _mm_clmulepi64_si128(t1, poly, 0x00);
+	x1 = _mm_xor_si128(x1, t1);
+
+	return _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t
+crc32_pclmul(uint32_t val, const unsigned char *s, size_t len)
+{
+	size_t n;
+
+	if (len < 64)
+		return crc32_sb8(val, s, len);
+
+	n = len & ~(size_t) 15;
+	val = crc32_pclmul_fold(val, s, n);
+
+	return crc32_sb8(val, s + n, len - n);
+}
+
+static int
+crc32_have_pclmul(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0;
+
+	return (ecx & bit_PCLMUL) && (ecx & bit_SSE4_1);
+}
+#endif
+
+__attribute__((constructor))
+static void
+crc32_init(void)
+{
+	uint32_t c;
+	int n, k;
+
+	for (n = 0; n < 256; n++) {
+		c = crc32_table[n];
+		crc32_slice[0][n] = c;
+		for (k = 1; k < 8; k++) {
+			c = crc32_table[c & 0xff] ^ (c >> 8);
+			crc32_slice[k][n] = c;
+		}
+	}
+
+	crc32_impl = crc32_sb8;
+#ifdef __ARM_FEATURE_CRC32
+	crc32_impl = crc32_armv8;
+#endif
+#ifdef CRC32_PCLMUL
+	if (crc32_have_pclmul())
+		crc32_impl = crc32_pclmul;
+#endif
+}
+
+uint32_t
+crc32(uint32_t val, const void *ss, size_t len)
+{
+	/* not worth the call overhead for small header fields */
+	if (len < 16)
+		return crc32_bytes(val, ss, len);
+
+	return crc32_impl(val, ss, len);
+}
@@ -148,24 +148,25 @@ static uint32_t strntoul(char *str, char **endptr, int base, size_t len) {
 
 uint32_t compute_crc32(uint32_t crc, off_t start, size_t compute_len, int fd)
 {
-	uint8_t readbuf[1024];
+	static uint8_t readbuf[64 * 1024];
 	ssize_t res;
 	off_t offset = start;
 
-	/* Read a buffer's worth of bytes  */
-	while (fd && (compute_len >= sizeof(readbuf))) {
-		res = pread(fd, readbuf, sizeof(readbuf), offset);
+	while (fd && (compute_len > 0)) {
+		size_t len = compute_len;
+
+		if (len > sizeof(readbuf))
+			len = sizeof(readbuf);
+
+		res = pread(fd, readbuf, len, offset);
+		if (res <= 0)
+			break;
+
 		crc = crc32(crc, readbuf, res);
-		compute_len = compute_len - res;
+		compute_len -= res;
 		offset += res;
 	}
 
-	/* Less than buffer-size bytes remains, read compute_len bytes */
-	if (fd && (compute_len > 0)) {
-	  res = pread(fd, readbuf, compute_len, offset);
-	  crc = crc32(crc, readbuf, res);
-	}
-
 	return crc;
 }
 
@@ -32,6 +32,9 @@
 
 #define PAD(x) (((x)+3)&~3)
 
+/* the kernel never reads back data nodes larger than a page */
+#define JFFS2_MAX_DATA_LEN 4096
+
 #if BYTE_ORDER == BIG_ENDIAN
 # define CLEANMARKER "\x19\x85\x20\x03\x00\x00\x00\x0c\xf0\x60\xdc\x98"
 #else
@@ -160,12 +163,61 @@ static int add_dir(const char *name, int parent)
 	return inode;
 }
 
+/*
+ * Same algorithm as the kernel's jffs2_rtime_compress(). It is always
+ * available in our kernel configs, unlike zlib and lzo. On success
+ * *sourcelen and *dstlen are updated with the amount of input consumed
+ * and the amount of output produced, which may be less than the whole
+ * input if the output space ran out first.
+ */
+static int jffs2_rtime_compress(const unsigned char *data_in,
+				unsigned char *cpage_out,
+				uint32_t *sourcelen, uint32_t *dstlen)
+{
+	unsigned short positions[256];
+	uint32_t outpos = 0;
+	uint32_t pos = 0;
+
+	if (*dstlen <= 3)
+		return -1;
+
+	memset(positions, 0, sizeof(positions));
+
+	while (pos < *sourcelen && outpos + 2 <= *dstlen) {
+		uint32_t backpos, runlen = 0;
+		unsigned char value;
+
+		value = data_in[pos];
+		cpage_out[outpos++] = data_in[pos++];
+
+		backpos = positions[value];
+		positions[value] = pos;
+
+		while ((backpos < pos) && (pos < *sourcelen) &&
+		       (data_in[pos] == data_in[backpos++]) && (runlen < 255)) {
+			pos++;
+			runlen++;
+		}
+		cpage_out[outpos++] = runlen;
+	}
+
+	/* not worth it, the caller falls back to an uncompressed node */
+	if (outpos >= pos)
+		return -1;
+
+	*sourcelen = pos;
+	*dstlen = outpos;
+	return 0;
+}
+
 static void add_file(const char *name, int parent)
 {
 	int inode, f_offset = 0, fd;
 	struct jffs2_raw_inode ri;
 	struct stat st;
-	char wbuf[4096];
+	char wbuf[JFFS2_MAX_DATA_LEN];
+	char cbuf[JFFS2_MAX_DATA_LEN];
+	uint32_t wlen = 0;
 	const char *fname;
 
 	if (stat(name, &st)) {
@@ -201,36 +253,61 @@ static void add_file(const char *name, int parent)
 	}
 
 	for (;;) {
-		int len = 0;
-
-		for (;;) {
-			len = rbytes() - sizeof(ri);
-			if (len > 128)
-				break;
+		uint32_t len = 0, dsize, csize;
+		char *data;
+		int r;
 
+		/* rbytes() may be smaller than the node header, don't wrap */
+		while (rbytes() <= (int) sizeof(ri) + 128) {
 			pad(erasesize);
 			prep_eraseblock();
 		}
+		len = rbytes() - sizeof(ri);
 
-		if (len > sizeof(wbuf))
-			len = sizeof(wbuf);
+		while (wlen < sizeof(wbuf)) {
+			r = read(fd, wbuf + wlen, sizeof(wbuf) - wlen);
+			if (r <= 0)
+				break;
+			wlen += r;
+		}
 
-		len = read(fd, wbuf, len);
-		if (len <= 0)
+		if (!wlen)
 			break;
 
-		ri.totlen = sizeof(ri) + len;
+		if (len > wlen)
+			len = wlen;
+
+		/* compress as much as fits into the rest of the eraseblock,
+		 * store the data raw if that does not save anything */
+		dsize = wlen;
+		csize = len;
+		if (!jffs2_rtime_compress((unsigned char *) wbuf,
+					  (unsigned char *) cbuf,
+					  &dsize, &csize)) {
+			ri.compr = JFFS2_COMPR_RTIME;
+			data = cbuf;
+		} else {
+			ri.compr = JFFS2_COMPR_NONE;
+			dsize = csize = len;
+			data = wbuf;
+		}
+
+		ri.totlen = sizeof(ri) + csize;
 		ri.hdr_crc = crc32(0, &ri, sizeof(struct jffs2_unknown_node) - 4);
 		ri.version = ++last_version;
 		ri.offset = f_offset;
-		ri.csize = ri.dsize = len;
+		ri.csize = csize;
+		ri.dsize = dsize;
 		ri.node_crc = crc32(0, &ri, sizeof(ri) - 8);
-		ri.data_crc = crc32(0, wbuf, len);
-		f_offset += len;
+		ri.data_crc = crc32(0, data, csize);
+		f_offset += dsize;
 		add_data((char *) &ri, sizeof(ri));
-		add_data(wbuf, len);
+		add_data(data, csize);
 		pad(4);
 		prep_eraseblock();
+
+		wlen -= dsize;
+		memmove(wbuf, wbuf + dsize, wlen);
 	}
 
 	close(fd);
@@ -0,0 +1,208 @@
+/*
+ * Write journal for resuming interrupted mtd writes
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License v2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The journal is a header followed by one record per eraseblock that
+ * has been erased and written completely. A block is only skipped on
+ * resume if the image data still matches the record and the flash
+ * contents read back identical to the image, so a stale or foreign
+ * journal can never cause a block to be left unwritten.
+ */
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "crc32.h"
+#include "mtd.h"
+
+#define JOURNAL_MAGIC	0x4d54444a	/* "MTDJ" */
+#define JOURNAL_VERSION	1
+
+struct journal_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t erasesize;
+	char device[64];
+};
+
+struct journal_rec {
+	uint32_t part;		/* index in the <device>[:<device>...] list */
+	uint32_t offset;	/* offset of the block on the device */
+	uint32_t len;
+	uint32_t crc;
+};
+
+static int journal_fd = -1;
+static char *journal_file;
+static struct journal_rec *recs;
+static int n_recs;
+static char *readbuf;
+static int skipped;
+
+static int
+journal_reset(const char *mtd)
+{
+	struct journal_hdr hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = JOURNAL_MAGIC;
+	hdr.version = JOURNAL_VERSION;
+	hdr.erasesize = erasesize;
+	strncpy(hdr.device, mtd, sizeof(hdr.device) - 1);
+
+	n_recs = 0;
+	if (ftruncate(journal_fd, 0) ||
+	    pwrite(journal_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+		return -1;
+
+	lseek(journal_fd, sizeof(hdr), SEEK_SET);
+	fdatasync(journal_fd);
+	return 0;
+}
+
+int
+mtd_journal_open(const char *file, const char *mtd)
+{
+	struct journal_hdr hdr;
+	struct journal_rec rec;
+
+	journal_fd = open(file, O_RDWR | O_CREAT, 0600);
+	if (journal_fd < 0) {
+		fprintf(stderr, "Could not open journal %s\n", file);
+		return -1;
+	}
+
+	journal_file = strdup(file);
+	readbuf = malloc(erasesize);
+	if (!journal_file || !readbuf) {
+		fprintf(stderr, "Out of memory!\n");
+		goto err;
+	}
+
+	if (read(journal_fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    hdr.magic != JOURNAL_MAGIC || hdr.version != JOURNAL_VERSION ||
+	    hdr.erasesize != erasesize ||
+	    strncmp(hdr.device, mtd, sizeof(hdr.device) - 1) != 0) {
+		if (journal_reset(mtd) < 0) {
+			fprintf(stderr, "Could not initialize journal %s\n", file);
+			goto err;
+		}
+		return 0;
+	}
+
+	while (read(journal_fd, &rec, sizeof(rec)) == sizeof(rec)) {
+		struct journal_rec *tmp;
+
+		if (!(n_recs % 64)) {
+			tmp = realloc(recs, (n_recs + 64) * sizeof(*recs));
+			if (!tmp)
+				break;
+			recs = tmp;
+		}
+		recs[n_recs++] = rec;
+	}
+
+	/* drop a partially written trailing record */
+	lseek(journal_fd, sizeof(hdr) + n_recs * sizeof(rec), SEEK_SET);
+
+	if (quiet < 2 && n_recs)
+		fprintf(stderr, "Resuming from journal %s (%d blocks recorded)\n",
+			file, n_recs);
+
+	return 0;
+
+err:
+	mtd_journal_close(false);
+	return -1;
+}
+
+bool
+mtd_journal_resuming(void)
+{
+	return journal_fd >= 0 && n_recs > 0;
+}
+
+int
+mtd_journal_check(int fd, int part, int offset, const char *buf, int len)
+{
+	uint32_t crc = 0;
+	int i;
+
+	if (journal_fd < 0)
+		return 0;
+
+	/* the latest record for a block wins */
+	for (i = n_recs - 1; i >= 0; i--) {
+		if (recs[i].part != part || recs[i].offset != offset)
+			continue;
+
+		if (recs[i].len != len)
+			return 0;
+
+		crc = crc32(0xFFFFFFFF, buf, len);
+		if (recs[i].crc != crc)
+			return 0;
+
+		if (pread(fd, readbuf, len, offset) != len ||
+		    memcmp(readbuf, buf, len) != 0)
+			return 0;
+
+		skipped++;
+		return 1;
+	}
+
+	return 0;
+}
+
+void
+mtd_journal_commit(int part, int offset, const char *buf, int len)
+{
+	struct journal_rec rec;
+
+	if (journal_fd < 0)
+		return;
+
+	rec.part = part;
+	rec.offset = offset;
+	rec.len = len;
+	rec.crc = crc32(0xFFFFFFFF, buf, len);
+
+	if (write(journal_fd, &rec, sizeof(rec)) != sizeof(rec) ||
+	    fdatasync(journal_fd)) {
+		fprintf(stderr, "\nFailed to update journal, disabling it\n");
+		mtd_journal_close(false);
+	}
+}
+
+void
+mtd_journal_close(bool done)
+{
+	if (journal_fd >= 0) {
+		close(journal_fd);
+		if (done) {
+			if (quiet < 2 && skipped)
+				fprintf(stderr, "Skipped %d blocks already written\n", skipped);
+			unlink(journal_file);
+		}
+	}
+
+	free(journal_file);
+	free(recs);
+	free(readbuf);
+	journal_fd = -1;
+	journal_file = NULL;
+	recs = NULL;
+	readbuf = NULL;
+	n_recs = 0;
+}
@@ -27,6 +27,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdarg.h>
 #include <signal.h>
 #include <sys/ioctl.h>
 #include <sys/syscall.h>
@@ -48,6 +49,7 @@
 #include <libubox/md5.h>
 
 #define MAX_ARGS 8
+#define DUMP_BUFSIZE	(1024 * 1024)
 #define JFFS2_DEFAULT_DIR	"" /* directory name without /, empty means root dir */
 
 static char *buf = NULL;
@@ -60,6 +62,7 @@ int mtdsize = 0;
 int erasesize = 0;
 int jffs2_skip_bytes=0;
 int mtdtype = 0;
+int preerase_blocks = 0;
 
 int mtd_open(const char *mtd, bool block)
 {
@@ -274,10 +277,75 @@ mtd_erase(const char *mtd)
 }
 
 static int
-mtd_dump(const char *mtd, int part_offset, int size)
+write_all(int fd, const char *buf, int len)
 {
-	int ret = 0, offset = 0;
-	int fd;
+	int w;
+
+	while (len > 0) {
+		w = write(fd, buf, len);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += w;
+		len -= w;
+	}
+
+	return 0;
+}
+
+/*
+ * splice() needs a pipe on one side, so data for a socket on stdout goes
+ * through an intermediate pipe. Returns the amount read from fd, all of
+ * which has been written out when it returns.
+ */
+static int
+splice_out(int fd, loff_t *ofs, int len, int *pipefd)
+{
+	int rlen, left, w;
+
+	if (pipefd[1] < 0)
+		return splice(fd, ofs, 1, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+
+	rlen = splice(fd, ofs, pipefd[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+	for (left = rlen; left > 0; left -= w) {
+		w = splice(pipefd[0], NULL, 1, NULL, left, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (w < 0 && errno == EINTR)
+			w = 0;
+		else if (w <= 0) {
+			/* the pipe still holds data, don't fall back to reads */
+			errno = EIO;
+			return -1;
+		}
+	}
+
+	return rlen;
+}
+
+static void
+md5_print(FILE *f, const unsigned char *md5, const char *fmt, ...)
+{
+	va_list ap;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		fprintf(f, "%02x", md5[i]);
+
+	va_start(ap, fmt);
+	vfprintf(f, fmt, ap);
+	va_end(ap);
+}
+
+static int
+mtd_dump(const char *mtd, int part_offset, int size, int hash)
+{
+	int ret = 0, offset = part_offset;
+	int fd, bufsize, use_splice = 0, block_open = 0, block_start = 0;
+	int pipefd[2] = { -1, -1 };
+	md5_ctx_t total, block;
+	unsigned char md5[16];
+	struct stat st;
 	char *buf;
 
 	if (quiet < 2)
@@ -292,16 +360,58 @@ mtd_dump(const char *mtd, int part_offset, int size)
 	if (!size)
 		size = mtdsize;
 
-	if (part_offset)
-		lseek(fd, part_offset, SEEK_SET);
+	/*
+	 * NOR has no bad blocks, so read several eraseblocks per call.
+	 * NAND reads stay eraseblock sized so that bad blocks can be
+	 * skipped, and hashing only needs one eraseblock at a time.
+	 */
+	bufsize = erasesize;
+	if (!hash && mtdtype != MTD_NANDFLASH && erasesize < DUMP_BUFSIZE)
+		bufsize = DUMP_BUFSIZE - (DUMP_BUFSIZE % erasesize);
+
+	posix_fadvise(fd, part_offset, size, POSIX_FADV_SEQUENTIAL);
+
+	/* let the kernel move the data if stdout is a pipe or a socket */
+	if (!hash && !fstat(1, &st)) {
+		if (S_ISFIFO(st.st_mode))
+			use_splice = 1;
+		else if (S_ISSOCK(st.st_mode) && !pipe(pipefd))
+			use_splice = 1;
+	}
 
-	buf = malloc(erasesize);
-	if (!buf)
+	buf = malloc(bufsize);
+	if (!buf) {
+		close(fd);
 		return -1;
+	}
 
-	do {
-		int len = (size > erasesize) ? (erasesize) : (size);
-		int rlen = read(fd, buf, len);
+	md5_begin(&total);
+
+	while (size > 0 && offset < mtdsize) {
+		int blockofs = offset % erasesize;
+		int len = bufsize - blockofs;
+		int rlen;
+
+		if (len > size)
+			len = size;
+
+		if (mtd_block_is_bad(fd, offset - blockofs)) {
+			fprintf(stderr, "skipping bad block at 0x%08x\n", offset - blockofs);
+			offset += erasesize - blockofs;
+			continue;
+		}
+
+		if (use_splice) {
+			loff_t o = offset;
+
+			rlen = splice_out(fd, &o, len, pipefd);
+			if (rlen < 0 && (errno == EINVAL || errno == ENOSYS)) {
+				use_splice = 0;
+				continue;
+			}
+		} else {
+			rlen = pread(fd, buf, len, offset);
+		}
 
 		if (rlen < 0) {
 			if (errno == EINTR)
@@ -309,18 +419,49 @@ mtd_dump(const char *mtd, int part_offset, int size)
 			ret = -1;
 			goto out;
 		}
-		if (!rlen || rlen != len)
+		if (!rlen)
 			break;
-		if (mtd_block_is_bad(fd, offset)) {
-			fprintf(stderr, "skipping bad block at 0x%08x\n", offset);
-		} else {
-			size -= rlen;
-			write(1, buf, rlen);
+
+		if (hash) {
+			/* rlen never crosses an eraseblock boundary here */
+			md5_hash(buf, rlen, &total);
+			/* the first block may start mid-way with -o */
+			if (!block_open) {
+				md5_begin(&block);
+				block_open = 1;
+				block_start = offset - blockofs;
+			}
+			md5_hash(buf, rlen, &block);
+			if ((offset + rlen) % erasesize == 0 || rlen == size) {
+				md5_end(md5, &block);
+				block_open = 0;
+				md5_print(stdout, md5, " 0x%08x\n", block_start);
+			}
+		} else if (!use_splice && write_all(1, buf, rlen) < 0) {
+			ret = -1;
+			goto out;
 		}
+
+		size -= rlen;
 		offset += rlen;
-	} while (size > 0);
+	}
+
+	if (hash) {
+		/* the dump may end within a block at the end of the device */
+		if (block_open) {
+			md5_end(md5, &block);
+			md5_print(stdout, md5, " 0x%08x\n", block_start);
+		}
+		md5_end(md5, &total);
+		md5_print(stdout, md5, "  %s\n", mtd);
+	}
 
 out:
+	if (pipefd[0] >= 0) {
+		close(pipefd[0]);
+		close(pipefd[1]);
+	}
+	free(buf);
 	close(fd);
 	return ret;
 }
@@ -403,6 +544,10 @@ mtd_write(int imagefd, const char *mtd, char *fis_layout, size_t part_offset)
 	uint32_t offset = 0;
 	int jffs2_replaced = 0;
 	int skip_bad_blocks = 0;
+	int part = 0, committed;
+	off_t pos;
+	struct stat st;
+	int image_end;
 
 #ifdef FIS_SUPPORT
 	static struct fis_part new_parts[MAX_ARGS];
@@ -486,6 +631,19 @@ resume:
 	indicate_writing(mtd);
 
 	w = e = 0;
+
+	/*
+	 * Resumed writes must not erase blocks the journal may skip, and
+	 * only erase ahead when the length of what is left to write is
+	 * known; the end of an image on stdin is only seen once read.
+	 */
+	if (preerase_blocks && !no_erase && mtdtype != MTD_NANDFLASH &&
+	    !mtd_journal_resuming() && !fstat(imagefd, &st) &&
+	    S_ISREG(st.st_mode) && (pos = lseek(imagefd, 0, SEEK_CUR)) >= 0) {
+		image_end = st.st_size - pos + buflen;
+		image_end = (image_end + erasesize - 1) & ~(erasesize - 1);
+		mtd_preerase_start(fd, preerase_blocks, image_end);
+	}
 	for (;;) {
 		/* buffer may contain data already (from trx check or last mtd partition write attempt) */
 		while (buflen < erasesize) {
@@ -530,6 +688,7 @@ resume:
 				if (quiet < 2)
 					fprintf(stderr, "\nAppending jffs2 data from %s to %s...", jffs2file, mtd);
 				/* got an EOF marker - this is the place to add some jffs2 data */
+				mtd_preerase_stop();
 				skip = mtd_replace_jffs2(mtd, fd, e, jffs2file);
 				jffs2_replaced = 1;
 
@@ -549,8 +708,15 @@ resume:
 		}
 
 		/* need to erase the next block before writing data to it */
+		committed = 0;
 		if(!no_erase)
 		{
+			if (mtd_preerase_running() && w + buflen > e) {
+				pos = mtd_preerase_wait(w + buflen);
+				if (pos > e)
+					e = pos;
+			}
+
 			while (w + buflen > e - skip_bad_blocks) {
 				if (!quiet)
 					fprintf(stderr, "\b\b\b[e]");
@@ -567,16 +733,27 @@ resume:
 					continue;
 				}
 
+				/* written completely before an interruption */
+				pos = lseek(fd, 0, SEEK_CUR);
+				if (w == e - skip_bad_blocks && !offset &&
+				    mtd_journal_check(fd, part, pos, buf, buflen)) {
+					committed = 1;
+					e += erasesize;
+					break;
+				}
+
 				if (mtd_erase_block(fd, e) < 0) {
 					if (next) {
 						if (w < e) {
 							write(fd, buf + offset, e - w);
 							offset = e - w;
 						}
+						mtd_preerase_stop();
 						w = 0;
 						e = 0;
 						close(fd);
 						mtd = next;
+						part++;
 						fprintf(stderr, "\b\b\b   \n");
 						goto resume;
 					} else {
@@ -590,9 +767,17 @@ resume:
 			}
 		}
 
+		if (committed) {
+			lseek(fd, buflen, SEEK_CUR);
+			w += buflen;
+			buflen = 0;
+			continue;
+		}
+
 		if (!quiet)
 			fprintf(stderr, "\b\b\b[w]");
 
+		pos = lseek(fd, 0, SEEK_CUR);
 		if ((result = write(fd, buf + offset, buflen)) < buflen) {
 			if (result < 0) {
 				fprintf(stderr, "Error writing image.\n");
@@ -604,10 +789,15 @@ resume:
 		}
 		w += buflen;
 
+		if (!offset)
+			mtd_journal_commit(part, pos, buf, buflen);
+
 		buflen = 0;
 		offset = 0;
 	}
 
+	mtd_preerase_stop();
+
 	if (jffs2_replaced && trx_fixup) {
 		trx_fixup(fd, mtd);
 	}
@@ -625,6 +815,7 @@ resume:
 	}
 #endif
 
+	mtd_journal_close(true);
 	close(fd);
 	return 0;
 }
@@ -660,7 +851,14 @@ static void usage(void)
 	"        -j <name>               integrate <file> into jffs2 data when writing an image\n"
 	"        -s <number>             skip the first n bytes when appending data to the jffs2 partiton, defaults to \"0\"\n"
 	"        -p                      write beginning at partition offset\n"
-	"        -l <length>             the length of data that we want to dump\n");
+	"        -J <file>               keep a journal of written blocks in <file> and skip\n"
+	"                                blocks it lists as written when resuming a write\n"
+	"        -a <blocks>             on NOR flash, erase up to <blocks> eraseblocks ahead\n"
+	"                                of the writer in the background (not for images\n"
+	"                                read from stdin)\n"
+	"        -l <length>             the length of data that we want to dump\n"
+	"        -H                      dump md5 sums of each eraseblock and of the whole\n"
+	"                                dump instead of the data\n");
 	if (mtd_fixtrx) {
 	    fprintf(stderr,
 	"        -o offset               offset of the image header in the partition(for fixtrx)\n");
@@ -696,7 +894,9 @@ int main (int argc, char **argv)
 	int ch, i, boot, imagefd = 0, force, unlocked;
 	char *erase[MAX_ARGS], *device = NULL;
 	char *fis_layout = NULL;
+	char *journal = NULL;
 	size_t offset = 0, part_offset = 0, dump_len = 0;
+	int dump_hash = 0;
 	enum {
 		CMD_ERASE,
 		CMD_WRITE,
@@ -719,7 +919,7 @@ int main (int argc, char **argv)
 #ifdef FIS_SUPPORT
 			"F:"
 #endif
-			"frnqe:d:s:j:p:o:l:")) != -1)
+			"frnqHe:d:s:j:p:o:l:J:a:")) != -1)
 		switch (ch) {
 			case 'f':
 				force = 1;
@@ -733,6 +933,17 @@ int main (int argc, char **argv)
 			case 'j':
 				jffs2file = optarg;
 				break;
+			case 'J':
+				journal = optarg;
+				break;
+			case 'a':
+				errno = 0;
+				preerase_blocks = strtoul(optarg, 0, 0);
+				if (errno) {
+					fprintf(stderr, "-a: illegal numeric string\n");
+					usage();
+				}
+				break;
 			case 's':
 				errno = 0;
 				jffs2_skip_bytes = strtoul(optarg, 0, 0);
@@ -744,6 +955,9 @@ int main (int argc, char **argv)
 			case 'q':
 				quiet++;
 				break;
+			case 'H':
+				dump_hash = 1;
+				break;
 			case 'e':
 				i = 0;
 				while ((erase[i] != NULL) && ((i + 1) < MAX_ARGS))
@@ -837,6 +1051,8 @@ int main (int argc, char **argv)
 			fprintf(stderr, "Image check failed.\n");
 			exit(1);
 		}
+		if (journal && mtd_journal_open(journal, device) < 0)
+			exit(1);
 	} else if ((strcmp(argv[0], "jffs2write") == 0) && (argc == 3)) {
 		cmd = CMD_JFFS2WRITE;
 		device = argv[2];
@@ -871,7 +1087,7 @@ int main (int argc, char **argv)
 			mtd_verify(device, imagefile);
 			break;
 		case CMD_DUMP:
-			mtd_dump(device, offset, dump_len);
+			mtd_dump(device, offset, dump_len, dump_hash);
 			break;
 		case CMD_ERASE:
 			if (!unlocked)
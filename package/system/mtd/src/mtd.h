@@ -21,6 +21,15 @@ extern int mtd_write_buffer(int fd, const char *buf, int offset, int length);
 extern int mtd_write_jffs2(const char *mtd, const char *filename, const char *dir);
 extern int mtd_replace_jffs2(const char *mtd, int fd, int ofs, const char *filename);
 extern void mtd_parse_jffs2data(const char *buf, const char *dir);
+extern int mtd_journal_open(const char *file, const char *mtd);
+extern int mtd_journal_check(int fd, int part, int offset, const char *buf, int len);
+extern void mtd_journal_commit(int part, int offset, const char *buf, int len);
+extern void mtd_journal_close(bool done);
+extern bool mtd_journal_resuming(void);
+extern int mtd_preerase_start(int fd, int blocks, int end);
+extern int mtd_preerase_wait(int end);
+extern bool mtd_preerase_running(void);
+extern void mtd_preerase_stop(void);
 
 /* target specific functions */
 extern int trx_fixup(int fd, const char *name)  __attribute__ ((weak));
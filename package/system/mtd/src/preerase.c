@@ -0,0 +1,171 @@
+/*
+ * Background eraseblock pre-erase for mtd writes
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License v2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Erasing a NOR block takes far longer than programming it. A helper
+ * thread keeps up to a configurable number of blocks erased ahead of
+ * the writer, so that erasing and programming overlap. On concatenated
+ * devices spanning several chips both really run in parallel, on a
+ * single chip the driver can still suspend erases for programming.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+#include "mtd.h"
+
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int running;
+static int stop;
+static int failed;
+
+static int erase_fd;
+static int ahead;
+static int erased;	/* everything below this offset has been erased */
+static int limit;	/* erase up to this offset */
+static int max_end;
+
+static unsigned long long erase_time, stall_time;
+static int n_blocks;
+
+static unsigned long long
+now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void *
+preerase_thread(void *arg)
+{
+	unsigned long long t;
+	int offset, ret;
+
+	pthread_mutex_lock(&lock);
+	while (!stop) {
+		if (failed || erased >= limit || erased >= max_end) {
+			pthread_cond_wait(&cond, &lock);
+			continue;
+		}
+
+		offset = erased;
+		pthread_mutex_unlock(&lock);
+
+		t = now_us();
+		ret = mtd_erase_block(erase_fd, offset);
+		t = now_us() - t;
+
+		pthread_mutex_lock(&lock);
+		erase_time += t;
+		if (ret < 0) {
+			failed = 1;
+		} else {
+			erased += erasesize;
+			n_blocks++;
+		}
+		pthread_cond_broadcast(&cond);
+	}
+	pthread_mutex_unlock(&lock);
+
+	return NULL;
+}
+
+/*
+ * Start erasing from offset 0 of fd. Nothing at or above end is erased,
+ * callers pass the length of the image rounded up to the eraseblock size
+ * and do not pre-erase when it is not known.
+ */
+int
+mtd_preerase_start(int fd, int blocks, int end)
+{
+	if (running || blocks <= 0)
+		return 0;
+
+	erase_fd = fd;
+	ahead = blocks;
+	erased = 0;
+	limit = blocks * erasesize;
+	max_end = end < mtdsize ? end : mtdsize;
+	stop = failed = 0;
+	erase_time = stall_time = 0;
+	n_blocks = 0;
+
+	if (pthread_create(&thread, NULL, preerase_thread, NULL)) {
+		fprintf(stderr, "Failed to start the pre-erase thread\n");
+		return -1;
+	}
+
+	running = 1;
+	return 0;
+}
+
+/*
+ * Wait until everything below end is erased and return the offset up to
+ * which blocks have been erased. This is less than end if the end of the
+ * device was reached or an erase failed; the caller then erases the
+ * remaining blocks itself.
+ */
+int
+mtd_preerase_wait(int end)
+{
+	unsigned long long t;
+	int ret;
+
+	pthread_mutex_lock(&lock);
+	limit = end + ahead * erasesize;
+	pthread_cond_broadcast(&cond);
+
+	t = now_us();
+	while (erased < end && erased < max_end && !failed)
+		pthread_cond_wait(&cond, &lock);
+	stall_time += now_us() - t;
+
+	ret = erased;
+	pthread_mutex_unlock(&lock);
+
+	return ret;
+}
+
+bool
+mtd_preerase_running(void)
+{
+	return running;
+}
+
+void
+mtd_preerase_stop(void)
+{
+	unsigned long long overlap = 0;
+
+	if (!running)
+		return;
+
+	pthread_mutex_lock(&lock);
+	stop = 1;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+	pthread_join(thread, NULL);
+	running = 0;
+
+	if (quiet >= 2 || !n_blocks)
+		return;
+
+	if (erase_time > stall_time)
+		overlap = (erase_time - stall_time) * 100 / erase_time;
+
+	fprintf(stderr, "Pre-erased %d blocks in %llu ms, writer waited %llu ms"
+		" (%llu%% overlap)\n", n_blocks, erase_time / 1000,
+		stall_time / 1000, overlap);
+}
@@ -17,6 +17,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
 
 #if !defined(__BYTE_ORDER)
 #error "Unknown byte order"
@@ -36,6 +41,9 @@
 #define TRX_FLAGS_OFFSET		12
 #define TRX_MAX_PARTS			3
 
+/* Size of the I/O buffer, memory use does not depend on the TRX size */
+#define OTRX_BUF_SIZE			(64 * 1024)
+
 struct trx_header {
 	uint32_t magic;
 	uint32_t length;
@@ -49,6 +57,8 @@ char *trx_path;
 size_t trx_offset = 0;
 char *partition[TRX_MAX_PARTS] = {};
 
+static uint8_t otrx_buf[OTRX_BUF_SIZE] __attribute__((aligned(16)));
+
 static inline size_t otrx_min(size_t x, size_t y) {
 	return x < y ? x : y;
 }
@@ -124,8 +134,44 @@ static const uint32_t crc32_tbl[] = {
 	0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d,
 };
 
-uint32_t otrx_crc32(uint8_t *buf, size_t len) {
-	uint32_t crc = 0xffffffff;
+/* Tables for the 2nd, 3rd and 4th byte of a word, for CRC-ing 4 bytes at once */
+static uint32_t crc32_tbl4[3][256];
+
+static void otrx_crc32_init(void) {
+	uint32_t crc;
+	int i, j;
+
+	if (crc32_tbl4[0][1])
+		return;
+
+	for (i = 0; i < 256; i++) {
+		crc = crc32_tbl[i];
+		for (j = 0; j < 3; j++) {
+			crc = crc32_tbl[crc & 0xff] ^ (crc >> 8);
+			crc32_tbl4[j][i] = crc;
+		}
+	}
+}
+
+/* Continue crc over len bytes, start with 0xffffffff */
+uint32_t otrx_crc32(uint32_t crc, uint8_t *buf, size_t len) {
+	otrx_crc32_init();
+
+	while (len && ((uintptr_t)buf & 3)) {
+		crc = crc32_tbl[(crc ^ *buf) & 0xff] ^ (crc >> 8);
+		buf++;
+		len--;
+	}
+
+	while (len >= 4) {
+		crc ^= le32_to_cpu(*(uint32_t *)buf);
+		crc = crc32_tbl4[2][crc & 0xff] ^
+		      crc32_tbl4[1][(crc >> 8) & 0xff] ^
+		      crc32_tbl4[0][(crc >> 16) & 0xff] ^
+		      crc32_tbl[crc >> 24];
+		buf += 4;
+		len -= 4;
+	}
 
 	while (len) {
 		crc = crc32_tbl[(crc ^ *buf) & 0xff] ^ (crc >> 8);
@@ -136,6 +182,155 @@ uint32_t otrx_crc32(uint8_t *buf, size_t len) {
 	return crc;
 }
 
+/*
+ * pread() that also accepts a pipe (e.g. /dev/stdin) as long as the
+ * offsets only move forward, the data in between is skipped. There is
+ * only ever one such input, the TRX being read.
+ */
+static ssize_t otrx_pread(int fd, void *buf, size_t count, off_t offset) {
+	static off_t pipe_pos;
+	ssize_t bytes;
+
+	bytes = pread(fd, buf, count, offset);
+	if (bytes >= 0 || errno != ESPIPE)
+		return bytes;
+
+	while (pipe_pos < offset) {
+		bytes = read(fd, otrx_buf, otrx_min(sizeof(otrx_buf), offset - pipe_pos));
+		if (bytes < 0 && errno == EINTR)
+			continue;
+		if (bytes <= 0)
+			return bytes;
+		pipe_pos += bytes;
+	}
+	if (pipe_pos > offset) {
+		errno = ESPIPE;
+		return -1;
+	}
+
+	do {
+		bytes = read(fd, buf, count);
+	} while (bytes < 0 && errno == EINTR);
+	if (bytes > 0)
+		pipe_pos += bytes;
+
+	return bytes;
+}
+
+/*
+ * Continue the CRC in *crc32 over length bytes of fd starting at offset,
+ * returns -errno on error
+ */
+static int otrx_crc32_fd(int fd, off_t offset, size_t length, uint32_t *crc32) {
+	uint32_t crc = *crc32;
+	ssize_t bytes;
+
+	posix_fadvise(fd, offset, length, POSIX_FADV_SEQUENTIAL);
+
+	while (length) {
+		bytes = otrx_pread(fd, otrx_buf, otrx_min(sizeof(otrx_buf), length), offset);
+		if (bytes < 0 && errno == EINTR)
+			continue;
+		if (bytes <= 0) {
+			fprintf(stderr, "Couldn't read last %zu B of data from %s\n", length, trx_path);
+			return -EIO;
+		}
+
+		crc = otrx_crc32(crc, otrx_buf, bytes);
+		offset += bytes;
+		length -= bytes;
+	}
+
+	*crc32 = crc;
+	return 0;
+}
+
+/**************************************************
+ * Copy
+ **************************************************/
+
+static int otrx_write(int fd, const uint8_t *buf, size_t length) {
+	ssize_t bytes;
+
+	while (length) {
+		bytes = write(fd, buf, length);
+		if (bytes < 0 && errno == EINTR)
+			continue;
+		if (bytes <= 0)
+			return -EIO;
+
+		buf += bytes;
+		length -= bytes;
+	}
+
+	return 0;
+}
+
+/* Copy up to length bytes in one go, returns the number copied or -1 */
+static ssize_t otrx_copy_chunk(int in_fd, off_t in_offset, int out_fd, size_t length, int seekable) {
+	static int no_copy_range, no_sendfile;
+	ssize_t bytes;
+
+#ifdef __NR_copy_file_range
+	if (!no_copy_range && seekable) {
+		loff_t off = in_offset;
+
+		bytes = syscall(__NR_copy_file_range, in_fd, &off, out_fd, NULL, length, 0);
+		if (bytes >= 0 || errno == EINTR)
+			return bytes;
+		if (errno != ENOSYS && errno != EXDEV && errno != EINVAL &&
+		    errno != EOPNOTSUPP && errno != EBADF)
+			return -1;
+		no_copy_range = 1;
+	}
+#endif
+
+	if (!no_sendfile && seekable) {
+		off_t off = in_offset;
+
+		bytes = sendfile(out_fd, in_fd, &off, length);
+		if (bytes >= 0 || errno == EINTR)
+			return bytes;
+		if (errno != ENOSYS && errno != EINVAL)
+			return -1;
+		no_sendfile = 1;
+	}
+
+	bytes = otrx_pread(in_fd, otrx_buf, otrx_min(length, sizeof(otrx_buf)), in_offset);
+	if (bytes > 0 && otrx_write(out_fd, otrx_buf, bytes))
+		return -1;
+
+	return bytes;
+}
+
+/*
+ * Copy length bytes from in_fd at in_offset to the current position of
+ * out_fd. The data is moved inside the kernel with copy_file_range() or
+ * sendfile() where possible, and through otrx_buf otherwise (e.g. when
+ * reading from a flash device or a pipe). Returns the number of bytes copied, which
+ * is less than length at the end of the input, or -errno.
+ */
+static ssize_t otrx_copy(int in_fd, off_t in_offset, int out_fd, size_t length) {
+	int seekable = lseek(in_fd, 0, SEEK_CUR) >= 0;
+	size_t copied = 0;
+	ssize_t bytes;
+
+	while (copied < length) {
+		bytes = otrx_copy_chunk(in_fd, in_offset, out_fd, otrx_min(length - copied, 1 << 30), seekable);
+		if (bytes < 0 && errno == EINTR)
+			continue;
+		if (bytes < 0)
+			return -errno;
+		if (bytes == 0)
+			break;
+
+		in_offset += bytes;
+		copied += bytes;
+	}
+
+	return copied;
+}
+
 /**************************************************
  * Check
  **************************************************/
@@ -153,12 +348,11 @@ static void otrx_check_parse_options(int argc, char **argv) {
 }
 
 static int otrx_check(int argc, char **argv) {
-	FILE *trx;
+	int trx;
 	struct trx_header hdr;
-	size_t bytes, length;
-	uint8_t buf[1024];
+	size_t length;
+	ssize_t bytes;
 	uint32_t crc32;
-	int i;
 	int err = 0;
 
 	if (argc < 3) {
@@ -171,15 +365,14 @@ static int otrx_check(int argc, char **argv) {
 	optind = 3;
 	otrx_check_parse_options(argc, argv);
 
-	trx = fopen(trx_path, "r");
-	if (!trx) {
+	trx = open(trx_path, O_RDONLY);
+	if (trx < 0) {
 		fprintf(stderr, "Couldn't open %s\n", trx_path);
 		err = -EACCES;
 		goto out;
 	}
 
-	fseek(trx, trx_offset, SEEK_SET);
-	bytes = fread(&hdr, 1, sizeof(hdr), trx);
+	bytes = otrx_pread(trx, &hdr, sizeof(hdr), trx_offset);
 	if (bytes != sizeof(hdr)) {
 		fprintf(stderr, "Couldn't read %s header\n", trx_path);
 		err =  -EIO;
@@ -199,20 +392,11 @@ static int otrx_check(int argc, char **argv) {
 		goto err_close;
 	}
 
-	crc32 = 0xffffffff;
-	fseek(trx, trx_offset + TRX_FLAGS_OFFSET, SEEK_SET);
-	length -= TRX_FLAGS_OFFSET;
-	while ((bytes = fread(buf, 1, otrx_min(sizeof(buf), length), trx)) > 0) {
-		for (i = 0; i < bytes; i++)
-			crc32 = crc32_tbl[(crc32 ^ buf[i]) & 0xff] ^ (crc32 >> 8);
-		length -= bytes;
-	}
-
-	if (length) {
-		fprintf(stderr, "Couldn't read last %zd B of data from %s\n", length, trx_path);
-		err = -EIO;
+	/* the header has been read already, which a pipe can't do twice */
+	crc32 = otrx_crc32(0xffffffff, (uint8_t *)&hdr + TRX_FLAGS_OFFSET, sizeof(hdr) - TRX_FLAGS_OFFSET);
+	err = otrx_crc32_fd(trx, trx_offset + sizeof(hdr), length - sizeof(hdr), &crc32);
+	if (err)
 		goto err_close;
-	}
 
 	if (crc32 != le32_to_cpu(hdr.crc32)) {
 		fprintf(stderr, "Invalid data crc32: 0x%08x instead of 0x%08x\n", crc32, le32_to_cpu(hdr.crc32));
@@ -223,7 +407,7 @@ static int otrx_check(int argc, char **argv) {
 	printf("Found a valid TRX version %d\n", le32_to_cpu(hdr.version));
 
 err_close:
-	fclose(trx);
+	close(trx);
 out:
 	return err;
 }
@@ -235,49 +419,78 @@ out:
 static void otrx_create_parse_options(int argc, char **argv) {
 }
 
-static ssize_t otrx_create_append_file(FILE *trx, const char *in_path) {
-	FILE *in;
-	size_t bytes;
-	ssize_t length = 0;
-	uint8_t buf[128];
+static ssize_t otrx_create_append_file(int trx, const char *in_path) {
+	int in;
+	struct stat st;
+	ssize_t length;
 
-	in = fopen(in_path, "r");
-	if (!in) {
+	in = open(in_path, O_RDONLY);
+	if (in < 0) {
 		fprintf(stderr, "Couldn't open %s\n", in_path);
 		return -EACCES;
 	}
 
-	while ((bytes = fread(buf, 1, sizeof(buf), in)) > 0) {
-		if (fwrite(buf, 1, bytes, trx) != bytes) {
-			fprintf(stderr, "Couldn't write %zu B to %s\n", bytes, trx_path);
+	if (fstat(in, &st)) {
+		fprintf(stderr, "Couldn't stat %s\n", in_path);
+		close(in);
+		return -EIO;
+	}
+
+	if (S_ISREG(st.st_mode)) {
+		length = otrx_copy(in, 0, trx, st.st_size);
+		if (length >= 0 && length != st.st_size) {
+			fprintf(stderr, "Couldn't read %zu B of data from %s\n", (size_t)st.st_size, in_path);
 			length = -EIO;
-			break;
 		}
-		length += bytes;
+	} else {
+		/* pipes and devices have no size, read them to the end */
+		length = 0;
+		for (;;) {
+			ssize_t bytes = read(in, otrx_buf, sizeof(otrx_buf));
+
+			if (bytes < 0 && errno == EINTR)
+				continue;
+			if (bytes < 0) {
+				length = -EIO;
+				break;
+			}
+			if (!bytes)
+				break;
+			if (otrx_write(trx, otrx_buf, bytes)) {
+				length = -EIO;
+				break;
+			}
+			length += bytes;
+		}
 	}
+	if (length < 0)
+		fprintf(stderr, "Couldn't copy %s to %s\n", in_path, trx_path);
 
-	fclose(in);
+	close(in);
 
 	return length;
 }
 
-static ssize_t otrx_create_append_zeros(FILE *trx, size_t length) {
-	uint8_t *buf;
+static ssize_t otrx_create_append_zeros(int trx, size_t length) {
+	size_t left = length;
 
-	buf = malloc(length);
-	if (!buf)
-		return -ENOMEM;
-	memset(buf, 0, length);
+	/* otrx_buf only holds zeros until it is used for a fallback copy */
+	memset(otrx_buf, 0, otrx_min(sizeof(otrx_buf), length));
 
-	if (fwrite(buf, 1, length, trx) != length) {
-		fprintf(stderr, "Couldn't write %zu B to %s\n", length, trx_path);
-		return -EIO;
+	while (left) {
+		size_t bytes = otrx_min(sizeof(otrx_buf), left);
+
+		if (otrx_write(trx, otrx_buf, bytes)) {
+			fprintf(stderr, "Couldn't write %zu B to %s\n", length, trx_path);
+			return -EIO;
+		}
+		left -= bytes;
 	}
 
 	return length;
 }
 
-static ssize_t otrx_create_align(FILE *trx, size_t curr_offset, size_t alignment) {
+static ssize_t otrx_create_align(int trx, size_t curr_offset, size_t alignment) {
 	if (curr_offset & (alignment - 1)) {
 		size_t length = alignment - (curr_offset % alignment);
 		return otrx_create_append_zeros(trx, length);
@@ -286,42 +499,28 @@ static ssize_t otrx_create_align(FILE *trx, size_t curr_offset, size_t alignment
 	return 0;
 }
 
-static int otrx_create_write_hdr(FILE *trx, struct trx_header *hdr) {
-	size_t bytes, length;
-	uint8_t *buf;
+static int otrx_create_write_hdr(int trx, struct trx_header *hdr) {
+	size_t length;
 	uint32_t crc32;
+	int err;
 
 	hdr->magic = cpu_to_le32(TRX_MAGIC);
 	hdr->version = 1;
 
-	fseek(trx, 0, SEEK_SET);
-	bytes = fwrite(hdr, 1, sizeof(struct trx_header), trx);
-	if (bytes != sizeof(struct trx_header)) {
+	if (pwrite(trx, hdr, sizeof(struct trx_header), 0) != sizeof(struct trx_header)) {
 		fprintf(stderr, "Couldn't write TRX header to %s\n", trx_path);
 		return -EIO;
 	}
 
+	/* The data is still in the page cache, CRC it from there */
 	length = le32_to_cpu(hdr->length);
-
-	buf = malloc(length);
-	if (!buf) {
-		fprintf(stderr, "Couldn't alloc %zu B buffer\n", length);
-		return -ENOMEM;
-	}
-
-	fseek(trx, 0, SEEK_SET);
-	bytes = fread(buf, 1, length, trx);
-	if (bytes != length) {
-		fprintf(stderr, "Couldn't read %zu B of data from %s\n", length, trx_path);
-		return -ENOMEM;
-	}
-
-	crc32 = otrx_crc32(buf + TRX_FLAGS_OFFSET, length - TRX_FLAGS_OFFSET);
+	crc32 = 0xffffffff;
+	err = otrx_crc32_fd(trx, TRX_FLAGS_OFFSET, length - TRX_FLAGS_OFFSET, &crc32);
+	if (err)
+		return err;
 	hdr->crc32 = cpu_to_le32(crc32);
 
-	fseek(trx, 0, SEEK_SET);
-	bytes = fwrite(hdr, 1, sizeof(struct trx_header), trx);
-	if (bytes != sizeof(struct trx_header)) {
+	if (pwrite(trx, hdr, sizeof(struct trx_header), 0) != sizeof(struct trx_header)) {
 		fprintf(stderr, "Couldn't write TRX header to %s\n", trx_path);
 		return -EIO;
 	}
@@ -330,7 +529,7 @@ static int otrx_create_write_hdr(FILE *trx, struct trx_header *hdr) {
 }
 
 static int otrx_create(int argc, char **argv) {
-	FILE *trx;
+	int trx;
 	struct trx_header hdr = {};
 	ssize_t sbytes;
 	size_t curr_idx = 0;
@@ -348,13 +547,13 @@ static int otrx_create(int argc, char **argv) {
 	optind = 3;
 	otrx_create_parse_options(argc, argv);
 
-	trx = fopen(trx_path, "w+");
-	if (!trx) {
+	trx = open(trx_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (trx < 0) {
 		fprintf(stderr, "Couldn't open %s\n", trx_path);
 		err = -EACCES;
 		goto out;
 	}
-	fseek(trx, curr_offset, SEEK_SET);
+	lseek(trx, curr_offset, SEEK_SET);
 
 	optind = 3;
 	while ((c = getopt(argc, argv, "f:b:")) != -1) {
@@ -369,6 +568,8 @@ static int otrx_create(int argc, char **argv) {
 			sbytes = otrx_create_append_file(trx, optarg);
 			if (sbytes < 0) {
 				fprintf(stderr, "Failed to append file %s\n", optarg);
+				err = sbytes;
+				goto err_close;
 			} else {
 				hdr.offset[curr_idx++] = curr_offset;
 				curr_offset += sbytes;
@@ -401,7 +602,7 @@ static int otrx_create(int argc, char **argv) {
 	hdr.length = curr_offset;
 	otrx_create_write_hdr(trx, &hdr);
 err_close:
-	fclose(trx);
+	close(trx);
 out:
 	return err;
 }
@@ -431,55 +632,42 @@ static void otrx_extract_parse_options(int argc, char **argv) {
 	}
 }
 
-static int otrx_extract_copy(FILE *trx, size_t offset, size_t length, char *out_path) {
-	FILE *out;
-	size_t bytes;
-	uint8_t *buf;
+static int otrx_extract_copy(int trx, size_t offset, size_t length, char *out_path) {
+	int out;
+	ssize_t bytes;
 	int err = 0;
 
-	out = fopen(out_path, "w");
-	if (!out) {
+	out = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out < 0) {
 		fprintf(stderr, "Couldn't open %s\n", out_path);
 		err = -EACCES;
 		goto out;
 	}
 
-	buf = malloc(length);
-	if (!buf) {
-		fprintf(stderr, "Couldn't alloc %zu B buffer\n", length);
-		err =  -ENOMEM;
+	bytes = otrx_copy(trx, offset, out, length);
+	if (bytes < 0) {
+		fprintf(stderr, "Couldn't write %zu B to %s\n", length, out_path);
+		err = -EIO;
 		goto err_close;
 	}
-
-	fseek(trx, offset, SEEK_SET);
-	bytes = fread(buf, 1, length, trx);
 	if (bytes != length) {
 		fprintf(stderr, "Couldn't read %zu B of data from %s\n", length, trx_path);
-		err =  -ENOMEM;
-		goto err_free_buf;
-	};
-
-	bytes = fwrite(buf, 1, length, out);
-	if (bytes != length) {
-		fprintf(stderr, "Couldn't write %zu B to %s\n", length, out_path);
-		err =  -ENOMEM;
-		goto err_free_buf;
+		err =  -EIO;
+		goto err_close;
 	}
 
 	printf("Extracted 0x%zx bytes into %s\n", length, out_path);
 
-err_free_buf:
-	free(buf);
 err_close:
-	fclose(out);
+	close(out);
 out:
 	return err;
 }
 
 static int otrx_extract(int argc, char **argv) {
-	FILE *trx;
+	int trx;
 	struct trx_header hdr;
-	size_t bytes;
+	ssize_t bytes;
 	int i;
 	int err = 0;
 
@@ -493,15 +681,14 @@ static int otrx_extract(int argc, char **argv) {
 	optind = 3;
 	otrx_extract_parse_options(argc, argv);
 
-	trx = fopen(trx_path, "r");
-	if (!trx) {
+	trx = open(trx_path, O_RDONLY);
+	if (trx < 0) {
 		fprintf(stderr, "Couldn't open %s\n", trx_path);
 		err = -EACCES;
 		goto out;
 	}
 
-	fseek(trx, trx_offset, SEEK_SET);
-	bytes = fread(&hdr, 1, sizeof(hdr), trx);
+	bytes = otrx_pread(trx, &hdr, sizeof(hdr), trx_offset);
 	if (bytes != sizeof(hdr)) {
 		fprintf(stderr, "Couldn't read %s header\n", trx_path);
 		err =  -EIO;
@@ -516,6 +703,7 @@ static int otrx_extract(int argc, char **argv) {
 
 	for (i = 0; i < TRX_MAX_PARTS; i++) {
 		size_t length;
+		uint32_t end;
 
 		if (!partition[i])
 			continue;
@@ -525,15 +713,22 @@ static int otrx_extract(int argc, char **argv) {
 		}
 
 		if (i + 1 >= TRX_MAX_PARTS || !hdr.offset[i + 1])
-			length = le32_to_cpu(hdr.length) - le32_to_cpu(hdr.offset[i]);
+			end = le32_to_cpu(hdr.length);
 		else
-			length = le32_to_cpu(hdr.offset[i + 1]) - le32_to_cpu(hdr.offset[i]);
+			end = le32_to_cpu(hdr.offset[i + 1]);
+
+		if (end < le32_to_cpu(hdr.offset[i]) || end > le32_to_cpu(hdr.length)) {
+			fprintf(stderr, "Invalid TRX partition %d: offset 0x%08x, end 0x%08x\n", i + 1, le32_to_cpu(hdr.offset[i]), end);
+			err = -EINVAL;
+			continue;
+		}
+		length = end - le32_to_cpu(hdr.offset[i]);
 
 		otrx_extract_copy(trx, trx_offset + le32_to_cpu(hdr.offset[i]), length, partition[i]);
 	}
 
 err_close:
-	fclose(trx);
+	close(trx);
 out:
 	return err;
 }
@@ -0,0 +1,168 @@
+#!/usr/bin/env bash
+#
+# Content addressed cache for generated firmware images
+#
+# The key of an image is the hash of the commands that build it together
+# with the contents of its declared prerequisites and of every file named
+# in those commands: the kernel and rootfs images, scripts, other inputs
+# and host tools, which are keyed by the path they resolve to in $PATH.
+# Paths of the output itself ($output and $output.*) are left out, they
+# are written by the commands. Commands naming a directory are never
+# cached, since a change to a file inside it would not change the key.
+#
+#   image-cache.sh lookup <cache dir> <output> <commands> [<prerequisite>...]
+#
+# Prints "hit" and restores <output> if it is in the cache. Otherwise the
+# key is saved in <output>.cachekey for the store command.
+#
+#   image-cache.sh store <cache dir> <output>
+#
+# Adds <output> to the cache, nothing is stored if it does not exist.
+#
+#   image-cache.sh prune <cache dir> <max size in MB> <max age in days>
+#
+# Removes entries not used for more than <max age> days, then the least
+# recently used ones until the cache fits in <max size>. 0 disables
+# either limit.
+
+cmd="$1"
+dir="$2"
+
+usage() {
+	echo "Usage: $0 lookup <cache dir> <output> <commands> [<prerequisite>...]" >&2
+	echo "       $0 store <cache dir> <output>" >&2
+	echo "       $0 prune <cache dir> <max size in MB> <max age in days>" >&2
+	exit 1
+}
+
+[ -n "$cmd" -a -n "$dir" ] || usage
+
+copy() {
+	cp --reflink=auto "$1" "$2" 2>/dev/null || cp "$1" "$2"
+}
+
+# Digests are remembered per file as long as its inode, size and times
+# stay the same, so that a rootfs shared by many images is only read once.
+# Files changed during the current second are always read again, since
+# another change within that second would not show up in their times.
+digest() {
+	local stat memo mstat now sum
+
+	stat=$(stat -L -c '%i %s %Y %Z' "$1") || return
+	memo="$dir/digests/$(echo "$1" | md5sum | cut -d' ' -f1)"
+	if [ -f "$memo" ]; then
+		read -r mstat sum < "$memo"
+		[ "$mstat" = "${stat// /:}" ] && { echo "$sum"; return; }
+	fi
+
+	sum=$(md5sum < "$1" | cut -d' ' -f1)
+	now=$(date +%s)
+	set -- $stat
+	if [ "$3" -lt "$now" -a "$4" -lt "$now" ]; then
+		echo "${stat// /:} $sum" > "$memo.$$" && mv "$memo.$$" "$memo"
+	fi
+	echo "$sum"
+}
+
+# Print "tool <path>", "file <path>" or "dir <path>" for each word of the
+# commands that names a host tool, a file or a directory
+inputs() {
+	local word path kind
+
+	set -f
+	for word in $(echo "$1" | tr -d "'\""); do
+		word="${word##*=}"
+		case "$word" in
+			""|"$out"|"$out".*) continue;;
+			*/*) path="$word"; kind=file;;
+			*)
+				path=$(command -v "$word" 2>/dev/null) || continue
+				# shell builtins and keywords resolve to their name
+				case "$path" in /*) ;; *) continue;; esac
+				kind=tool
+			;;
+		esac
+		if [ -d "$path" ]; then
+			echo "dir $path"
+		elif [ -f "$path" ]; then
+			echo "$kind $path"
+		fi
+	done
+	set +f
+}
+
+lookup() {
+	local text="$1" key entry kind file sum keytext
+	shift
+
+	rm -f "$out.cachekey"
+	mkdir -p "$dir/digests" || return 0
+
+	keytext="cmd $text"
+	while read -r kind file; do
+		[ -n "$file" ] || continue
+		[ "$kind" != "dir" -a -f "$file" ] || return 0
+		sum=$(digest "$file") || return 0
+		keytext="$keytext
+$kind $file $sum"
+	done <<-EOF
+		$([ $# -gt 0 ] && printf 'prereq %s\n' "$@")
+		$(inputs "$text" | sort -u)
+	EOF
+	key=$(echo "$keytext" | md5sum | cut -d' ' -f1)
+
+	entry="$dir/${key:0:2}/$key"
+	if [ -f "$entry" ] && copy "$entry" "$out"; then
+		touch "$entry"
+		echo "hit"
+	else
+		echo "$key" > "$out.cachekey"
+	fi
+}
+
+store() {
+	local key entry
+
+	[ -f "$out.cachekey" ] || return 0
+	read -r key < "$out.cachekey"
+	rm -f "$out.cachekey"
+	[ -f "$out" ] || return 0
+
+	entry="$dir/${key:0:2}/$key"
+	mkdir -p "${entry%/*}" &&
+		copy "$out" "$entry.$$" &&
+		mv "$entry.$$" "$entry"
+}
+
+# Entries are touched on every hit, so their mtime is their last use
+prune() {
+	local max_kb=$(( ${1:-0} * 1024 )) days="${2:-0}" total=0 size file
+
+	[ -d "$dir" ] || return 0
+	[ "$days" -gt 0 ] && find "$dir" -type f -mtime +"$days" -delete
+	[ "$max_kb" -gt 0 ] || return 0
+
+	find "$dir" -mindepth 2 -type f ! -path "$dir/digests/*" \
+		-printf '%T@ %k %p\n' | sort -rn |
+	while read -r _ size file; do
+		total=$((total + size))
+		[ "$total" -gt "$max_kb" ] && rm -f "$file"
+	done
+	return 0
+}
+
+case "$cmd" in
+	lookup)
+		out="$3"
+		[ -n "$out" ] || usage
+		shift 3
+		lookup "$@"
+	;;
+	store)
+		out="$3"
+		[ -n "$out" ] || usage
+		store
+	;;
+	prune) prune "$3" "$4";;
+	*) echo "Unknown command: $cmd" >&2; exit 1;;
+esac
@@ -77,8 +77,24 @@ __FBSDID("$FreeBSD: src/sys/opencrypto/crypto.c,v 1.16 2005/01/07 02:29:16 imp E
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,4)
 #include <linux/kthread.h>
 #endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,16)
+#include <linux/ktime.h>
+#endif
+#include <linux/rcupdate.h>
+#include <linux/radix-tree.h>
+#include <linux/workqueue.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include <cryptodev.h>
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,32)
+#define CREATE_TRACE_POINTS
+#include "ocf-trace.h"
+#else
+#define trace_ocf_dispatch(crp)	do { } while (0)
+#define trace_ocf_done(crp)		do { } while (0)
+#endif
+
 /*
  * keep track of whether or not we have been initialised, a big
  * issue if we are linked into the kernel and a driver gets started before
@@ -143,25 +159,59 @@ struct cryptocap {
 	int		cc_qblocked;		/* (q) symmetric q blocked */
 	int		cc_kqblocked;		/* (q) asymmetric q blocked */
 
-	int		cc_unqblocked;		/* (q) symmetric q blocked */
+	int		cc_unblocks;		/* (q) # of symmetric unblocks */
 	int		cc_unkqblocked;		/* (q) asymmetric q blocked */
+
+	/*
+	 * Load estimates used to pick a driver.  They are updated without
+	 * locking, losing an update now and then does not matter.  The
+	 * averages are kept scaled by 8, see CRYPTO_EWMA().
+	 */
+	atomic_t	cc_inflight;		/* ops handed to the driver */
+	u_int32_t	cc_lat;			/* op latency, ~us */
+	u_int32_t	cc_svc;			/* time between completions, ~us */
+	u_int32_t	cc_last_done;		/* time of the last completion */
+	u_int32_t	cc_blockrate;		/* ERESTART ratio, 1024 is all */
+
+	/*
+	 * Statistics for <debugfs>/ocf, kept the same way.  The histograms
+	 * count the ~us spent in each stage in log2 buckets.
+	 */
+	unsigned long	cc_submitted;		/* ops accepted by the driver */
+	unsigned long	cc_completed;
+	unsigned long	cc_errors;
+	u_int64_t	cc_bytes;		/* input bytes of completed ops */
+	int		cc_inflight_max;	/* high-water of cc_inflight */
+	unsigned long	cc_blocks;		/* (q) times it ran out */
+	u_int64_t	cc_blocked_time;	/* (q) ~us spent blocked */
+	u_int32_t	cc_blocked_at;		/* (q) time it got blocked */
+#define CRYPTO_STAGE_QUEUE	0		/* crypto_dispatch -> driver */
+#define CRYPTO_STAGE_DRIVER	1		/* driver -> crypto_done */
+#define CRYPTO_STAGE_RET	2		/* crypto_done -> callback */
+#define CRYPTO_STAGES		3
+#define CRYPTO_HIST		16
+	u_int32_t	cc_hist[CRYPTO_STAGES][CRYPTO_HIST];
 };
 static struct cryptocap *crypto_drivers = NULL;
 static int crypto_drivers_num = 0;
 
 /*
- * There are two queues for crypto requests; one for symmetric (e.g.
- * cipher) operations and one for asymmetric (e.g. MOD)operations.
- * A single mutex is used to lock access to both queues.  We could
- * have one per-queue but having one simplifies handling of block/unblock
- * operations.
+ * Symmetric requests are queued on one of a set of per-CPU queues,
+ * each with its own dispatch and return thread.  The queue is picked by
+ * hashing the session id, so all requests of a session go through the
+ * same queue in both directions and keep their order.  A thread that
+ * finds nothing to do on its own queue takes work from the others, so a
+ * blocked driver or a busy CPU does not hold up the remaining queues.
+ *
+ * Asymmetric (e.g. MOD) requests are rare and stay on a single queue
+ * that any of the threads may service.  crypto_q_lock protects it as
+ * well as the driver block state.
  */
-static LIST_HEAD(crp_q);		/* crypto request queue */
 static LIST_HEAD(crp_kq);		/* asym request queue */
 
 static spinlock_t crypto_q_lock;
 
-int crypto_all_qblocked = 0;  /* protect with Q_LOCK */
+int crypto_all_qblocked = 0;  /* informational only */
 module_param(crypto_all_qblocked, int, 0444);
 MODULE_PARM_DESC(crypto_all_qblocked, "Are all crypto queues blocked");
 
@@ -181,28 +231,103 @@ MODULE_PARM_DESC(crypto_all_kqblocked, "Are all asym crypto queues blocked");
 			 })
 
 /*
+ * Synchronization:
+ * (c) - protected by CRYPTO_CQ_LOCK()
+ * (r) - protected by CRYPTO_RETQ_LOCK()
+ *
  * There are two queues for processing completed crypto requests; one
  * for the symmetric and one for the asymmetric ops.  We only need one
- * but have two to avoid type futzing (cryptop vs. cryptkop).  A single
- * mutex is used to lock access to both queues.  Note that this lock
- * must be separate from the lock on request queues to insure driver
- * callbacks don't generate lock order reversals.
+ * but have two to avoid type futzing (cryptop vs. cryptkop).  Note that
+ * the return lock must be separate from the lock on request queues to
+ * insure driver callbacks don't generate lock order reversals.
+ */
+struct crypto_queue {
+	spinlock_t		cq_lock;
+	struct list_head	cq_q;		/* (c) crypto request queue */
+	int			cq_running;	/* (c) a request is being dispatched */
+	unsigned int		cq_kicks;	/* (c) bumped to wake cq_proc */
+	wait_queue_head_t	cq_wait;
+	struct task_struct	*cq_proc;
+	int			cq_index;
+
+	spinlock_t		cq_ret_lock;
+	struct list_head	cq_ret_q;	/* (r) callback queues */
+	struct list_head	cq_ret_kq;	/* (r) */
+	wait_queue_head_t	cq_ret_wait;
+	struct task_struct	*cq_ret_proc;
+} ____cacheline_aligned_in_smp;
+
+static struct crypto_queue *crypto_queues = NULL;
+static int crypto_nqueues = 0;
+
+/*
+ * The session ids handed out by crypto_newsession() are our own and map
+ * to the session of the driver doing the work.  This lets a session move
+ * to another driver without the caller noticing.  The upper half of the
+ * id still holds the flags and id of the driver it was created on.
+ *
+ * Sessions live in a radix tree indexed by the lower half of their id.
+ * Lookups only hold rcu_read_lock(), so dispatching from many CPUs does
+ * not bounce a lock around.  The table holds one reference on a session
+ * and every request dispatched on it holds another until it is done, so
+ * the driver session is only freed once the last op on it has completed
+ * and the structure itself a grace period after that.
+ *
+ * (s) - protected by CRYPTO_SES_LOCK()
+ * (c) - only changed by the thread dispatching from the session's queue
  */
-static LIST_HEAD(crp_ret_q);		/* callback queues */
-static LIST_HEAD(crp_ret_kq);
+struct crypto_session {
+	struct rcu_head		cs_rcu;		/* deferred free */
+	struct work_struct	cs_work;	/* teardown after the last op */
+	atomic_t		cs_refs;	/* table plus requests */
+	int			cs_dying;	/* (s) freed by the caller */
+	u_int64_t		cs_sid;		/* id known to the caller */
+	u_int64_t		cs_drvsid;	/* (s,c) id known to the driver */
+	int			cs_crid;	/* driver constraints */
+	atomic_t		cs_inflight;	/* ops handed to the driver */
+	unsigned long		cs_moved;	/* (c) jiffies of last move */
+	atomic_long_t		cs_ops;		/* completed ops */
+	atomic_long_t		cs_bytes;	/* input bytes of those ops */
+	atomic_long_t		cs_errs;	/* ops completed with an error */
+};
 
-static spinlock_t crypto_ret_q_lock;
-#define	CRYPTO_RETQ_LOCK() \
+static RADIX_TREE(crypto_ses_tree, GFP_ATOMIC);	/* (s) for updates */
+static spinlock_t crypto_ses_lock;
+static atomic_t crypto_ses_ids = ATOMIC_INIT(0);
+
+#define	CRYPTO_SES_LOCK() \
 			({ \
-				spin_lock_irqsave(&crypto_ret_q_lock, r_flags); \
+				spin_lock_irqsave(&crypto_ses_lock, s_flags); \
+				dprintk("%s,%d: SES_LOCK()\n", __FILE__, __LINE__); \
+			 })
+#define	CRYPTO_SES_UNLOCK() \
+			({ \
+				dprintk("%s,%d: SES_UNLOCK()\n", __FILE__, __LINE__); \
+				spin_unlock_irqrestore(&crypto_ses_lock, s_flags); \
+			 })
+
+#define	CRYPTO_CQ_LOCK(cq) \
+			({ \
+				spin_lock_irqsave(&(cq)->cq_lock, c_flags); \
+				dprintk("%s,%d: CQ_LOCK()\n", __FILE__, __LINE__); \
+			 })
+#define	CRYPTO_CQ_UNLOCK(cq) \
+			({ \
+				dprintk("%s,%d: CQ_UNLOCK()\n", __FILE__, __LINE__); \
+				spin_unlock_irqrestore(&(cq)->cq_lock, c_flags); \
+			 })
+#define	CRYPTO_RETQ_LOCK(cq) \
+			({ \
+				spin_lock_irqsave(&(cq)->cq_ret_lock, r_flags); \
 				dprintk("%s,%d: RETQ_LOCK\n", __FILE__, __LINE__); \
 			 })
-#define	CRYPTO_RETQ_UNLOCK() \
+#define	CRYPTO_RETQ_UNLOCK(cq) \
 			({ \
 			 	dprintk("%s,%d: RETQ_UNLOCK\n", __FILE__, __LINE__); \
-				spin_unlock_irqrestore(&crypto_ret_q_lock, r_flags); \
+				spin_unlock_irqrestore(&(cq)->cq_ret_lock, r_flags); \
 			 })
-#define	CRYPTO_RETQ_EMPTY()	(list_empty(&crp_ret_q) && list_empty(&crp_ret_kq))
+#define	CRYPTO_RETQ_EMPTY(cq) \
+			(list_empty(&(cq)->cq_ret_q) && list_empty(&(cq)->cq_ret_kq))
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
 static kmem_cache_t *cryptop_zone;
@@ -212,6 +337,29 @@ static struct kmem_cache *cryptop_zone;
 static struct kmem_cache *cryptodesc_zone;
 #endif
 
+/*
+ * Most requests are a cipher, or a cipher and a MAC.  Freed requests of
+ * those shapes are kept per CPU with their descriptors still linked, so
+ * that crypto_getreq() only has to clear them.  Cached requests are
+ * chained through crp_opaque.
+ */
+#define CRYPTO_REQCACHE_SHAPES	2	/* 1 or 2 descriptors */
+
+struct crypto_reqcache {
+	struct cryptop *rc_free[CRYPTO_REQCACHE_SHAPES];
+	int		rc_count[CRYPTO_REQCACHE_SHAPES];
+	unsigned long	rc_hits;
+	unsigned long	rc_misses;
+};
+
+static DEFINE_PER_CPU(struct crypto_reqcache, crypto_reqcaches);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,33)
+#define CRYPTO_REQCACHE()	this_cpu_ptr(&crypto_reqcaches)
+#else
+#define CRYPTO_REQCACHE()	(&__get_cpu_var(crypto_reqcaches))
+#endif
+
 #define debug crypto_debug
 int crypto_debug = 0;
 module_param(crypto_debug, int, 0644);
@@ -229,8 +377,17 @@ EXPORT_SYMBOL(crypto_debug);
  * slow,  printing anything will just kill us
  */
 
-static int crypto_q_cnt = 0;
-module_param(crypto_q_cnt, int, 0444);
+static atomic_t crypto_q_cnt = ATOMIC_INIT(0);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36)
+static int crypto_q_cnt_get(char *buf, const struct kernel_param *kp)
+#else
+static int crypto_q_cnt_get(char *buf, struct kernel_param *kp)
+#endif
+{
+	return sprintf(buf, "%d", atomic_read(&crypto_q_cnt));
+}
+module_param_call(crypto_q_cnt, NULL, crypto_q_cnt_get, NULL, 0444);
 MODULE_PARM_DESC(crypto_q_cnt,
 		"Current number of outstanding crypto requests");
 
@@ -239,6 +396,35 @@ module_param(crypto_q_max, int, 0644);
 MODULE_PARM_DESC(crypto_q_max,
 		"Maximum number of outstanding crypto requests");
 
+static int crypto_q_hiwat = 0;
+module_param(crypto_q_hiwat, int, 0644);
+MODULE_PARM_DESC(crypto_q_hiwat,
+		"Most outstanding crypto requests seen, write 0 to reset");
+
+static int crypto_reqcache_max = 64;
+module_param(crypto_reqcache_max, int, 0644);
+MODULE_PARM_DESC(crypto_reqcache_max,
+		"Freed requests of each common shape kept per CPU for reuse");
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36)
+static int crypto_reqcache_get(char *buf, const struct kernel_param *kp)
+#else
+static int crypto_reqcache_get(char *buf, struct kernel_param *kp)
+#endif
+{
+	unsigned long hits = 0, misses = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		hits += per_cpu(crypto_reqcaches, cpu).rc_hits;
+		misses += per_cpu(crypto_reqcaches, cpu).rc_misses;
+	}
+	return sprintf(buf, "%lu %lu", hits, misses);
+}
+module_param_call(crypto_reqcache_stats, NULL, crypto_reqcache_get, NULL, 0444);
+MODULE_PARM_DESC(crypto_reqcache_stats,
+		"Requests taken from and missing in the per-CPU caches");
+
 #define bootverbose crypto_verbose
 static int crypto_verbose = 0;
 module_param(crypto_verbose, int, 0644);
@@ -272,19 +458,85 @@ module_param(crypto_max_loopcount, int, 0644);
 MODULE_PARM_DESC(crypto_max_loopcount,
 	   "Maximum number of crypto ops to do before yielding to other processes");
 
-#ifndef CONFIG_NR_CPUS
-#define CONFIG_NR_CPUS 1
-#endif
+/*
+ * Driver selection.  New sessions either go to the driver with the fewest
+ * sessions, or to the one expected to complete an op soonest judging by
+ * its queue depth, completion rate and latency.  Hardware is preferred,
+ * software drivers are only used when all hardware is overloaded.
+ *
+ * A driver is overloaded when more than crypto_migrate_block_pct percent
+ * of recent submissions were refused with ERESTART.  Sessions on such a
+ * driver are moved to a less loaded one once none of their ops are left
+ * in the driver, at most every crypto_migrate_interval ms.
+ */
+#define CRYPTO_SELECT_SESSIONS	0
+#define CRYPTO_SELECT_LOAD	1
+
+static int crypto_select_policy = CRYPTO_SELECT_LOAD;
+module_param(crypto_select_policy, int, 0644);
+MODULE_PARM_DESC(crypto_select_policy,
+	   "Driver selection for new sessions (0 fewest sessions, 1 lowest load)");
+
+static int crypto_migrate = 2;
+module_param(crypto_migrate, int, 0644);
+MODULE_PARM_DESC(crypto_migrate,
+	   "Move sessions off overloaded drivers (0 never, 1 to hardware, 2 also to software)");
+
+static int crypto_migrate_block_pct = 50;
+module_param(crypto_migrate_block_pct, int, 0644);
+MODULE_PARM_DESC(crypto_migrate_block_pct,
+	   "Percentage of blocked submissions at which a driver is overloaded");
+
+static int crypto_migrate_interval = 1000;
+module_param(crypto_migrate_interval, int, 0644);
+MODULE_PARM_DESC(crypto_migrate_interval,
+	   "Minimum time between moves of a session in ms");
+
+static int crypto_migrations = 0;
+module_param(crypto_migrations, int, 0444);
+MODULE_PARM_DESC(crypto_migrations,
+	   "Number of sessions moved to another driver");
+
+/*
+ * Completions are delivered in batches.  Drivers may hand a burst of
+ * finished requests to crypto_done_batch(), which queues them under one
+ * lock and only wakes the return thread when its queue was empty.  The
+ * return thread takes everything queued in one go and passes runs of
+ * requests sharing a crp_vcallback to it as a single vector.
+ *
+ * The histograms count batch sizes in powers of two: slot n holds the
+ * batches of 2^n up to 2^(n+1)-1 requests.
+ */
+#define CRYPTO_BATCH_HIST	8
+#define CRYPTO_RET_VEC		16
+
+static int crypto_done_burst[CRYPTO_BATCH_HIST];
+static int crypto_done_burst_num = CRYPTO_BATCH_HIST;
+module_param_array(crypto_done_burst, int, &crypto_done_burst_num, 0444);
+MODULE_PARM_DESC(crypto_done_burst,
+	   "Histogram of completion bursts reported by drivers (log2 buckets)");
+
+static int crypto_ret_batch[CRYPTO_BATCH_HIST];
+static int crypto_ret_batch_num = CRYPTO_BATCH_HIST;
+module_param_array(crypto_ret_batch, int, &crypto_ret_batch_num, 0444);
+MODULE_PARM_DESC(crypto_ret_batch,
+	   "Histogram of requests drained per return thread pass (log2 buckets)");
+
+static inline void
+crypto_batch_count(int *hist, int n)
+{
+	int b = fls(n) - 1;
 
-static struct task_struct *cryptoproc[CONFIG_NR_CPUS];
-static struct task_struct *cryptoretproc[CONFIG_NR_CPUS];
-static DECLARE_WAIT_QUEUE_HEAD(cryptoproc_wait);
-static DECLARE_WAIT_QUEUE_HEAD(cryptoretproc_wait);
+	if (b >= CRYPTO_BATCH_HIST)
+		b = CRYPTO_BATCH_HIST - 1;
+	hist[b]++;
+}
 
 static	int crypto_proc(void *arg);
 static	int crypto_ret_proc(void *arg);
 static	int crypto_invoke(struct cryptocap *cap, struct cryptop *crp, int hint);
 static	int crypto_kinvoke(struct cryptkop *krp, int flags);
+static	int crypto_drv_freesession(u_int64_t sid);
 static	void crypto_exit(void);
 static  int crypto_init(void);
 
@@ -298,6 +550,381 @@ crypto_checkdriver(u_int32_t hid)
 	return (hid >= crypto_drivers_num ? NULL : &crypto_drivers[hid]);
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,16)
+#define crypto_now()	((u_int32_t) (ktime_to_ns(ktime_get()) >> 10))
+#else
+#define crypto_now()	((u_int32_t) (jiffies * ((1 << 20) / HZ)))
+#endif
+
+/* moving average over the last 8 or so samples, kept scaled by 8 */
+#define CRYPTO_EWMA(avg, val)	((avg) = (avg) - ((avg) >> 3) + (val))
+
+/*
+ * Estimate in ~us how long a new op would take on a driver: its latency
+ * when idle, otherwise the ops in the driver times the interval between
+ * completions.
+ */
+static u_int32_t
+crypto_driver_load(const struct cryptocap *cap)
+{
+	u_int32_t lat = cap->cc_lat >> 3;
+	u_int32_t busy;
+	int n = atomic_read(&cap->cc_inflight);
+
+	if (n <= 0)
+		return lat;
+	busy = (n + 1) * (cap->cc_svc >> 3);
+	return busy > lat ? busy : lat;
+}
+
+static __inline void
+crypto_hist(u_int32_t *hist, u_int32_t us)
+{
+	int b = fls(us);
+
+	if (b >= CRYPTO_HIST)
+		b = CRYPTO_HIST - 1;
+	hist[b]++;
+}
+
+static __inline int
+crypto_driver_overloaded(const struct cryptocap *cap)
+{
+	return cap->cc_blockrate * 100 > crypto_migrate_block_pct * 1024;
+}
+
+/*
+ * Account an op the driver has completed, crp_sid is still the id of the
+ * driver session.  Returns the time of completion.
+ */
+static u_int32_t
+crypto_driver_done(struct cryptop *crp)
+{
+	struct cryptocap *cap = crypto_checkdriver(CRYPTO_SESID2HID(crp->crp_sid));
+	u_int32_t now, lat, svc;
+
+	now = crypto_now();
+	if (cap == NULL)
+		return now;
+	lat = now - crp->crp_start;
+	svc = now - cap->cc_last_done;
+	CRYPTO_EWMA(cap->cc_lat, lat);
+	/* an interval spanning idle time says nothing about the rate */
+	if (atomic_dec_return(&cap->cc_inflight) > 0)
+		CRYPTO_EWMA(cap->cc_svc, svc < lat ? svc : lat);
+	cap->cc_last_done = now;
+
+	cap->cc_completed++;
+	cap->cc_bytes += crp->crp_ilen;
+	if (crp->crp_etype != 0)
+		cap->cc_errors++;
+	crypto_hist(cap->cc_hist[CRYPTO_STAGE_DRIVER], lat);
+	return now;
+}
+
+/*
+ * Map a session to its queue.  The low bits of the local session id are
+ * usually sequential, so mix them before picking a queue.
+ */
+static __inline struct crypto_queue *
+crypto_sesq(u_int64_t sid)
+{
+	u_int32_t h;
+
+	h = (CRYPTO_SESID2LID(sid) ^ (CRYPTO_SESID2HID(sid) << 24)) * 0x9e3779b1;
+	return &crypto_queues[(h >> 16) % crypto_nqueues];
+}
+
+/*
+ * Wake the dispatch thread of a queue, called with the queue locked.
+ */
+static __inline void
+crypto_kick(struct crypto_queue *cq)
+{
+	cq->cq_kicks++;
+	wake_up_interruptible(&cq->cq_wait);
+}
+
+static void
+crypto_kick_all(void)
+{
+	struct crypto_queue *cq;
+	unsigned long c_flags;
+	int i;
+
+	for (i = 0; i < crypto_nqueues; i++) {
+		cq = &crypto_queues[i];
+		CRYPTO_CQ_LOCK(cq);
+		crypto_kick(cq);
+		CRYPTO_CQ_UNLOCK(cq);
+	}
+}
+
+static void crypto_ses_put(struct crypto_session *ses);
+
+/*
+ * Find a session and take a reference on it.  A lookup can still see a
+ * session that crypto_freesession() is removing until the grace period
+ * ends, so one that is already dying is not handed out.
+ */
+static struct crypto_session *
+crypto_ses_lookup(u_int64_t sid)
+{
+	struct crypto_session *ses;
+
+	rcu_read_lock();
+	ses = radix_tree_lookup(&crypto_ses_tree, CRYPTO_SESID2LID(sid));
+	if (ses != NULL && (ses->cs_sid != sid ||
+			!atomic_inc_not_zero(&ses->cs_refs)))
+		ses = NULL;
+	rcu_read_unlock();
+	if (ses != NULL && ses->cs_dying) {
+		crypto_ses_put(ses);
+		ses = NULL;
+	}
+	return ses;
+}
+
+/*
+ * Give a session an id that is not in use and add it to the table.
+ */
+static int
+crypto_ses_insert(struct crypto_session *ses)
+{
+	unsigned long s_flags;
+	u_int32_t lid;
+	int err;
+
+	do {
+		lid = (u_int32_t) atomic_inc_return(&crypto_ses_ids);
+		ses->cs_sid = (ses->cs_drvsid & 0xffffffff00000000ULL) | lid;
+		CRYPTO_SES_LOCK();
+		err = radix_tree_insert(&crypto_ses_tree, lid, ses);
+		CRYPTO_SES_UNLOCK();
+	} while (err == -EEXIST);
+	return -err;
+}
+
+static struct crypto_session *
+crypto_ses_remove(u_int64_t sid)
+{
+	struct crypto_session *ses;
+	unsigned long s_flags;
+
+	CRYPTO_SES_LOCK();
+	ses = radix_tree_lookup(&crypto_ses_tree, CRYPTO_SESID2LID(sid));
+	if (ses != NULL && ses->cs_sid == sid && !ses->cs_dying) {
+		radix_tree_delete(&crypto_ses_tree, CRYPTO_SESID2LID(sid));
+		ses->cs_dying = 1;
+	} else
+		ses = NULL;
+	CRYPTO_SES_UNLOCK();
+	return ses;
+}
+
+static void
+crypto_ses_free(struct rcu_head *head)
+{
+	kfree(container_of(head, struct crypto_session, cs_rcu));
+}
+
+static int
+crypto_ses_destroy(struct crypto_session *ses)
+{
+	int err;
+
+	err = crypto_drv_freesession(ses->cs_drvsid);
+	call_rcu(&ses->cs_rcu, crypto_ses_free);
+	return err;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
+static void
+crypto_ses_work(struct work_struct *work)
+{
+	crypto_ses_destroy(container_of(work, struct crypto_session, cs_work));
+}
+#else
+static void
+crypto_ses_work(void *arg)
+{
+	crypto_ses_destroy(arg);
+}
+#endif
+
+/*
+ * Drop a request's reference on a session.  Requests complete from
+ * drivers that may hold their own locks, and drivers may sleep in their
+ * freesession method, so the last one hands the teardown to a work queue.
+ */
+static void
+crypto_ses_put(struct crypto_session *ses)
+{
+	if (atomic_dec_and_test(&ses->cs_refs))
+		schedule_work(&ses->cs_work);
+}
+
+/*
+ * <debugfs>/ocf/sessions: one line per session with the driver it is on
+ * and what it has done so far.
+ */
+static int
+crypto_ses_show(struct seq_file *m, void *v)
+{
+	struct crypto_session *ses[16];
+	struct cryptocap *cap;
+	unsigned long lid = 0;
+	unsigned long d_flags;
+	u_int32_t hid;
+	int i, n;
+
+	seq_puts(m, "# sid driver ops bytes errors inflight\n");
+	rcu_read_lock();
+	do {
+		n = radix_tree_gang_lookup(&crypto_ses_tree, (void **) ses, lid,
+				ARRAY_SIZE(ses));
+		for (i = 0; i < n; i++) {
+			lid = CRYPTO_SESID2LID(ses[i]->cs_sid) + 1;
+			hid = CRYPTO_SESID2HID(ses[i]->cs_drvsid);
+			CRYPTO_DRIVER_LOCK();
+			cap = crypto_checkdriver(hid);
+			seq_printf(m, "%016llx %s %lu %lu %lu %d\n",
+					(unsigned long long) ses[i]->cs_sid,
+					cap && cap->cc_dev ?
+						device_get_nameunit(cap->cc_dev) : "-",
+					atomic_long_read(&ses[i]->cs_ops),
+					atomic_long_read(&ses[i]->cs_bytes),
+					atomic_long_read(&ses[i]->cs_errs),
+					atomic_read(&ses[i]->cs_inflight));
+			CRYPTO_DRIVER_UNLOCK();
+		}
+	} while (n == ARRAY_SIZE(ses) && lid != 0);
+	rcu_read_unlock();
+	return 0;
+}
+
+static int
+crypto_ses_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, crypto_ses_show, NULL);
+}
+
+static const struct file_operations crypto_ses_fops = {
+	.owner = THIS_MODULE,
+	.open = crypto_ses_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void
+crypto_hist_show(struct seq_file *m, const u_int32_t *hist)
+{
+	int b;
+
+	for (b = 0; b < CRYPTO_HIST; b++)
+		seq_printf(m, b ? ",%u" : " %u", hist[b]);
+}
+
+/*
+ * <debugfs>/ocf/stats: the global counters, and the stage histograms of
+ * all drivers added up.  Bucket b counts times below 2^b ~us.
+ */
+static int
+crypto_stats_show(struct seq_file *m, void *v)
+{
+	static const char *stages[CRYPTO_STAGES] = { "queue", "driver", "return" };
+	u_int32_t hist[CRYPTO_STAGES][CRYPTO_HIST];
+	unsigned long d_flags;
+	int hid, st, b;
+
+	seq_printf(m, "ops %u\nerrors %u\ndrops %u\nblocks %u\n"
+			"kops %u\nkerrors %u\nkblocks %u\n",
+			cryptostats.cs_ops, cryptostats.cs_errs, cryptostats.cs_drops,
+			cryptostats.cs_blocks, cryptostats.cs_kops, cryptostats.cs_kerrs,
+			cryptostats.cs_kblocks);
+	seq_printf(m, "outstanding %d\noutstanding_max %d\n",
+			atomic_read(&crypto_q_cnt), crypto_q_hiwat);
+
+	memset(hist, 0, sizeof(hist));
+	CRYPTO_DRIVER_LOCK();
+	for (hid = 0; hid < crypto_drivers_num; hid++)
+		for (st = 0; st < CRYPTO_STAGES; st++)
+			for (b = 0; b < CRYPTO_HIST; b++)
+				hist[st][b] += crypto_drivers[hid].cc_hist[st][b];
+	CRYPTO_DRIVER_UNLOCK();
+	for (st = 0; st < CRYPTO_STAGES; st++) {
+		seq_printf(m, "%s_hist", stages[st]);
+		crypto_hist_show(m, hist[st]);
+		seq_putc(m, '\n');
+	}
+	return 0;
+}
+
+/*
+ * <debugfs>/ocf/drivers: one line per driver, ending with its queue,
+ * driver and return stage histograms.
+ */
+static int
+crypto_drivers_show(struct seq_file *m, void *v)
+{
+	struct cryptocap *cap;
+	unsigned long d_flags;
+	int hid, st;
+
+	seq_puts(m, "# hid driver submitted completed errors bytes inflight"
+			" inflight_max blocks blocked_usecs lat_usecs"
+			" queue_hist driver_hist return_hist\n");
+	CRYPTO_DRIVER_LOCK();
+	for (hid = 0; hid < crypto_drivers_num; hid++) {
+		cap = &crypto_drivers[hid];
+		if (cap->cc_dev == NULL)
+			continue;
+		seq_printf(m, "%d %s %lu %lu %lu %llu %d %d %lu %llu %u", hid,
+				device_get_nameunit(cap->cc_dev), cap->cc_submitted,
+				cap->cc_completed, cap->cc_errors,
+				(unsigned long long) cap->cc_bytes,
+				atomic_read(&cap->cc_inflight), cap->cc_inflight_max,
+				cap->cc_blocks, (unsigned long long) cap->cc_blocked_time,
+				cap->cc_lat >> 3);
+		for (st = 0; st < CRYPTO_STAGES; st++)
+			crypto_hist_show(m, cap->cc_hist[st]);
+		seq_putc(m, '\n');
+	}
+	CRYPTO_DRIVER_UNLOCK();
+	return 0;
+}
+
+static int
+crypto_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, crypto_stats_show, NULL);
+}
+
+static int
+crypto_drivers_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, crypto_drivers_show, NULL);
+}
+
+static const struct file_operations crypto_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = crypto_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static const struct file_operations crypto_drivers_fops = {
+	.owner = THIS_MODULE,
+	.open = crypto_drivers_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static struct dentry *crypto_debugfs;
+
 /*
  * Compare a driver's list of supported algorithms against another
  * list; return non-zero if all algorithms are supported.
@@ -315,21 +942,41 @@ driver_suitable(const struct cryptocap *cap, const struct cryptoini *cri)
 }
 
 
+/*
+ * Return non-zero if cap is a better choice for a new session than best.
+ */
+static int
+crypto_driver_better(const struct cryptocap *cap, const struct cryptocap *best)
+{
+	u_int32_t load, bload;
+
+	if (best == NULL)
+		return 1;
+	if (crypto_select_policy == CRYPTO_SELECT_LOAD) {
+		if (crypto_driver_overloaded(cap) != crypto_driver_overloaded(best))
+			return !crypto_driver_overloaded(cap);
+		load = crypto_driver_load(cap);
+		bload = crypto_driver_load(best);
+		if (load != bload)
+			return load < bload;
+	}
+	return cap->cc_sessions < best->cc_sessions;
+}
+
 /*
  * Select a driver for a new session that supports the specified
  * algorithms and, optionally, is constrained according to the flags.
- * The algorithm we use here is pretty stupid; just use the
- * first driver that supports all the algorithms we need. If there
- * are multiple drivers we choose the driver with the fewest active
- * sessions.  We prefer hardware-backed drivers to software ones.
+ * Of the drivers supporting all the algorithms we need, the one
+ * chosen by crypto_driver_better() wins.  We prefer hardware-backed
+ * drivers to software ones, unless all suitable hardware is overloaded.
  *
- * XXX We need more smarts here (in real life too, but that's
- * XXX another story altogether).
+ * When a session is being moved off the driver "exclude", only a
+ * driver that is not overloaded itself will do.
  */
 static struct cryptocap *
-crypto_select_driver(const struct cryptoini *cri, int flags)
+crypto_select_driver(const struct cryptoini *cri, int flags, int exclude)
 {
-	struct cryptocap *cap, *best;
+	struct cryptocap *cap, *best, *hw;
 	int match, hid;
 
 	CRYPTO_DRIVER_ASSERT();
@@ -341,7 +988,7 @@ crypto_select_driver(const struct cryptoini *cri, int flags)
 		match = CRYPTOCAP_F_HARDWARE;
 	else
 		match = CRYPTOCAP_F_SOFTWARE;
-	best = NULL;
+	best = hw = NULL;
 again:
 	for (hid = 0; hid < crypto_drivers_num; hid++) {
 		cap = &crypto_drivers[hid];
@@ -352,34 +999,43 @@ again:
 		 */
 		if (cap->cc_dev == NULL ||
 		    (cap->cc_flags & CRYPTOCAP_F_CLEANUP) ||
-		    (cap->cc_flags & match) == 0)
+		    (cap->cc_flags & match) == 0 ||
+		    (flags & ~cap->cc_flags & CRYPTOCAP_F_SG) ||
+		    hid == exclude)
+			continue;
+		if (exclude >= 0 && crypto_driver_overloaded(cap))
 			continue;
 
 		/* verify all the algorithms are supported. */
-		if (driver_suitable(cap, cri)) {
-			if (best == NULL ||
-			    cap->cc_sessions < best->cc_sessions)
-				best = cap;
-		}
+		if (driver_suitable(cap, cri) && crypto_driver_better(cap, best))
+			best = cap;
 	}
-	if (best != NULL)
+	if (best != NULL && (crypto_select_policy != CRYPTO_SELECT_LOAD ||
+			!crypto_driver_overloaded(best)))
 		return best;
 	if (match == CRYPTOCAP_F_HARDWARE && (flags & CRYPTOCAP_F_SOFTWARE)) {
 		/* sort of an Algol 68-style for loop */
 		match = CRYPTOCAP_F_SOFTWARE;
+		hw = best;
+		best = NULL;
 		goto again;
 	}
+	/* all software is overloaded too, stay with the hardware */
+	if (match == CRYPTOCAP_F_SOFTWARE && hw != NULL &&
+			(best == NULL || crypto_driver_overloaded(best)))
+		return hw;
 	return best;
 }
 
 /*
- * Create a new session.  The crid argument specifies a crypto
+ * Create a session with a driver.  The crid argument specifies a crypto
  * driver to use or constraints on a driver to select (hardware
  * only, software only, either).  Whatever driver is selected
  * must be capable of the requested crypto algorithms.
  */
-int
-crypto_newsession(u_int64_t *sid, struct cryptoini *cri, int crid)
+static int
+crypto_drv_newsession(u_int64_t *sid, struct cryptoini *cri, int crid,
+		int exclude)
 {
 	struct cryptocap *cap;
 	u_int32_t hid, lid;
@@ -398,7 +1054,7 @@ crypto_newsession(u_int64_t *sid, struct cryptoini *cri, int crid)
 		/*
 		 * No requested driver; select based on crid flags.
 		 */
-		cap = crypto_select_driver(cri, crid);
+		cap = crypto_select_driver(cri, crid, exclude);
 		/*
 		 * if NULL then can't do everything in one session.
 		 * XXX Fix this. We need to inject a "virtual" session
@@ -426,6 +1082,43 @@ crypto_newsession(u_int64_t *sid, struct cryptoini *cri, int crid)
 	return err;
 }
 
+/*
+ * Create a new session, see crypto_drv_newsession() for crid.
+ */
+int
+crypto_newsession(u_int64_t *sid, struct cryptoini *cri, int crid)
+{
+	struct crypto_session *ses;
+	int err;
+
+	ses = kmalloc(sizeof(*ses), SLAB_ATOMIC);
+	if (ses == NULL)
+		return ENOMEM;
+	memset(ses, 0, sizeof(*ses));
+	atomic_set(&ses->cs_refs, 1);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
+	INIT_WORK(&ses->cs_work, crypto_ses_work);
+#else
+	INIT_WORK(&ses->cs_work, crypto_ses_work, ses);
+#endif
+
+	err = crypto_drv_newsession(&ses->cs_drvsid, cri, crid, -1);
+	if (err) {
+		kfree(ses);
+		return err;
+	}
+	ses->cs_crid = crid;
+	ses->cs_moved = jiffies;
+	err = crypto_ses_insert(ses);
+	if (err) {
+		crypto_drv_freesession(ses->cs_drvsid);
+		kfree(ses);
+		return err;
+	}
+	*sid = ses->cs_sid;
+	return 0;
+}
+
 static void
 crypto_remove(struct cryptocap *cap)
 {
@@ -435,11 +1128,11 @@ crypto_remove(struct cryptocap *cap)
 }
 
 /*
- * Delete an existing session (or a reserved session on an unregistered
- * driver).
+ * Delete an existing session with a driver (or a reserved session on an
+ * unregistered driver).
  */
-int
-crypto_freesession(u_int64_t sid)
+static int
+crypto_drv_freesession(u_int64_t sid)
 {
 	struct cryptocap *cap;
 	u_int32_t hid;
@@ -482,6 +1175,104 @@ done:
 	return err;
 }
 
+/*
+ * Delete an existing session.  If it still has ops in flight the driver
+ * session is freed when the last of them completes.
+ */
+int
+crypto_freesession(u_int64_t sid)
+{
+	struct crypto_session *ses;
+
+	dprintk("%s()\n", __FUNCTION__);
+	ses = crypto_ses_remove(sid);
+	if (ses == NULL)
+		return ENOENT;
+	if (atomic_dec_and_test(&ses->cs_refs))
+		return crypto_ses_destroy(ses);
+	return 0;
+}
+
+/*
+ * Move a session to another driver, setting up the new driver session
+ * from the descriptors of one of its requests.  The session must have
+ * no ops in a driver, and is only moved by the thread dispatching from
+ * its queue.  A session that is being freed is left where it is.
+ */
+static int
+crypto_ses_move(struct crypto_session *ses, struct cryptop *crp, int crid)
+{
+	struct cryptodesc *crd;
+	u_int64_t nid, oid = ses->cs_drvsid;
+	unsigned long s_flags;
+	int dying;
+
+	/* failed moves back off too, or the queue would retry at once */
+	ses->cs_moved = jiffies;
+	if (ses->cs_dying)
+		return -1;
+
+	for (crd = crp->crp_desc; crd->crd_next; crd = crd->crd_next)
+		crd->CRD_INI.cri_next = &(crd->crd_next->CRD_INI);
+
+	if (crypto_drv_newsession(&nid, &(crp->crp_desc->CRD_INI), crid,
+			CRYPTO_SESID2HID(oid)) != 0)
+		return -1;
+
+	dprintk("%s - session %llx moved from driver %u to %u\n", __FUNCTION__,
+			(unsigned long long) ses->cs_sid, (u_int) CRYPTO_SESID2HID(oid),
+			(u_int) CRYPTO_SESID2HID(nid));
+	CRYPTO_SES_LOCK();
+	dying = ses->cs_dying;
+	if (!dying)
+		ses->cs_drvsid = nid;
+	CRYPTO_SES_UNLOCK();
+	if (dying) {
+		crypto_drv_freesession(nid);
+		return -1;
+	}
+	crypto_drv_freesession(oid);
+	crypto_migrations++;
+	return 0;
+}
+
+/*
+ * Driver constraints to use when moving a session, either because its
+ * driver is overloaded or because it went away.  Sessions created on
+ * a specific driver only move in the latter case.
+ */
+static int
+crypto_ses_moveflags(const struct crypto_session *ses, int load)
+{
+	int crid = ses->cs_crid & (CRYPTOCAP_F_HARDWARE | CRYPTOCAP_F_SOFTWARE);
+
+	if (load) {
+		if (crypto_migrate < 2)
+			crid &= ~CRYPTOCAP_F_SOFTWARE;
+		if (crid == 0)
+			return 0;
+	} else if (crid == 0)
+		crid = CRYPTOCAP_F_HARDWARE | CRYPTOCAP_F_SOFTWARE;
+	/* users may rely on the capabilities they saw in the sid */
+	return crid | (CRYPTO_SESID2CAPS(ses->cs_sid) & CRYPTOCAP_F_SG);
+}
+
+/*
+ * Return non-zero if a session on an overloaded driver should be moved
+ * to another one now.
+ */
+static int
+crypto_ses_movable(const struct crypto_session *ses,
+		const struct cryptocap *cap)
+{
+	return crypto_migrate && !ses->cs_dying &&
+	    crypto_ses_moveflags(ses, 1) &&
+	    crypto_driver_overloaded(cap) &&
+	    atomic_read(&ses->cs_inflight) == 0 &&
+	    time_after(jiffies, ses->cs_moved +
+			msecs_to_jiffies(crypto_migrate_interval));
+}
+
 /*
  * Return an unused driver id.  Used by drivers prior to registering
  * support for the algorithms they handle.
@@ -779,8 +1570,10 @@ crypto_unblock(u_int32_t driverid, int what)
 	cap = crypto_checkdriver(driverid);
 	if (cap != NULL) {
 		if (what & CRYPTO_SYMQ) {
+			if (cap->cc_qblocked)
+				cap->cc_blocked_time += crypto_now() - cap->cc_blocked_at;
 			cap->cc_qblocked = 0;
-			cap->cc_unqblocked = 0;
+			cap->cc_unblocks++;
 			crypto_all_qblocked = 0;
 		}
 		if (what & CRYPTO_ASYMQ) {
@@ -788,13 +1581,92 @@ crypto_unblock(u_int32_t driverid, int what)
 			cap->cc_unkqblocked = 0;
 			crypto_all_kqblocked = 0;
 		}
-		wake_up_interruptible(&cryptoproc_wait);
-		err = 0;
-	} else
-		err = EINVAL;
-	CRYPTO_Q_UNLOCK(); //DAVIDM should this be a driver lock
+		err = 0;
+	} else
+		err = EINVAL;
+	CRYPTO_Q_UNLOCK(); //DAVIDM should this be a driver lock
+
+	/* requests for this driver may be waiting on any of the queues */
+	if (err == 0)
+		crypto_kick_all();
+
+	return err;
+}
+
+/*
+ * Pass a request to the driver of its session.  If the driver runs out
+ * of resources it is marked ``blocked'' for cryptop's, unless it was
+ * unblocked while the request was being handed over.
+ */
+static int
+crypto_invoke_sym(struct cryptop *crp, int hint)
+{
+	struct crypto_session *ses = crp->crp_ses;
+	struct cryptocap *cap;
+	u_int32_t hid, now, wait;
+	unsigned long q_flags;
+	int result, unblocks, n;
+
+again:
+	hid = CRYPTO_SESID2HID(ses->cs_drvsid);
+	cap = crypto_checkdriver(hid);
+	/* Driver cannot disappear when there is an active session. */
+	KASSERT(cap != NULL, ("%s: Driver disappeared.", __func__));
+
+	if (cap == NULL || cap->cc_dev == NULL ||
+			(cap->cc_flags & CRYPTOCAP_F_CLEANUP)) {
+		/*
+		 * Driver has unregistered; migrate the session and carry
+		 * on with the new driver.  If there is none, return an
+		 * error to the caller so they'll resubmit the op.
+		 */
+		if (crypto_ses_move(ses, crp, crypto_ses_moveflags(ses, 0)) == 0)
+			goto again;
+		crp->crp_etype = EAGAIN;
+		crypto_done(crp);
+		return 0;
+	}
+
+	unblocks = cap->cc_unblocks;
+	smp_rmb();
+
+	/* the driver only knows its own session id */
+	crp->crp_sid = ses->cs_drvsid;
+	now = crypto_now();
+	wait = now - crp->crp_stamp;
+	crp->crp_start = now | 1;
+	atomic_inc(&ses->cs_inflight);
+	n = atomic_inc_return(&cap->cc_inflight);
+	if (n > cap->cc_inflight_max)
+		cap->cc_inflight_max = n;
+
+	/* crp may be gone once the driver has accepted it */
+	result = crypto_invoke(cap, crp, hint);
+
+	cap = crypto_checkdriver(hid);
+	if (cap != NULL)
+		CRYPTO_EWMA(cap->cc_blockrate, result == ERESTART ? 128 : 0);
+	if (result == ERESTART) {
+		CRYPTO_Q_LOCK();
+		if (cap != NULL && cap->cc_unblocks == unblocks &&
+				!cap->cc_qblocked) {
+			cap->cc_qblocked = 1;
+			cap->cc_blocked_at = now;
+			cap->cc_blocks++;
+		}
+		cryptostats.cs_blocks++;
+		CRYPTO_Q_UNLOCK();
 
-	return err;
+		if (cap != NULL)
+			atomic_dec(&cap->cc_inflight);
+		atomic_dec(&ses->cs_inflight);
+		crp->crp_sid = ses->cs_sid;
+		crp->crp_start = 0;
+	} else if (cap != NULL) {
+		cap->cc_submitted++;
+		crypto_hist(cap->cc_hist[CRYPTO_STAGE_QUEUE], wait);
+	}
+	return result;
 }
 
 /*
@@ -803,66 +1675,85 @@ crypto_unblock(u_int32_t driverid, int what)
 int
 crypto_dispatch(struct cryptop *crp)
 {
+	struct crypto_queue *cq;
 	struct cryptocap *cap;
-	int result = -1;
-	unsigned long q_flags;
+	int result = -1, n;
+	unsigned long c_flags;
 
 	dprintk("%s()\n", __FUNCTION__);
 
 	cryptostats.cs_ops++;
 
-	CRYPTO_Q_LOCK();
-	if (crypto_q_cnt >= crypto_q_max) {
+	crp->crp_ses = crypto_ses_lookup(crp->crp_sid);
+	if (crp->crp_ses == NULL) {
+		dprintk("%s - unknown session %llx\n", __FUNCTION__,
+				(unsigned long long) crp->crp_sid);
+		return EINVAL;
+	}
+
+	n = atomic_inc_return(&crypto_q_cnt);
+	if (n > crypto_q_max) {
+		atomic_dec(&crypto_q_cnt);
 		cryptostats.cs_drops++;
-		CRYPTO_Q_UNLOCK();
+		crypto_ses_put(crp->crp_ses);
+		crp->crp_ses = NULL;
 		return ENOMEM;
 	}
-	crypto_q_cnt++;
+	if (n > crypto_q_hiwat)
+		crypto_q_hiwat = n;
 
 	/* make sure we are starting a fresh run on this crp. */
 	crp->crp_flags &= ~CRYPTO_F_DONE;
 	crp->crp_etype = 0;
+	crp->crp_stamp = crypto_now();
+	trace_ocf_dispatch(crp);
+
+	cq = crypto_sesq(crp->crp_sid);
+	CRYPTO_CQ_LOCK(cq);
 
 	/*
 	 * Caller marked the request to be processed immediately; dispatch
 	 * it directly to the driver unless the driver is currently blocked.
+	 * Earlier requests still on the queue, or being passed to a driver
+	 * by a thread, must go first to keep the session order.
 	 */
-	if ((crp->crp_flags & CRYPTO_F_BATCH) == 0) {
-		int hid = CRYPTO_SESID2HID(crp->crp_sid);
-		cap = crypto_checkdriver(hid);
+	if ((crp->crp_flags & CRYPTO_F_BATCH) == 0 &&
+			!cq->cq_running && list_empty(&cq->cq_q)) {
+		cap = crypto_checkdriver(
+				CRYPTO_SESID2HID(crp->crp_ses->cs_drvsid));
 		/* Driver cannot disappear when there is an active session. */
 		KASSERT(cap != NULL, ("%s: Driver disappeared.", __func__));
-		if (!cap->cc_qblocked) {
-			crypto_all_qblocked = 0;
-			crypto_drivers[hid].cc_unqblocked = 1;
-			CRYPTO_Q_UNLOCK();
-			result = crypto_invoke(cap, crp, 0);
-			CRYPTO_Q_LOCK();
-			if (result == ERESTART)
-				if (crypto_drivers[hid].cc_unqblocked)
-					crypto_drivers[hid].cc_qblocked = 1;
-			crypto_drivers[hid].cc_unqblocked = 0;
+		if (cap == NULL || !cap->cc_qblocked) {
+			cq->cq_running = 1;
+			CRYPTO_CQ_UNLOCK(cq);
+			result = crypto_invoke_sym(crp, 0);
+			CRYPTO_CQ_LOCK(cq);
+			cq->cq_running = 0;
 		}
 	}
 	if (result == ERESTART) {
 		/*
-		 * The driver ran out of resources, mark the
-		 * driver ``blocked'' for cryptop's and put
-		 * the request back in the queue.  It would
-		 * best to put the request back where we got
-		 * it but that's hard so for now we put it
-		 * at the front.  This should be ok; putting
-		 * it at the end does not work.
+		 * The driver ran out of resources, put the request
+		 * back at the front of the queue.  Nothing could be
+		 * dispatched from this queue while we had it, so this
+		 * is where it belongs.
 		 */
-		list_add(&crp->crp_next, &crp_q);
-		cryptostats.cs_blocks++;
+		list_add(&crp->crp_next, &cq->cq_q);
 		result = 0;
 	} else if (result == -1) {
-		TAILQ_INSERT_TAIL(&crp_q, crp, crp_next);
+		/*
+		 * If the queue was already backed up, let the next
+		 * thread know as well in case this one is busy.
+		 */
+		if (!list_empty(&cq->cq_q) && crypto_nqueues > 1)
+			wake_up_interruptible(
+				&crypto_queues[(cq->cq_index + 1) % crypto_nqueues].cq_wait);
+		TAILQ_INSERT_TAIL(&cq->cq_q, crp, crp_next);
 		result = 0;
 	}
-	wake_up_interruptible(&cryptoproc_wait);
-	CRYPTO_Q_UNLOCK();
+	if (!list_empty(&cq->cq_q))
+		crypto_kick(cq);
+	CRYPTO_CQ_UNLOCK(cq);
 	return result;
 }
 
@@ -882,8 +1773,8 @@ crypto_kdispatch(struct cryptkop *krp)
 	if (error == ERESTART) {
 		CRYPTO_Q_LOCK();
 		TAILQ_INSERT_TAIL(&crp_kq, krp, krp_next);
-		wake_up_interruptible(&cryptoproc_wait);
 		CRYPTO_Q_UNLOCK();
+		crypto_kick_all();
 		error = 0;
 	}
 	return error;
@@ -1029,7 +1920,7 @@ static int
 crypto_invoke(struct cryptocap *cap, struct cryptop *crp, int hint)
 {
 	KASSERT(crp != NULL, ("%s: crp == NULL", __func__));
-	KASSERT(crp->crp_callback != NULL,
+	KASSERT(crp->crp_callback != NULL || crp->crp_vcallback != NULL,
 	    ("%s: crp->crp_callback == NULL", __func__));
 	KASSERT(crp->crp_desc != NULL, ("%s: crp->crp_desc == NULL", __func__));
 
@@ -1039,36 +1930,23 @@ crypto_invoke(struct cryptocap *cap, struct cryptop *crp, int hint)
 	if (crypto_timing)
 		crypto_tstat(&cryptostats.cs_invoke, &crp->crp_tstamp);
 #endif
-	if (cap->cc_flags & CRYPTOCAP_F_CLEANUP) {
-		struct cryptodesc *crd;
-		u_int64_t nid;
-
-		/*
-		 * Driver has unregistered; migrate the session and return
-		 * an error to the caller so they'll resubmit the op.
-		 *
-		 * XXX: What if there are more already queued requests for this
-		 *      session?
-		 */
-		crypto_freesession(crp->crp_sid);
-
-		for (crd = crp->crp_desc; crd->crd_next; crd = crd->crd_next)
-			crd->CRD_INI.cri_next = &(crd->crd_next->CRD_INI);
+	/*
+	 * Invoke the driver to process the request.  An unregistered
+	 * driver is dealt with by crypto_invoke_sym().
+	 */
+	return CRYPTODEV_PROCESS(cap->cc_dev, crp, hint);
+}
 
-		/* XXX propagate flags from initial session? */
-		if (crypto_newsession(&nid, &(crp->crp_desc->CRD_INI),
-		    CRYPTOCAP_F_HARDWARE | CRYPTOCAP_F_SOFTWARE) == 0)
-			crp->crp_sid = nid;
+static void
+crypto_freereq_all(struct cryptop *crp)
+{
+	struct cryptodesc *crd;
 
-		crp->crp_etype = EAGAIN;
-		crypto_done(crp);
-		return 0;
-	} else {
-		/*
-		 * Invoke the driver to process the request.
-		 */
-		return CRYPTODEV_PROCESS(cap->cc_dev, crp, hint);
+	while ((crd = crp->crp_desc) != NULL) {
+		crp->crp_desc = crd->crd_next;
+		kmem_cache_free(cryptodesc_zone, crd);
 	}
+	kmem_cache_free(cryptop_zone, crp);
 }
 
 /*
@@ -1077,38 +1955,60 @@ crypto_invoke(struct cryptocap *cap, struct cryptop *crp, int hint)
 void
 crypto_freereq(struct cryptop *crp)
 {
+	struct crypto_reqcache *rc;
 	struct cryptodesc *crd;
+	unsigned long flags;
+	int n;
 
 	if (crp == NULL)
 		return;
 
 #ifdef DIAGNOSTIC
 	{
+		struct crypto_queue *cq;
 		struct cryptop *crp2;
-		unsigned long q_flags;
-
-		CRYPTO_Q_LOCK();
-		TAILQ_FOREACH(crp2, &crp_q, crp_next) {
-			KASSERT(crp2 != crp,
-			    ("Freeing cryptop from the crypto queue (%p).",
-			    crp));
-		}
-		CRYPTO_Q_UNLOCK();
-		CRYPTO_RETQ_LOCK();
-		TAILQ_FOREACH(crp2, &crp_ret_q, crp_next) {
-			KASSERT(crp2 != crp,
-			    ("Freeing cryptop from the return queue (%p).",
-			    crp));
+		unsigned long c_flags, r_flags;
+		int i;
+
+		for (i = 0; i < crypto_nqueues; i++) {
+			cq = &crypto_queues[i];
+			CRYPTO_CQ_LOCK(cq);
+			TAILQ_FOREACH(crp2, &cq->cq_q, crp_next) {
+				KASSERT(crp2 != crp,
+				    ("Freeing cryptop from the crypto queue (%p).",
+				    crp));
+			}
+			CRYPTO_CQ_UNLOCK(cq);
+			CRYPTO_RETQ_LOCK(cq);
+			TAILQ_FOREACH(crp2, &cq->cq_ret_q, crp_next) {
+				KASSERT(crp2 != crp,
+				    ("Freeing cryptop from the return queue (%p).",
+				    crp));
+			}
+			CRYPTO_RETQ_UNLOCK(cq);
 		}
-		CRYPTO_RETQ_UNLOCK();
 	}
 #endif
 
-	while ((crd = crp->crp_desc) != NULL) {
-		crp->crp_desc = crd->crd_next;
-		kmem_cache_free(cryptodesc_zone, crd);
+	/* keep it for reuse if it has one of the common shapes */
+	for (n = 0, crd = crp->crp_desc; crd != NULL && n <= CRYPTO_REQCACHE_SHAPES;
+			crd = crd->crd_next)
+		n++;
+	if (n > 0 && n <= CRYPTO_REQCACHE_SHAPES) {
+		local_irq_save(flags);
+		rc = CRYPTO_REQCACHE();
+		if (rc->rc_count[n - 1] < crypto_reqcache_max) {
+			crp->crp_opaque = (caddr_t) rc->rc_free[n - 1];
+			rc->rc_free[n - 1] = crp;
+			rc->rc_count[n - 1]++;
+			crp = NULL;
+		}
+		local_irq_restore(flags);
+		if (crp == NULL)
+			return;
 	}
-	kmem_cache_free(cryptop_zone, crp);
+
+	crypto_freereq_all(crp);
 }
 
 /*
@@ -1117,8 +2017,37 @@ crypto_freereq(struct cryptop *crp)
 struct cryptop *
 crypto_getreq(int num)
 {
-	struct cryptodesc *crd;
-	struct cryptop *crp;
+	struct crypto_reqcache *rc;
+	struct cryptodesc *crd, *next;
+	struct cryptop *crp = NULL;
+	unsigned long flags;
+
+	if (num > 0 && num <= CRYPTO_REQCACHE_SHAPES) {
+		local_irq_save(flags);
+		rc = CRYPTO_REQCACHE();
+		crp = rc->rc_free[num - 1];
+		if (crp != NULL) {
+			rc->rc_free[num - 1] = (struct cryptop *) crp->crp_opaque;
+			rc->rc_count[num - 1]--;
+			rc->rc_hits++;
+		} else
+			rc->rc_misses++;
+		local_irq_restore(flags);
+	}
+	if (crp != NULL) {
+		/* reset it to what a new request looks like */
+		crd = crp->crp_desc;
+		memset(crp, 0, sizeof(*crp));
+		INIT_LIST_HEAD(&crp->crp_next);
+		init_waitqueue_head(&crp->crp_waitq);
+		crp->crp_desc = crd;
+		for (; crd != NULL; crd = next) {
+			next = crd->crd_next;
+			memset(crd, 0, sizeof(*crd));
+			crd->crd_next = next;
+		}
+		return crp;
+	}
 
 	crp = kmem_cache_alloc(cryptop_zone, SLAB_ATOMIC);
 	if (crp != NULL) {
@@ -1139,25 +2068,50 @@ crypto_getreq(int num)
 	return crp;
 }
 
+static inline void
+crypto_callback(struct cryptop *crp)
+{
+	if (crp->crp_vcallback != NULL)
+		crp->crp_vcallback(&crp, 1);
+	else
+		crp->crp_callback(crp);
+}
+
 /*
- * Invoke the callback on behalf of the driver.
+ * Account for a completed request, returns non-zero if its
+ * callback is to be done immediately.
  */
-void
-crypto_done(struct cryptop *crp)
+static int
+crypto_done_prep(struct cryptop *crp)
 {
-	unsigned long q_flags;
+	int sync = CRYPTO_SESID2CAPS(crp->crp_sid) & CRYPTOCAP_F_SYNC;
 
 	dprintk("%s()\n", __FUNCTION__);
 	if ((crp->crp_flags & CRYPTO_F_DONE) == 0) {
 		crp->crp_flags |= CRYPTO_F_DONE;
-		CRYPTO_Q_LOCK();
-		crypto_q_cnt--;
-		CRYPTO_Q_UNLOCK();
+		atomic_dec(&crypto_q_cnt);
+		if (crp->crp_start) {
+			crp->crp_stamp = crypto_driver_done(crp);
+			crp->crp_start = 0;
+			atomic_dec(&crp->crp_ses->cs_inflight);
+		} else
+			crp->crp_stamp = crypto_now();
+		/* give the caller back the session id it knows */
+		if (crp->crp_ses != NULL) {
+			crp->crp_sid = crp->crp_ses->cs_sid;
+			atomic_long_inc(&crp->crp_ses->cs_ops);
+			atomic_long_add(crp->crp_ilen, &crp->crp_ses->cs_bytes);
+			if (crp->crp_etype != 0)
+				atomic_long_inc(&crp->crp_ses->cs_errs);
+			crypto_ses_put(crp->crp_ses);
+			crp->crp_ses = NULL;
+		}
 	} else
 		printk("crypto: crypto_done op already done, flags 0x%x",
 				crp->crp_flags);
 	if (crp->crp_etype != 0)
 		cryptostats.cs_errs++;
+	trace_ocf_done(crp);
 	/*
 	 * CBIMM means unconditionally do the callback immediately;
 	 * CBIFSYNC means do the callback immediately only if the
@@ -1165,27 +2119,90 @@ crypto_done(struct cryptop *crp)
 	 * doing extraneous context switches; the latter is mostly
 	 * used with the software crypto driver.
 	 */
-	if ((crp->crp_flags & CRYPTO_F_CBIMM) ||
-	    ((crp->crp_flags & CRYPTO_F_CBIFSYNC) &&
-	     (CRYPTO_SESID2CAPS(crp->crp_sid) & CRYPTOCAP_F_SYNC))) {
-		/*
-		 * Do the callback directly.  This is ok when the
-		 * callback routine does very little (e.g. the
-		 * /dev/crypto callback method just does a wakeup).
-		 */
-		crp->crp_callback(crp);
-	} else {
-		unsigned long r_flags;
+	return (crp->crp_flags & CRYPTO_F_CBIMM) ||
+	    ((crp->crp_flags & CRYPTO_F_CBIFSYNC) && sync);
+}
+
+/*
+ * Account the time a request waited on a return queue to the driver
+ * its session was created on; the request no longer holds the session.
+ */
+static void
+crypto_ret_account(struct cryptop *crp, u_int32_t now)
+{
+	struct cryptocap *cap;
+
+	cap = crypto_checkdriver(CRYPTO_SESID2HID(crp->crp_sid));
+	if (cap != NULL)
+		crypto_hist(cap->cc_hist[CRYPTO_STAGE_RET], now - crp->crp_stamp);
+}
+
+/*
+ * Invoke the callbacks for a burst of requests on behalf of the driver.
+ */
+void
+crypto_done_batch(struct cryptop **crps, int n)
+{
+	struct crypto_queue *cq = NULL, *ncq;
+	unsigned long r_flags = 0;
+	int i, wake = 0;
+
+	if (n <= 0)
+		return;
+	crypto_batch_count(crypto_done_burst, n);
+
+	for (i = 0; i < n; i++) {
+		struct cryptop *crp = crps[i];
+
+		if (crypto_done_prep(crp)) {
+			if (cq != NULL) {
+				CRYPTO_RETQ_UNLOCK(cq);
+				if (wake)
+					wake_up_interruptible(&cq->cq_ret_wait);
+				cq = NULL;
+			}
+			/*
+			 * Do the callback directly.  This is ok when the
+			 * callback routine does very little (e.g. the
+			 * /dev/crypto callback method just does a wakeup).
+			 */
+			crypto_callback(crp);
+			continue;
+		}
 		/*
-		 * Normal case; queue the callback for the thread.
+		 * Normal case; queue the callback for the thread
+		 * of the queue the request was submitted on.  The
+		 * lock is kept while the burst stays on one queue.
 		 */
-		CRYPTO_RETQ_LOCK();
-		wake_up_interruptible(&cryptoretproc_wait);/* shared wait channel */
-		TAILQ_INSERT_TAIL(&crp_ret_q, crp, crp_next);
-		CRYPTO_RETQ_UNLOCK();
+		ncq = crypto_sesq(crp->crp_sid);
+		if (ncq != cq) {
+			if (cq != NULL) {
+				CRYPTO_RETQ_UNLOCK(cq);
+				if (wake)
+					wake_up_interruptible(&cq->cq_ret_wait);
+			}
+			cq = ncq;
+			CRYPTO_RETQ_LOCK(cq);
+			wake = CRYPTO_RETQ_EMPTY(cq);
+		}
+		TAILQ_INSERT_TAIL(&cq->cq_ret_q, crp, crp_next);
+	}
+	if (cq != NULL) {
+		CRYPTO_RETQ_UNLOCK(cq);
+		if (wake)
+			wake_up_interruptible(&cq->cq_ret_wait);
 	}
 }
 
+/*
+ * Invoke the callback on behalf of the driver.
+ */
+void
+crypto_done(struct cryptop *crp)
+{
+	crypto_done_batch(&crp, 1);
+}
+
 /*
  * Invoke the callback on behalf of the driver.
  */
@@ -1225,14 +2242,15 @@ crypto_kdone(struct cryptkop *krp)
 		 */
 		krp->krp_callback(krp);
 	} else {
+		struct crypto_queue *cq = &crypto_queues[0];
 		unsigned long r_flags;
 		/*
 		 * Normal case; queue the callback for the thread.
 		 */
-		CRYPTO_RETQ_LOCK();
-		wake_up_interruptible(&cryptoretproc_wait);/* shared wait channel */
-		TAILQ_INSERT_TAIL(&crp_ret_kq, krp, krp_next);
-		CRYPTO_RETQ_UNLOCK();
+		CRYPTO_RETQ_LOCK(cq);
+		wake_up_interruptible(&cq->cq_ret_wait);
+		TAILQ_INSERT_TAIL(&cq->cq_ret_kq, krp, krp_next);
+		CRYPTO_RETQ_UNLOCK(cq);
 	}
 }
 
@@ -1260,40 +2278,30 @@ crypto_getfeat(int *featp)
 }
 
 /*
- * Crypto thread, dispatches crypto requests.
+ * Pass the first request on a queue whose driver is not blocked to the
+ * driver, looking ahead to see if more ops are ready for the same driver.
+ * Only one thread at a time dispatches from a queue so that requests of
+ * a session reach the driver in order.  Returns 1 if a request was passed
+ * to a driver.
  */
 static int
-crypto_proc(void *arg)
+crypto_proc_queue(struct crypto_queue *cq)
 {
-	struct cryptop *crp, *submit;
-	struct cryptkop *krp, *krpp;
+	struct cryptop *crp, *submit, *move;
 	struct cryptocap *cap;
 	u_int32_t hid;
 	int result, hint;
-	unsigned long q_flags;
-	int loopcount = 0;
-
-	set_current_state(TASK_INTERRUPTIBLE);
+	unsigned long c_flags;
 
-	CRYPTO_Q_LOCK();
-	for (;;) {
-		/*
-		 * we need to make sure we don't get into a busy loop with nothing
-		 * to do,  the two crypto_all_*blocked vars help us find out when
-		 * we are all full and can do nothing on any driver or Q.  If so we
-		 * wait for an unblock.
-		 */
-		crypto_all_qblocked  = !list_empty(&crp_q);
+	if (cq->cq_running || list_empty(&cq->cq_q))
+		return 0;
 
-		/*
-		 * Find the first element in the queue that can be
-		 * processed and look-ahead to see if multiple ops
-		 * are ready for the same driver.
-		 */
-		submit = NULL;
-		hint = 0;
-		list_for_each_entry(crp, &crp_q, crp_next) {
-			hid = CRYPTO_SESID2HID(crp->crp_sid);
+	CRYPTO_CQ_LOCK(cq);
+	submit = move = NULL;
+	hint = 0;
+	if (!cq->cq_running) {
+		list_for_each_entry(crp, &cq->cq_q, crp_next) {
+			hid = CRYPTO_SESID2HID(crp->crp_ses->cs_drvsid);
 			cap = crypto_checkdriver(hid);
 			/*
 			 * Driver cannot disappear when there is an active
@@ -1317,7 +2325,7 @@ crypto_proc(void *arg)
 					 * better to just use a per-driver
 					 * queue instead.
 					 */
-					if (CRYPTO_SESID2HID(submit->crp_sid) == hid)
+					if (CRYPTO_SESID2HID(submit->crp_ses->cs_drvsid) == hid)
 						hint = CRYPTO_HINT_MORE;
 					break;
 				} else {
@@ -1327,88 +2335,170 @@ crypto_proc(void *arg)
 					/* keep scanning for more are q'd */
 				}
 			}
+			/*
+			 * Skipping the requests of a blocked driver keeps
+			 * the session order, every request of a session
+			 * goes to the same driver.  The first one seen is
+			 * the oldest of its session, which makes it the
+			 * one to take along if the session moves.
+			 */
+			else if (move == NULL &&
+					crypto_ses_movable(crp->crp_ses, cap))
+				move = crp;
 		}
-		if (submit != NULL) {
-			hid = CRYPTO_SESID2HID(submit->crp_sid);
-			crypto_all_qblocked = 0;
-			list_del(&submit->crp_next);
-			crypto_drivers[hid].cc_unqblocked = 1;
-			cap = crypto_checkdriver(hid);
-			CRYPTO_Q_UNLOCK();
-			KASSERT(cap != NULL, ("%s:%u Driver disappeared.",
-			    __func__, __LINE__));
-			result = crypto_invoke(cap, submit, hint);
-			CRYPTO_Q_LOCK();
-			if (result == ERESTART) {
-				/*
-				 * The driver ran out of resources, mark the
-				 * driver ``blocked'' for cryptop's and put
-				 * the request back in the queue.  It would
-				 * best to put the request back where we got
-				 * it but that's hard so for now we put it
-				 * at the front.  This should be ok; putting
-				 * it at the end does not work.
-				 */
-				/* XXX validate sid again? */
-				list_add(&submit->crp_next, &crp_q);
-				cryptostats.cs_blocks++;
-				if (crypto_drivers[hid].cc_unqblocked)
-					crypto_drivers[hid].cc_qblocked=0;
-				crypto_drivers[hid].cc_unqblocked=0;
-			}
-			crypto_drivers[hid].cc_unqblocked = 0;
-		}
+	}
+	/*
+	 * Everything left is waiting for blocked drivers.  Try moving a
+	 * session off an overloaded one.
+	 */
+	if (submit == NULL && move != NULL)
+		submit = move;
+	else
+		move = NULL;
+	if (submit == NULL) {
+		if (!list_empty(&cq->cq_q))
+			crypto_all_qblocked = 1;
+		CRYPTO_CQ_UNLOCK(cq);
+		return 0;
+	}
+	crypto_all_qblocked = 0;
+	list_del(&submit->crp_next);
+	cq->cq_running = 1;
+	CRYPTO_CQ_UNLOCK(cq);
+
+	if (move != NULL && crypto_ses_move(move->crp_ses, move,
+			crypto_ses_moveflags(move->crp_ses, 1)) != 0)
+		result = ERESTART;
+	else
+		result = crypto_invoke_sym(submit, hint);
+
+	CRYPTO_CQ_LOCK(cq);
+	if (result == ERESTART) {
+		/*
+		 * The driver ran out of resources, put the request
+		 * back in the queue.  Nothing else was dispatched
+		 * from this queue meanwhile, so the front is where
+		 * it came from.
+		 */
+		/* XXX validate sid again? */
+		list_add(&submit->crp_next, &cq->cq_q);
+	}
+	cq->cq_running = 0;
+	/* requests queued meanwhile may be waiting for us to finish */
+	if (!list_empty(&cq->cq_q))
+		crypto_kick(cq);
+	CRYPTO_CQ_UNLOCK(cq);
+	return 1;
+}
+
+/*
+ * As above, but for key ops.  These share one queue that any of the
+ * crypto threads will service.
+ */
+static int
+crypto_proc_kq(void)
+{
+	struct cryptkop *krp, *krpp;
+	struct cryptocap *cap;
+	int result;
+	unsigned long q_flags;
 
-		crypto_all_kqblocked = !list_empty(&crp_kq);
+	if (list_empty(&crp_kq))
+		return 0;
 
-		/* As above, but for key ops */
-		krp = NULL;
-		list_for_each_entry(krpp, &crp_kq, krp_next) {
-			cap = crypto_checkdriver(krpp->krp_hid);
-			if (cap == NULL || cap->cc_dev == NULL) {
-				/*
-				 * Operation needs to be migrated, invalidate
-				 * the assigned device so it will reselect a
-				 * new one below.  Propagate the original
-				 * crid selection flags if supplied.
-				 */
-				krp->krp_hid = krp->krp_crid &
-				    (CRYPTOCAP_F_SOFTWARE|CRYPTOCAP_F_HARDWARE);
-				if (krp->krp_hid == 0)
-					krp->krp_hid =
-				    CRYPTOCAP_F_SOFTWARE|CRYPTOCAP_F_HARDWARE;
-				break;
-			}
-			if (!cap->cc_kqblocked) {
-				krp = krpp;
-				break;
-			}
+	CRYPTO_Q_LOCK();
+	crypto_all_kqblocked = !list_empty(&crp_kq);
+
+	krp = NULL;
+	list_for_each_entry(krpp, &crp_kq, krp_next) {
+		cap = crypto_checkdriver(krpp->krp_hid);
+		if (cap == NULL || cap->cc_dev == NULL) {
+			/*
+			 * Operation needs to be migrated, invalidate
+			 * the assigned device so it will reselect a
+			 * new one below.  Propagate the original
+			 * crid selection flags if supplied.
+			 */
+			krp = krpp;
+			krp->krp_hid = krp->krp_crid &
+			    (CRYPTOCAP_F_SOFTWARE|CRYPTOCAP_F_HARDWARE);
+			if (krp->krp_hid == 0)
+				krp->krp_hid =
+			    CRYPTOCAP_F_SOFTWARE|CRYPTOCAP_F_HARDWARE;
+			break;
 		}
-		if (krp != NULL) {
-			crypto_all_kqblocked = 0;
-			list_del(&krp->krp_next);
-			crypto_drivers[krp->krp_hid].cc_kqblocked = 1;
-			CRYPTO_Q_UNLOCK();
-			result = crypto_kinvoke(krp, krp->krp_hid);
-			CRYPTO_Q_LOCK();
-			if (result == ERESTART) {
-				/*
-				 * The driver ran out of resources, mark the
-				 * driver ``blocked'' for cryptkop's and put
-				 * the request back in the queue.  It would
-				 * best to put the request back where we got
-				 * it but that's hard so for now we put it
-				 * at the front.  This should be ok; putting
-				 * it at the end does not work.
-				 */
-				/* XXX validate sid again? */
-				list_add(&krp->krp_next, &crp_kq);
-				cryptostats.cs_kblocks++;
-			} else
-				crypto_drivers[krp->krp_hid].cc_kqblocked = 0;
+		if (!cap->cc_kqblocked) {
+			krp = krpp;
+			break;
 		}
+	}
+	if (krp == NULL) {
+		CRYPTO_Q_UNLOCK();
+		return 0;
+	}
+
+	crypto_all_kqblocked = 0;
+	list_del(&krp->krp_next);
+	cap = crypto_checkdriver(krp->krp_hid);
+	if (cap != NULL)
+		cap->cc_kqblocked = 1;
+	CRYPTO_Q_UNLOCK();
+	result = crypto_kinvoke(krp, krp->krp_hid);
+	CRYPTO_Q_LOCK();
+	if (result == ERESTART) {
+		/*
+		 * The driver ran out of resources, mark the
+		 * driver ``blocked'' for cryptkop's and put
+		 * the request back in the queue.  It would
+		 * best to put the request back where we got
+		 * it but that's hard so for now we put it
+		 * at the front.  This should be ok; putting
+		 * it at the end does not work.
+		 */
+		/* XXX validate sid again? */
+		list_add(&krp->krp_next, &crp_kq);
+		cryptostats.cs_kblocks++;
+	} else {
+		cap = crypto_checkdriver(krp->krp_hid);
+		if (cap != NULL)
+			cap->cc_kqblocked = 0;
+	}
+	CRYPTO_Q_UNLOCK();
+	return 1;
+}
+
+/*
+ * Crypto thread, dispatches crypto requests.  There is one per queue.
+ */
+static int
+crypto_proc(void *arg)
+{
+	struct crypto_queue *cq = arg;
+	unsigned int kicks;
+	int i, busy;
+	int loopcount = 0;
+
+	set_current_state(TASK_INTERRUPTIBLE);
+
+	for (;;) {
+		kicks = cq->cq_kicks;
+		smp_rmb();
+
+		busy = crypto_proc_queue(cq);
 
-		if (submit == NULL && krp == NULL) {
+		/*
+		 * Nothing we can do on our own queue, it is empty or its
+		 * drivers are blocked.  Help out with the other queues,
+		 * starting with our neighbour so that the threads do not
+		 * all pile onto the same one.
+		 */
+		for (i = 1; !busy && i < crypto_nqueues; i++)
+			busy = crypto_proc_queue(
+				&crypto_queues[(cq->cq_index + i) % crypto_nqueues]);
+
+		busy |= crypto_proc_kq();
+
+		if (!busy) {
 			/*
 			 * Nothing more to be processed.  Sleep until we're
 			 * woken because there are more ops to process.
@@ -1421,15 +2511,13 @@ crypto_proc(void *arg)
 			 * out of order if dispatched to different devices
 			 * and some become blocked while others do not.
 			 */
-			dprintk("%s - sleeping (qe=%d qb=%d kqe=%d kqb=%d)\n",
-					__FUNCTION__,
-					list_empty(&crp_q), crypto_all_qblocked,
+			dprintk("%s - sleeping (q=%d qe=%d qb=%d kqe=%d kqb=%d)\n",
+					__FUNCTION__, cq->cq_index,
+					list_empty(&cq->cq_q), crypto_all_qblocked,
 					list_empty(&crp_kq), crypto_all_kqblocked);
 			loopcount = 0;
-			CRYPTO_Q_UNLOCK();
-			wait_event_interruptible(cryptoproc_wait,
-					!(list_empty(&crp_q) || crypto_all_qblocked) ||
-					!(list_empty(&crp_kq) || crypto_all_kqblocked) ||
+			wait_event_interruptible(cq->cq_wait,
+					cq->cq_kicks != kicks ||
 					kthread_should_stop());
 			if (signal_pending (current)) {
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,0)
@@ -1440,7 +2528,6 @@ crypto_proc(void *arg)
 				spin_unlock_irq(&current->sigmask_lock);
 #endif
 			}
-			CRYPTO_Q_LOCK();
 			dprintk("%s - awake\n", __FUNCTION__);
 			if (kthread_should_stop())
 				break;
@@ -1451,13 +2538,10 @@ crypto_proc(void *arg)
 			 * been using the CPU exclusively for a while.
 			 */
 			loopcount = 0;
-			CRYPTO_Q_UNLOCK();
 			schedule();
-			CRYPTO_Q_LOCK();
 		}
 		loopcount++;
 	}
-	CRYPTO_Q_UNLOCK();
 	return 0;
 }
 
@@ -1465,51 +2549,75 @@ crypto_proc(void *arg)
  * Crypto returns thread, does callbacks for processed crypto requests.
  * Callbacks are done here, rather than in the crypto drivers, because
  * callbacks typically are expensive and would slow interrupt handling.
+ * There is one per queue.
  */
 static int
 crypto_ret_proc(void *arg)
 {
-	struct cryptop *crpt;
+	struct crypto_queue *cq = arg;
+	struct cryptop *crpt, *vec[CRYPTO_RET_VEC];
 	struct cryptkop *krpt;
 	unsigned long  r_flags;
+	LIST_HEAD(crpq);
+	LIST_HEAD(krpq);
+	u_int32_t now;
+	int i, n;
 
 	set_current_state(TASK_INTERRUPTIBLE);
 
-	CRYPTO_RETQ_LOCK();
+	CRYPTO_RETQ_LOCK(cq);
 	for (;;) {
-		/* Harvest return q's for completed ops */
-		crpt = NULL;
-		if (!list_empty(&crp_ret_q))
-			crpt = list_entry(crp_ret_q.next, typeof(*crpt), crp_next);
-		if (crpt != NULL)
-			list_del(&crpt->crp_next);
-
-		krpt = NULL;
-		if (!list_empty(&crp_ret_kq))
-			krpt = list_entry(crp_ret_kq.next, typeof(*krpt), krp_next);
-		if (krpt != NULL)
-			list_del(&krpt->krp_next);
-
-		if (crpt != NULL || krpt != NULL) {
-			CRYPTO_RETQ_UNLOCK();
+		/* Harvest return q's for completed ops, all at once */
+		if (!CRYPTO_RETQ_EMPTY(cq)) {
+			list_splice_init(&cq->cq_ret_q, &crpq);
+			list_splice_init(&cq->cq_ret_kq, &krpq);
+			CRYPTO_RETQ_UNLOCK(cq);
+
 			/*
-			 * Run callbacks unlocked.
+			 * Run callbacks unlocked.  Requests are unlinked
+			 * before their callback as it may free or reuse them.
+			 * Their wait is counted up to when we picked them up.
 			 */
-			if (crpt != NULL)
-				crpt->crp_callback(crpt);
-			if (krpt != NULL)
+			now = crypto_now();
+			n = 0;
+			while (!list_empty(&crpq)) {
+				crpt = list_entry(crpq.next, typeof(*crpt), crp_next);
+				list_del(&crpt->crp_next);
+				crypto_ret_account(crpt, now);
+				n++;
+				if (crpt->crp_vcallback == NULL) {
+					crpt->crp_callback(crpt);
+					continue;
+				}
+				vec[0] = crpt;
+				for (i = 1; i < CRYPTO_RET_VEC && !list_empty(&crpq); i++) {
+					crpt = list_entry(crpq.next, typeof(*crpt), crp_next);
+					if (crpt->crp_vcallback != vec[0]->crp_vcallback)
+						break;
+					list_del(&crpt->crp_next);
+					crypto_ret_account(crpt, now);
+					vec[i] = crpt;
+				}
+				n += i - 1;
+				vec[0]->crp_vcallback(vec, i);
+			}
+			while (!list_empty(&krpq)) {
+				krpt = list_entry(krpq.next, typeof(*krpt), krp_next);
+				list_del(&krpt->krp_next);
 				krpt->krp_callback(krpt);
-			CRYPTO_RETQ_LOCK();
+				n++;
+			}
+			crypto_batch_count(crypto_ret_batch, n);
+			CRYPTO_RETQ_LOCK(cq);
 		} else {
 			/*
 			 * Nothing more to be processed.  Sleep until we're
 			 * woken because there are more returns to process.
 			 */
 			dprintk("%s - sleeping\n", __FUNCTION__);
-			CRYPTO_RETQ_UNLOCK();
-			wait_event_interruptible(cryptoretproc_wait,
-					!list_empty(&crp_ret_q) ||
-					!list_empty(&crp_ret_kq) ||
+			CRYPTO_RETQ_UNLOCK(cq);
+			wait_event_interruptible(cq->cq_ret_wait,
+					!CRYPTO_RETQ_EMPTY(cq) ||
 					kthread_should_stop());
 			if (signal_pending (current)) {
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,0)
@@ -1520,7 +2628,7 @@ crypto_ret_proc(void *arg)
 				spin_unlock_irq(&current->sigmask_lock);
 #endif
 			}
-			CRYPTO_RETQ_LOCK();
+			CRYPTO_RETQ_LOCK(cq);
 			dprintk("%s - awake\n", __FUNCTION__);
 			if (kthread_should_stop()) {
 				dprintk("%s - EXITING!\n", __FUNCTION__);
@@ -1529,7 +2637,7 @@ crypto_ret_proc(void *arg)
 			cryptostats.cs_rets++;
 		}
 	}
-	CRYPTO_RETQ_UNLOCK();
+	CRYPTO_RETQ_UNLOCK(cq);
 	return 0;
 }
 
@@ -1565,7 +2673,9 @@ db_show_drivers(void)
 
 DB_SHOW_COMMAND(crypto, db_show_crypto)
 {
+	struct crypto_queue *cq;
 	struct cryptop *crp;
+	int i;
 
 	db_show_drivers();
 	db_printf("\n");
@@ -1573,21 +2683,27 @@ DB_SHOW_COMMAND(crypto, db_show_crypto)
 	db_printf("%4s %8s %4s %4s %4s %4s %8s %8s\n",
 	    "HID", "Caps", "Ilen", "Olen", "Etype", "Flags",
 	    "Desc", "Callback");
-	TAILQ_FOREACH(crp, &crp_q, crp_next) {
-		db_printf("%4u %08x %4u %4u %4u %04x %8p %8p\n"
-		    , (int) CRYPTO_SESID2HID(crp->crp_sid)
-		    , (int) CRYPTO_SESID2CAPS(crp->crp_sid)
-		    , crp->crp_ilen, crp->crp_olen
-		    , crp->crp_etype
-		    , crp->crp_flags
-		    , crp->crp_desc
-		    , crp->crp_callback
-		);
+	for (i = 0; i < crypto_nqueues; i++) {
+		cq = &crypto_queues[i];
+		TAILQ_FOREACH(crp, &cq->cq_q, crp_next) {
+			db_printf("%4u %08x %4u %4u %4u %04x %8p %8p\n"
+			    , (int) CRYPTO_SESID2HID(crp->crp_sid)
+			    , (int) CRYPTO_SESID2CAPS(crp->crp_sid)
+			    , crp->crp_ilen, crp->crp_olen
+			    , crp->crp_etype
+			    , crp->crp_flags
+			    , crp->crp_desc
+			    , crp->crp_callback
+			);
+		}
 	}
-	if (!TAILQ_EMPTY(&crp_ret_q)) {
+	for (i = 0; i < crypto_nqueues; i++) {
+		cq = &crypto_queues[i];
+		if (TAILQ_EMPTY(&cq->cq_ret_q))
+			continue;
 		db_printf("\n%4s %4s %4s %8s\n",
 		    "HID", "Etype", "Flags", "Callback");
-		TAILQ_FOREACH(crp, &crp_ret_q, crp_next) {
+		TAILQ_FOREACH(crp, &cq->cq_ret_q, crp_next) {
 			db_printf("%4u %4u %04x %8p\n"
 			    , (int) CRYPTO_SESID2HID(crp->crp_sid)
 			    , crp->crp_etype
@@ -1616,10 +2732,10 @@ DB_SHOW_COMMAND(kcrypto, db_show_kcrypto)
 		    , krp->krp_callback
 		);
 	}
-	if (!TAILQ_EMPTY(&crp_ret_q)) {
+	if (!TAILQ_EMPTY(&crypto_queues[0].cq_ret_kq)) {
 		db_printf("%4s %5s %8s %4s %8s\n",
 		    "Op", "Status", "CRID", "HID", "Callback");
-		TAILQ_FOREACH(krp, &crp_ret_kq, krp_next) {
+		TAILQ_FOREACH(krp, &crypto_queues[0].cq_ret_kq, krp_next) {
 			db_printf("%4u %5u %08x %4u %8p\n"
 			    , krp->krp_op
 			    , krp->krp_status
@@ -1635,7 +2751,8 @@ DB_SHOW_COMMAND(kcrypto, db_show_kcrypto)
 static int
 crypto_init(void)
 {
-	int error;
+	struct crypto_queue *cq;
+	int error, i;
 	unsigned long cpu;
 
 	dprintk("%s(%p)\n", __FUNCTION__, (void *) crypto_init);
@@ -1646,7 +2763,7 @@ crypto_init(void)
 
 	spin_lock_init(&crypto_drivers_lock);
 	spin_lock_init(&crypto_q_lock);
-	spin_lock_init(&crypto_ret_q_lock);
+	spin_lock_init(&crypto_ses_lock);
 
 	cryptop_zone = kmem_cache_create("cryptop", sizeof(struct cryptop),
 				       0, SLAB_HWCACHE_ALIGN, NULL
@@ -1679,28 +2796,73 @@ crypto_init(void)
 
 	memset(crypto_drivers, 0, crypto_drivers_num * sizeof(struct cryptocap));
 
+	/* one queue with its dispatch and return threads per CPU */
+	crypto_nqueues = 0;
+	ocf_for_each_cpu(cpu)
+		crypto_nqueues++;
+
+	crypto_queues = kmalloc(crypto_nqueues * sizeof(struct crypto_queue),
+			GFP_KERNEL);
+	if (crypto_queues == NULL) {
+		printk("crypto: crypto_init cannot setup crypto queues\n");
+		crypto_nqueues = 0;
+		error = ENOMEM;
+		goto bad;
+	}
+
+	memset(crypto_queues, 0, crypto_nqueues * sizeof(struct crypto_queue));
+
+	i = 0;
 	ocf_for_each_cpu(cpu) {
-		cryptoproc[cpu] = kthread_create(crypto_proc, (void *) cpu,
+		cq = &crypto_queues[i];
+		spin_lock_init(&cq->cq_lock);
+		INIT_LIST_HEAD(&cq->cq_q);
+		init_waitqueue_head(&cq->cq_wait);
+		spin_lock_init(&cq->cq_ret_lock);
+		INIT_LIST_HEAD(&cq->cq_ret_q);
+		INIT_LIST_HEAD(&cq->cq_ret_kq);
+		init_waitqueue_head(&cq->cq_ret_wait);
+		cq->cq_index = i++;
+	}
+
+	i = 0;
+	ocf_for_each_cpu(cpu) {
+		cq = &crypto_queues[i++];
+		cq->cq_proc = kthread_create(crypto_proc, cq,
 									"ocf_%d", (int) cpu);
-		if (IS_ERR(cryptoproc[cpu])) {
-			error = PTR_ERR(cryptoproc[cpu]);
+		if (IS_ERR(cq->cq_proc)) {
+			error = PTR_ERR(cq->cq_proc);
+			cq->cq_proc = NULL;
 			printk("crypto: crypto_init cannot start crypto thread; error %d",
 				error);
 			goto bad;
 		}
-		kthread_bind(cryptoproc[cpu], cpu);
-		wake_up_process(cryptoproc[cpu]);
+		kthread_bind(cq->cq_proc, cpu);
+		wake_up_process(cq->cq_proc);
 
-		cryptoretproc[cpu] = kthread_create(crypto_ret_proc, (void *) cpu,
+		cq->cq_ret_proc = kthread_create(crypto_ret_proc, cq,
 									"ocf_ret_%d", (int) cpu);
-		if (IS_ERR(cryptoretproc[cpu])) {
-			error = PTR_ERR(cryptoretproc[cpu]);
+		if (IS_ERR(cq->cq_ret_proc)) {
+			error = PTR_ERR(cq->cq_ret_proc);
+			cq->cq_ret_proc = NULL;
 			printk("crypto: crypto_init cannot start cryptoret thread; error %d",
 					error);
 			goto bad;
 		}
-		kthread_bind(cryptoretproc[cpu], cpu);
-		wake_up_process(cryptoretproc[cpu]);
+		kthread_bind(cq->cq_ret_proc, cpu);
+		wake_up_process(cq->cq_ret_proc);
+	}
+
+	crypto_debugfs = debugfs_create_dir("ocf", NULL);
+	if (IS_ERR(crypto_debugfs))
+		crypto_debugfs = NULL;
+	if (crypto_debugfs) {
+		debugfs_create_file("sessions", 0444, crypto_debugfs, NULL,
+				&crypto_ses_fops);
+		debugfs_create_file("stats", 0444, crypto_debugfs, NULL,
+				&crypto_stats_fops);
+		debugfs_create_file("drivers", 0444, crypto_debugfs, NULL,
+				&crypto_drivers_fops);
 	}
 
 	return 0;
@@ -1713,24 +2875,52 @@ bad:
 static void
 crypto_exit(void)
 {
-	int cpu;
+	struct crypto_queue *cq;
+	struct crypto_session *ses;
+	int i, cpu;
 
 	dprintk("%s()\n", __FUNCTION__);
 
 	/*
 	 * Terminate any crypto threads.
 	 */
-	ocf_for_each_cpu(cpu) {
-		kthread_stop(cryptoproc[cpu]);
-		kthread_stop(cryptoretproc[cpu]);
+	for (i = 0; i < crypto_nqueues; i++) {
+		cq = &crypto_queues[i];
+		if (cq->cq_proc)
+			kthread_stop(cq->cq_proc);
+		if (cq->cq_ret_proc)
+			kthread_stop(cq->cq_ret_proc);
 	}
 
 	/* 
 	 * Reclaim dynamically allocated resources.
 	 */
+	if (crypto_debugfs)
+		debugfs_remove_recursive(crypto_debugfs);
+	crypto_debugfs = NULL;
+	while (radix_tree_gang_lookup(&crypto_ses_tree, (void **) &ses, 0, 1)) {
+		radix_tree_delete(&crypto_ses_tree, CRYPTO_SESID2LID(ses->cs_sid));
+		kfree(ses);
+	}
+	flush_scheduled_work();	/* teardowns queued by crypto_ses_put() */
+	rcu_barrier();	/* sessions freed by crypto_ses_destroy() */
+	if (crypto_queues != NULL)
+		kfree(crypto_queues);
 	if (crypto_drivers != NULL)
 		kfree(crypto_drivers);
 
+	for_each_possible_cpu(cpu) {
+		struct crypto_reqcache *rc = &per_cpu(crypto_reqcaches, cpu);
+		struct cryptop *crp;
+
+		for (i = 0; i < CRYPTO_REQCACHE_SHAPES; i++) {
+			while ((crp = rc->rc_free[i]) != NULL) {
+				rc->rc_free[i] = (struct cryptop *) crp->crp_opaque;
+				crypto_freereq_all(crp);
+			}
+			rc->rc_count[i] = 0;
+		}
+	}
 	if (cryptodesc_zone != NULL)
 		kmem_cache_destroy(cryptodesc_zone);
 	if (cryptop_zone != NULL)
@@ -1751,6 +2941,7 @@ EXPORT_SYMBOL(crypto_kdispatch);
 EXPORT_SYMBOL(crypto_freereq);
 EXPORT_SYMBOL(crypto_getreq);
 EXPORT_SYMBOL(crypto_done);
+EXPORT_SYMBOL(crypto_done_batch);
 EXPORT_SYMBOL(crypto_kdone);
 EXPORT_SYMBOL(crypto_getfeat);
 EXPORT_SYMBOL(crypto_userasymcrypto);
@@ -58,6 +58,10 @@ __FBSDID("$FreeBSD: src/sys/opencrypto/cryptodev.c,v 1.34 2007/05/09 19:37:02 gn
 #include <linux/file.h>
 #include <linux/mount.h>
 #include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
 #include <asm/uaccess.h>
 
 #include <cryptodev.h>
@@ -70,6 +74,36 @@ int cryptodev_debug = 0;
 module_param(cryptodev_debug, int, 0644);
 MODULE_PARM_DESC(cryptodev_debug, "Enable cryptodev debug");
 
+/*
+ * Requests of at least cryptodev_zc_min bytes that are done in place
+ * (dst == src) or only compute a MAC are not copied through a kernel
+ * buffer.  The user pages are pinned and passed to the driver as one
+ * iovec each, provided the driver takes such uios (CRYPTOCAP_F_SG).
+ */
+#define CRYPTODEV_ZC_IOV	16	/* the most cryptosoft takes */
+
+static int cryptodev_zc_min = 4096;
+module_param(cryptodev_zc_min, int, 0644);
+MODULE_PARM_DESC(cryptodev_zc_min,
+	   "Smallest request done in place in user memory (0 never)");
+
+static unsigned long cryptodev_zc_ops, cryptodev_zc_bytes;
+module_param(cryptodev_zc_ops, ulong, 0444);
+MODULE_PARM_DESC(cryptodev_zc_ops, "Requests done in place in user memory");
+module_param(cryptodev_zc_bytes, ulong, 0444);
+MODULE_PARM_DESC(cryptodev_zc_bytes, "Bytes done in place in user memory");
+
+static unsigned long cryptodev_copy_ops, cryptodev_copy_bytes;
+module_param(cryptodev_copy_ops, ulong, 0444);
+MODULE_PARM_DESC(cryptodev_copy_ops, "Requests copied through the kernel");
+module_param(cryptodev_copy_bytes, ulong, 0444);
+MODULE_PARM_DESC(cryptodev_copy_bytes, "Bytes copied through the kernel");
+
+static int cryptodev_async_max = 256;
+module_param(cryptodev_async_max, int, 0644);
+MODULE_PARM_DESC(cryptodev_async_max,
+	   "Asynchronous operations a file may have submitted and not read");
+
 struct csession_info {
 	u_int16_t	blocksize;
 	u_int16_t	minkey, maxkey;
@@ -81,6 +115,36 @@ struct csession_info {
 	/* u_int16_t	ctxsize; */
 };
 
+struct csession;
+struct fcrypt;
+
+/*
+ * The state of one operation.  Synchronous operations use the one in
+ * their session.  Asynchronous ones (CIOCCRYPTM) get their own, which is
+ * queued on the fcrypt when done until read() returns its result.
+ */
+struct cryptodev_req {
+	struct list_head	list;
+	struct csession		*cse;
+	struct fcrypt		*fcr;		/* NULL if synchronous */
+	struct cryptop		*crp;
+	struct crypt_op		cop;
+	u_int32_t		id;
+	struct mm_struct	*mm;		/* of the submitter */
+	int			error;
+
+	struct iovec	iovec;
+	struct uio	uio;
+
+	/* the pinned user pages of a zero copy request */
+	int		zc;
+	struct iovec	zc_iov[CRYPTODEV_ZC_IOV];
+	struct page	*zc_pages[CRYPTODEV_ZC_IOV];
+	int		zc_npages;
+	int		zc_write;
+	u_char		zc_mac[HASH_MAX_LEN];
+};
+
 struct csession {
 	struct list_head	list;
 	u_int64_t	sid;
@@ -94,21 +158,25 @@ struct csession {
 
 	caddr_t		key;
 	int		keylen;
-	u_char		tmp_iv[EALG_MAX_BLOCK_LEN];
 
 	caddr_t		mackey;
 	int		mackeylen;
 
 	struct csession_info info;
 
-	struct iovec	iovec;
-	struct uio	uio;
-	int		error;
+	struct cryptodev_req req;	/* for synchronous operations */
+	atomic_t	nasync;		/* asynchronous operations not read yet */
 };
 
 struct fcrypt {
 	struct list_head	csessions;
 	int		sesn;
+
+	spinlock_t	lock;
+	struct list_head done;		/* completed asynchronous operations */
+	wait_queue_head_t waitq;
+	atomic_t	nasync;		/* asynchronous operations not read yet */
+	atomic_t	inflight;	/* asynchronous operations not done yet */
 };
 
 static struct csession *csefind(struct fcrypt *, u_int);
@@ -163,7 +231,124 @@ checkcrid(int crid)
 }
 
 static int
-cryptodev_op(struct csession *cse, struct crypt_op *cop)
+cryptodev_get_pages(unsigned long start, int npages, int write,
+		struct page **pages)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,2,0)
+	return get_user_pages_fast(start, npages, write ? FOLL_WRITE : 0, pages);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,27)
+	return get_user_pages_fast(start, npages, write, pages);
+#else
+	int n;
+
+	down_read(&current->mm->mmap_sem);
+	n = get_user_pages(current, current->mm, start, npages, write, 0,
+			pages, NULL);
+	up_read(&current->mm->mmap_sem);
+	return n;
+#endif
+}
+
+static void
+cryptodev_zc_unmap(struct cryptodev_req *req)
+{
+	int i;
+
+	for (i = 0; i < req->zc_npages; i++) {
+		if (req->zc_write) {
+			flush_dcache_page(req->zc_pages[i]);
+			set_page_dirty_lock(req->zc_pages[i]);
+		}
+		put_page(req->zc_pages[i]);
+	}
+	req->zc_npages = 0;
+}
+
+/*
+ * Point the request uio at the user pages of the operation, returns 0 if
+ * the operation has to be copied instead.
+ */
+static int
+cryptodev_zc_map(struct cryptodev_req *req)
+{
+	struct csession *cse = req->cse;
+	struct crypt_op *cop = &req->cop;
+	unsigned long addr = (unsigned long) cop->src;
+	int npages, n, i, off, len;
+
+	if (cryptodev_zc_min <= 0 || cop->len < cryptodev_zc_min ||
+			!(CRYPTO_SESID2CAPS(cse->sid) & CRYPTOCAP_F_SG))
+		return 0;
+	if (cop->dst != cop->src && (cop->dst || cse->info.blocksize))
+		return 0;
+
+	npages = ((addr + cop->len - 1) >> PAGE_SHIFT) - (addr >> PAGE_SHIFT) + 1;
+	if (npages + (cse->info.authsize != 0) > CRYPTODEV_ZC_IOV)
+		return 0;
+
+	req->zc_write = cse->info.blocksize != 0;
+	n = cryptodev_get_pages(addr & PAGE_MASK, npages, req->zc_write,
+			req->zc_pages);
+	req->zc_npages = n > 0 ? n : 0;
+	if (n != npages) {
+		req->zc_write = 0;
+		cryptodev_zc_unmap(req);
+		return 0;
+	}
+
+	/* drivers use the lowmem mapping */
+	for (i = 0; i < npages; i++) {
+		if (PageHighMem(req->zc_pages[i])) {
+			req->zc_write = 0;
+			cryptodev_zc_unmap(req);
+			return 0;
+		}
+		flush_dcache_page(req->zc_pages[i]);
+	}
+
+	off = addr & ~PAGE_MASK;
+	len = cop->len;
+	for (i = 0; i < npages; i++) {
+		req->zc_iov[i].iov_base = page_address(req->zc_pages[i]) + off;
+		req->zc_iov[i].iov_len = min_t(int, len, PAGE_SIZE - off);
+		len -= req->zc_iov[i].iov_len;
+		off = 0;
+	}
+	/* the MAC goes to a buffer of our own */
+	if (cse->info.authsize) {
+		req->zc_iov[i].iov_base = req->zc_mac;
+		req->zc_iov[i].iov_len = cse->info.authsize;
+		i++;
+	}
+	req->uio.uio_iov = req->zc_iov;
+	req->uio.uio_iovcnt = i;
+	req->uio.uio_offset = 0;
+	return 1;
+}
+
+/*
+ * Release the buffers and the OCF request of an operation.
+ */
+static void
+cryptodev_req_release(struct cryptodev_req *req)
+{
+	if (req->crp)
+		crypto_freereq(req->crp);
+	req->crp = NULL;
+	if (req->zc)
+		cryptodev_zc_unmap(req);
+	else if (req->iovec.iov_base)
+		kfree(req->iovec.iov_base);
+	req->iovec.iov_base = NULL;
+}
+
+/*
+ * Set up the buffers and the OCF request for an operation, ready to be
+ * dispatched.
+ */
+static int
+cryptodev_req_setup(struct cryptodev_req *req, struct csession *cse,
+		struct crypt_op *cop)
 {
 	struct cryptop *crp = NULL;
 	struct cryptodesc *crde = NULL, *crda = NULL;
@@ -181,25 +366,37 @@ cryptodev_op(struct csession *cse, struct crypt_op *cop)
 		return (EINVAL);
 	}
 
-	cse->uio.uio_iov = &cse->iovec;
-	cse->uio.uio_iovcnt = 1;
-	cse->uio.uio_offset = 0;
+	req->cse = cse;
+	req->cop = *cop;
+	req->crp = NULL;
+	req->error = 0;
+	req->iovec.iov_base = NULL;
+	req->zc = cryptodev_zc_map(req);
+	if (req->zc) {
+		cryptodev_zc_ops++;
+		cryptodev_zc_bytes += cop->len;
+	} else {
+		req->uio.uio_iov = &req->iovec;
+		req->uio.uio_iovcnt = 1;
+		req->uio.uio_offset = 0;
 #if 0
-	cse->uio.uio_resid = cop->len;
-	cse->uio.uio_segflg = UIO_SYSSPACE;
-	cse->uio.uio_rw = UIO_WRITE;
-	cse->uio.uio_td = td;
+		req->uio.uio_resid = cop->len;
+		req->uio.uio_segflg = UIO_SYSSPACE;
+		req->uio.uio_rw = UIO_WRITE;
+		req->uio.uio_td = td;
 #endif
-	cse->uio.uio_iov[0].iov_len = cop->len;
-	if (cse->info.authsize)
-		cse->uio.uio_iov[0].iov_len += cse->info.authsize;
-	cse->uio.uio_iov[0].iov_base = kmalloc(cse->uio.uio_iov[0].iov_len,
-			GFP_KERNEL);
-
-	if (cse->uio.uio_iov[0].iov_base == NULL) {
-		dprintk("%s: iov_base kmalloc(%d) failed\n", __FUNCTION__,
-				(int)cse->uio.uio_iov[0].iov_len);
-		return (ENOMEM);
+		req->iovec.iov_len = cop->len;
+		if (cse->info.authsize)
+			req->iovec.iov_len += cse->info.authsize;
+		req->iovec.iov_base = kmalloc(req->iovec.iov_len, GFP_KERNEL);
+
+		if (req->iovec.iov_base == NULL) {
+			dprintk("%s: iov_base kmalloc(%d) failed\n", __FUNCTION__,
+					(int)req->iovec.iov_len);
+			return (ENOMEM);
+		}
+		cryptodev_copy_ops++;
+		cryptodev_copy_bytes += cop->len;
 	}
 
 	crp = crypto_getreq((cse->info.blocksize != 0) + (cse->info.authsize != 0));
@@ -208,6 +405,7 @@ cryptodev_op(struct csession *cse, struct crypt_op *cop)
 		error = ENOMEM;
 		goto bail;
 	}
+	req->crp = crp;
 
 	if (cse->info.authsize && cse->info.blocksize) {
 		if (cop->op == COP_ENCRYPT) {
@@ -227,7 +425,7 @@ cryptodev_op(struct csession *cse, struct crypt_op *cop)
 		goto bail;
 	}
 
-	if ((error = copy_from_user(cse->uio.uio_iov[0].iov_base, cop->src,
+	if (!req->zc && (error = copy_from_user(req->iovec.iov_base, cop->src,
 					cop->len))) {
 		dprintk("%s: bad copy\n", __FUNCTION__);
 		goto bail;
@@ -256,13 +454,11 @@ cryptodev_op(struct csession *cse, struct crypt_op *cop)
 		crde->crd_klen = cse->keylen * 8;
 	}
 
-	crp->crp_ilen = cse->uio.uio_iov[0].iov_len;
-	crp->crp_flags = CRYPTO_F_IOV | CRYPTO_F_CBIMM
-		       | (cop->flags & COP_F_BATCH);
-	crp->crp_buf = (caddr_t)&cse->uio;
-	crp->crp_callback = (int (*) (struct cryptop *)) cryptodev_cb;
+	crp->crp_ilen = cop->len + cse->info.authsize;
+	crp->crp_flags = CRYPTO_F_IOV | (cop->flags & COP_F_BATCH);
+	crp->crp_buf = (caddr_t)&req->uio;
 	crp->crp_sid = cse->sid;
-	crp->crp_opaque = (void *)cse;
+	crp->crp_opaque = (void *)req;
 
 	if (cop->iv) {
 		if (crde == NULL) {
@@ -275,12 +471,11 @@ cryptodev_op(struct csession *cse, struct crypt_op *cop)
 			dprintk("%s arc4 with IV\n", __FUNCTION__);
 			goto bail;
 		}
-		if ((error = copy_from_user(cse->tmp_iv, cop->iv,
+		if ((error = copy_from_user(crde->crd_iv, cop->iv,
 						cse->info.blocksize))) {
 			dprintk("%s bad iv copy\n", __FUNCTION__);
 			goto bail;
 		}
-		memcpy(crde->crd_iv, cse->tmp_iv, cse->info.blocksize);
 		crde->crd_flags |= CRD_F_IV_EXPLICIT | CRD_F_IV_PRESENT;
 		crde->crd_skip = 0;
 	} else if (cse->cipher == CRYPTO_ARC4) { /* XXX use flag? */
@@ -296,6 +491,77 @@ cryptodev_op(struct csession *cse, struct crypt_op *cop)
 		dprintk("%s no crda\n", __FUNCTION__);
 		goto bail;
 	}
+	return (0);
+
+bail:
+	cryptodev_req_release(req);
+	return (error);
+}
+
+/*
+ * Hand the results of a completed operation back to the user and
+ * release it.
+ */
+static int
+cryptodev_req_finish(struct cryptodev_req *req)
+{
+	struct crypt_op *cop = &req->cop;
+	struct cryptop *crp = req->crp;
+	int error = 0;
+
+	if (crp->crp_etype != 0) {
+		error = crp->crp_etype;
+		dprintk("%s error in crp processing\n", __FUNCTION__);
+		goto bail;
+	}
+
+	if (req->error) {
+		error = req->error;
+		dprintk("%s error in cse processing\n", __FUNCTION__);
+		goto bail;
+	}
+
+	/* asynchronous results can only be read by the submitter */
+	if (req->mm != current->mm) {
+		error = EFAULT;
+		dprintk("%s read by another process\n", __FUNCTION__);
+		goto bail;
+	}
+
+	if (!req->zc && cop->dst && (error = copy_to_user(cop->dst,
+					req->iovec.iov_base, cop->len))) {
+		dprintk("%s bad dst copy\n", __FUNCTION__);
+		goto bail;
+	}
+
+	if (cop->mac &&
+			(error=copy_to_user(cop->mac, req->zc ? (caddr_t)req->zc_mac :
+				(caddr_t)req->iovec.iov_base + cop->len,
+				req->cse->info.authsize))) {
+		dprintk("%s bad mac copy\n", __FUNCTION__);
+		goto bail;
+	}
+
+bail:
+	cryptodev_req_release(req);
+	return (error);
+}
+
+static int
+cryptodev_op(struct csession *cse, struct crypt_op *cop)
+{
+	struct cryptodev_req *req = &cse->req;
+	struct cryptop *crp;
+	int error;
+
+	error = cryptodev_req_setup(req, cse, cop);
+	if (error)
+		return (error);
+	req->fcr = NULL;
+	req->mm = current->mm;
+	crp = req->crp;
+	crp->crp_flags |= CRYPTO_F_CBIMM;
+	crp->crp_callback = (int (*) (struct cryptop *)) cryptodev_cb;
 
 	/*
 	 * Let the dispatch run unlocked, then, interlock against the
@@ -307,7 +573,8 @@ cryptodev_op(struct csession *cse, struct crypt_op *cop)
 	error = crypto_dispatch(crp);
 	if (error) {
 		dprintk("%s error in crypto_dispatch\n", __FUNCTION__);
-		goto bail;
+		cryptodev_req_release(req);
+		return (error);
 	}
 
 	dprintk("%s about to WAIT\n", __FUNCTION__);
@@ -331,46 +598,14 @@ cryptodev_op(struct csession *cse, struct crypt_op *cop)
 	} while ((crp->crp_flags & CRYPTO_F_DONE) == 0);
 	dprintk("%s finished WAITING error=%d\n", __FUNCTION__, error);
 
-	if (crp->crp_etype != 0) {
-		error = crp->crp_etype;
-		dprintk("%s error in crp processing\n", __FUNCTION__);
-		goto bail;
-	}
-
-	if (cse->error) {
-		error = cse->error;
-		dprintk("%s error in cse processing\n", __FUNCTION__);
-		goto bail;
-	}
-
-	if (cop->dst && (error = copy_to_user(cop->dst,
-					cse->uio.uio_iov[0].iov_base, cop->len))) {
-		dprintk("%s bad dst copy\n", __FUNCTION__);
-		goto bail;
-	}
-
-	if (cop->mac &&
-			(error=copy_to_user(cop->mac,
-				(caddr_t)cse->uio.uio_iov[0].iov_base + cop->len,
-				cse->info.authsize))) {
-		dprintk("%s bad mac copy\n", __FUNCTION__);
-		goto bail;
-	}
-
-bail:
-	if (crp)
-		crypto_freereq(crp);
-	if (cse->uio.uio_iov[0].iov_base)
-		kfree(cse->uio.uio_iov[0].iov_base);
-
-	return (error);
+	return (cryptodev_req_finish(req));
 }
 
 static int
 cryptodev_cb(void *op)
 {
 	struct cryptop *crp = (struct cryptop *) op;
-	struct csession *cse = (struct csession *)crp->crp_opaque;
+	struct cryptodev_req *req = (struct cryptodev_req *)crp->crp_opaque;
 	int error;
 
 	dprintk("%s()\n", __FUNCTION__);
@@ -387,12 +622,118 @@ cryptodev_cb(void *op)
 		return crypto_dispatch(crp);
 	}
 	if (error != 0 || (crp->crp_flags & CRYPTO_F_DONE)) {
-		cse->error = error;
+		req->error = error;
 		wake_up_interruptible(&crp->crp_waitq);
 	}
 	return (0);
 }
 
+/*
+ * Completion of asynchronous operations, the return thread hands us
+ * all those done in one go.  They are queued for read() on their file.
+ */
+static int
+cryptodev_vcb(struct cryptop **crps, int n)
+{
+	struct fcrypt *fcr = NULL;
+	struct cryptodev_req *req;
+	struct cryptop *crp;
+	unsigned long flags = 0;
+	int i;
+
+	dprintk("%s(%d)\n", __FUNCTION__, n);
+	for (i = 0; i < n; i++) {
+		crp = crps[i];
+		req = (struct cryptodev_req *)crp->crp_opaque;
+		if (crp->crp_etype == EAGAIN) {
+			if (fcr) {
+				wake_up(&fcr->waitq);
+				spin_unlock_irqrestore(&fcr->lock, flags);
+				fcr = NULL;
+			}
+			crp->crp_flags &= ~CRYPTO_F_DONE;
+			if (crypto_dispatch(crp) == 0)
+				continue;
+		}
+		if (req->fcr != fcr) {
+			if (fcr) {
+				wake_up(&fcr->waitq);
+				spin_unlock_irqrestore(&fcr->lock, flags);
+			}
+			fcr = req->fcr;
+			spin_lock_irqsave(&fcr->lock, flags);
+		}
+		list_add_tail(&req->list, &fcr->done);
+		atomic_dec(&fcr->inflight);
+	}
+	/*
+	 * wake while locked, cryptodev_release() may free fcr once we
+	 * unlock; wake_up() as it waits uninterruptibly
+	 */
+	if (fcr) {
+		wake_up(&fcr->waitq);
+		spin_unlock_irqrestore(&fcr->lock, flags);
+	}
+	return (0);
+}
+
+static int
+cryptodev_acb(struct cryptop *crp)
+{
+	return cryptodev_vcb(&crp, 1);
+}
+
+/*
+ * Submit an operation without waiting for it, more is set if further
+ * operations follow straight away.
+ */
+static int
+cryptodev_aop(struct fcrypt *fcr, struct csession *cse, struct crypt_op *cop,
+		u_int32_t id, int more)
+{
+	struct cryptodev_req *req;
+	struct cryptop *crp;
+	int error;
+
+	dprintk("%s()\n", __FUNCTION__);
+	if (atomic_read(&fcr->nasync) >= cryptodev_async_max)
+		return (EAGAIN);
+
+	req = kmalloc(sizeof(*req), GFP_KERNEL);
+	if (req == NULL)
+		return (ENOMEM);
+	memset(req, 0, sizeof(*req));
+
+	error = cryptodev_req_setup(req, cse, cop);
+	if (error) {
+		kfree(req);
+		return (error);
+	}
+	INIT_LIST_HEAD(&req->list);
+	req->fcr = fcr;
+	req->id = id;
+	req->mm = current->mm;
+	crp = req->crp;
+	if (more)
+		crp->crp_flags |= CRYPTO_F_BATCH;
+	crp->crp_callback = cryptodev_acb;
+	crp->crp_vcallback = cryptodev_vcb;
+
+	atomic_inc(&fcr->nasync);
+	atomic_inc(&cse->nasync);
+	atomic_inc(&fcr->inflight);
+	error = crypto_dispatch(crp);
+	if (error) {
+		dprintk("%s error in crypto_dispatch\n", __FUNCTION__);
+		atomic_dec(&fcr->inflight);
+		atomic_dec(&cse->nasync);
+		atomic_dec(&fcr->nasync);
+		cryptodev_req_release(req);
+		kfree(req);
+	}
+	return (error);
+}
+
 static int
 cryptodevkey_cb(void *op)
 {
@@ -632,9 +973,12 @@ cryptodev_ioctl(
 	struct crypt_op cop;
 	struct crypt_kop kop;
 	struct crypt_find_op fop;
+	struct crypt_mop mop;
+	struct crypt_aop aop;
 	u_int64_t sid;
 	u_int32_t ses = 0;
 	int feat, fd, error = 0, crid;
+	u_int i;
 	mm_segment_t fs;
 
 	dprintk("%s(cmd=%x arg=%lx)\n", __FUNCTION__, cmd, arg);
@@ -878,6 +1222,11 @@ bail:
 			dprintk("%s(CIOCFSESSION) - Fail %d\n", __FUNCTION__, error);
 			break;
 		}
+		if (atomic_read(&cse->nasync)) {
+			error = EBUSY;
+			dprintk("%s(CIOCFSESSION) - Busy\n", __FUNCTION__);
+			break;
+		}
 		csedelete(fcr, cse);
 		error = csefree(cse);
 		break;
@@ -901,6 +1250,32 @@ bail:
 			goto bail;
 		}
 		break;
+	case CIOCCRYPTM:
+		dprintk("%s(CIOCCRYPTM)\n", __FUNCTION__);
+		if (copy_from_user(&mop, (void*)arg, sizeof(mop))) {
+			dprintk("%s(CIOCCRYPTM) - bad copy\n", __FUNCTION__);
+			error = EFAULT;
+			break;
+		}
+		for (i = 0; i < mop.count; i++) {
+			if (copy_from_user(&aop, &mop.reqs[i], sizeof(aop))) {
+				dprintk("%s(CIOCCRYPTM) - bad op copy\n", __FUNCTION__);
+				error = EFAULT;
+				break;
+			}
+			cse = csefind(fcr, aop.cop.ses);
+			if (cse == NULL)
+				aop.status = EINVAL;
+			else
+				aop.status = cryptodev_aop(fcr, cse, &aop.cop, aop.id,
+						i + 1 < mop.count);
+			if (put_user(aop.status, &mop.reqs[i].status)) {
+				dprintk("%s(CIOCCRYPTM) - bad return copy\n", __FUNCTION__);
+				error = EFAULT;
+				break;
+			}
+		}
+		break;
 	case CIOCKEY:
 	case CIOCKEY2:
 		dprintk("%s(CIOCKEY)\n", __FUNCTION__);
@@ -971,6 +1346,68 @@ cryptodev_unlocked_ioctl(
 }
 #endif
 
+/*
+ * Return the results of completed asynchronous operations, as many as
+ * fit.  Blocks until there is at least one, unless nothing is pending.
+ */
+static ssize_t
+cryptodev_read(struct file *filp, char __user *buf, size_t count,
+		loff_t *ppos)
+{
+	struct fcrypt *fcr = filp->private_data;
+	struct cryptodev_req *req;
+	struct crypt_result res;
+	unsigned long flags;
+	size_t done = 0;
+
+	dprintk("%s()\n", __FUNCTION__);
+	if (count < sizeof(res))
+		return(-EINVAL);
+
+	while (done + sizeof(res) <= count) {
+		req = NULL;
+		spin_lock_irqsave(&fcr->lock, flags);
+		if (!list_empty(&fcr->done)) {
+			req = list_entry(fcr->done.next, struct cryptodev_req, list);
+			list_del(&req->list);
+		}
+		spin_unlock_irqrestore(&fcr->lock, flags);
+
+		if (req == NULL) {
+			if (done || atomic_read(&fcr->nasync) == 0)
+				break;
+			if (filp->f_flags & O_NONBLOCK)
+				return(-EAGAIN);
+			if (wait_event_interruptible(fcr->waitq,
+					!list_empty(&fcr->done) ||
+					atomic_read(&fcr->nasync) == 0))
+				return(-ERESTARTSYS);
+			continue;
+		}
+
+		res.id = req->id;
+		res.status = cryptodev_req_finish(req);
+		atomic_dec(&req->cse->nasync);
+		atomic_dec(&fcr->nasync);
+		kfree(req);
+		if (copy_to_user(buf + done, &res, sizeof(res)))
+			return(done ? done : -EFAULT);
+		done += sizeof(res);
+	}
+	return(done);
+}
+
+static unsigned int
+cryptodev_poll(struct file *filp, poll_table *wait)
+{
+	struct fcrypt *fcr = filp->private_data;
+
+	poll_wait(filp, &fcr->waitq, wait);
+	if (!list_empty(&fcr->done))
+		return(POLLIN | POLLRDNORM);
+	return(0);
+}
+
 static int
 cryptodev_open(struct inode *inode, struct file *filp)
 {
@@ -996,6 +1433,11 @@ cryptodev_open(struct inode *inode, struct file *filp)
 	memset(fcr, 0, sizeof(*fcr));
 
 	INIT_LIST_HEAD(&fcr->csessions);
+	spin_lock_init(&fcr->lock);
+	INIT_LIST_HEAD(&fcr->done);
+	init_waitqueue_head(&fcr->waitq);
+	atomic_set(&fcr->nasync, 0);
+	atomic_set(&fcr->inflight, 0);
 	filp->private_data = fcr;
 	return(0);
 }
@@ -1005,6 +1447,8 @@ cryptodev_release(struct inode *inode, struct file *filp)
 {
 	struct fcrypt *fcr = filp->private_data;
 	struct csession *cse, *tmp;
+	struct cryptodev_req *req, *rtmp;
+	unsigned long flags;
 
 	dprintk("%s()\n", __FUNCTION__);
 	if (!filp) {
@@ -1012,6 +1456,16 @@ cryptodev_release(struct inode *inode, struct file *filp)
 		return(0);
 	}
 
+	/* let the drivers finish, then drop the unread results */
+	wait_event(fcr->waitq, atomic_read(&fcr->inflight) == 0);
+	spin_lock_irqsave(&fcr->lock, flags);
+	spin_unlock_irqrestore(&fcr->lock, flags);
+	list_for_each_entry_safe(req, rtmp, &fcr->done, list) {
+		list_del(&req->list);
+		cryptodev_req_release(req);
+		kfree(req);
+	}
+
 	list_for_each_entry_safe(cse, tmp, &fcr->csessions, list) {
 		list_del(&cse->list);
 		(void)csefree(cse);
@@ -1025,6 +1479,8 @@ static struct file_operations cryptodev_fops = {
 	.owner = THIS_MODULE,
 	.open = cryptodev_open,
 	.release = cryptodev_release,
+	.read = cryptodev_read,
+	.poll = cryptodev_poll,
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,36)
 	.ioctl = cryptodev_ioctl,
 #endif
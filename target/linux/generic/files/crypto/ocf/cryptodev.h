@@ -216,6 +216,29 @@ struct crypt_op {
 	caddr_t		iv;
 };
 
+/*
+ * Asynchronous operations.  CIOCCRYPTM submits a vector of them, each
+ * op gets the error it was refused with in status, or 0 if it was
+ * queued.  Queued ops do not block, their results are read() from the
+ * file as struct crypt_result, which is when dst and mac are written.
+ * The file polls readable while results are waiting.
+ */
+struct crypt_aop {
+	struct crypt_op	cop;
+	u_int32_t	id;		/* returned in the result */
+	int		status;		/* returns: 0 if queued, or errno */
+};
+
+struct crypt_mop {
+	u_int		count;		/* number of ops in reqs */
+	struct crypt_aop *reqs;
+};
+
+struct crypt_result {
+	u_int32_t	id;
+	int		status;		/* 0, or errno of the op */
+};
+
 /*
  * Parameters for looking up a crypto driver/device by
  * device name or by id.  The latter are returned for
@@ -273,6 +296,7 @@ struct crypt_kop {
 #define CIOCGSESSION2	_IOWR('c', 106, struct session2_op)
 #define CIOCKEY2	_IOWR('c', 107, struct crypt_kop)
 #define CIOCFINDDEV	_IOWR('c', 108, struct crypt_find_op)
+#define CIOCCRYPTM	_IOWR('c', 109, struct crypt_mop)
 
 struct cryptotstat {
 	struct timespec	acc;		/* total accumulated time */
@@ -342,6 +366,8 @@ struct cryptodesc {
 	struct cryptodesc *crd_next;
 };
 
+struct crypto_session;
+
 /* Structure describing complete operation */
 struct cryptop {
 	struct list_head crp_next;
@@ -376,6 +402,14 @@ struct cryptop {
 	struct cryptodesc *crp_desc;	/* Linked list of processing descriptors */
 
 	int (*crp_callback)(struct cryptop *); /* Callback function */
+	int (*crp_vcallback)(struct cryptop **, int); /* Optional, takes
+					 * a vector of completed requests
+					 * instead of crp_callback
+					 */
+
+	struct crypto_session *crp_ses;	/* set by crypto_dispatch */
+	u_int32_t	crp_start;	/* time handed to the driver, ~us */
+	u_int32_t	crp_stamp;	/* time queued or completed, ~us */
 };
 
 #define CRYPTO_BUF_CONTIG	0x0
@@ -426,6 +460,8 @@ extern	int crypto_freesession(u_int64_t sid);
 #define CRYPTOCAP_F_HARDWARE	CRYPTO_FLAG_HARDWARE
 #define CRYPTOCAP_F_SOFTWARE	CRYPTO_FLAG_SOFTWARE
 #define CRYPTOCAP_F_SYNC	0x04000000	/* operates synchronously */
+#define CRYPTOCAP_F_SG		0x08000000	/* takes uios of any number of
+						 * page sized or smaller iovecs */
 extern	int32_t crypto_get_driverid(device_t dev, int flags);
 extern	int crypto_find_driver(const char *);
 extern	device_t crypto_find_device_byhid(int hid);
@@ -441,6 +477,7 @@ extern	int crypto_kdispatch(struct cryptkop *);
 #define CRYPTO_ASYMQ	0x2
 extern	int crypto_unblock(u_int32_t, int);
 extern	void crypto_done(struct cryptop *crp);
+extern	void crypto_done_batch(struct cryptop **crps, int n);
 extern	void crypto_kdone(struct cryptkop *);
 extern	int crypto_getfeat(int *);
 
@@ -56,6 +56,11 @@
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,29)
 #include <crypto/hash.h>
 #endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,32)
+#include <linux/rtnetlink.h>
+#include <crypto/aead.h>
+#include <crypto/authenc.h>
+#endif
 
 #include <cryptodev.h>
 #include <uio.h>
@@ -102,17 +107,35 @@ struct swcr_data {
 		void *sw_comp_buf;
 	} u;
 	struct swcr_data	*sw_next;
+	struct crypto_aead	*sw_aead;	/* cipher+hmac pair, first entry only */
 };
 
+/*
+ * Room for the kernel's async request in our own, so that most requests
+ * need no allocation of their own.  Larger ones are allocated.
+ */
+#define SWCR_REQ_CTX	512
+
+#ifndef CRYPTO_MINALIGN_ATTR
+#define CRYPTO_MINALIGN_ATTR
+#endif
+
 struct swcr_req {
 	struct swcr_data	*sw_head;
 	struct swcr_data	*sw;
 	struct cryptop		*crp;
 	struct cryptodesc	*crd;
+	struct scatterlist	 buf_sg[SCATTERLIST_MAX];	/* whole buffer */
+	int					 buf_sgn;
 	struct scatterlist	 sg[SCATTERLIST_MAX];
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,3,0)
+	struct scatterlist	 asg[SCATTERLIST_MAX];		/* aead assoc data */
+#endif
 	unsigned char		 iv[EALG_MAX_BLOCK_LEN];
 	char				 result[HASH_MAX_LEN];
+	int					 aead;
 	void				*crypto_req;
+	char				 ctx[SWCR_REQ_CTX] CRYPTO_MINALIGN_ATTR;
 };
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
@@ -208,6 +231,7 @@ static struct kmem_cache *swcr_req_cache;
 #define	crypto_ahash_digestsize(x)			0
 #else
 #define	HAVE_AHASH
+#define	HAVE_AEAD
 #endif
 
 struct crypto_details {
@@ -332,6 +356,80 @@ execute_later(void (fn)(void *), void *arg)
 	}
 }
 
+#ifdef HAVE_AEAD
+/*
+ * A session with one block cipher and one HMAC can be run as a single
+ * authenc() transform, doing both in one call instead of two passes.
+ * Not finding one is fine, the requests then take the usual path.
+ */
+static void
+swcr_aead_alloc(struct swcr_data *head, struct cryptoini *cri)
+{
+	struct crypto_authenc_key_param *param;
+	struct swcr_data *sw, *enc = NULL, *mac = NULL;
+	struct cryptoini *ecri = NULL;
+	struct crypto_aead *aead;
+	char name[CRYPTO_MAX_ALG_NAME];
+	struct rtattr *rta;
+	int eklen, keylen;
+	char *key, *p;
+
+	for (sw = head; sw && cri; sw = sw->sw_next, cri = cri->cri_next) {
+		if ((sw->sw_type & SW_TYPE_BLKCIPHER) && enc == NULL) {
+			enc = sw;
+			ecri = cri;
+		} else if ((sw->sw_type & SW_TYPE_HMAC) && mac == NULL)
+			mac = sw;
+		else
+			return;
+	}
+	if (enc == NULL || mac == NULL)
+		return;
+
+	snprintf(name, sizeof(name), "authenc(%s,%s)",
+			crypto_details[mac->sw_alg].alg_name,
+			crypto_details[enc->sw_alg].alg_name);
+	aead = crypto_alloc_aead(name, 0, 0);
+	if (IS_ERR(aead)) {
+		dprintk("%s no %s\n", __FUNCTION__, name);
+		return;
+	}
+
+	/* authenc() takes both keys in one rtattr wrapped blob */
+	eklen = (ecri->cri_klen + 7) / 8;
+	keylen = RTA_SPACE(sizeof(*param)) + mac->u.hmac.sw_klen + eklen;
+	key = kmalloc(keylen, SLAB_ATOMIC);
+	if (key == NULL)
+		goto bad;
+	p = key;
+	rta = (struct rtattr *) p;
+	rta->rta_type = CRYPTO_AUTHENC_KEYA_PARAM;
+	rta->rta_len = RTA_LENGTH(sizeof(*param));
+	param = RTA_DATA(rta);
+	param->enckeylen = cpu_to_be32(eklen);
+	p += RTA_SPACE(sizeof(*param));
+	memcpy(p, mac->u.hmac.sw_key, mac->u.hmac.sw_klen);
+	p += mac->u.hmac.sw_klen;
+	memcpy(p, ecri->cri_key, eklen);
+
+	if (crypto_aead_setkey(aead, key, keylen) ||
+			crypto_aead_setauthsize(aead, mac->u.hmac.sw_mlen)) {
+		dprintk("%s %s setkey failed\n", __FUNCTION__, name);
+		memset(key, 0, keylen);
+		kfree(key);
+		goto bad;
+	}
+	memset(key, 0, keylen);
+	kfree(key);
+
+	dprintk("%s using %s\n", __FUNCTION__, name);
+	head->sw_aead = aead;
+	return;
+bad:
+	crypto_free_aead(aead);
+}
+#endif /* HAVE_AEAD */
+
 /*
  * Generate a new software session.
  */
@@ -339,6 +437,7 @@ static int
 swcr_newsession(device_t dev, u_int32_t *sid, struct cryptoini *cri)
 {
 	struct swcr_data **swd;
+	struct cryptoini *cri0 = cri;
 	u_int32_t i;
 	int error;
 	char *algo;
@@ -550,6 +649,9 @@ swcr_newsession(device_t dev, u_int32_t *sid, struct cryptoini *cri)
 		cri = cri->cri_next;
 		swd = &((*swd)->sw_next);
 	}
+#ifdef HAVE_AEAD
+	swcr_aead_alloc(swcr_sessions[*sid], cri0);
+#endif
 	return 0;
 }
 
@@ -575,6 +677,10 @@ swcr_freesession(device_t dev, u_int64_t tid)
 
 	while ((swd = swcr_sessions[sid]) != NULL) {
 		swcr_sessions[sid] = swd->sw_next;
+#ifdef HAVE_AEAD
+		if (swd->sw_aead)
+			crypto_free_aead(swd->sw_aead);
+#endif
 		if (swd->sw_tfm) {
 			switch (swd->sw_type & SW_TYPE_ALG_AMASK) {
 #ifdef HAVE_AHASH
@@ -619,6 +725,92 @@ swcr_freesession(device_t dev, u_int64_t tid)
 	return 0;
 }
 
+/*
+ * Map the whole request buffer once, each descriptor then only takes
+ * its window out of it.
+ */
+static void
+swcr_sg_build(struct swcr_req *req)
+{
+	struct cryptop *crp = req->crp;
+	struct scatterlist *sg = req->buf_sg;
+	int i, n = 0;
+
+	sg_init_table(sg, SCATTERLIST_MAX);
+	if (crp->crp_flags & CRYPTO_F_SKBUF) {
+		struct sk_buff *skb = (struct sk_buff *) crp->crp_buf;
+
+		if (skb_headlen(skb))
+			sg_set_page(&sg[n++], virt_to_page(skb->data), skb_headlen(skb),
+					offset_in_page(skb->data));
+		for (i = 0; i < skb_shinfo(skb)->nr_frags; i++)
+			sg_set_page(&sg[n++], skb_frag_page(&skb_shinfo(skb)->frags[i]),
+					skb_shinfo(skb)->frags[i].size,
+					skb_shinfo(skb)->frags[i].page_offset);
+	} else if (crp->crp_flags & CRYPTO_F_IOV) {
+		struct uio *uiop = (struct uio *) crp->crp_buf;
+
+		for (i = 0; i < uiop->uio_iovcnt; i++)
+			sg_set_page(&sg[n++], virt_to_page(uiop->uio_iov[i].iov_base),
+					uiop->uio_iov[i].iov_len,
+					offset_in_page(uiop->uio_iov[i].iov_base));
+	} else
+		sg_set_page(&sg[n++], virt_to_page(crp->crp_buf), crp->crp_ilen,
+				offset_in_page(crp->crp_buf));
+	req->buf_sgn = n;
+}
+
+/*
+ * Fill sg with the part of the buffer from skip for len bytes, return
+ * the number of entries and in *sg_len how much of it the buffer had.
+ */
+static int
+swcr_sg_window(struct swcr_req *req, struct scatterlist *sg, int skip,
+		int len, int *sg_len)
+{
+	struct scatterlist *b;
+	int i, n = 0, l, off;
+
+	*sg_len = 0;
+	sg_init_table(sg, SCATTERLIST_MAX);
+	for (i = 0; i < req->buf_sgn && *sg_len < len; i++) {
+		b = &req->buf_sg[i];
+		if (skip >= b->length) {
+			skip -= b->length;
+			continue;
+		}
+		off = b->offset + skip;
+		l = b->length - skip;
+		if (l > len - *sg_len)
+			l = len - *sg_len;
+		sg_set_page(&sg[n++], nth_page(sg_page(b), off >> PAGE_SHIFT), l,
+				off & ~PAGE_MASK);
+		*sg_len += l;
+		skip = 0;
+	}
+	if (n > 0)
+		sg_mark_end(&sg[n - 1]);
+	return n;
+}
+
+static void *
+swcr_req_ctx(struct swcr_req *req, unsigned int size)
+{
+	if (size <= sizeof(req->ctx))
+		req->crypto_req = req->ctx;
+	else
+		req->crypto_req = kmalloc(size, GFP_ATOMIC);
+	return req->crypto_req;
+}
+
+static void
+swcr_req_ctx_free(struct swcr_req *req)
+{
+	if (req->crypto_req && req->crypto_req != req->ctx)
+		kfree(req->crypto_req);
+	req->crypto_req = NULL;
+}
+
 static void swcr_process_req_complete(struct swcr_req *req)
 {
 	dprintk("%s()\n", __FUNCTION__);
@@ -630,6 +822,24 @@ static void swcr_process_req_complete(struct swcr_req *req)
 		spin_unlock_irqrestore(&req->sw->sw_tfm_lock, flags);
 	}
 
+	swcr_req_ctx_free(req);
+
+	if (req->aead) {
+		req->aead = 0;
+		/*
+		 * The caller compares the MAC itself and wants the one we
+		 * computed in the buffer, which authenc() does not give us
+		 * on a mismatch.  Do it the long way then.
+		 */
+		if (req->crp->crp_etype == EBADMSG) {
+			req->crp->crp_etype = 0;
+			req->crd = req->crp->crp_desc;
+			swcr_process_req(req);
+			return;
+		}
+		goto done;
+	}
+
 	if (req->crp->crp_etype)
 		goto done;
 
@@ -639,12 +849,10 @@ static void swcr_process_req_complete(struct swcr_req *req)
 	case SW_TYPE_AHASH:
 		crypto_copyback(req->crp->crp_flags, req->crp->crp_buf,
 				req->crd->crd_inject, req->sw->u.hmac.sw_mlen, req->result);
-		ahash_request_free(req->crypto_req);
 		break;
 #endif
 #if defined(HAVE_ABLKCIPHER)
 	case SW_TYPE_ABLKCIPHER:
-		ablkcipher_request_free(req->crypto_req);
 		break;
 #endif
 	case SW_TYPE_CIPHER:
@@ -687,15 +895,127 @@ static void swcr_process_callback(struct crypto_async_request *creq, int err)
 }
 #endif /* defined(HAVE_ABLKCIPHER) || defined(HAVE_AHASH) */
 
+#ifdef HAVE_AEAD
+/*
+ * Run a cipher+MAC request through the session's authenc() transform
+ * in one pass.  That only matches the two descriptors when they are
+ * laid out the ESP way: encrypt then MAC, or MAC then decrypt, the MAC
+ * covering everything from its start to the end of the ciphertext, the
+ * IV in the buffer just before the ciphertext and the MAC going right
+ * after it.  Returns 0 if the request has to take the usual path.
+ */
+static int
+swcr_aead_process(struct swcr_req *req)
+{
+	struct cryptop *crp = req->crp;
+	struct crypto_aead *aead = req->sw_head->sw_aead;
+	struct cryptodesc *crd1, *crd2, *enc, *mac;
+	struct swcr_data *sw, *esw = NULL, *msw = NULL;
+	struct aead_request *areq;
+	int ivsize, authsize, assoclen, cryptlen, encrypt, sg_len, ret;
+
+	crd1 = crp->crp_desc;
+	crd2 = crd1->crd_next;
+	if (crd2 == NULL || crd2->crd_next != NULL)
+		return 0;
+	for (sw = req->sw_head; sw; sw = sw->sw_next)
+		if (sw->sw_type & SW_TYPE_BLKCIPHER)
+			esw = sw;
+		else
+			msw = sw;
+
+	if (crd1->crd_alg == esw->sw_alg && crd2->crd_alg == msw->sw_alg &&
+			(crd1->crd_flags & CRD_F_ENCRYPT)) {
+		enc = crd1;
+		mac = crd2;
+		encrypt = 1;
+	} else if (crd1->crd_alg == msw->sw_alg && crd2->crd_alg == esw->sw_alg &&
+			!(crd2->crd_flags & CRD_F_ENCRYPT)) {
+		mac = crd1;
+		enc = crd2;
+		encrypt = 0;
+	} else
+		return 0;
+
+	ivsize = crypto_aead_ivsize(aead);
+	authsize = msw->u.hmac.sw_mlen;
+	assoclen = enc->crd_skip - mac->crd_skip;
+	if ((enc->crd_flags | mac->crd_flags) & CRD_F_KEY_EXPLICIT)
+		return 0;
+	/* the IV has to be the one in the buffer */
+	if ((enc->crd_flags & CRD_F_IV_EXPLICIT) &&
+			(!encrypt || (enc->crd_flags & CRD_F_IV_PRESENT)))
+		return 0;
+	if (ivsize > sizeof(req->iv) || enc->crd_inject + ivsize != enc->crd_skip ||
+			mac->crd_skip > enc->crd_inject || assoclen <= ivsize ||
+			mac->crd_skip + mac->crd_len != enc->crd_skip + enc->crd_len ||
+			mac->crd_inject != enc->crd_skip + enc->crd_len ||
+			crp->crp_ilen < mac->crd_inject + authsize)
+		return 0;
+
+	req->sw = esw;
+	req->aead = 1;
+	if (encrypt) {
+		if (enc->crd_flags & CRD_F_IV_EXPLICIT)
+			memcpy(req->iv, enc->crd_iv, ivsize);
+		else
+			get_random_bytes(req->iv, ivsize);
+		if ((enc->crd_flags & CRD_F_IV_PRESENT) == 0)
+			crypto_copyback(crp->crp_flags, crp->crp_buf,
+					enc->crd_inject, ivsize, (caddr_t)req->iv);
+		cryptlen = enc->crd_len;
+	} else {
+		crypto_copydata(crp->crp_flags, crp->crp_buf,
+				enc->crd_inject, ivsize, (caddr_t)req->iv);
+		cryptlen = enc->crd_len + authsize;
+	}
+
+	areq = swcr_req_ctx(req, sizeof(struct aead_request) +
+			crypto_aead_reqsize(aead));
+	if (areq == NULL) {
+		crp->crp_etype = ENOMEM;
+		goto done;
+	}
+	aead_request_set_tfm(areq, aead);
+	aead_request_set_callback(areq, CRYPTO_TFM_REQ_MAY_BACKLOG,
+			swcr_process_callback, req);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,3,0)
+	swcr_sg_window(req, req->sg, mac->crd_skip,
+			assoclen + enc->crd_len + authsize, &sg_len);
+	aead_request_set_ad(areq, assoclen);
+#else
+	/* the IV is hashed between the assoc data and the ciphertext */
+	swcr_sg_window(req, req->asg, mac->crd_skip, assoclen - ivsize, &sg_len);
+	aead_request_set_assoc(areq, req->asg, assoclen - ivsize);
+	swcr_sg_window(req, req->sg, enc->crd_skip, enc->crd_len + authsize,
+			&sg_len);
+#endif
+	aead_request_set_crypt(areq, req->sg, req->sg, cryptlen, req->iv);
+
+	ret = encrypt ? crypto_aead_encrypt(areq) : crypto_aead_decrypt(areq);
+	switch (ret) {
+	case -EINPROGRESS:
+	case -EBUSY:
+		return 1;
+	default:
+	case 0:
+		dprintk("aead OP %s %d\n", ret ? "failed" : "success", ret);
+		crp->crp_etype = -ret;
+		break;
+	}
+done:
+	swcr_process_req_complete(req);
+	return 1;
+}
+#endif /* HAVE_AEAD */
+
 
 static void swcr_process_req(struct swcr_req *req)
 {
 	struct swcr_data *sw;
 	struct cryptop *crp = req->crp;
 	struct cryptodesc *crd = req->crd;
-	struct sk_buff *skb = (struct sk_buff *) crp->crp_buf;
-	struct uio *uiop = (struct uio *) crp->crp_buf;
-	int sg_num, sg_len, skip;
+	int sg_num, sg_len;
 
 	dprintk("%s()\n", __FUNCTION__);
 
@@ -743,79 +1063,7 @@ static void swcr_process_req(struct swcr_req *req)
 	}
 
 	req->sw = sw;
-	skip = crd->crd_skip;
-
-	/*
-	 * setup the SG list skip from the start of the buffer
-	 */
-	memset(req->sg, 0, sizeof(req->sg));
-	sg_init_table(req->sg, SCATTERLIST_MAX);
-	if (crp->crp_flags & CRYPTO_F_SKBUF) {
-		int i, len;
-
-		sg_num = 0;
-		sg_len = 0;
-
-		if (skip < skb_headlen(skb)) {
-			len = skb_headlen(skb) - skip;
-			if (len + sg_len > crd->crd_len)
-				len = crd->crd_len - sg_len;
-			sg_set_page(&req->sg[sg_num],
-				virt_to_page(skb->data + skip), len,
-				offset_in_page(skb->data + skip));
-			sg_len += len;
-			sg_num++;
-			skip = 0;
-		} else
-			skip -= skb_headlen(skb);
-
-		for (i = 0; sg_len < crd->crd_len &&
-					i < skb_shinfo(skb)->nr_frags &&
-					sg_num < SCATTERLIST_MAX; i++) {
-			if (skip < skb_shinfo(skb)->frags[i].size) {
-				len = skb_shinfo(skb)->frags[i].size - skip;
-				if (len + sg_len > crd->crd_len)
-					len = crd->crd_len - sg_len;
-				sg_set_page(&req->sg[sg_num],
-					skb_frag_page(&skb_shinfo(skb)->frags[i]),
-					len,
-					skb_shinfo(skb)->frags[i].page_offset + skip);
-				sg_len += len;
-				sg_num++;
-				skip = 0;
-			} else
-				skip -= skb_shinfo(skb)->frags[i].size;
-		}
-	} else if (crp->crp_flags & CRYPTO_F_IOV) {
-		int len;
-
-		sg_len = 0;
-		for (sg_num = 0; sg_len < crd->crd_len &&
-				sg_num < uiop->uio_iovcnt &&
-				sg_num < SCATTERLIST_MAX; sg_num++) {
-			if (skip <= uiop->uio_iov[sg_num].iov_len) {
-				len = uiop->uio_iov[sg_num].iov_len - skip;
-				if (len + sg_len > crd->crd_len)
-					len = crd->crd_len - sg_len;
-				sg_set_page(&req->sg[sg_num],
-					virt_to_page(uiop->uio_iov[sg_num].iov_base+skip),
-					len,
-					offset_in_page(uiop->uio_iov[sg_num].iov_base+skip));
-				sg_len += len;
-				skip = 0;
-			} else 
-				skip -= uiop->uio_iov[sg_num].iov_len;
-		}
-	} else {
-		sg_len = (crp->crp_ilen - skip);
-		if (sg_len > crd->crd_len)
-			sg_len = crd->crd_len;
-		sg_set_page(&req->sg[0], virt_to_page(crp->crp_buf + skip),
-			sg_len, offset_in_page(crp->crp_buf + skip));
-		sg_num = 1;
-	}
-	if (sg_num > 0)
-		sg_mark_end(&req->sg[sg_num-1]);
+	sg_num = swcr_sg_window(req, req->sg, crd->crd_skip, crd->crd_len, &sg_len);
 
 	switch (sw->sw_type & SW_TYPE_ALG_AMASK) {
 
@@ -834,13 +1082,13 @@ static void swcr_process_req(struct swcr_req *req)
 			goto done;
 		}
 
-		req->crypto_req =
-				ahash_request_alloc(__crypto_ahash_cast(sw->sw_tfm),GFP_ATOMIC);
-		if (!req->crypto_req) {
+		if (!swcr_req_ctx(req, sizeof(struct ahash_request) +
+				crypto_ahash_reqsize(__crypto_ahash_cast(sw->sw_tfm)))) {
 			crp->crp_etype = ENOMEM;
-			dprintk("%s,%d: ENOMEM ahash_request_alloc", __FILE__, __LINE__);
+			dprintk("%s,%d: ENOMEM ahash request", __FILE__, __LINE__);
 			goto done;
 		}
+		ahash_request_set_tfm(req->crypto_req, __crypto_ahash_cast(sw->sw_tfm));
 
 		ahash_request_set_callback(req->crypto_req,
 				CRYPTO_TFM_REQ_MAY_BACKLOG, swcr_process_callback, req);
@@ -887,14 +1135,14 @@ static void swcr_process_req(struct swcr_req *req)
 			goto done;
 		}
 
-		req->crypto_req = ablkcipher_request_alloc(
-				__crypto_ablkcipher_cast(sw->sw_tfm), GFP_ATOMIC);
-		if (!req->crypto_req) {
+		if (!swcr_req_ctx(req, sizeof(struct ablkcipher_request) +
+				crypto_ablkcipher_reqsize(__crypto_ablkcipher_cast(sw->sw_tfm)))) {
 			crp->crp_etype = ENOMEM;
-			dprintk("%s,%d: ENOMEM ablkcipher_request_alloc",
-					__FILE__, __LINE__);
+			dprintk("%s,%d: ENOMEM ablkcipher request", __FILE__, __LINE__);
 			goto done;
 		}
+		ablkcipher_request_set_tfm(req->crypto_req,
+				__crypto_ablkcipher_cast(sw->sw_tfm));
 
 		ablkcipher_request_set_callback(req->crypto_req,
 				CRYPTO_TFM_REQ_MAY_BACKLOG, swcr_process_callback, req);
@@ -1215,12 +1463,17 @@ swcr_process(device_t dev, struct cryptop *crp, int hint)
 		crp->crp_etype = ENOMEM;
 		goto done;
 	}
-	memset(req, 0, sizeof(*req));
+	memset(req, 0, offsetof(struct swcr_req, ctx));
 
 	req->sw_head = swcr_sessions[lid];
 	req->crp = crp;
 	req->crd = crp->crp_desc;
+	swcr_sg_build(req);
 
+#ifdef HAVE_AEAD
+	if (req->sw_head->sw_aead && swcr_aead_process(req))
+		return 0;
+#endif
 	swcr_process_req(req);
 	return 0;
 
@@ -1254,7 +1507,7 @@ cryptosoft_init(void)
 	softc_device_init(&swcr_softc, "cryptosoft", 0, swcr_methods);
 
 	swcr_id = crypto_get_driverid(softc_get_device(&swcr_softc),
-			CRYPTOCAP_F_SOFTWARE | CRYPTOCAP_F_SYNC);
+			CRYPTOCAP_F_SOFTWARE | CRYPTOCAP_F_SYNC | CRYPTOCAP_F_SG);
 	if (swcr_id < 0) {
 		printk("cryptosoft: Software crypto device cannot initialize!");
 		return -ENODEV;
@@ -30,6 +30,21 @@
  */
 
 
+/*
+ * The benchmark sweeps every combination of driver, algorithm, request
+ * size, queue depth and number of submitting CPUs.  Each run keeps
+ * request_q_len requests in flight for at least request_msecs and
+ * request_num requests, resubmitting each one from a work item on its
+ * CPU as soon as it completes.
+ *
+ * Results are printed as each run completes, and are kept in
+ * <debugfs>/ocf-bench/results until the module is removed, one line per
+ * run with space separated fields as named in the header line.  Latency
+ * is measured from crypto_dispatch() to the callback, in microseconds.
+ * The histogram holds the number of requests that took 2^n to 2^(n+1)-1
+ * microseconds in slot n, the first slot includes those under 1us.
+ */
+
 #include <linux/version.h>
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,38) && !defined(AUTOCONF_INCLUDED)
 #include <linux/config.h>
@@ -42,48 +57,64 @@
 #include <linux/sched.h>
 #include <linux/spinlock.h>
 #include <linux/interrupt.h>
+#include <linux/workqueue.h>
+#include <linux/kthread.h>
+#include <linux/cpumask.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,22)
+#include <linux/ktime.h>
+#endif
+#include <asm/div64.h>
 #include <cryptodev.h>
 
-#ifdef I_HAVE_AN_XSCALE_WITH_INTEL_SDK
-#define BENCH_IXP_ACCESS_LIB 1
-#endif
-#ifdef BENCH_IXP_ACCESS_LIB
-#include <IxTypes.h>
-#include <IxOsBuffMgt.h>
-#include <IxNpeDl.h>
-#include <IxCryptoAcc.h>
-#include <IxQMgr.h>
-#include <IxOsServices.h>
-#include <IxOsCacheMMU.h>
-#endif
+/*
+ * the numbers of simultaneously active requests
+ */
+static int request_q_len[8] = { 1, 8, 40 };
+static int request_q_len_num = 3;
+module_param_array(request_q_len, int, &request_q_len_num, 0);
+MODULE_PARM_DESC(request_q_len, "Numbers of outstanding requests");
 
 /*
- * support for access lib version 1.4
+ * how many requests we want to have processed, and for how long
  */
-#ifndef IX_MBUF_PRIV
-#define IX_MBUF_PRIV(x) ((x)->priv)
-#endif
+static int request_num = 1024;
+module_param(request_num, int, 0);
+MODULE_PARM_DESC(request_num, "run for at least this many requests");
+
+static int request_msecs = 100;
+module_param(request_msecs, int, 0);
+MODULE_PARM_DESC(request_msecs, "run for at least this many ms");
 
 /*
- * the number of simultaneously active requests
+ * the sizes of each request
  */
-static int request_q_len = 40;
-module_param(request_q_len, int, 0);
-MODULE_PARM_DESC(request_q_len, "Number of outstanding requests");
+static int request_size[8] = { 64, 256, 1024, 1488, 4096, 16384 };
+static int request_size_num = 6;
+module_param_array(request_size, int, &request_size_num, 0);
+MODULE_PARM_DESC(request_size, "sizes of each request");
 
 /*
- * how many requests we want to have processed
+ * the numbers of CPUs submitting requests, 0 for all online CPUs
  */
-static int request_num = 1024;
-module_param(request_num, int, 0);
-MODULE_PARM_DESC(request_num, "run for at least this many requests");
+static int request_cpus[8] = { 1, 0 };
+static int request_cpus_num = 2;
+module_param_array(request_cpus, int, &request_cpus_num, 0);
+MODULE_PARM_DESC(request_cpus, "numbers of CPUs submitting requests (0 all)");
 
 /*
- * the size of each request
+ * the algorithms and drivers to test, all of them by default
  */
-static int request_size = 1488;
-module_param(request_size, int, 0);
-MODULE_PARM_DESC(request_size, "size of each request");
+static char *request_algs[16];
+static int request_algs_num = 0;
+module_param_array(request_algs, charp, &request_algs_num, 0);
+MODULE_PARM_DESC(request_algs, "algorithms to test (default all)");
+
+static char *request_drivers[16];
+static int request_drivers_num = 0;
+module_param_array(request_drivers, charp, &request_drivers_num, 0);
+MODULE_PARM_DESC(request_drivers, "drivers to test, e.g. cryptosoft0 (default all)");
 
 /*
  * OCF batching of requests
@@ -99,132 +130,244 @@ static int request_cbimm = 1;
 module_param(request_cbimm, int, 0);
 MODULE_PARM_DESC(request_cbimm, "enable OCF immediate callback on completion");
 
+#define BENCH_MAX_DRIVERS	32
+#define BENCH_MAC_LEN		64	/* room for the MAC after the data */
+#define BENCH_HIST			24
+
+struct bench_alg {
+	const char	*name;
+	int		cipher;		/* 0 if none */
+	int		cipher_klen;	/* bytes */
+	int		mac;		/* 0 if none */
+	int		mac_klen;	/* bytes */
+};
+
+static struct bench_alg bench_algs[] = {
+	{ "aes-cbc",             CRYPTO_AES_CBC,  16, 0,                    0  },
+	{ "3des-cbc",            CRYPTO_3DES_CBC, 24, 0,                    0  },
+	{ "sha1-hmac",           0,               0,  CRYPTO_SHA1_HMAC,     20 },
+	{ "sha256-hmac",         0,               0,  CRYPTO_SHA2_256_HMAC, 32 },
+	{ "aes-cbc+sha1-hmac",   CRYPTO_AES_CBC,  16, CRYPTO_SHA1_HMAC,     20 },
+	{ "aes-cbc+sha256-hmac", CRYPTO_AES_CBC,  16, CRYPTO_SHA2_256_HMAC, 32 },
+	{ "3des-cbc+sha1-hmac",  CRYPTO_3DES_CBC, 24, CRYPTO_SHA1_HMAC,     20 },
+};
+
+#define BENCH_NALGS	(sizeof(bench_algs) / sizeof(bench_algs[0]))
+
+static const char bench_key[] = "0123456789abcdefghijklmnopqrstuv";
+
+struct bench_result {
+	char		driver[16];
+	const char	*alg;
+	int		size;
+	int		depth;
+	int		cpus;
+	unsigned long	requests;
+	unsigned long	errors;
+	u_int64_t	usecs;
+	u_int64_t	bytes;
+	u_int32_t	lat_min;
+	u_int32_t	lat_max;
+	u_int64_t	lat_sum;
+	unsigned long	hist[BENCH_HIST];
+};
+
+static struct bench_result *bench_results;
+static int bench_nresults;
+static int bench_maxresults;
+static int bench_done;
+
 /*
  * a structure for each request
  */
 typedef struct  {
 	struct work_struct work;
-#ifdef BENCH_IXP_ACCESS_LIB
-	IX_MBUF mbuf;
-#endif
 	unsigned char *buffer;
+	int cpu;
+	u_int64_t start;
 } request_t;
 
 static request_t *requests;
+static int request_max_q_len;
+static int request_max_size;
 
 static spinlock_t ocfbench_counter_lock;
-static int outstanding;
-static int total;
+static atomic_t outstanding;
+static DECLARE_WAIT_QUEUE_HEAD(ocfbench_wait);
+static int ocfbench_stop;
+
+static struct task_struct *ocfbench_task;
+static int *ocfbench_cpus;	/* CPUs to submit from, -1 terminated */
+static struct dentry *ocfbench_dir;
+
+/* the run in progress */
+static struct bench_result *bench_cur;
+static struct bench_alg *bench_alg_cur;
+static u_int64_t bench_start;
+static u_int64_t ocf_cryptoid;
+
+static inline u_int64_t
+bench_now(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,22)
+	return ktime_to_us(ktime_get());
+#else
+	return (u_int64_t) jiffies * (1000000 / HZ);
+#endif
+}
 
 /*************************************************************************/
 /*
  * OCF benchmark routines
  */
 
-static uint64_t ocf_cryptoid;
-static unsigned long jstart, jstop;
-
-static int ocf_init(void);
 static int ocf_cb(struct cryptop *crp);
 static void ocf_request(void *arg);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
 static void ocf_request_wq(struct work_struct *work);
 #endif
 
+static void
+ocf_queue(request_t *r)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,27)
+	schedule_work_on(r->cpu, &r->work);
+#else
+	schedule_work(&r->work);
+#endif
+}
+
+/* a request leaves the run */
+static void
+ocf_put(void)
+{
+	if (atomic_dec_and_test(&outstanding))
+		wake_up(&ocfbench_wait);
+}
+
 static int
-ocf_init(void)
+ocf_init(int hid)
 {
+	struct bench_alg *alg = bench_alg_cur;
+	struct cryptoini crie, cria, *cri = NULL;
 	int error;
-	struct cryptoini crie, cria;
-	struct cryptodesc crda, crde;
 
 	memset(&crie, 0, sizeof(crie));
 	memset(&cria, 0, sizeof(cria));
-	memset(&crde, 0, sizeof(crde));
-	memset(&crda, 0, sizeof(crda));
 
-	cria.cri_alg  = CRYPTO_SHA1_HMAC;
-	cria.cri_klen = 20 * 8;
-	cria.cri_key  = "0123456789abcdefghij";
+	if (alg->mac) {
+		cria.cri_alg  = alg->mac;
+		cria.cri_klen = alg->mac_klen * 8;
+		cria.cri_key  = (caddr_t) bench_key;
+		cri = &cria;
+	}
+	if (alg->cipher) {
+		crie.cri_alg  = alg->cipher;
+		crie.cri_klen = alg->cipher_klen * 8;
+		crie.cri_key  = (caddr_t) bench_key;
+		crie.cri_next = cri;
+		cri = &crie;
+	}
 
-	//crie.cri_alg  = CRYPTO_3DES_CBC;
-	crie.cri_alg  = CRYPTO_AES_CBC;
-	crie.cri_klen = 24 * 8;
-	crie.cri_key  = "0123456789abcdefghijklmn";
+	error = crypto_newsession(&ocf_cryptoid, cri, hid);
+	if (error)
+		return -1;
+	return 0;
+}
 
-	crie.cri_next = &cria;
+static void
+ocf_account(request_t *r, int error)
+{
+	struct bench_result *res = bench_cur;
+	u_int64_t now = bench_now();
+	u_int32_t lat = now - r->start;
+	unsigned long flags;
+	int b, done;
 
-	error = crypto_newsession(&ocf_cryptoid, &crie,
-				CRYPTOCAP_F_HARDWARE | CRYPTOCAP_F_SOFTWARE);
+	spin_lock_irqsave(&ocfbench_counter_lock, flags);
 	if (error) {
-		printk("crypto_newsession failed %d\n", error);
-		return -1;
+		res->errors++;
+	} else {
+		res->requests++;
+		res->bytes += res->size;
+		res->lat_sum += lat;
+		if (res->requests == 1 || lat < res->lat_min)
+			res->lat_min = lat;
+		if (lat > res->lat_max)
+			res->lat_max = lat;
+		b = fls(lat) - 1;
+		if (b < 0)
+			b = 0;
+		if (b >= BENCH_HIST)
+			b = BENCH_HIST - 1;
+		res->hist[b]++;
 	}
-	return 0;
+	/* do all requests but take at least request_msecs */
+	done = error || ocfbench_stop || (res->requests >= request_num &&
+			now - bench_start >= (u_int64_t) request_msecs * 1000);
+	spin_unlock_irqrestore(&ocfbench_counter_lock, flags);
+
+	if (done)
+		ocf_put();
+	else
+		ocf_queue(r);
 }
 
 static int
 ocf_cb(struct cryptop *crp)
 {
 	request_t *r = (request_t *) crp->crp_opaque;
-	unsigned long flags;
+	int error = crp->crp_etype;
 
-	if (crp->crp_etype)
-		printk("Error in OCF processing: %d\n", crp->crp_etype);
 	crypto_freereq(crp);
 	crp = NULL;
-
-	/* do all requests  but take at least 1 second */
-	spin_lock_irqsave(&ocfbench_counter_lock, flags);
-	total++;
-	if (total > request_num && jstart + HZ < jiffies) {
-		outstanding--;
-		spin_unlock_irqrestore(&ocfbench_counter_lock, flags);
-		return 0;
-	}
-	spin_unlock_irqrestore(&ocfbench_counter_lock, flags);
-
-	schedule_work(&r->work);
+	ocf_account(r, error);
 	return 0;
 }
 
-
 static void
 ocf_request(void *arg)
 {
 	request_t *r = arg;
-	struct cryptop *crp = crypto_getreq(2);
-	struct cryptodesc *crde, *crda;
-	unsigned long flags;
+	struct bench_alg *alg = bench_alg_cur;
+	int size = bench_cur->size;
+	struct cryptop *crp;
+	struct cryptodesc *crde = NULL, *crda = NULL;
 
+	crp = crypto_getreq((alg->cipher ? 1 : 0) + (alg->mac ? 1 : 0));
 	if (!crp) {
-		spin_lock_irqsave(&ocfbench_counter_lock, flags);
-		outstanding--;
-		spin_unlock_irqrestore(&ocfbench_counter_lock, flags);
+		ocf_account(r, ENOMEM);
 		return;
 	}
 
-	crde = crp->crp_desc;
-	crda = crde->crd_next;
-
-	crda->crd_skip = 0;
-	crda->crd_flags = 0;
-	crda->crd_len = request_size;
-	crda->crd_inject = request_size;
-	crda->crd_alg = CRYPTO_SHA1_HMAC;
-	crda->crd_key = "0123456789abcdefghij";
-	crda->crd_klen = 20 * 8;
-
-	crde->crd_skip = 0;
-	crde->crd_flags = CRD_F_IV_EXPLICIT | CRD_F_ENCRYPT;
-	crde->crd_len = request_size;
-	crde->crd_inject = request_size;
-	//crde->crd_alg = CRYPTO_3DES_CBC;
-	crde->crd_alg = CRYPTO_AES_CBC;
-	crde->crd_key = "0123456789abcdefghijklmn";
-	crde->crd_klen = 24 * 8;
-
-	crp->crp_ilen = request_size + 64;
+	if (alg->cipher) {
+		crde = crp->crp_desc;
+		if (alg->mac)
+			crda = crde->crd_next;
+	} else
+		crda = crp->crp_desc;
+
+	if (crda) {
+		crda->crd_skip = 0;
+		crda->crd_flags = 0;
+		crda->crd_len = size;
+		crda->crd_inject = size;
+		crda->crd_alg = alg->mac;
+		crda->crd_key = (caddr_t) bench_key;
+		crda->crd_klen = alg->mac_klen * 8;
+	}
+
+	if (crde) {
+		crde->crd_skip = 0;
+		crde->crd_flags = CRD_F_IV_EXPLICIT | CRD_F_ENCRYPT;
+		crde->crd_len = size;
+		crde->crd_inject = size;
+		crde->crd_alg = alg->cipher;
+		crde->crd_key = (caddr_t) bench_key;
+		crde->crd_klen = alg->cipher_klen * 8;
+	}
+
+	crp->crp_ilen = size + (alg->mac ? BENCH_MAC_LEN : 0);
 	crp->crp_flags = 0;
 	if (request_batch)
 		crp->crp_flags |= CRYPTO_F_BATCH;
@@ -234,7 +377,11 @@ ocf_request(void *arg)
 	crp->crp_callback = ocf_cb;
 	crp->crp_sid = ocf_cryptoid;
 	crp->crp_opaque = (caddr_t) r;
-	crypto_dispatch(crp);
+	r->start = bench_now();
+	if (crypto_dispatch(crp)) {
+		crypto_freereq(crp);
+		ocf_account(r, EAGAIN);
+	}
 }
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
@@ -252,258 +399,341 @@ ocf_done(void)
 	crypto_freesession(ocf_cryptoid);
 }
 
-/*************************************************************************/
-#ifdef BENCH_IXP_ACCESS_LIB
 /*************************************************************************/
 /*
- * CryptoAcc benchmark routines
+ * Results
  */
 
-static IxCryptoAccCtx ixp_ctx;
-static UINT32 ixp_ctx_id;
-static IX_MBUF ixp_pri;
-static IX_MBUF ixp_sec;
-static int ixp_registered = 0;
-
-static void ixp_register_cb(UINT32 ctx_id, IX_MBUF *bufp,
-					IxCryptoAccStatus status);
-static void ixp_perform_cb(UINT32 ctx_id, IX_MBUF *sbufp, IX_MBUF *dbufp,
-					IxCryptoAccStatus status);
-static void ixp_request(void *arg);
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
-static void ixp_request_wq(struct work_struct *work);
-#endif
-
-static int
-ixp_init(void)
+static void
+bench_format(struct bench_result *res, u_int64_t *kbps, u_int32_t *lat_avg)
 {
-	IxCryptoAccStatus status;
-
-	ixp_ctx.cipherCtx.cipherAlgo = IX_CRYPTO_ACC_CIPHER_3DES;
-	ixp_ctx.cipherCtx.cipherMode = IX_CRYPTO_ACC_MODE_CBC;
-	ixp_ctx.cipherCtx.cipherKeyLen = 24;
-	ixp_ctx.cipherCtx.cipherBlockLen = IX_CRYPTO_ACC_DES_BLOCK_64;
-	ixp_ctx.cipherCtx.cipherInitialVectorLen = IX_CRYPTO_ACC_DES_IV_64;
-	memcpy(ixp_ctx.cipherCtx.key.cipherKey, "0123456789abcdefghijklmn", 24);
-
-	ixp_ctx.authCtx.authAlgo = IX_CRYPTO_ACC_AUTH_SHA1;
-	ixp_ctx.authCtx.authDigestLen = 12;
-	ixp_ctx.authCtx.aadLen = 0;
-	ixp_ctx.authCtx.authKeyLen = 20;
-	memcpy(ixp_ctx.authCtx.key.authKey, "0123456789abcdefghij", 20);
-
-	ixp_ctx.useDifferentSrcAndDestMbufs = 0;
-	ixp_ctx.operation = IX_CRYPTO_ACC_OP_ENCRYPT_AUTH ;
-
-	IX_MBUF_MLEN(&ixp_pri)  = IX_MBUF_PKT_LEN(&ixp_pri) = 128;
-	IX_MBUF_MDATA(&ixp_pri) = (unsigned char *) kmalloc(128, SLAB_ATOMIC);
-	IX_MBUF_MLEN(&ixp_sec)  = IX_MBUF_PKT_LEN(&ixp_sec) = 128;
-	IX_MBUF_MDATA(&ixp_sec) = (unsigned char *) kmalloc(128, SLAB_ATOMIC);
-
-	status = ixCryptoAccCtxRegister(&ixp_ctx, &ixp_pri, &ixp_sec,
-			ixp_register_cb, ixp_perform_cb, &ixp_ctx_id);
-
-	if (IX_CRYPTO_ACC_STATUS_SUCCESS == status) {
-		while (!ixp_registered)
-			schedule();
-		return ixp_registered < 0 ? -1 : 0;
-	}
-
-	printk("ixp: ixCryptoAccCtxRegister failed %d\n", status);
-	return -1;
+	u_int64_t v;
+
+	v = res->bytes * 8 * 1000;
+	if (res->usecs)
+		do_div(v, (u_int32_t) res->usecs);
+	*kbps = v;
+	v = res->lat_sum;
+	if (res->requests)
+		do_div(v, (u_int32_t) res->requests);
+	*lat_avg = v;
 }
 
 static void
-ixp_register_cb(UINT32 ctx_id, IX_MBUF *bufp, IxCryptoAccStatus status)
+bench_print(struct bench_result *res)
 {
-	if (bufp) {
-		IX_MBUF_MLEN(bufp) = IX_MBUF_PKT_LEN(bufp) = 0;
-		kfree(IX_MBUF_MDATA(bufp));
-		IX_MBUF_MDATA(bufp) = NULL;
+	u_int64_t kbps;
+	u_int32_t lat_avg;
+
+	bench_format(res, &kbps, &lat_avg);
+	printk("OCF: %s %s %d bytes, %d deep on %d cpus: %lu requests "
+			"(%lu errors) in %llu us, %llu kbps, latency %u/%u/%u us\n",
+			res->driver, res->alg, res->size, res->depth, res->cpus,
+			res->requests, res->errors, (unsigned long long) res->usecs,
+			(unsigned long long) kbps,
+			res->lat_min, lat_avg, res->lat_max);
+}
+
+static int
+bench_show(struct seq_file *m, void *v)
+{
+	struct bench_result *res;
+	u_int64_t kbps;
+	u_int32_t lat_avg;
+	int i, n, b;
+
+	n = bench_nresults;
+	smp_rmb();
+	seq_printf(m, "# %s %d/%d\n", bench_done ? "done" : "running",
+			n, bench_maxresults);
+	seq_puts(m, "# driver alg size depth cpus requests errors usecs kbps"
+			" lat_min lat_avg lat_max hist\n");
+	for (i = 0; i < n; i++) {
+		res = &bench_results[i];
+		bench_format(res, &kbps, &lat_avg);
+		seq_printf(m, "%s %s %d %d %d %lu %lu %llu %llu %u %u %u ",
+				res->driver, res->alg, res->size, res->depth, res->cpus,
+				res->requests, res->errors,
+				(unsigned long long) res->usecs,
+				(unsigned long long) kbps,
+				res->lat_min, lat_avg, res->lat_max);
+		for (b = 0; b < BENCH_HIST; b++)
+			seq_printf(m, b ? ",%lu" : "%lu", res->hist[b]);
+		seq_putc(m, '\n');
 	}
+	return 0;
+}
 
-	if (IX_CRYPTO_ACC_STATUS_WAIT == status)
-		return;
-	if (IX_CRYPTO_ACC_STATUS_SUCCESS == status)
-		ixp_registered = 1;
-	else
-		ixp_registered = -1;
+static int
+bench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, bench_show, NULL);
 }
 
+static const struct file_operations bench_fops = {
+	.owner = THIS_MODULE,
+	.open = bench_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*************************************************************************/
+/*
+ * The sweep
+ */
+
 static void
-ixp_perform_cb(
-	UINT32 ctx_id,
-	IX_MBUF *sbufp,
-	IX_MBUF *dbufp,
-	IxCryptoAccStatus status)
+bench_run(int hid, const char *driver, struct bench_alg *alg, int size,
+		int depth, int ncpus, int *cpus)
 {
-	request_t *r = NULL;
-	unsigned long flags;
-
-	/* do all requests  but take at least 1 second */
-	spin_lock_irqsave(&ocfbench_counter_lock, flags);
-	total++;
-	if (total > request_num && jstart + HZ < jiffies) {
-		outstanding--;
-		spin_unlock_irqrestore(&ocfbench_counter_lock, flags);
-		return;
-	}
+	struct bench_result *res;
+	int i;
 
-	if (!sbufp || !(r = IX_MBUF_PRIV(sbufp))) {
-		printk("crappo %p %p\n", sbufp, r);
-		outstanding--;
-		spin_unlock_irqrestore(&ocfbench_counter_lock, flags);
+	if (bench_nresults >= bench_maxresults)
 		return;
+	res = &bench_results[bench_nresults];
+	memset(res, 0, sizeof(*res));
+	strncpy(res->driver, driver, sizeof(res->driver) - 1);
+	res->alg = alg->name;
+	res->size = size;
+	res->depth = depth;
+	res->cpus = ncpus;
+
+	bench_alg_cur = alg;
+	bench_cur = res;
+	if (ocf_init(hid) == -1)
+		return;		/* the driver lacks the algorithm */
+
+	atomic_set(&outstanding, depth);
+	bench_start = bench_now();
+	for (i = 0; i < depth; i++) {
+		requests[i].cpu = cpus[i % ncpus];
+		ocf_queue(&requests[i]);
 	}
-	spin_unlock_irqrestore(&ocfbench_counter_lock, flags);
+	wait_event(ocfbench_wait, atomic_read(&outstanding) == 0);
+	res->usecs = bench_now() - bench_start;
+	ocf_done();
 
-	schedule_work(&r->work);
+	smp_wmb();
+	bench_nresults++;
+	bench_print(res);
 }
 
-static void
-ixp_request(void *arg)
+static int
+bench_selected(char **names, int num, const char *name)
 {
-	request_t *r = arg;
-	IxCryptoAccStatus status;
-	unsigned long flags;
+	int i;
 
-	memset(&r->mbuf, 0, sizeof(r->mbuf));
-	IX_MBUF_MLEN(&r->mbuf) = IX_MBUF_PKT_LEN(&r->mbuf) = request_size + 64;
-	IX_MBUF_MDATA(&r->mbuf) = r->buffer;
-	IX_MBUF_PRIV(&r->mbuf) = r;
-	status = ixCryptoAccAuthCryptPerform(ixp_ctx_id, &r->mbuf, NULL,
-			0, request_size, 0, request_size, request_size, r->buffer);
-	if (IX_CRYPTO_ACC_STATUS_SUCCESS != status) {
-		printk("status1 = %d\n", status);
-		spin_lock_irqsave(&ocfbench_counter_lock, flags);
-		outstanding--;
-		spin_unlock_irqrestore(&ocfbench_counter_lock, flags);
-		return;
-	}
-	return;
+	if (num == 0)
+		return 1;
+	for (i = 0; i < num; i++)
+		if (names[i] && strcmp(names[i], name) == 0)
+			return 1;
+	return 0;
 }
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
-static void
-ixp_request_wq(struct work_struct *work)
+static int
+bench_ncpus(int i, int online)
 {
-	request_t *r = container_of(work, request_t, work);
-	ixp_request(r);
+	if (request_cpus[i] <= 0 || request_cpus[i] > online)
+		return online;
+	return request_cpus[i];
 }
-#endif
 
-static void
-ixp_done(void)
+static int
+bench_thread(void *arg)
 {
-	/* we should free the session here but I am lazy :-) */
+	int *cpus = ocfbench_cpus;
+	int ncpus_online = 0, ncpus, hid, a, s, d, c, i;
+	device_t dev;
+
+	while (cpus[ncpus_online] >= 0)
+		ncpus_online++;
+
+	for (hid = 0; hid < BENCH_MAX_DRIVERS && !kthread_should_stop(); hid++) {
+		dev = crypto_find_device_byhid(hid);
+		if (dev == NULL ||
+				!bench_selected(request_drivers, request_drivers_num,
+					device_get_nameunit(dev)))
+			continue;
+		for (a = 0; a < BENCH_NALGS && !kthread_should_stop(); a++) {
+			if (!bench_selected(request_algs, request_algs_num,
+					bench_algs[a].name))
+				continue;
+			for (c = 0; c < request_cpus_num; c++) {
+				ncpus = bench_ncpus(c, ncpus_online);
+				/* skip counts that came out the same as an earlier one */
+				for (i = 0; i < c; i++)
+					if (bench_ncpus(i, ncpus_online) == ncpus)
+						break;
+				if (i < c)
+					continue;
+				for (s = 0; s < request_size_num; s++)
+					for (d = 0; d < request_q_len_num; d++) {
+						if (kthread_should_stop())
+							goto out;
+						bench_run(hid, device_get_nameunit(dev),
+								&bench_algs[a], request_size[s],
+								request_q_len[d], ncpus, cpus);
+					}
+			}
+		}
+	}
+out:
+	bench_done = 1;
+	printk("OCF: benchmark done, %d runs\n", bench_nresults);
+
+	/* keep the results until we are stopped */
+	while (!kthread_should_stop()) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!kthread_should_stop())
+			schedule();
+		set_current_state(TASK_RUNNING);
+	}
+	return 0;
 }
 
-/*************************************************************************/
-#endif /* BENCH_IXP_ACCESS_LIB */
-/*************************************************************************/
+static void
+ocfbench_free(void)
+{
+	int i;
+
+	if (ocfbench_dir)
+		debugfs_remove_recursive(ocfbench_dir);
+	ocfbench_dir = NULL;
+	if (requests) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,22)
+		flush_scheduled_work();
+#endif
+		for (i = 0; i < request_max_q_len; i++) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,22)
+			cancel_work_sync(&requests[i].work);
+#endif
+			kfree(requests[i].buffer);
+		}
+		kfree(requests);
+		requests = NULL;
+	}
+	kfree(bench_results);
+	bench_results = NULL;
+	kfree(ocfbench_cpus);
+	ocfbench_cpus = NULL;
+}
 
 int
 ocfbench_init(void)
 {
-	int i;
-	unsigned long mbps;
-	unsigned long flags;
+	int i, ncpus, ndrivers, nalgs;
+	unsigned long cpu;
+	device_t dev;
 
 	printk("Crypto Speed tests\n");
 
-	requests = kmalloc(sizeof(request_t) * request_q_len, GFP_KERNEL);
-	if (!requests) {
-		printk("malloc failed\n");
+	request_max_q_len = request_max_size = 0;
+	for (i = 0; i < request_q_len_num; i++) {
+		if (request_q_len[i] <= 0) {
+			printk("request_q_len must be positive\n");
+			return -EINVAL;
+		}
+		if (request_q_len[i] > request_max_q_len)
+			request_max_q_len = request_q_len[i];
+	}
+	for (i = 0; i < request_size_num; i++) {
+		if (request_size[i] <= 0 ||
+				request_size[i] > CRYPTO_MAX_DATA_LEN - BENCH_MAC_LEN) {
+			printk("request_size must be between 1 and %d\n",
+					CRYPTO_MAX_DATA_LEN - BENCH_MAC_LEN);
+			return -EINVAL;
+		}
+		if (request_size[i] > request_max_size)
+			request_max_size = request_size[i];
+	}
+
+	/* one result per selected driver and algorithm the thread will run */
+	ndrivers = nalgs = 0;
+	for (i = 0; i < BENCH_MAX_DRIVERS; i++) {
+		dev = crypto_find_device_byhid(i);
+		if (dev != NULL && bench_selected(request_drivers,
+				request_drivers_num, device_get_nameunit(dev)))
+			ndrivers++;
+	}
+	for (i = 0; i < BENCH_NALGS; i++)
+		if (bench_selected(request_algs, request_algs_num,
+				bench_algs[i].name))
+			nalgs++;
+	if (ndrivers == 0 || nalgs == 0) {
+		printk("no driver or algorithm selected\n");
 		return -EINVAL;
 	}
+	bench_maxresults = ndrivers * nalgs * request_size_num *
+			request_q_len_num * request_cpus_num;
+	bench_results = kmalloc(sizeof(*bench_results) * bench_maxresults,
+			GFP_KERNEL);
+	requests = kmalloc(sizeof(request_t) * request_max_q_len, GFP_KERNEL);
+	if (!bench_results || !requests) {
+		printk("malloc failed\n");
+		goto bad;
+	}
+	memset(requests, 0, sizeof(request_t) * request_max_q_len);
 
-	for (i = 0; i < request_q_len; i++) {
-		/* +64 for return data */
+	for (i = 0; i < request_max_q_len; i++) {
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
 		INIT_WORK(&requests[i].work, ocf_request_wq);
 #else
 		INIT_WORK(&requests[i].work, ocf_request, &requests[i]);
 #endif
-		requests[i].buffer = kmalloc(request_size + 128, GFP_DMA);
+		requests[i].buffer = kmalloc(request_max_size + 128, GFP_KERNEL);
 		if (!requests[i].buffer) {
 			printk("malloc failed\n");
-			return -EINVAL;
+			goto bad;
 		}
-		memset(requests[i].buffer, '0' + i, request_size + 128);
+		memset(requests[i].buffer, '0' + i, request_max_size + 128);
 	}
 
-	/*
-	 * OCF benchmark
-	 */
-	printk("OCF: testing ...\n");
-	if (ocf_init() == -1)
-		return -EINVAL;
+	ncpus = 0;
+	for_each_online_cpu(cpu)
+		ncpus++;
+	ocfbench_cpus = kmalloc(sizeof(int) * (ncpus + 1), GFP_KERNEL);
+	if (!ocfbench_cpus) {
+		printk("malloc failed\n");
+		goto bad;
+	}
+	i = 0;
+	for_each_online_cpu(cpu)
+		if (i < ncpus)
+			ocfbench_cpus[i++] = cpu;
+	ocfbench_cpus[i] = -1;
 
 	spin_lock_init(&ocfbench_counter_lock);
-	total = outstanding = 0;
-	jstart = jiffies;
-	for (i = 0; i < request_q_len; i++) {
-		spin_lock_irqsave(&ocfbench_counter_lock, flags);
-		outstanding++;
-		spin_unlock_irqrestore(&ocfbench_counter_lock, flags);
-		ocf_request(&requests[i]);
-	}
-	while (outstanding > 0)
-		schedule();
-	jstop = jiffies;
-
-	mbps = 0;
-	if (jstop > jstart) {
-		mbps = (unsigned long) total * (unsigned long) request_size * 8;
-		mbps /= ((jstop - jstart) * 1000) / HZ;
-	}
-	printk("OCF: %d requests of %d bytes in %d jiffies (%d.%03d Mbps)\n",
-			total, request_size, (int)(jstop - jstart),
-			((int)mbps) / 1000, ((int)mbps) % 1000);
-	ocf_done();
+	ocfbench_stop = 0;
+	bench_nresults = bench_done = 0;
 
-#ifdef BENCH_IXP_ACCESS_LIB
-	/*
-	 * IXP benchmark
-	 */
-	printk("IXP: testing ...\n");
-	ixp_init();
-	total = outstanding = 0;
-	jstart = jiffies;
-	for (i = 0; i < request_q_len; i++) {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
-		INIT_WORK(&requests[i].work, ixp_request_wq);
-#else
-		INIT_WORK(&requests[i].work, ixp_request, &requests[i]);
-#endif
-		spin_lock_irqsave(&ocfbench_counter_lock, flags);
-		outstanding++;
-		spin_unlock_irqrestore(&ocfbench_counter_lock, flags);
-		ixp_request(&requests[i]);
-	}
-	while (outstanding > 0)
-		schedule();
-	jstop = jiffies;
-
-	mbps = 0;
-	if (jstop > jstart) {
-		mbps = (unsigned long) total * (unsigned long) request_size * 8;
-		mbps /= ((jstop - jstart) * 1000) / HZ;
+	ocfbench_dir = debugfs_create_dir("ocf-bench", NULL);
+	if (IS_ERR(ocfbench_dir))
+		ocfbench_dir = NULL;
+	if (ocfbench_dir)
+		debugfs_create_file("results", 0444, ocfbench_dir, NULL, &bench_fops);
+
+	printk("OCF: testing ...\n");
+	ocfbench_task = kthread_run(bench_thread, NULL, "ocf-bench");
+	if (IS_ERR(ocfbench_task)) {
+		printk("cannot start benchmark thread\n");
+		goto bad;
 	}
-	printk("IXP: %d requests of %d bytes in %d jiffies (%d.%03d Mbps)\n",
-			total, request_size, jstop - jstart,
-			((int)mbps) / 1000, ((int)mbps) % 1000);
-	ixp_done();
-#endif /* BENCH_IXP_ACCESS_LIB */
-
-	for (i = 0; i < request_q_len; i++)
-		kfree(requests[i].buffer);
-	kfree(requests);
-	return -EINVAL; /* always fail to load so it can be re-run quickly ;-) */
+	return 0;
+
+bad:
+	ocfbench_free();
+	return -ENOMEM;
 }
 
 static void __exit ocfbench_exit(void)
 {
+	/* end the run in progress, then the thread */
+	ocfbench_stop = 1;
+	kthread_stop(ocfbench_task);
+	ocfbench_free();
 }
 
 module_init(ocfbench_init);
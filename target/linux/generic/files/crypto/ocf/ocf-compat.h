@@ -309,6 +309,10 @@ static inline void *sg_virt(struct scatterlist *sg)
 #define ocf_for_each_cpu(cpu) for_each_present_cpu(cpu)
 #endif
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,16)
+#define for_each_possible_cpu(cpu) for_each_cpu(cpu)
+#endif
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,27)
 #include <linux/sched.h>
 #define	kill_proc(p,s,v)	send_sig(s,find_task_by_vpid(p),0)
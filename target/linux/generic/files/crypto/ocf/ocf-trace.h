@@ -0,0 +1,56 @@
+/*
+ * Tracepoints for OCF requests, seen under events/ocf in the tracing
+ * directory.  A request can be followed from dispatch to done by its
+ * crp pointer.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ocf
+
+#if !defined(_OCF_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _OCF_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(ocf_dispatch,
+	TP_PROTO(struct cryptop *crp),
+	TP_ARGS(crp),
+	TP_STRUCT__entry(
+		__field(void *, crp)
+		__field(u64, sid)
+		__field(int, ilen)
+		__field(int, flags)
+	),
+	TP_fast_assign(
+		__entry->crp = crp;
+		__entry->sid = crp->crp_sid;
+		__entry->ilen = crp->crp_ilen;
+		__entry->flags = crp->crp_flags;
+	),
+	TP_printk("crp=%p sid=%016llx len=%d flags=0x%x", __entry->crp,
+		(unsigned long long) __entry->sid, __entry->ilen, __entry->flags)
+);
+
+TRACE_EVENT(ocf_done,
+	TP_PROTO(struct cryptop *crp),
+	TP_ARGS(crp),
+	TP_STRUCT__entry(
+		__field(void *, crp)
+		__field(u64, sid)
+		__field(int, etype)
+	),
+	TP_fast_assign(
+		__entry->crp = crp;
+		__entry->sid = crp->crp_sid;
+		__entry->etype = crp->crp_etype;
+	),
+	TP_printk("crp=%p sid=%016llx error=%d", __entry->crp,
+		(unsigned long long) __entry->sid, __entry->etype)
+);
+
+#endif /* _OCF_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ocf-trace
+#include <trace/define_trace.h>
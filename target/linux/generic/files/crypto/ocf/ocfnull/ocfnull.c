@@ -170,7 +170,7 @@ null_init(void)
 	softc_device_init(&nulldev, "ocfnull", 0, null_methods);
 
 	null_id = crypto_get_driverid(softc_get_device(&nulldev),
-				CRYPTOCAP_F_HARDWARE);
+				CRYPTOCAP_F_HARDWARE | CRYPTOCAP_F_SG);
 	if (null_id < 0)
 		panic("ocfnull: crypto device cannot initialize!");
 
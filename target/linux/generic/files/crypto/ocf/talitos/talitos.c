@@ -139,6 +139,9 @@
 
 #define read_random(p,l) get_random_bytes(p,l)
 
+/* completions handed to ocf at once, a channel fifo holds up to 24 */
+#define TALITOS_DONE_BATCH	32
+
 const char talitos_driver_name[] = "Talitos OCF";
 const char talitos_driver_version[] = "0.2";
 
@@ -945,19 +948,25 @@ static void talitos_errorprocessing(struct talitos_softc *sc)
 /* go through all channels descriptors, notifying OCF what's been done */
 static void talitos_doneprocessing(struct talitos_softc *sc)
 {
+	struct cryptop *done[TALITOS_DONE_BATCH];
 	unsigned long flags;
-	int i, j;
+	int i, j, n;
 
 	/* go through descriptors looking for done bits */
 	for (i = 0; i < sc->sc_num_channels; i++) {
+		n = 0;
 		spin_lock_irqsave(&sc->sc_chnfifolock[i], flags);
 		for (j = 0; j < sc->sc_chfifo_len; j++) {
 			/* descriptor has done bits set? */
 			if ((sc->sc_chnfifo[i][j].cf_desc.hdr 
 				& TALITOS_HDR_DONE_BITS) 
 				== TALITOS_HDR_DONE_BITS) {
-				/* notify ocf */
-				crypto_done(sc->sc_chnfifo[i][j].cf_crp);
+				/* collect it, ocf is notified per channel */
+				if (n == TALITOS_DONE_BATCH) {
+					crypto_done_batch(done, n);
+					n = 0;
+				}
+				done[n++] = sc->sc_chnfifo[i][j].cf_crp;
 				/* and tag it available again
 				 *
 				 * memset to ensure correct descriptor formation by
@@ -969,6 +978,8 @@ static void talitos_doneprocessing(struct talitos_softc *sc)
 			}
 		}
 		spin_unlock_irqrestore(&sc->sc_chnfifolock[i], flags);
+		/* notify ocf of the whole burst */
+		crypto_done_batch(done, n);
 	}
 	return;
 }
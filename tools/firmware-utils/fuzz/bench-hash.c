@@ -0,0 +1,234 @@
+/*
+ * Throughput of the shared crc32, sha1 and md5 code against the byte at a
+ * time versions the tools used before
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * Usage: bench-hash [<MiB>]
+ *
+ * Hashes a buffer of random data (64 MiB by default) with both versions,
+ * prints the best of a few runs and fails if their results differ.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+/* for Transform() and sha1_process(), which the old code called directly */
+#include "../src/md5.c"
+/* both define their round functions as F() */
+#undef F
+#include "../src/sha1.c"
+
+#include "crc32.h"
+
+#define RUNS	3
+
+static uint32_t old_le_tab[256];
+static uint32_t old_be_tab[256];
+
+static void old_crc32_init(void)
+{
+	uint32_t le, be;
+	int n, k;
+
+	for (n = 0; n < 256; n++) {
+		le = n;
+		be = (uint32_t) n << 24;
+		for (k = 0; k < 8; k++) {
+			le = (le & 1) ? (le >> 1) ^ 0xedb88320 : le >> 1;
+			be = (be & 0x80000000) ? (be << 1) ^ 0x04c11db7 : be << 1;
+		}
+		old_le_tab[n] = le;
+		old_be_tab[n] = be;
+	}
+}
+
+static uint32_t old_crc32_le(uint32_t crc, const uint8_t *p, size_t len)
+{
+	while (len--)
+		crc = old_le_tab[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+static uint32_t old_crc32_be(uint32_t crc, const uint8_t *p, size_t len)
+{
+	while (len--)
+		crc = old_be_tab[(crc >> 24) ^ *p++] ^ (crc << 8);
+
+	return crc;
+}
+
+/*
+ * MD5_Update as it was, copying the input into the context byte by byte.
+ * Only used on a fresh context with whole blocks.
+ */
+static void old_md5_update(MD5_CTX *ctx, const uint8_t *p, size_t len)
+{
+	UINT4 in[16];
+	unsigned int i, ii;
+	int mdi = 0;
+
+	while (len--) {
+		ctx->in[mdi++] = *p++;
+		if (mdi == 0x40) {
+			for (i = 0, ii = 0; i < 16; i++, ii += 4)
+				in[i] = (((UINT4) ctx->in[ii + 3]) << 24) |
+					(((UINT4) ctx->in[ii + 2]) << 16) |
+					(((UINT4) ctx->in[ii + 1]) << 8) |
+					((UINT4) ctx->in[ii]);
+			Transform(ctx->buf, in);
+			mdi = 0;
+		}
+	}
+}
+
+/* sha1_update as it was, one sha1_process() call per block */
+static void old_sha1_update(sha1_context *ctx, uint8_t *p, size_t len)
+{
+	for (; len >= 64; p += 64, len -= 64)
+		sha1_process(ctx, p);
+}
+
+/*
+ * Each hash function returns a 32 bit summary of its result, which is
+ * all that is needed to tell whether both versions agree.
+ */
+typedef uint32_t (*hash_fn)(uint8_t *buf, size_t len);
+
+static uint32_t old_le(uint8_t *buf, size_t len)
+{
+	return old_crc32_le(~0, buf, len);
+}
+
+static uint32_t new_le(uint8_t *buf, size_t len)
+{
+	return crc32_le(~0, buf, len);
+}
+
+static uint32_t old_be(uint8_t *buf, size_t len)
+{
+	return old_crc32_be(~0, buf, len);
+}
+
+static uint32_t new_be(uint8_t *buf, size_t len)
+{
+	return crc32_be(~0, buf, len);
+}
+
+static uint32_t old_sha1(uint8_t *buf, size_t len)
+{
+	sha1_context ctx;
+
+	sha1_starts(&ctx);
+	old_sha1_update(&ctx, buf, len);
+	return ctx.state[0] ^ ctx.state[4];
+}
+
+static uint32_t new_sha1(uint8_t *buf, size_t len)
+{
+	sha1_context ctx;
+
+	sha1_starts(&ctx);
+	sha1_update(&ctx, buf, len);
+	return ctx.state[0] ^ ctx.state[4];
+}
+
+static uint32_t old_md5(uint8_t *buf, size_t len)
+{
+	MD5_CTX ctx;
+
+	MD5_Init(&ctx);
+	old_md5_update(&ctx, buf, len);
+	return ctx.buf[0] ^ ctx.buf[3];
+}
+
+static uint32_t new_md5(uint8_t *buf, size_t len)
+{
+	MD5_CTX ctx;
+
+	MD5_Init(&ctx);
+	MD5_Update(&ctx, buf, len);
+	return ctx.buf[0] ^ ctx.buf[3];
+}
+
+static const struct {
+	const char *name;
+	hash_fn old, new;
+} hashes[] = {
+	{ "crc32 (reflected)", old_le, new_le },
+	{ "crc32 (MSB-first)", old_be, new_be },
+	{ "sha1", old_sha1, new_sha1 },
+	{ "md5", old_md5, new_md5 },
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* best throughput in MB/s of RUNS runs */
+static double run(hash_fn fn, uint8_t *buf, size_t len, uint32_t *res)
+{
+	double start, t, best = 0;
+	int i;
+
+	for (i = 0; i < RUNS; i++) {
+		start = now();
+		*res = fn(buf, len);
+		t = now() - start;
+		if (!i || t < best)
+			best = t;
+	}
+
+	return best > 0 ? len / best / 1e6 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t old_res, new_res;
+	double old_mbs, new_mbs;
+	int ret = EXIT_SUCCESS;
+	uint8_t *buf;
+	size_t len, i;
+
+	len = (size_t) (argc > 1 ? atoi(argv[1]) : 64) << 20;
+	if (!len) {
+		fprintf(stderr, "Usage: %s [<MiB>]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	buf = malloc(len);
+	if (!buf) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+
+	srand(1);
+	for (i = 0; i < len; i++)
+		buf[i] = rand();
+
+	old_crc32_init();
+
+	for (i = 0; i < sizeof(hashes) / sizeof(hashes[0]); i++) {
+		old_mbs = run(hashes[i].old, buf, len, &old_res);
+		new_mbs = run(hashes[i].new, buf, len, &new_res);
+		printf("%-20s %8.1f MB/s -> %8.1f MB/s%s\n", hashes[i].name,
+		       old_mbs, new_mbs,
+		       old_res == new_res ? "" : "  MISMATCH");
+		if (old_res != new_res)
+			ret = EXIT_FAILURE;
+	}
+
+	free(buf);
+
+	return ret;
+}
@@ -0,0 +1,17 @@
+/*
+ * Fuzz target for the firmware inspection of mktplinkfw2 (-i)
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ */
+
+#define main mktplinkfw2_main
+#include "../src/mktplinkfw2.c"
+#undef main
+
+#include "fuzz.h"
+
+#define FUZZ_PROGNAME	"mktplinkfw2"
+#include "fuzz-tplink.h"
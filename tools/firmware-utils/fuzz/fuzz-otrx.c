@@ -0,0 +1,29 @@
+/*
+ * Fuzz target for otrx check and extract
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ */
+
+#define main otrx_main
+#include OTRX_SRC
+#undef main
+
+#include "fuzz.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	char *name = (char *) fuzz_file(data, size);
+	char *check[] = { "otrx", "check", name, NULL };
+	char *extract[] = {
+		"otrx", "extract", name,
+		"-1", "/dev/null", "-2", "/dev/null", "-3", "/dev/null", NULL
+	};
+
+	otrx_check(3, check);
+	otrx_extract(9, extract);
+
+	return 0;
+}
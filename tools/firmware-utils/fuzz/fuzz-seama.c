@@ -0,0 +1,30 @@
+/*
+ * Fuzz target for the verification (-d) and extraction (-x) of seama
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ */
+
+/* makes seama.c call its main() seama_main() */
+#define RGBIN_BOX
+#include "../src/seama.c"
+
+#include "fuzz.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	const char *name = fuzz_file(data, size);
+
+	o_images[0] = (char *) name;
+	o_isize = 1;
+	/* the images of the seed corpus carry this */
+	o_meta[0] = "dev=fuzz";
+	o_msize = 1;
+
+	dump_seama(name);
+	extract_file("/dev/null");
+
+	return 0;
+}
@@ -0,0 +1,32 @@
+/*
+ * Fuzz target body shared by mktplinkfw and mktplinkfw2: inspect the
+ * input with -i -x, removing what -x extracted afterwards.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ */
+
+static void fuzz_unlink(const char *name, const char *suffix)
+{
+	char path[256];
+
+	snprintf(path, sizeof(path), "%s%s", name, suffix);
+	unlink(path);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	progname = FUZZ_PROGNAME;
+	inspect_info.file_name = (char *) fuzz_file(data, size);
+	inspect_info.file_size = size;
+	extract = 1;
+
+	inspect_fw();
+
+	fuzz_unlink(inspect_info.file_name, "-kernel");
+	fuzz_unlink(inspect_info.file_name, "-rootfs");
+
+	return 0;
+}
@@ -0,0 +1,204 @@
+/*
+ * Common code for the firmware-utils fuzz targets
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * Without FUZZ_LIBFUZZER this also provides a main() that runs the target
+ * once on each file given, or on stdin when there are none, which is what
+ * AFL and crash reproduction need. With -b <n> it instead runs every file
+ * n times and prints how long the target took per file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+#include "fuzz.h"
+
+static char fuzz_path[] = "/tmp/fuzz-fwutils.XXXXXX";
+static int fuzz_fd = -1;
+
+static void fuzz_cleanup(void)
+{
+	if (fuzz_fd >= 0)
+		unlink(fuzz_path);
+}
+
+const char *fuzz_file(const uint8_t *data, size_t size)
+{
+	ssize_t ret;
+	size_t ofs;
+
+	if (fuzz_fd < 0) {
+		fuzz_fd = mkstemp(fuzz_path);
+		if (fuzz_fd < 0) {
+			perror("mkstemp");
+			abort();
+		}
+		atexit(fuzz_cleanup);
+	}
+
+	if (ftruncate(fuzz_fd, 0)) {
+		perror("ftruncate");
+		abort();
+	}
+
+	for (ofs = 0; ofs < size; ofs += ret) {
+		ret = pwrite(fuzz_fd, data + ofs, size - ofs, ofs);
+		if (ret <= 0) {
+			perror("pwrite");
+			abort();
+		}
+	}
+
+	return fuzz_path;
+}
+
+/*
+ * The tools are chatty, drop their output unless FUZZ_VERBOSE is set.
+ * libFuzzer reports on stderr, use -close_fd_mask=2 to drop it there.
+ */
+int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+	if (!getenv("FUZZ_VERBOSE") && !freopen("/dev/null", "w", stdout))
+		perror("/dev/null");
+
+	return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+
+struct input {
+	const char *name;
+	uint8_t *data;
+	size_t size;
+};
+
+static int read_input(FILE *f, struct input *in)
+{
+	size_t len, alloc = 0;
+
+	in->data = NULL;
+	in->size = 0;
+	do {
+		if (in->size == alloc) {
+			alloc = alloc ? alloc * 2 : 65536;
+			in->data = realloc(in->data, alloc);
+			if (!in->data)
+				return -1;
+		}
+		len = fread(in->data + in->size, 1, alloc - in->size, f);
+		in->size += len;
+	} while (len);
+
+	return ferror(f) ? -1 : 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(FILE *out, struct input *in, int num, int rounds)
+{
+	double start, t, total = 0;
+	size_t bytes = 0;
+	int i, j;
+
+	for (i = 0; i < num; i++) {
+		start = now();
+		for (j = 0; j < rounds; j++)
+			LLVMFuzzerTestOneInput(in[i].data, in[i].size);
+		t = now() - start;
+
+		fprintf(out, "%10.1f us %8.1f MB/s  %s\n",
+			t / rounds * 1e6,
+			t > 0 ? in[i].size * (double) rounds / t / 1e6 : 0,
+			in[i].name);
+		total += t;
+		bytes += in[i].size;
+	}
+
+	fprintf(out, "%10.1f us %8.1f MB/s  total for %d inputs\n",
+		total / rounds * 1e6,
+		total > 0 ? bytes * (double) rounds / total / 1e6 : 0, num);
+}
+
+int main(int argc, char **argv)
+{
+	struct input *in;
+	FILE *report;
+	int rounds = 0;
+	int i, num = 0;
+	FILE *f;
+	int c;
+
+	while ((c = getopt(argc, argv, "b:")) != -1) {
+		switch (c) {
+		case 'b':
+			rounds = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-b <rounds>] [<file>...]\n",
+				argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	LLVMFuzzerInitialize(&argc, &argv);
+
+	in = calloc(argc - optind + 1, sizeof(*in));
+	if (!in)
+		return EXIT_FAILURE;
+
+	if (optind == argc) {
+		in[num].name = "-";
+		if (read_input(stdin, &in[num++]))
+			return EXIT_FAILURE;
+	}
+
+	for (i = optind; i < argc; i++) {
+		f = fopen(argv[i], "r");
+		if (!f) {
+			fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+			return EXIT_FAILURE;
+		}
+		in[num].name = argv[i];
+		if (read_input(f, &in[num++])) {
+			fprintf(stderr, "%s: read error\n", argv[i]);
+			return EXIT_FAILURE;
+		}
+		fclose(f);
+	}
+
+	if (rounds > 0) {
+		/* keep the timings apart from the error messages of the tools */
+		report = stderr;
+		if (!getenv("FUZZ_VERBOSE")) {
+			report = fdopen(dup(2), "w");
+			if (!report || !freopen("/dev/null", "w", stderr))
+				return EXIT_FAILURE;
+		}
+		bench(report, in, num, rounds);
+	} else {
+		for (i = 0; i < num; i++)
+			LLVMFuzzerTestOneInput(in[i].data, in[i].size);
+	}
+
+	for (i = 0; i < num; i++)
+		free(in[i].data);
+	free(in);
+
+	return EXIT_SUCCESS;
+}
+
+#endif /* FUZZ_LIBFUZZER */
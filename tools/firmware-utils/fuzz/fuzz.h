@@ -0,0 +1,25 @@
+/*
+ * Common code for the firmware-utils fuzz targets
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ */
+
+#ifndef _FUZZ_H
+#define _FUZZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* entry point of every target, as called by libFuzzer */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+/*
+ * The tools only parse files given by name. Store data in a scratch file
+ * and return its name, the same file is reused for every input.
+ */
+const char *fuzz_file(const uint8_t *data, size_t size);
+
+#endif /* _FUZZ_H */
@@ -0,0 +1,76 @@
+#!/usr/bin/env bash
+#
+# Generate a seed corpus for the firmware-utils fuzz targets
+#
+#   gen-corpus.sh <tool dir> <corpus dir>
+#
+# Builds one or more valid images with each tool in <tool dir> and
+# derives corrupted ones from them: truncated copies and copies with one
+# 32 bit word of the header inverted. The images end up in <corpus dir>/<target>.
+
+set -e
+
+tools="$1"
+corpus="$2"
+
+[ -n "$tools" -a -n "$corpus" ] || {
+	echo "Usage: $0 <tool dir> <corpus dir>" >&2
+	exit 1
+}
+
+mkdir -p "$corpus"
+tools=$(cd "$tools" && pwd)
+corpus=$(cd "$corpus" && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+# payloads small enough to keep each run of a target short
+head -c 8192 /dev/zero | tr '\0' 'k' > "$work/kernel"
+head -c 12288 /dev/zero | tr '\0' 'r' > "$work/rootfs"
+
+flip() {
+	local in="$1" out="$2" ofs="$3" byte i
+
+	cp "$in" "$out"
+	for i in $(seq "$ofs" $((ofs + 3))); do
+		byte=$(od -An -tu1 -j"$i" -N1 "$in")
+		[ -n "$byte" ] || return 0
+		printf "\\$(printf %o $((byte ^ 0xff)))" |
+			dd of="$out" bs=1 seek="$i" conv=notrunc 2>/dev/null
+	done
+}
+
+# <target> <header bytes to corrupt> <valid image>...
+variants() {
+	local target="$1" hdr="$2" img name size ofs
+	shift 2
+
+	mkdir -p "$corpus/$target"
+	for img in "$@"; do
+		name="$corpus/$target/$(basename "$img")"
+		size=$(stat -c %s "$img")
+		cp "$img" "$name"
+		head -c 16 "$img" > "$name-short"
+		head -c "$hdr" "$img" > "$name-hdr"
+		head -c $((size / 2)) "$img" > "$name-half"
+		for ofs in $(seq 0 4 $((hdr - 4))); do
+			flip "$img" "$name-flip$ofs" "$ofs"
+		done
+	done
+}
+
+cd "$work"
+
+"$tools/mktplinkfw" -B TL-WR741NDv1 -k kernel -r rootfs -s -o tplink >/dev/null
+"$tools/mktplinkfw" -B TL-WR741NDv1 -c -k kernel -s -o tplink-combined >/dev/null
+variants mktplinkfw 256 tplink tplink-combined
+
+"$tools/mktplinkfw2" -B ArcherC20i -k kernel -r rootfs -s -o tplink2 >/dev/null
+variants mktplinkfw2 256 tplink2
+
+"$tools/seama" -i kernel -m dev=fuzz -m type=firmware >/dev/null
+"$tools/seama" -s sealed -m signature=fuzz -i kernel.seama >/dev/null
+variants seama 64 kernel.seama sealed
+
+"$tools/otrx" create trx -f kernel -f rootfs >/dev/null
+variants otrx 28 trx
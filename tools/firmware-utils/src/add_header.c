@@ -35,33 +35,11 @@
 #include <string.h>
 #include <netinet/in.h>
 #include <inttypes.h>
-
-#define BPB 8 /* bits/byte */
-
-static uint32_t crc32[1<<BPB];
-
-static void init_crc32()
-{
-	const uint32_t poly = ntohl(0x2083b8ed);
-	int n;
-
-	for (n = 0; n < 1<<BPB; n++) {
-		uint32_t crc = n;
-		int bit;
-
-		for (bit = 0; bit < BPB; bit++)
-			crc = (crc & 1) ? (poly ^ (crc >> 1)) : (crc >> 1);
-		crc32[n] = crc;
-	}
-}
+#include "crc32.h"
 
 static uint32_t crc32buf(unsigned char *buf, size_t len)
 {
-	uint32_t crc = 0xFFFFFFFF;
-
-	for (; len; len--, buf++)
-		crc = crc32[(uint8_t)crc ^ *buf] ^ (crc >> BPB);
-	return ~crc;
+	return ~crc32_le(0xFFFFFFFF, buf, len);
 }
 
 struct header {
@@ -105,8 +83,6 @@ int main(int argc, char **argv)
 
 	buflen = len + sizeof(header);
 
-	init_crc32();
-
 	// copy model name into header
 	strncpy(header.model, argv[1], sizeof(header.model));
 	header.crc = 0;
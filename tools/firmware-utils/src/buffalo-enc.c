@@ -11,6 +11,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <unistd.h>     /* for unlink() */
 #include <libgen.h>
 #include <getopt.h>     /* for getopt() */
 #include <stdarg.h>
@@ -61,7 +62,7 @@ static int decrypt_file(void)
 {
 	struct enc_param ep;
 	ssize_t src_len;
-	unsigned char *buf = NULL;
+	FILE *in, *out;
 	int err;
 	int ret = -1;
 
@@ -71,26 +72,26 @@ static int decrypt_file(void)
 		goto out;
 	}
 
-	buf = malloc(src_len);
-	if (buf == NULL) {
-		ERR("no memory for the buffer");
+	in = fopen(ifname, "r");
+	if (in == NULL) {
+		ERR("unable to read from file '%s'", ifname);
 		goto out;
 	}
 
-	err = read_file_to_buf(ifname, buf, src_len);
-	if (err) {
-		ERR("unable to read from file '%s'", ifname);
-		goto out;
+	out = fopen(ofname, "w");
+	if (out == NULL) {
+		ERR("unable to write to file '%s'", ofname);
+		goto close_in;
 	}
 
 	memset(&ep, '\0', sizeof(ep));
 	ep.key = (unsigned char *) crypt_key;
 	ep.longstate = longstate;
 
-	err = decrypt_buf(&ep, buf, src_len);
+	err = decrypt_stream(&ep, in, out, src_len);
 	if (err) {
 		ERR("unable to decrypt '%s'", ifname);
-		goto out;
+		goto close_out;
 	}
 
 	printf("Magic\t\t: '%s'\n", ep.magic);
@@ -100,16 +101,18 @@ static int decrypt_file(void)
 	printf("Data len\t: %u\n", ep.datalen);
 	printf("Checksum\t: 0x%08x\n", ep.csum);
 
-	err = write_buf_to_file(ofname, buf, ep.datalen);
-	if (err) {
-		ERR("unable to write to file '%s'", ofname);
-		goto out;
-	}
-
 	ret = 0;
 
+close_out:
+	if (fclose(out) && !ret) {
+		ERR("unable to write to file '%s'", ofname);
+		ret = -1;
+	}
+	if (ret)
+		unlink(ofname);
+close_in:
+	fclose(in);
 out:
-	free(buf);
 	return ret;
 }
 
@@ -117,9 +120,7 @@ static int encrypt_file(void)
 {
 	struct enc_param ep;
 	ssize_t src_len;
-	unsigned char *buf;
-	uint32_t hdrlen;
-	ssize_t totlen = 0;
+	FILE *in, *out;
 	int err;
 	int ret = -1;
 
@@ -129,49 +130,46 @@ static int encrypt_file(void)
 		goto out;
 	}
 
-	totlen = enc_compute_buf_len(product, version, src_len);
-	hdrlen = enc_compute_header_len(product, version);
-
-	buf = malloc(totlen);
-	if (buf == NULL) {
-		ERR("no memory for the buffer");
+	in = fopen(ifname, "r");
+	if (in == NULL) {
+		ERR("unable to read from file '%s'", ifname);
 		goto out;
 	}
 
-	err = read_file_to_buf(ifname, &buf[hdrlen], src_len);
-	if (err) {
-		ERR("unable to read from file '%s'", ofname);
-		goto free_buf;
+	out = fopen(ofname, "w");
+	if (out == NULL) {
+		ERR("unable to write to file '%s'", ofname);
+		goto close_in;
 	}
 
 	memset(&ep, '\0', sizeof(ep));
 	ep.key = (unsigned char *) crypt_key;
 	ep.seed = seed;
 	ep.longstate = longstate;
-	ep.csum = buffalo_csum(src_len, &buf[hdrlen], src_len);
 	ep.datalen = src_len;
 	strcpy((char *) ep.magic, magic);
 	strcpy((char *) ep.product, product);
 	strcpy((char *) ep.version, version);
 
-	err = encrypt_buf(&ep, buf, &buf[hdrlen]);
-	if (err) {
-		ERR("invalid input file");
-		goto free_buf;
-	}
-
-	err = write_buf_to_file(ofname, buf, totlen);
+	err = encrypt_stream(&ep, in, out);
 	if (err) {
-		ERR("unable to write to file '%s'", ofname);
-		goto free_buf;
+		ERR("unable to encrypt '%s' to '%s'", ifname, ofname);
+		goto close_out;
 	}
 
 	ret = 0;
 
-free_buf:
- 	free(buf);
+close_out:
+	if (fclose(out) && !ret) {
+		ERR("unable to write to file '%s'", ofname);
+		ret = -1;
+	}
+	if (ret)
+		unlink(ofname);
+close_in:
+	fclose(in);
 out:
- 	return ret;
+	return ret;
 }
 
 static int check_params(void)
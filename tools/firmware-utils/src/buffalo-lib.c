@@ -15,74 +15,7 @@
 #include <sys/stat.h>
 
 #include "buffalo-lib.h"
-
-static uint32_t crc32_table[256] =
-{
-	0x00000000, 0x04c11db7, 0x09823b6e, 0x0d4326d9,
-	0x130476dc, 0x17c56b6b, 0x1a864db2, 0x1e475005,
-	0x2608edb8, 0x22c9f00f, 0x2f8ad6d6, 0x2b4bcb61,
-	0x350c9b64, 0x31cd86d3, 0x3c8ea00a, 0x384fbdbd,
-	0x4c11db70, 0x48d0c6c7, 0x4593e01e, 0x4152fda9,
-	0x5f15adac, 0x5bd4b01b, 0x569796c2, 0x52568b75,
-	0x6a1936c8, 0x6ed82b7f, 0x639b0da6, 0x675a1011,
-	0x791d4014, 0x7ddc5da3, 0x709f7b7a, 0x745e66cd,
-	0x9823b6e0, 0x9ce2ab57, 0x91a18d8e, 0x95609039,
-	0x8b27c03c, 0x8fe6dd8b, 0x82a5fb52, 0x8664e6e5,
-	0xbe2b5b58, 0xbaea46ef, 0xb7a96036, 0xb3687d81,
-	0xad2f2d84, 0xa9ee3033, 0xa4ad16ea, 0xa06c0b5d,
-	0xd4326d90, 0xd0f37027, 0xddb056fe, 0xd9714b49,
-	0xc7361b4c, 0xc3f706fb, 0xceb42022, 0xca753d95,
-	0xf23a8028, 0xf6fb9d9f, 0xfbb8bb46, 0xff79a6f1,
-	0xe13ef6f4, 0xe5ffeb43, 0xe8bccd9a, 0xec7dd02d,
-	0x34867077, 0x30476dc0, 0x3d044b19, 0x39c556ae,
-	0x278206ab, 0x23431b1c, 0x2e003dc5, 0x2ac12072,
-	0x128e9dcf, 0x164f8078, 0x1b0ca6a1, 0x1fcdbb16,
-	0x018aeb13, 0x054bf6a4, 0x0808d07d, 0x0cc9cdca,
-	0x7897ab07, 0x7c56b6b0, 0x71159069, 0x75d48dde,
-	0x6b93dddb, 0x6f52c06c, 0x6211e6b5, 0x66d0fb02,
-	0x5e9f46bf, 0x5a5e5b08, 0x571d7dd1, 0x53dc6066,
-	0x4d9b3063, 0x495a2dd4, 0x44190b0d, 0x40d816ba,
-	0xaca5c697, 0xa864db20, 0xa527fdf9, 0xa1e6e04e,
-	0xbfa1b04b, 0xbb60adfc, 0xb6238b25, 0xb2e29692,
-	0x8aad2b2f, 0x8e6c3698, 0x832f1041, 0x87ee0df6,
-	0x99a95df3, 0x9d684044, 0x902b669d, 0x94ea7b2a,
-	0xe0b41de7, 0xe4750050, 0xe9362689, 0xedf73b3e,
-	0xf3b06b3b, 0xf771768c, 0xfa325055, 0xfef34de2,
-	0xc6bcf05f, 0xc27dede8, 0xcf3ecb31, 0xcbffd686,
-	0xd5b88683, 0xd1799b34, 0xdc3abded, 0xd8fba05a,
-	0x690ce0ee, 0x6dcdfd59, 0x608edb80, 0x644fc637,
-	0x7a089632, 0x7ec98b85, 0x738aad5c, 0x774bb0eb,
-	0x4f040d56, 0x4bc510e1, 0x46863638, 0x42472b8f,
-	0x5c007b8a, 0x58c1663d, 0x558240e4, 0x51435d53,
-	0x251d3b9e, 0x21dc2629, 0x2c9f00f0, 0x285e1d47,
-	0x36194d42, 0x32d850f5, 0x3f9b762c, 0x3b5a6b9b,
-	0x0315d626, 0x07d4cb91, 0x0a97ed48, 0x0e56f0ff,
-	0x1011a0fa, 0x14d0bd4d, 0x19939b94, 0x1d528623,
-	0xf12f560e, 0xf5ee4bb9, 0xf8ad6d60, 0xfc6c70d7,
-	0xe22b20d2, 0xe6ea3d65, 0xeba91bbc, 0xef68060b,
-	0xd727bbb6, 0xd3e6a601, 0xdea580d8, 0xda649d6f,
-	0xc423cd6a, 0xc0e2d0dd, 0xcda1f604, 0xc960ebb3,
-	0xbd3e8d7e, 0xb9ff90c9, 0xb4bcb610, 0xb07daba7,
-	0xae3afba2, 0xaafbe615, 0xa7b8c0cc, 0xa379dd7b,
-	0x9b3660c6, 0x9ff77d71, 0x92b45ba8, 0x9675461f,
-	0x8832161a, 0x8cf30bad, 0x81b02d74, 0x857130c3,
-	0x5d8a9099, 0x594b8d2e, 0x5408abf7, 0x50c9b640,
-	0x4e8ee645, 0x4a4ffbf2, 0x470cdd2b, 0x43cdc09c,
-	0x7b827d21, 0x7f436096, 0x7200464f, 0x76c15bf8,
-	0x68860bfd, 0x6c47164a, 0x61043093, 0x65c52d24,
-	0x119b4be9, 0x155a565e, 0x18197087, 0x1cd86d30,
-	0x029f3d35, 0x065e2082, 0x0b1d065b, 0x0fdc1bec,
-	0x3793a651, 0x3352bbe6, 0x3e119d3f, 0x3ad08088,
-	0x2497d08d, 0x2056cd3a, 0x2d15ebe3, 0x29d4f654,
-	0xc5a92679, 0xc1683bce, 0xcc2b1d17, 0xc8ea00a0,
-	0xd6ad50a5, 0xd26c4d12, 0xdf2f6bcb, 0xdbee767c,
-	0xe3a1cbc1, 0xe760d676, 0xea23f0af, 0xeee2ed18,
-	0xf0a5bd1d, 0xf464a0aa, 0xf9278673, 0xfde69bc4,
-	0x89b8fd09, 0x8d79e0be, 0x803ac667, 0x84fbdbd0,
-	0x9abc8bd5, 0x9e7d9662, 0x933eb0bb, 0x97ffad0c,
-	0xafb010b1, 0xab710d06, 0xa6322bdf, 0xa2f33668,
-	0xbcb4666d, 0xb8757bda, 0xb5365d03, 0xb1f740b4
-};
+#include "crc32.h"
 
 int bcrypt_init(struct bcrypt_ctx *ctx, void *key, int keylen,
 		unsigned long state_len)
@@ -127,6 +60,41 @@ int bcrypt_process(struct bcrypt_ctx *ctx, unsigned char *src,
 	i = ctx->i;
 	j = ctx->j;
 
+	/*
+	 * i and j are bytes, so with the default state length the modulo is
+	 * just their wrap around, and a state longer than 510 bytes is never
+	 * wrapped at all. Only other lengths need the divisions.
+	 */
+	if (state_len == 256) {
+		for (k = 0; k < len; k++) {
+			unsigned char t;
+
+			i++;
+			j += state[i];
+			t = state[j];
+			state[j] = state[i];
+			state[i] = t;
+
+			dst[k] = src[k] ^ state[(unsigned char) (state[i] + state[j])];
+		}
+		goto out;
+	}
+
+	if (state_len > 510) {
+		for (k = 0; k < len; k++) {
+			unsigned char t;
+
+			i++;
+			j += state[i];
+			t = state[j];
+			state[j] = state[i];
+			state[i] = t;
+
+			dst[k] = src[k] ^ state[state[i] + state[j]];
+		}
+		goto out;
+	}
+
 	for (k = 0; k < len; k++) {
 		unsigned char t;
 
@@ -139,6 +107,7 @@ int bcrypt_process(struct bcrypt_ctx *ctx, unsigned char *src,
 		dst[k] = src[k] ^ state[(state[i] + state[j]) % state_len];
 	}
 
+out:
 	ctx->i = i;
 	ctx->j = j;
 
@@ -151,13 +120,12 @@ void bcrypt_finish(struct bcrypt_ctx *ctx)
 		free(ctx->state);
 }
 
-int bcrypt_buf(unsigned char seed, unsigned char *key, unsigned char *src,
-	       unsigned char *dst, unsigned long len, int longstate)
+static int bcrypt_init_seed(struct bcrypt_ctx *ctx, unsigned char seed,
+			    unsigned char *key, unsigned long len,
+			    int longstate)
 {
 	unsigned char bckey[BCRYPT_MAX_KEYLEN + 1];
 	unsigned int keylen;
-	struct bcrypt_ctx ctx;
-	int ret;
 
 	/* setup decryption key */
 	keylen = strlen((char *) key);
@@ -166,8 +134,17 @@ int bcrypt_buf(unsigned char seed, unsigned char *key, unsigned char *src,
 
 	keylen++;
 
-	ret = bcrypt_init(&ctx, bckey, keylen,
-			  (longstate) ? len : BCRYPT_DEFAULT_STATE_LEN);
+	return bcrypt_init(ctx, bckey, keylen,
+			   (longstate) ? len : BCRYPT_DEFAULT_STATE_LEN);
+}
+
+int bcrypt_buf(unsigned char seed, unsigned char *key, unsigned char *src,
+	       unsigned char *dst, unsigned long len, int longstate)
+{
+	struct bcrypt_ctx ctx;
+	int ret;
+
+	ret = bcrypt_init_seed(&ctx, seed, key, len, longstate);
 	if (ret)
 		return ret;
 
@@ -179,14 +156,26 @@ int bcrypt_buf(unsigned char seed, unsigned char *key, unsigned char *src,
 
 uint32_t buffalo_csum(uint32_t csum, void *buf, unsigned long len)
 {
+	static uint32_t table[256];
 	char *p = buf;
 
-	while (len--) {
-		int i;
+	/* eight shifts of the register at once */
+	if (!table[1]) {
+		uint32_t c;
+		int i, j;
+
+		for (i = 0; i < 256; i++) {
+			c = i;
+			for (j = 0; j < 8; j++)
+				c = (c >> 1) ^ ((c & 1) ? 0xedb88320ul : 0);
+			table[i] = c;
+		}
+	}
 
+	/* bytes are XORed in as plain char, sign extension included */
+	while (len--) {
 		csum ^= *p++;
-		for (i = 0; i < 8; i++)
-			csum = (csum >> 1) ^ ((csum & 1) ? 0xedb88320ul : 0);
+		csum = (csum >> 8) ^ table[csum & 0xff];
 	}
 
 	return csum;
@@ -194,17 +183,10 @@ uint32_t buffalo_csum(uint32_t csum, void *buf, unsigned long len)
 
 uint32_t buffalo_crc(void *buf, unsigned long len)
 {
-	unsigned char *p = buf;
-	unsigned long t = len;
-	uint32_t crc = 0;
-
-	while (len--)
-		crc = (crc << 8) ^ crc32_table[((crc >> 24) ^ *p++) & 0xFF];
+	uint32_t crc;
 
-	while (t) {
-		crc = (crc << 8) ^ crc32_table[((crc >> 24) ^ t) & 0xFF];
-		t >>= 8;
-	}
+	crc = crc32_be(0, buf, len);
+	crc = crc32_be_length(crc, len);
 
 	return ~crc;
 }
@@ -258,13 +240,13 @@ static int check_magic(void *magic)
 	return -1;
 }
 
-int encrypt_buf(struct enc_param *ep, unsigned char *hdr,
-		unsigned char *data)
+/* put the header, *seed is set to the seed of the data */
+static int enc_put_header(struct enc_param *ep, unsigned char *hdr,
+			  unsigned char *seed)
 {
 	unsigned char *p;
 	uint32_t len;
 	int err;
-	int ret = -1;
 	unsigned char s;
 
 	p = (unsigned char *) hdr;
@@ -286,7 +268,7 @@ int encrypt_buf(struct enc_param *ep, unsigned char *hdr,
 	memcpy(p, ep->product, len);
 	err = bcrypt_buf(ep->seed, ep->key, p, p, len, ep->longstate);
 	if (err)
-		goto out;
+		return -1;
 	s = *p;
 	p += len;
 
@@ -299,36 +281,96 @@ int encrypt_buf(struct enc_param *ep, unsigned char *hdr,
 	memcpy(p, ep->version, len);
 	err = bcrypt_buf(s, ep->key, p, p, len, ep->longstate);
 	if (err)
-		goto out;
-	s = *p;
+		return -1;
+	*seed = *p;
 	p += len;
 
 	/* put data length */
 	put_be32(p, ep->datalen);
+	p += sizeof(uint32_t);
 
-	/* encrypt data */
-	err = bcrypt_buf(s, ep->key, data, data, ep->datalen, ep->longstate);
-	if (err)
-		goto out;
+	return p - hdr;
+}
+
+/*
+ * Encrypt ep->datalen bytes from in to out. The data is read once, each
+ * block is checksummed, encrypted and written before the next one is read.
+ */
+int encrypt_stream(struct enc_param *ep, FILE *in, FILE *out)
+{
+	unsigned char hdr[ENC_MAGIC_LEN + 1 + ENC_PRODUCT_LEN +
+			  ENC_VERSION_LEN + 3 * sizeof(uint32_t)];
+	unsigned char trailer[2 * sizeof(uint32_t)];
+	unsigned char *buf;
+	struct bcrypt_ctx ctx;
+	unsigned long remain, totlen;
+	size_t len;
+	unsigned char s;
+	int hdrlen;
+	int ret = -1;
+
+	hdrlen = enc_put_header(ep, hdr, &s);
+	if (hdrlen < 0)
+		return -1;
+
+	buf = malloc(BUFFALO_BLOCK_SIZE);
+	if (buf == NULL)
+		return -1;
+
+	if (bcrypt_init_seed(&ctx, s, ep->key, ep->datalen, ep->longstate))
+		goto free_buf;
+
+	if (fwrite(hdr, hdrlen, 1, out) != 1)
+		goto finish;
+
+	ep->csum = ep->datalen;
+	for (remain = ep->datalen; remain; remain -= len) {
+		len = remain < BUFFALO_BLOCK_SIZE ? remain : BUFFALO_BLOCK_SIZE;
+		if (fread(buf, len, 1, in) != 1)
+			goto finish;
+
+		ep->csum = buffalo_csum(ep->csum, buf, len);
+		bcrypt_process(&ctx, buf, buf, len);
+
+		if (fwrite(buf, len, 1, out) != 1)
+			goto finish;
+	}
 
-	/* put checksum */
-	put_be32(&data[ep->datalen], ep->csum);
+	/* put checksum, followed by the padding */
+	totlen = enc_compute_buf_len((char *) ep->product,
+				     (char *) ep->version, ep->datalen);
+	len = totlen - hdrlen - ep->datalen;
+	memset(trailer, 0, sizeof(trailer));
+	put_be32(trailer, ep->csum);
+	if (fwrite(trailer, len, 1, out) != 1)
+		goto finish;
 
 	ret = 0;
 
-out:
+finish:
+	bcrypt_finish(&ctx);
+free_buf:
+	free(buf);
 	return ret;
 }
 
-int decrypt_buf(struct enc_param *ep, unsigned char *data,
-		unsigned long datalen)
+/*
+ * Decrypt the image of datalen bytes in in, and write the data to out.
+ * The data is written before its checksum has been verified, the caller
+ * has to throw the output away if this fails.
+ */
+int decrypt_stream(struct enc_param *ep, FILE *in, FILE *out,
+		   unsigned long datalen)
 {
-	unsigned char *p;
+	unsigned char tmp[sizeof(uint32_t)];
+	unsigned char *buf = NULL;
+	struct bcrypt_ctx ctx;
 	uint32_t prod_len;
 	uint32_t ver_len;
 	uint32_t len;
 	uint32_t csum;
-	ssize_t remain;
+	unsigned long remain;
+	unsigned long n;
 	int err;
 	int ret = -1;
 
@@ -339,62 +381,80 @@ int decrypt_buf(struct enc_param *ep, unsigned char *data,
 	}				\
 } while (0)
 
-#define INCP() do {			\
-	p += len;			\
+#define READP(_p) do {			\
+	if (fread((_p), len, 1, in) != 1)	\
+		goto out;		\
 	remain -= len;			\
 } while (0)
 
 	remain = datalen;
-	p = data;
 
 	CHECKLEN(ENC_MAGIC_LEN);
-	err = check_magic(p);
+	READP(ep->magic);
+	err = check_magic(ep->magic);
 	if (err)
 		goto out;
-	memcpy(ep->magic, p, ENC_MAGIC_LEN);
-	INCP();
 
 	CHECKLEN(1);
-	ep->seed = *p;
-	INCP();
+	READP(&ep->seed);
 
 	CHECKLEN(sizeof(uint32_t));
-	prod_len = get_be32(p);
+	READP(tmp);
+	prod_len = get_be32(tmp);
 	if (prod_len > ENC_PRODUCT_LEN)
 		goto out;
-	INCP();
 
 	CHECKLEN(prod_len);
-	memcpy(ep->product, p, prod_len);
-	INCP();
+	READP(ep->product);
 
 	CHECKLEN(sizeof(uint32_t));
-	ver_len = get_be32(p);
+	READP(tmp);
+	ver_len = get_be32(tmp);
 	if (ver_len > ENC_VERSION_LEN)
 		goto out;
-	INCP();
 
 	CHECKLEN(ver_len);
-	memcpy(ep->version, p, ver_len);
-	INCP();
+	READP(ep->version);
 
 	CHECKLEN(sizeof(uint32_t));
-	ep->datalen = get_be32(p);
-	INCP();
+	READP(tmp);
+	ep->datalen = get_be32(tmp);
 
 	/* decrypt data */
 	CHECKLEN(ep->datalen);
-	err = bcrypt_buf(ep->version[0], ep->key, p, data, ep->datalen,
-			 ep->longstate);
+	buf = malloc(BUFFALO_BLOCK_SIZE);
+	if (buf == NULL)
+		goto out;
+
+	err = bcrypt_init_seed(&ctx, ep->version[0], ep->key, ep->datalen,
+			       ep->longstate);
 	if (err)
 		goto out;
-	INCP();
+
+	csum = ep->datalen;
+	for (n = 0; n < ep->datalen; n += len) {
+		len = ep->datalen - n;
+		if (len > BUFFALO_BLOCK_SIZE)
+			len = BUFFALO_BLOCK_SIZE;
+
+		if (fread(buf, len, 1, in) != 1)
+			break;
+
+		bcrypt_process(&ctx, buf, buf, len);
+		csum = buffalo_csum(csum, buf, len);
+
+		if (fwrite(buf, len, 1, out) != 1)
+			break;
+	}
+	bcrypt_finish(&ctx);
+	if (n < ep->datalen)
+		goto out;
+	remain -= n;
 
 	CHECKLEN(sizeof(uint32_t));
-	ep->csum = get_be32(p);
-	INCP();
+	READP(tmp);
+	ep->csum = get_be32(tmp);
 
-	csum = buffalo_csum(ep->datalen, data, ep->datalen);
 	if (csum != ep->csum)
 		goto out;
 
@@ -412,10 +472,11 @@ int decrypt_buf(struct enc_param *ep, unsigned char *data,
 
 	ret = 0;
 out:
+	free(buf);
 	return ret;
 
 #undef CHECKLEN
-#undef INCP
+#undef READP
 }
 
 ssize_t get_file_size(char *name)
@@ -10,6 +10,7 @@
 #ifndef _BUFFALO_LIB_H
 #define _BUFFALO_LIB_H
 
+#include <stdio.h>
 #include <stdint.h>
 
 #define ARRAY_SIZE(_a)	(sizeof((_a)) / sizeof((_a)[0]))
@@ -73,6 +74,8 @@ struct buffalo_tag2 {
 #define ENC_VERSION_LEN		8
 #define ENC_MAGIC_LEN		6
 
+#define BUFFALO_BLOCK_SIZE	(64 * 1024)
+
 unsigned long enc_compute_header_len(char *product, char *version);
 unsigned long enc_compute_buf_len(char *product, char *version,
 				  unsigned long datalen);
@@ -88,10 +91,9 @@ struct enc_param {
 	uint32_t csum;
 };
 
-int encrypt_buf(struct enc_param *ep, unsigned char *hdr,
-	        unsigned char *data);
-int decrypt_buf(struct enc_param *ep, unsigned char *data,
-		unsigned long datalen);
+int encrypt_stream(struct enc_param *ep, FILE *in, FILE *out);
+int decrypt_stream(struct enc_param *ep, FILE *in, FILE *out,
+		   unsigned long datalen);
 
 #define BCRYPT_DEFAULT_STATE_LEN	256
 #define BCRYPT_MAX_KEYLEN		254
@@ -13,9 +13,11 @@
 #include <string.h>
 #include <libgen.h>
 #include <getopt.h>     /* for getopt() */
+#include <unistd.h>     /* for unlink() */
 #include <netinet/in.h>
 
 #include "buffalo-lib.h"
+#include "crc32.h"
 
 #define ERR(fmt, ...) do { \
 	fflush(0); \
@@ -187,9 +189,6 @@ static void fixup_tag(unsigned char *buf, ssize_t buflen)
 		memcpy(tag->hwv, "hwv", 3);
 		memcpy(tag->hwv_val, hwver, strlen(hwver));
 	}
-
-	if (!skipcrc)
-		tag->crc = htonl(buffalo_crc(buf, buflen));
 }
 
 static void fixup_tag2(unsigned char *buf, ssize_t buflen)
@@ -222,17 +221,51 @@ static void fixup_tag2(unsigned char *buf, ssize_t buflen)
 		memcpy(tag->hwv, "hwv", 3);
 		memcpy(tag->hwv_val, hwver, strlen(hwver));
 	}
+}
+
+/* append the file to out, updating the CRC of the image */
+static int copy_file(char *name, ssize_t len, unsigned char *buf, FILE *out,
+		     uint32_t *crc)
+{
+	FILE *f;
+	size_t n;
+	int ret = -1;
+
+	f = fopen(name, "r");
+	if (f == NULL)
+		goto out;
+
+	while (len) {
+		n = len < BUFFALO_BLOCK_SIZE ? len : BUFFALO_BLOCK_SIZE;
+		if (fread(buf, n, 1, f) != 1)
+			goto close;
+
+		*crc = crc32_be(*crc, buf, n);
+		if (fwrite(buf, n, 1, out) != 1)
+			goto close;
 
-	if (!skipcrc)
-		tag->crc = htonl(buffalo_crc(buf, buflen));
+		len -= n;
+	}
+
+	ret = 0;
+
+close:
+	fclose(f);
+out:
+	return ret;
 }
 
 static int tag_file(void)
 {
+	union {
+		struct buffalo_tag tag;
+		struct buffalo_tag2 tag2;
+	} hdr;
 	unsigned char *buf;
-	ssize_t offset;
 	ssize_t hdrlen;
 	ssize_t buflen;
+	uint32_t crc;
+	FILE *out;
 	int err;
 	int ret = -1;
 	int i;
@@ -253,36 +286,61 @@ static int tag_file(void)
 		buflen += fsize[i];
 	}
 
-	buf = malloc(buflen);
+	buf = malloc(BUFFALO_BLOCK_SIZE);
 	if (!buf) {
 		ERR("no memory for buffer\n");
 		goto out;
 	}
 
-	offset = hdrlen;
-	for (i = 0; i < num_files; i++) {
-		err = read_file_to_buf(ifname[i], buf + offset, fsize[i]);
-		if (err) {
-			ERR("unable to read from file '%s'", ifname[i]);
-			goto free_buf;
-		}
-
-		offset += fsize[i];
-	}
-
+	/* all fields but the CRC are known from the file sizes */
 	if (num_files == 1)
-		fixup_tag(buf, buflen);
+		fixup_tag((unsigned char *) &hdr, buflen);
 	else
-		fixup_tag2(buf, buflen);
+		fixup_tag2((unsigned char *) &hdr, buflen);
 
-	err = write_buf_to_file(ofname, buf, buflen);
-	if (err) {
+	out = fopen(ofname, "w");
+	if (out == NULL) {
 		ERR("unable to write to file '%s'", ofname);
 		goto free_buf;
 	}
 
+	if (fwrite(&hdr, hdrlen, 1, out) != 1) {
+		ERR("unable to write to file '%s'", ofname);
+		goto close_out;
+	}
+
+	crc = crc32_be(0, &hdr, hdrlen);
+	for (i = 0; i < num_files; i++) {
+		err = copy_file(ifname[i], fsize[i], buf, out, &crc);
+		if (err) {
+			ERR("unable to copy '%s' to '%s'", ifname[i], ofname);
+			goto close_out;
+		}
+	}
+
+	if (!skipcrc) {
+		crc = ~crc32_be_length(crc, buflen);
+		if (num_files == 1)
+			hdr.tag.crc = htonl(crc);
+		else
+			hdr.tag2.crc = htonl(crc);
+
+		if (fseek(out, 0, SEEK_SET) ||
+		    fwrite(&hdr, hdrlen, 1, out) != 1) {
+			ERR("unable to write to file '%s'", ofname);
+			goto close_out;
+		}
+	}
+
 	ret = 0;
 
+close_out:
+	if (fclose(out) && !ret) {
+		ERR("unable to write to file '%s'", ofname);
+		ret = -1;
+	}
+	if (ret)
+		unlink(ofname);
 free_buf:
 	free(buf);
 out:
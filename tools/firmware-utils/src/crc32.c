@@ -0,0 +1,294 @@
+/*
+ * Shared CRC32 routines for the firmware utilities
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ * The generic code uses slicing-by-8 tables. On x86 hosts with PCLMULQDQ
+ * the reflected CRC is computed by carry-less multiplication folding, on
+ * ARMv8 hosts built with the CRC extension by the CRC32 instructions.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define CRC32_PCLMUL 1
+#endif
+
+#ifdef __ARM_FEATURE_CRC32
+#include <arm_acle.h>
+#endif
+
+#include "crc32.h"
+
+#define CRC32_POLY_LE	0xedb88320
+#define CRC32_POLY_BE	0x04c11db7
+
+static uint32_t crc32_le_tab[8][256];
+static uint32_t crc32_be_tab[8][256];
+static uint32_t (*crc32_le_impl)(uint32_t crc, const uint8_t *p, size_t len);
+
+static inline uint32_t load_le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static inline uint32_t load_be32(const uint8_t *p)
+{
+	return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static uint32_t crc32_le_generic(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint32_t w1, w2;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		w1 = load_le32(p) ^ crc;
+		w2 = load_le32(p + 4);
+		crc = crc32_le_tab[7][w1 & 0xff] ^
+		      crc32_le_tab[6][(w1 >> 8) & 0xff] ^
+		      crc32_le_tab[5][(w1 >> 16) & 0xff] ^
+		      crc32_le_tab[4][w1 >> 24] ^
+		      crc32_le_tab[3][w2 & 0xff] ^
+		      crc32_le_tab[2][(w2 >> 8) & 0xff] ^
+		      crc32_le_tab[1][(w2 >> 16) & 0xff] ^
+		      crc32_le_tab[0][w2 >> 24];
+	}
+
+	while (len--)
+		crc = crc32_le_tab[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+#ifdef __ARM_FEATURE_CRC32
+static uint32_t crc32_le_armv8(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint64_t d;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&d, p, 8);
+		crc = __crc32d(crc, d);
+	}
+
+	while (len--)
+		crc = __crc32b(crc, *p++);
+
+	return crc;
+}
+#endif
+
+#ifdef CRC32_PCLMUL
+/*
+ * Folding with carry-less multiplication, see Intel's "Fast CRC
+ * Computation for Generic Polynomials Using PCLMULQDQ Instruction".
+ * Handles len >= 64, a multiple of 16.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_le_fold(uint32_t crc, const uint8_t *p, size_t len)
+{
+	const __m128i k1k2 = _mm_set_epi64x(0x1c6e41596ULL, 0x154442bd4ULL);
+	const __m128i k3k4 = _mm_set_epi64x(0x0ccaa009eULL, 0x1751997d0ULL);
+	const __m128i k5 = _mm_set_epi64x(0, 0x163cd6124ULL);
+	const __m128i poly = _mm_set_epi64x(0x1f7011641ULL, 0x1db710641ULL);
+	const __m128i mask32 = _mm_set_epi32(0, 0, 0, ~0);
+	__m128i x1, x2, x3, x4, t1, t2, t3, t4;
+
+	x1 = _mm_loadu_si128((const __m128i *) p);
+	x2 = _mm_loadu_si128((const __m128i *) (p + 16));
+	x3 = _mm_loadu_si128((const __m128i *) (p + 32));
+	x4 = _mm_loadu_si128((const __m128i *) (p + 48));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	p += 64;
+	len -= 64;
+
+	for (; len >= 64; p += 64, len -= 64) {
+		t1 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+		t2 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+		t3 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+		t4 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, t1),
+				   _mm_loadu_si128((const __m128i *) p));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, t2),
+				   _mm_loadu_si128((const __m128i *) (p + 16)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, t3),
+				   _mm_loadu_si128((const __m128i *) (p + 32)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, t4),
+				   _mm_loadu_si128((const __m128i *) (p + 48)));
+	}
+
+	t1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, t1), x2);
+	t1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, t1), x3);
+	t1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, t1), x4);
+
+	for (; len >= 16; p += 16, len -= 16) {
+		t1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, t1),
+				   _mm_loadu_si128((const __m128i *) p));
+	}
+
+	/* 128 -> 64 bits */
+	t1 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), t1);
+
+	/* 64 -> 32 bits */
+	t1 = _mm_and_si128(x1, mask32);
+	x1 = _mm_srli_si128(x1, 4);
+	x1 = _mm_xor_si128(x1, _mm_clmulepi64_si128(t1, k5, 0x00));
+
+	/* Barrett reduction */
+	t1 = _mm_and_si128(x1, mask32);
+	t1 = _mm_clmulepi64_si128(t1, poly, 0x10);
+	t1 = _mm_and_si128(t1, mask32);
+	t1 = _mm_clmulepi64_si128(t1, poly, 0x00);
+	x1 = _mm_xor_si128(x1, t1);
+
+	return _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32_le_pclmul(uint32_t crc, const uint8_t *p, size_t len)
+{
+	size_t n;
+
+	if (len < 64)
+		return crc32_le_generic(crc, p, len);
+
+	n = len & ~(size_t) 15;
+	crc = crc32_le_fold(crc, p, n);
+
+	return crc32_le_generic(crc, p + n, len - n);
+}
+
+static int have_pclmul(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0;
+
+	return (ecx & bit_PCLMUL) && (ecx & bit_SSE4_1);
+}
+#endif
+
+__attribute__((constructor))
+static void crc32_init(void)
+{
+	uint32_t le, be;
+	int n, k;
+
+	for (n = 0; n < 256; n++) {
+		le = n;
+		be = (uint32_t) n << 24;
+		for (k = 0; k < 8; k++) {
+			le = (le & 1) ? (le >> 1) ^ CRC32_POLY_LE : le >> 1;
+			be = (be & 0x80000000) ? (be << 1) ^ CRC32_POLY_BE : be << 1;
+		}
+		crc32_le_tab[0][n] = le;
+		crc32_be_tab[0][n] = be;
+	}
+
+	for (n = 0; n < 256; n++) {
+		le = crc32_le_tab[0][n];
+		be = crc32_be_tab[0][n];
+		for (k = 1; k < 8; k++) {
+			le = crc32_le_tab[0][le & 0xff] ^ (le >> 8);
+			be = crc32_be_tab[0][be >> 24] ^ (be << 8);
+			crc32_le_tab[k][n] = le;
+			crc32_be_tab[k][n] = be;
+		}
+	}
+
+	crc32_le_impl = crc32_le_generic;
+#ifdef __ARM_FEATURE_CRC32
+	crc32_le_impl = crc32_le_armv8;
+#endif
+#ifdef CRC32_PCLMUL
+	if (have_pclmul())
+		crc32_le_impl = crc32_le_pclmul;
+#endif
+}
+
+uint32_t crc32_le(uint32_t crc, const void *buf, size_t len)
+{
+	return crc32_le_impl(crc, buf, len);
+}
+
+uint32_t crc32_be(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	uint32_t w1, w2;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		w1 = load_be32(p) ^ crc;
+		w2 = load_be32(p + 4);
+		crc = crc32_be_tab[7][w1 >> 24] ^
+		      crc32_be_tab[6][(w1 >> 16) & 0xff] ^
+		      crc32_be_tab[5][(w1 >> 8) & 0xff] ^
+		      crc32_be_tab[4][w1 & 0xff] ^
+		      crc32_be_tab[3][w2 >> 24] ^
+		      crc32_be_tab[2][(w2 >> 16) & 0xff] ^
+		      crc32_be_tab[1][(w2 >> 8) & 0xff] ^
+		      crc32_be_tab[0][w2 & 0xff];
+	}
+
+	while (len--)
+		crc = crc32_be_tab[0][(crc >> 24) ^ *p++] ^ (crc << 8);
+
+	return crc;
+}
+
+uint32_t crc32_be_length(uint32_t crc, uintmax_t len)
+{
+	for (; len; len >>= 8)
+		crc = crc32_be_tab[0][(crc >> 24) ^ (len & 0xff)] ^ (crc << 8);
+
+	return crc;
+}
+
+/* multiply a and b modulo the reflected CRC polynomial */
+static uint32_t multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m = 1U << 31, p = 0;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = (b & 1) ? (b >> 1) ^ CRC32_POLY_LE : b >> 1;
+	}
+
+	return p;
+}
+
+uint32_t crc32_le_combine(uint32_t crc1, uint32_t crc2, size_t len2)
+{
+	uint32_t p = 1U << 31;	/* x^0 */
+	uint32_t sq = 1U << 23;	/* x^8 */
+
+	while (len2) {
+		if (len2 & 1)
+			p = multmodp(sq, p);
+		sq = multmodp(sq, sq);
+		len2 >>= 1;
+	}
+
+	return multmodp(p, crc1) ^ crc2;
+}
@@ -0,0 +1,47 @@
+/*
+ * Shared CRC32 routines for the firmware utilities
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ */
+
+#ifndef _CRC32_H
+#define _CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Both functions work on the raw CRC register: no initial or final
+ * inversion is applied, callers do that according to the image format.
+ *
+ * crc32_le: reflected CRC32 (polynomial 0xedb88320), as used by zlib,
+ *           ethernet, trx and most vendor headers.
+ * crc32_be: MSB-first CRC32 (polynomial 0x04c11db7), as used by POSIX
+ *           cksum and the Buffalo/Titan style checksums.
+ */
+uint32_t crc32_le(uint32_t crc, const void *buf, size_t len);
+uint32_t crc32_be(uint32_t crc, const void *buf, size_t len);
+
+/*
+ * Feed the length to crc32_be the way POSIX cksum does: least significant
+ * byte first, without leading zero bytes.
+ */
+uint32_t crc32_be_length(uint32_t crc, uintmax_t len);
+
+/*
+ * Return the crc32_le of two concatenated blocks, given the CRC of the
+ * first block and the CRC of the second one computed with a start value
+ * of 0.
+ */
+uint32_t crc32_le_combine(uint32_t crc1, uint32_t crc2, size_t len2);
+
+/* The usual zlib compatible CRC32 */
+static inline uint32_t crc32_zlib(uint32_t crc, const void *buf, size_t len)
+{
+	return ~crc32_le(~crc, buf, len);
+}
+
+#endif /* _CRC32_H */
@@ -0,0 +1,368 @@
+/*
+ * Firmware image writer for the firmware utilities
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "fwimage.h"
+
+#define FILL_BUFSIZE	(64 * 1024)
+
+struct fwimage_seg {
+	size_t ofs;
+	size_t len;
+	const uint8_t *data;
+	int fd;			/* >= 0 for mapped files */
+};
+
+typedef int (*fwimage_emit_fn)(const struct fwimage_seg *seg, size_t seg_ofs,
+			       const uint8_t *buf, size_t pos, size_t len,
+			       void *priv);
+
+static uint8_t fill_buf[FILL_BUFSIZE];
+static int fill_byte = -1;
+
+void fwimage_init(struct fwimage *img, uint8_t fill)
+{
+	img->segs = NULL;
+	img->num_segs = 0;
+	img->fill = fill;
+}
+
+void fwimage_free(struct fwimage *img)
+{
+	struct fwimage_seg *seg;
+	int i;
+
+	for (i = 0; i < img->num_segs; i++) {
+		seg = &img->segs[i];
+		if (seg->fd < 0)
+			continue;
+
+		munmap((void *) seg->data, seg->len);
+		close(seg->fd);
+	}
+
+	free(img->segs);
+	img->segs = NULL;
+	img->num_segs = 0;
+}
+
+static int fwimage_add(struct fwimage *img, size_t ofs, const void *data,
+		       size_t len, int fd)
+{
+	struct fwimage_seg *segs;
+	int i;
+
+	for (i = 0; i < img->num_segs; i++) {
+		if (ofs < img->segs[i].ofs + img->segs[i].len &&
+		    img->segs[i].ofs < ofs + len) {
+			fprintf(stderr, "image segment at 0x%zx overlaps the one "
+				"at 0x%zx\n", ofs, img->segs[i].ofs);
+			return -1;
+		}
+	}
+
+	segs = realloc(img->segs, (img->num_segs + 1) * sizeof(*segs));
+	if (!segs) {
+		fprintf(stderr, "out of memory\n");
+		return -1;
+	}
+	img->segs = segs;
+
+	/* keep the segments sorted by offset */
+	for (i = img->num_segs; i > 0 && segs[i - 1].ofs > ofs; i--)
+		segs[i] = segs[i - 1];
+
+	segs[i].ofs = ofs;
+	segs[i].len = len;
+	segs[i].data = data;
+	segs[i].fd = fd;
+	img->num_segs++;
+
+	return 0;
+}
+
+int fwimage_add_data(struct fwimage *img, size_t ofs, const void *data,
+		     size_t len)
+{
+	if (!len)
+		return 0;
+
+	return fwimage_add(img, ofs, data, len, -1);
+}
+
+int fwimage_add_file(struct fwimage *img, size_t ofs, const char *name,
+		     size_t *len)
+{
+	struct stat st;
+	void *data;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "could not open \"%s\" for reading: %s\n",
+			name, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st)) {
+		fprintf(stderr, "stat failed on \"%s\": %s\n",
+			name, strerror(errno));
+		goto err;
+	}
+
+	if (len)
+		*len = st.st_size;
+
+	if (!st.st_size) {
+		close(fd);
+		return 0;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "could not map \"%s\": %s\n",
+			name, strerror(errno));
+		goto err;
+	}
+
+	if (fwimage_add(img, ofs, data, st.st_size, fd)) {
+		munmap(data, st.st_size);
+		goto err;
+	}
+
+	return 0;
+
+err:
+	close(fd);
+	return -1;
+}
+
+/*
+ * Call emit for the contents between pos and end, in order. Gaps are
+ * passed with seg == NULL and a buffer holding the fill byte.
+ */
+static int fwimage_walk(struct fwimage *img, size_t pos, size_t end,
+			fwimage_emit_fn emit, void *priv)
+{
+	const struct fwimage_seg *seg;
+	size_t next, len, seg_ofs;
+	int i = 0;
+
+	if (fill_byte != img->fill) {
+		memset(fill_buf, img->fill, sizeof(fill_buf));
+		fill_byte = img->fill;
+	}
+
+	while (pos < end) {
+		while (i < img->num_segs &&
+		       img->segs[i].ofs + img->segs[i].len <= pos)
+			i++;
+
+		seg = i < img->num_segs ? &img->segs[i] : NULL;
+		if (!seg || seg->ofs > pos) {
+			next = seg && seg->ofs < end ? seg->ofs : end;
+			len = next - pos;
+			if (len > FILL_BUFSIZE)
+				len = FILL_BUFSIZE;
+
+			if (emit(NULL, 0, fill_buf, pos, len, priv))
+				return -1;
+		} else {
+			seg_ofs = pos - seg->ofs;
+			len = seg->len - seg_ofs;
+			if (len > end - pos)
+				len = end - pos;
+
+			if (emit(seg, seg_ofs, seg->data + seg_ofs, pos, len, priv))
+				return -1;
+		}
+
+		pos += len;
+	}
+
+	return 0;
+}
+
+struct hash_priv {
+	fwimage_hash_fn update;
+	void *ctx;
+};
+
+static int hash_emit(const struct fwimage_seg *seg, size_t seg_ofs,
+		     const uint8_t *buf, size_t pos, size_t len, void *priv)
+{
+	struct hash_priv *h = priv;
+
+	h->update(h->ctx, buf, len);
+	return 0;
+}
+
+void fwimage_hash(struct fwimage *img, size_t ofs, size_t len,
+		  fwimage_hash_fn update, void *ctx)
+{
+	struct hash_priv h = { update, ctx };
+
+	fwimage_walk(img, ofs, ofs + len, hash_emit, &h);
+}
+
+static int write_buf(int fd, const uint8_t *buf, size_t pos, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = pwrite(fd, buf, len, pos);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+
+		buf += ret;
+		pos += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/* copy file data inside the kernel, 0 if this is not supported */
+static ssize_t copy_range(int fd_in, size_t ofs_in, int fd_out, size_t ofs_out,
+			  size_t len)
+{
+#if defined(__linux__) && defined(__NR_copy_file_range)
+	static int unsupported;
+	loff_t in = ofs_in, out = ofs_out;
+	ssize_t ret;
+
+	if (unsupported)
+		return 0;
+
+	ret = syscall(__NR_copy_file_range, fd_in, &in, fd_out, &out, len, 0);
+	if (ret < 0 && (errno == ENOSYS || errno == EXDEV ||
+			errno == EINVAL || errno == EOPNOTSUPP)) {
+		unsupported = 1;
+		return 0;
+	}
+
+	return ret;
+#else
+	return 0;
+#endif
+}
+
+static int write_emit(const struct fwimage_seg *seg, size_t seg_ofs,
+		      const uint8_t *buf, size_t pos, size_t len, void *priv)
+{
+	int fd = *(int *) priv;
+	ssize_t ret;
+
+	while (seg && seg->fd >= 0 && len) {
+		ret = copy_range(seg->fd, seg_ofs, fd, pos, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -1;
+		if (ret == 0)
+			break;
+
+		seg_ofs += ret;
+		buf += ret;
+		pos += ret;
+		len -= ret;
+	}
+
+	return write_buf(fd, buf, pos, len);
+}
+
+/* for outputs that can't seek, the image is walked in order */
+static int stream_emit(const struct fwimage_seg *seg, size_t seg_ofs,
+		       const uint8_t *buf, size_t pos, size_t len, void *priv)
+{
+	int fd = *(int *) priv;
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, buf, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+
+		buf += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+int fwimage_write(struct fwimage *img, const char *name, size_t len)
+{
+	char *tmp = NULL;
+	struct stat st;
+	mode_t mask;
+	int fd, ret;
+
+	/*
+	 * The output may be one of the mapped inputs, truncating it would
+	 * pull the data from under the mapping. Write a new file and rename
+	 * it over the old one, unless the output is a device or a pipe.
+	 */
+	if (!stat(name, &st) && !S_ISREG(st.st_mode)) {
+		fd = open(name, O_WRONLY | O_TRUNC);
+	} else {
+		tmp = malloc(strlen(name) + sizeof(".XXXXXX"));
+		if (!tmp) {
+			fprintf(stderr, "out of memory\n");
+			return -1;
+		}
+		sprintf(tmp, "%s.XXXXXX", name);
+		fd = mkstemp(tmp);
+		if (fd >= 0) {
+			mask = umask(0);
+			umask(mask);
+			fchmod(fd, 0666 & ~mask);
+		}
+	}
+	if (fd < 0) {
+		fprintf(stderr, "could not open \"%s\" for writing: %s\n",
+			name, strerror(errno));
+		free(tmp);
+		return -1;
+	}
+
+	if (!fstat(fd, &st) && !S_ISREG(st.st_mode))
+		ret = fwimage_walk(img, 0, len, stream_emit, &fd);
+	else
+		ret = fwimage_walk(img, 0, len, write_emit, &fd);
+	if (close(fd))
+		ret = -1;
+	if (!ret && tmp && rename(tmp, name))
+		ret = -1;
+
+	if (ret) {
+		fprintf(stderr, "unable to write \"%s\": %s\n",
+			name, strerror(errno));
+		if (tmp)
+			unlink(tmp);
+	}
+	free(tmp);
+
+	return ret;
+}
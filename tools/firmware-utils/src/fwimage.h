@@ -0,0 +1,55 @@
+/*
+ * Firmware image writer for the firmware utilities
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ *
+ */
+
+#ifndef _FWIMAGE_H
+#define _FWIMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * An image is described as a list of non-overlapping segments at fixed
+ * offsets. Gaps between segments read as the fill byte. Input files are
+ * mapped instead of being read into memory, and their contents are moved
+ * into the output with copy_file_range() where the kernel supports it, so
+ * building an image needs no memory proportional to its size.
+ */
+struct fwimage_seg;
+
+struct fwimage {
+	struct fwimage_seg *segs;
+	int num_segs;
+	uint8_t fill;
+};
+
+typedef void (*fwimage_hash_fn)(void *ctx, const void *buf, size_t len);
+
+void fwimage_init(struct fwimage *img, uint8_t fill);
+void fwimage_free(struct fwimage *img);
+
+/*
+ * The data is not copied: the buffer must stay valid until the image has
+ * been written, and changes to it are picked up by fwimage_hash() and
+ * fwimage_write(). This is how headers get their checksum filled in.
+ */
+int fwimage_add_data(struct fwimage *img, size_t ofs, const void *data,
+		     size_t len);
+
+/* Add the whole file. Its size is returned in *len if len is not NULL. */
+int fwimage_add_file(struct fwimage *img, size_t ofs, const char *name,
+		     size_t *len);
+
+/* Feed the image contents between ofs and ofs + len to a hash function */
+void fwimage_hash(struct fwimage *img, size_t ofs, size_t len,
+		  fwimage_hash_fn update, void *ctx);
+
+/* Write the first len bytes of the image to the file name */
+int fwimage_write(struct fwimage *img, const char *name, size_t len);
+
+#endif /* _FWIMAGE_H */
@@ -137,9 +137,27 @@ unsigned int inLen;
   mdContext->i[0] += ((UINT4)inLen << 3);
   mdContext->i[1] += ((UINT4)inLen >> 29);
 
-  while (inLen--) {
+  while (inLen) {
+    /* whole blocks are transformed straight from the input buffer */
+    if (mdi == 0 && inLen >= 64) {
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+      memcpy (in, inBuf, 64);
+#else
+      for (i = 0, ii = 0; i < 16; i++, ii += 4)
+        in[i] = (((UINT4)inBuf[ii+3]) << 24) |
+                (((UINT4)inBuf[ii+2]) << 16) |
+                (((UINT4)inBuf[ii+1]) << 8) |
+                ((UINT4)inBuf[ii]);
+#endif
+      Transform (mdContext->buf, in);
+      inBuf += 64;
+      inLen -= 64;
+      continue;
+    }
+
     /* add new character to buffer, increment mdi */
     mdContext->in[mdi++] = *inBuf++;
+    inLen--;
 
     /* transform if necessary */
     if (mdi == 0x40) {
@@ -24,12 +24,12 @@
 #include <string.h>
 #include <errno.h>
 #include <zlib.h>
-#include <sys/mman.h>
 #include <netinet/in.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
 #include "fw.h"
+#include "fwimage.h"
 
 typedef struct fw_layout_data {
 	char		name[PATH_MAX];
@@ -127,42 +127,41 @@ static void write_header(void* mem, const char *magic, const char* version)
 }
 
 
-static void write_signature(void* mem, u_int32_t sig_offset)
+static void crc_update(void *ctx, const void *buf, size_t len)
 {
+	uLong *crc = ctx;
+
+	*crc = crc32(*crc, buf, len);
+}
+
+static void write_signature(signature_t* sign, struct fwimage *img, u_int32_t sig_offset)
+{
+	uLong crc = 0L;
+
 	/* write signature */
-	signature_t* sign = (signature_t*)(mem + sig_offset);
 	memset(sign, 0, sizeof(signature_t));
 
+	fwimage_hash(img, 0, sig_offset, crc_update, &crc);
 	memcpy(sign->magic, MAGIC_END, MAGIC_LENGTH);
-	sign->crc = htonl(crc32(0L,(unsigned char *)mem, sig_offset));
+	sign->crc = htonl(crc);
 	sign->pad = 0L;
 }
 
-static int write_part(void* mem, part_data_t* d)
+static int write_part(struct fwimage *img, u_int32_t offset, part_t* p,
+		      part_crc_t* crc, part_data_t* d)
 {
-	char* addr;
-	int fd;
-	part_t* p = mem;
-	part_crc_t* crc = mem + sizeof(part_t) + d->stats.st_size;
+	uLong sum = 0L;
 
-	fd = open(d->filename, O_RDONLY);
-	if (fd < 0)
+	if (fwimage_add_data(img, offset, p, sizeof(part_t)) ||
+	    fwimage_add_file(img, offset + sizeof(part_t), d->filename, NULL) ||
+	    fwimage_add_data(img, offset + sizeof(part_t) + d->stats.st_size,
+			     crc, sizeof(part_crc_t)))
 	{
-		ERROR("Failed opening file '%s'\n", d->filename);
+		ERROR("Failed mapping file '%s'\n", d->filename);
 		return -1;
 	}
 
-	if ((addr=(char*)mmap(0, d->stats.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
-	{
-		ERROR("Failed mmaping memory for file '%s'\n", d->filename);
-		close(fd);
-		return -2;
-	}
-
-	memcpy(mem + sizeof(part_t), addr, d->stats.st_size);
-	munmap(addr, d->stats.st_size);
-
-	memset(p->name, 0, sizeof(p->name));
+	memset(p, 0, sizeof(part_t));
 	strncpy(p->magic, MAGIC_PART, MAGIC_LENGTH);
 	strncpy(p->name, d->partition_name, sizeof(p->name));
 	p->index = htonl(d->partition_index);
@@ -172,7 +171,9 @@ static int write_part(void* mem, part_data_t* d)
 	p->memaddr = htonl(d->partition_memaddr);
 	p->entryaddr = htonl(d->partition_entryaddr);
 
-	crc->crc = htonl(crc32(0L, mem, d->stats.st_size + sizeof(part_t)));
+	fwimage_hash(img, offset, d->stats.st_size + sizeof(part_t),
+		     crc_update, &sum);
+	crc->crc = htonl(sum);
 	crc->pad = 0L;
 
 	return 0;
@@ -319,61 +320,45 @@ static int validate_image_layout(image_info_t* im)
 
 static int build_image(image_info_t* im)
 {
-	char* mem;
-	char* ptr;
+	header_t header;
+	part_t parts[MAX_SECTIONS];
+	part_crc_t crcs[MAX_SECTIONS];
+	signature_t sign;
+	struct fwimage img;
 	u_int32_t mem_size;
-	FILE* f;
-	int i;
+	u_int32_t offset;
+	int i, rc = 0;
 
-	// build in-memory buffer
-	mem_size = sizeof(header_t) + sizeof(signature_t);
-	for (i = 0; i < im->part_count; ++i)
-	{
-		part_data_t* d = &im->parts[i];
-		mem_size += sizeof(part_t) + d->stats.st_size + sizeof(part_crc_t);
-	}
+	// describe the image, the part data is mapped from the input files
+	fwimage_init(&img, 0);
 
-	mem = (char*)calloc(mem_size, 1);
-	if (mem == NULL)
-	{
-		ERROR("Cannot allocate memory chunk of size '%u'\n", mem_size);
-		return -1;
-	}
-
-	// write header
-	write_header(mem, im->magic, im->version);
-	ptr = mem + sizeof(header_t);
+	write_header(&header, im->magic, im->version);
+	fwimage_add_data(&img, 0, &header, sizeof(header_t));
+	offset = sizeof(header_t);
 	// write all parts
 	for (i = 0; i < im->part_count; ++i)
 	{
 		part_data_t* d = &im->parts[i];
-		int rc;
-		if ((rc = write_part(ptr, d)) != 0)
+		if (write_part(&img, offset, &parts[i], &crcs[i], d) != 0)
 		{
 			ERROR("ERROR: failed writing part %u '%s'\n", i, d->partition_name);
 		}
-		ptr += sizeof(part_t) + d->stats.st_size + sizeof(part_crc_t);
+		offset += sizeof(part_t) + d->stats.st_size + sizeof(part_crc_t);
 	}
 	// write signature
-	write_signature(mem, mem_size - sizeof(signature_t));
+	mem_size = offset + sizeof(signature_t);
+	fwimage_add_data(&img, offset, &sign, sizeof(signature_t));
+	write_signature(&sign, &img, offset);
 
-	// write in-memory buffer into file
-	if ((f = fopen(im->outputfile, "w")) == NULL)
-	{
-		ERROR("Can not create output file: '%s'\n", im->outputfile);
-		return -10;
-	}
-
-	if (fwrite(mem, mem_size, 1, f) != 1)
+	if (fwimage_write(&img, im->outputfile, mem_size))
 	{
 		ERROR("Could not write %d bytes into file: '%s'\n",
 				mem_size, im->outputfile);
-		return -11;
+		rc = -11;
 	}
 
-	free(mem);
-	fclose(f);
-	return 0;
+	fwimage_free(&img);
+	return rc;
 }
 
 
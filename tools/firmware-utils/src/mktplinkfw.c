@@ -26,6 +26,7 @@
 #include <netinet/in.h>
 
 #include "md5.h"
+#include "fwimage.h"
 
 #define ALIGN(x,a) ({ typeof(a) __a = (a); (((x) + __a - 1) & ~(__a - 1)); })
 
@@ -719,9 +720,14 @@ static int check_options(void)
 	return 0;
 }
 
-static void fill_header(char *buf, int len)
+static void md5_update(void *ctx, const void *buf, size_t len)
 {
-	struct fw_header *hdr = (struct fw_header *)buf;
+	MD5_Update(ctx, buf, len);
+}
+
+static void fill_header(struct fw_header *hdr, struct fwimage *img, int len)
+{
+	MD5_CTX ctx;
 
 	memset(hdr, 0, sizeof(struct fw_header));
 
@@ -750,10 +756,13 @@ static void fill_header(char *buf, int len)
 	hdr->ver_mid = htons(fw_ver_mid);
 	hdr->ver_lo = htons(fw_ver_lo);
 
-	get_md5(buf, len, hdr->md5sum1);
+	/* the header is part of the image, the digest replaces the salt */
+	MD5_Init(&ctx);
+	fwimage_hash(img, 0, len, md5_update, &ctx);
+	MD5_Final(hdr->md5sum1, &ctx);
 }
 
-static int pad_jffs2(char *buf, int currlen)
+static int pad_jffs2(struct fwimage *img, int currlen)
 {
 	int len;
 	uint32_t pad_mask;
@@ -778,8 +787,9 @@ static int pad_jffs2(char *buf, int currlen)
 				pad_mask &= ~mask;
 		}
 
-		for (i = 0; i < sizeof(jffs2_eof_mark); i++)
-			buf[len + i] = jffs2_eof_mark[i];
+		if (fwimage_add_data(img, len, jffs2_eof_mark,
+				     sizeof(jffs2_eof_mark)))
+			return -1;
 
 		len += sizeof(jffs2_eof_mark);
 	}
@@ -787,94 +797,60 @@ static int pad_jffs2(char *buf, int currlen)
 	return len;
 }
 
-static int write_fw(char *data, int len)
-{
-	FILE *f;
-	int ret = EXIT_FAILURE;
-
-	f = fopen(ofname, "w");
-	if (f == NULL) {
-		ERRS("could not open \"%s\" for writing", ofname);
-		goto out;
-	}
-
-	errno = 0;
-	fwrite(data, len, 1, f);
-	if (errno) {
-		ERRS("unable to write output file");
-		goto out_flush;
-	}
-
-	DBG("firmware file \"%s\" completed", ofname);
-
-	ret = EXIT_SUCCESS;
-
- out_flush:
-	fflush(f);
-	fclose(f);
-	if (ret != EXIT_SUCCESS) {
-		unlink(ofname);
-	}
- out:
-	return ret;
-}
-
 static int build_fw(void)
 {
-	int buflen;
-	char *buf;
-	char *p;
+	struct fw_header hdr;
+	struct fwimage img;
 	int ret = EXIT_FAILURE;
 	int writelen = 0;
+	size_t ofs;
 
-	buflen = layout->fw_max_len;
+	/* the input files are mapped, the gaps read as 0xff */
+	fwimage_init(&img, 0xff);
 
-	buf = malloc(buflen);
-	if (!buf) {
-		ERR("no memory for buffer\n");
+	if (fwimage_add_data(&img, 0, &hdr, sizeof(hdr)))
 		goto out;
-	}
 
-	memset(buf, 0xff, buflen);
-	p = buf + sizeof(struct fw_header);
-	ret = read_to_buf(&kernel_info, p);
-	if (ret)
-		goto out_free_buf;
+	if (fwimage_add_file(&img, sizeof(struct fw_header),
+			     kernel_info.file_name, NULL))
+		goto out;
 
 	writelen = sizeof(struct fw_header) + kernel_len;
 
 	if (!combined) {
 		if (rootfs_align)
-			p = buf + writelen;
+			ofs = writelen;
 		else
-			p = buf + rootfs_ofs;
+			ofs = rootfs_ofs;
 
-		ret = read_to_buf(&rootfs_info, p);
-		if (ret)
-			goto out_free_buf;
+		if (fwimage_add_file(&img, ofs, rootfs_info.file_name, NULL))
+			goto out;
 
 		if (rootfs_align)
 			writelen += rootfs_info.file_size;
 		else
 			writelen = rootfs_ofs + rootfs_info.file_size;
 
-		if (add_jffs2_eof)
-			writelen = pad_jffs2(buf, writelen);
+		if (add_jffs2_eof) {
+			writelen = pad_jffs2(&img, writelen);
+			if (writelen < 0)
+				goto out;
+		}
 	}
 
 	if (!strip_padding)
-		writelen = buflen;
+		writelen = layout->fw_max_len;
 
-	fill_header(buf, writelen);
-	ret = write_fw(buf, writelen);
-	if (ret)
-		goto out_free_buf;
+	fill_header(&hdr, &img, writelen);
+	if (fwimage_write(&img, ofname, writelen))
+		goto out;
+
+	DBG("firmware file \"%s\" completed", ofname);
 
 	ret = EXIT_SUCCESS;
 
- out_free_buf:
-	free(buf);
  out:
+	fwimage_free(&img);
 	return ret;
 }
 
@@ -884,6 +860,12 @@ static inline void inspect_fw_pstr(char *label, char *str)
 	printf("%-23s: %s\n", label, str);
 }
 
+/* header strings are not terminated if they fill the whole field */
+static inline void inspect_fw_pfield(char *label, char *str, size_t size)
+{
+	printf("%-23s: %.*s\n", label, (int) strnlen(str, size), str);
+}
+
 static inline void inspect_fw_phex(char *label, uint32_t val)
 {
 	printf("%-23s: 0x%08x\n", label, val);
@@ -943,6 +925,19 @@ static inline void inspect_fw_pmd5sum(char *label, uint8_t *val, char *text)
 	printf(" %s\n", text);
 }
 
+/* check that a part described by the header lies within the file */
+static int inspect_fw_part_ok(char *name, uint32_t ofs, uint32_t len)
+{
+	if (ofs > inspect_info.file_size ||
+	    len > inspect_info.file_size - ofs) {
+		ERR("%s data (offset 0x%08x, length 0x%08x) is beyond the "
+		    "end of the file", name, ofs, len);
+		return 0;
+	}
+
+	return 1;
+}
+
 static int inspect_fw(void)
 {
 	char *buf;
@@ -965,8 +960,15 @@ static int inspect_fw(void)
 	inspect_fw_pstr("File name", inspect_info.file_name);
 	inspect_fw_phexdec("File size", inspect_info.file_size);
 
+	if (inspect_info.file_size < sizeof(struct fw_header)) {
+		ERR("file is too small for a firmware header");
+		ret = EXIT_FAILURE;
+		goto out_free_buf;
+	}
+
 	if (ntohl(hdr->version) != HEADER_VERSION_V1) {
 		ERR("file does not seem to have V1 header!\n");
+		ret = EXIT_FAILURE;
 		goto out_free_buf;
 	}
 
@@ -997,8 +999,10 @@ static int inspect_fw(void)
 
 	printf("\n");
 
-	inspect_fw_pstr("Vendor name", hdr->vendor_name);
-	inspect_fw_pstr("Firmware version", hdr->fw_version);
+	inspect_fw_pfield("Vendor name", hdr->vendor_name,
+	                  sizeof(hdr->vendor_name));
+	inspect_fw_pfield("Firmware version", hdr->fw_version,
+	                  sizeof(hdr->fw_version));
 	board = find_board_by_hwid(ntohl(hdr->hw_id));
 	if (board) {
 		layout = find_layout(board->layout_id);
@@ -1052,6 +1056,14 @@ static int inspect_fw(void)
 
 		printf("\n");
 
+		if (!inspect_fw_part_ok("kernel", ntohl(hdr->kernel_ofs),
+					ntohl(hdr->kernel_len)) ||
+		    !inspect_fw_part_ok("rootfs", ntohl(hdr->rootfs_ofs),
+					ntohl(hdr->rootfs_len))) {
+			ret = EXIT_FAILURE;
+			goto out_free_buf;
+		}
+
 		filename = malloc(strlen(inspect_info.file_name) + 8);
 		sprintf(filename, "%s-kernel", inspect_info.file_name);
 		printf("Extracting kernel to \"%s\"...\n", filename);
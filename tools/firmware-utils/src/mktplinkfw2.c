@@ -650,6 +650,12 @@ static inline void inspect_fw_pstr(char *label, char *str)
 	printf("%-23s: %s\n", label, str);
 }
 
+/* header strings are not terminated if they fill the whole field */
+static inline void inspect_fw_pfield(char *label, char *str, size_t size)
+{
+	printf("%-23s: %.*s\n", label, (int) strnlen(str, size), str);
+}
+
 static inline void inspect_fw_phex(char *label, uint32_t val)
 {
 	printf("%-23s: 0x%08x\n", label, val);
@@ -709,6 +715,19 @@ static inline void inspect_fw_pmd5sum(char *label, uint8_t *val, char *text)
 	printf(" %s\n", text);
 }
 
+/* check that a part described by the header lies within the file */
+static int inspect_fw_part_ok(char *name, uint32_t ofs, uint32_t len)
+{
+	if (ofs > inspect_info.file_size ||
+	    len > inspect_info.file_size - ofs) {
+		ERR("%s data (offset 0x%08x, length 0x%08x) is beyond the "
+		    "end of the file", name, ofs, len);
+		return 0;
+	}
+
+	return 1;
+}
+
 static int inspect_fw(void)
 {
 	char *buf;
@@ -731,12 +750,19 @@ static int inspect_fw(void)
 	inspect_fw_pstr("File name", inspect_info.file_name);
 	inspect_fw_phexdec("File size", inspect_info.file_size);
 
+	if (inspect_info.file_size < sizeof(struct fw_header)) {
+		ERR("file is too small for a firmware header");
+		ret = EXIT_FAILURE;
+		goto out_free_buf;
+	}
+
 	switch(bswap_32(ntohl(hdr->version))) {
 	case 2:
 	case 3:
 		break;
 	default:
 		ERR("file does not seem to have V2/V3 header!\n");
+		ret = EXIT_FAILURE;
 		goto out_free_buf;
 	}
 
@@ -774,7 +800,8 @@ static int inspect_fw(void)
 
 	printf("\n");
 
-	inspect_fw_pstr("Firmware version", hdr->fw_version);
+	inspect_fw_pfield("Firmware version", hdr->fw_version,
+	                  sizeof(hdr->fw_version));
 
 	board = find_board_by_hwid(ntohl(hdr->hw_id));
 	if (board) {
@@ -833,6 +860,14 @@ static int inspect_fw(void)
 
 		printf("\n");
 
+		if (!inspect_fw_part_ok("kernel", ntohl(hdr->kernel_ofs),
+					ntohl(hdr->kernel_len)) ||
+		    !inspect_fw_part_ok("rootfs", ntohl(hdr->rootfs_ofs),
+					ntohl(hdr->rootfs_len))) {
+			ret = EXIT_FAILURE;
+			goto out_free_buf;
+		}
+
 		filename = malloc(strlen(inspect_info.file_name) + 8);
 		sprintf(filename, "%s-kernel", inspect_info.file_name);
 		printf("Extracting kernel to \"%s\"...\n", filename);
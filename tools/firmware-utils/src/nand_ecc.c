@@ -23,19 +23,32 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <time.h>
+#include <byteswap.h>
+#include <pthread.h>
 
 #define DEF_NAND_PAGE_SIZE   2048
 #define DEF_NAND_OOB_SIZE     64
 #define DEF_NAND_ECC_OFFSET   0x28
 
+#define HAMMING_STEP_SIZE	256
+#define HAMMING_ECC_BYTES	3
+
 static int page_size = DEF_NAND_PAGE_SIZE;
 static int oob_size = DEF_NAND_OOB_SIZE;
 static int ecc_offset = DEF_NAND_ECC_OFFSET;
+static int ecc_strength;
+static int step_size;
+static int ecc_bytes = HAMMING_ECC_BYTES;
+static int num_threads;
 
 /*
  * Pre-calculated 256-way 1 byte column parity
@@ -59,32 +72,109 @@ static const uint8_t nand_ecc_precalc_table[] = {
 	0x00, 0x55, 0x56, 0x03, 0x59, 0x0c, 0x0f, 0x5a, 0x5a, 0x0f, 0x0c, 0x59, 0x03, 0x56, 0x55, 0x00
 };
 
+
+#define BCH_MAX_WORDS	8
+
+#if __BYTE_ORDER == __BIG_ENDIAN
+#define LOAD64_LE(X)	bswap_64(X)
+#define LOAD32_BE(X)	(X)
+#else
+#define LOAD64_LE(X)	(X)
+#define LOAD32_BE(X)	bswap_32(X)
+#endif
+
+/*
+ * BCH code over GF(2^m) in the layout of the Linux nand_bch driver: data
+ * bits are taken MSB first, parity bits are stored MSB first and XORed
+ * with a mask that makes the ECC of an erased step read back as all 0xff.
+ */
+struct bch_code {
+	int words;		/* 32 bit words holding the parity bits */
+	uint32_t *mod_tab;	/* remainders of every byte v at the 4 positions
+				   of a 32 bit word: (v * x^(ecc_bits + 8 * k)) mod g */
+	uint8_t eccmask[BCH_MAX_WORDS * 4];
+};
+
+static struct bch_code bch;
+
+/* primitive polynomials for GF(2^m), the same ones the kernel uses */
+static const unsigned int bch_prim_poly[] = {
+	[5] = 0x25, [6] = 0x43, [7] = 0x83, [8] = 0x11d, [9] = 0x211,
+	[10] = 0x409, [11] = 0x805, [12] = 0x1053, [13] = 0x201b,
+	[14] = 0x402b, [15] = 0x8003,
+};
+
+struct ecc_job {
+	pthread_t thread;
+	const uint8_t *in;
+	uint8_t *out;
+	size_t pages;
+};
+
+static inline uint64_t get_le64(const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return LOAD64_LE(v);
+}
+
+static inline uint32_t get_be32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return LOAD32_BE(v);
+}
+
 /**
  * nand_calculate_ecc - [NAND Interface] Calculate 3-byte ECC for 256-byte block
  * @dat:	raw data
  * @ecc_code:	buffer for ECC
+ *
+ * Byte i contributes its parity to line parity bit n if bit n of i is set.
+ * Reading the block 8 bytes at a time, the byte lane gives the low three
+ * bits of i and the word number the upper five, so every line parity is
+ * the parity of a fixed set of words and lanes. Column parity is linear,
+ * one table lookup on the XOR of all bytes is enough.
  */
 int nand_calculate_ecc(const uint8_t *dat,
 		       uint8_t *ecc_code)
 {
-	uint8_t idx, reg1, reg2, reg3, tmp1, tmp2;
+	uint64_t all = 0, lp0 = 0, lp1 = 0, lp2 = 0, lp3 = 0, lp4 = 0;
+	uint64_t cur;
+	uint8_t reg1, reg2, reg3, tmp1, tmp2;
 	int i;
 
-	/* Initialize variables */
-	reg1 = reg2 = reg3 = 0;
+	/* Build up line parity of the word numbers */
+	for (i = 0; i < 32; i++) {
+		cur = get_le64(dat + 8 * i);
+		all ^= cur;
+		lp0 ^= cur & -(uint64_t) (i & 1);
+		lp1 ^= cur & -(uint64_t) ((i >> 1) & 1);
+		lp2 ^= cur & -(uint64_t) ((i >> 2) & 1);
+		lp3 ^= cur & -(uint64_t) ((i >> 3) & 1);
+		lp4 ^= cur & -(uint64_t) ((i >> 4) & 1);
+	}
+
+	/* XOR of the indices of all bytes with odd parity */
+	reg3  = __builtin_parityll(all & 0xff00ff00ff00ff00ULL);
+	reg3 |= __builtin_parityll(all & 0xffff0000ffff0000ULL) << 1;
+	reg3 |= __builtin_parityll(all & 0xffffffff00000000ULL) << 2;
+	reg3 |= __builtin_parityll(lp0) << 3;
+	reg3 |= __builtin_parityll(lp1) << 4;
+	reg3 |= __builtin_parityll(lp2) << 5;
+	reg3 |= __builtin_parityll(lp3) << 6;
+	reg3 |= __builtin_parityll(lp4) << 7;
 
-	/* Build up column parity */
-	for(i = 0; i < 256; i++) {
-		/* Get CP0 - CP5 from table */
-		idx = nand_ecc_precalc_table[*dat++];
-		reg1 ^= (idx & 0x3f);
+	/* ... and of their inverted indices */
+	reg2 = reg3 ^ (__builtin_parityll(all) ? 0xff : 0x00);
 
-		/* All bit XOR = 1 ? */
-		if (idx & 0x40) {
-			reg3 ^= (uint8_t) i;
-			reg2 ^= ~((uint8_t) i);
-		}
-	}
+	/* Get CP0 - CP5 from table */
+	all ^= all >> 32;
+	all ^= all >> 16;
+	all ^= all >> 8;
+	reg1 = nand_ecc_precalc_table[all & 0xff] & 0x3f;
 
 	/* Create non-inverted ECC code from line parity */
 	tmp1  = (reg3 & 0x80) >> 0; /* B7 -> B7 */
@@ -118,33 +208,370 @@ int nand_calculate_ecc(const uint8_t *dat,
 	return 0;
 }
 
+/*
+ * Divide the data by the generator polynomial 32 bits at a time. The
+ * remainder is kept left aligned, each byte of its top word XORed with
+ * the data selects one table entry.
+ */
+static void bch_calculate_ecc(const uint8_t *dat, uint8_t *ecc_code)
+{
+	uint32_t r[BCH_MAX_WORDS + 1] = { 0 };
+	const uint32_t *t0, *t1, *t2, *t3;
+	int words = bch.words;
+	uint32_t w;
+	int i, j;
+
+	for (i = 0; i < step_size; i += 4) {
+		w = r[0] ^ get_be32(dat + i);
+		t0 = &bch.mod_tab[(3 * 256 + (w >> 24)) * words];
+		t1 = &bch.mod_tab[(2 * 256 + ((w >> 16) & 0xff)) * words];
+		t2 = &bch.mod_tab[(1 * 256 + ((w >> 8) & 0xff)) * words];
+		t3 = &bch.mod_tab[(w & 0xff) * words];
+		for (j = 0; j < words; j++)
+			r[j] = r[j + 1] ^ t0[j] ^ t1[j] ^ t2[j] ^ t3[j];
+	}
+
+	for (i = 0; i < ecc_bytes; i++)
+		ecc_code[i] = (r[i / 4] >> (24 - 8 * (i % 4))) ^ bch.eccmask[i];
+}
+
+static inline uint16_t gf_mul_pow(const uint16_t *a_pow, const uint16_t *a_log,
+				  int n, uint16_t x, int r)
+{
+	return x ? a_pow[(a_log[x] + r) % n] : 0;
+}
+
+static int bch_init(void)
+{
+	uint16_t *a_pow = NULL, *a_log = NULL, *p = NULL;
+	uint8_t *g = NULL, *done = NULL, *erased = NULL;
+	uint8_t ecc[BCH_MAX_WORDS * 4];
+	uint32_t gen[BCH_MAX_WORDS] = { 0 };
+	uint32_t *tab, fb;
+	int m, n, i, j, k, r, v, deg, pdeg;
+	int ret = -1;
+
+	/* the same field size the kernel picks for the step size */
+	for (m = 0; (1 + 8 * step_size) >> m; m++)
+		;
+	if (m < 5 || m > 15 || step_size % 4) {
+		fprintf(stderr, "unsupported ECC step size %d\n", step_size);
+		return -1;
+	}
+
+	n = (1 << m) - 1;
+	if (m * ecc_strength > BCH_MAX_WORDS * 32 ||
+	    8 * step_size + m * ecc_strength > n) {
+		fprintf(stderr, "unsupported ECC strength %d for %d byte steps\n",
+			ecc_strength, step_size);
+		return -1;
+	}
+
+	a_pow = malloc(n * sizeof(*a_pow));
+	a_log = malloc((n + 1) * sizeof(*a_log));
+	p = malloc((m + 1) * sizeof(*p));
+	g = calloc(m * ecc_strength + 1, 1);
+	done = calloc(n, 1);
+	erased = malloc(step_size);
+	bch.mod_tab = malloc(4 * 256 * BCH_MAX_WORDS * sizeof(uint32_t));
+	if (!a_pow || !a_log || !p || !g || !done || !erased || !bch.mod_tab) {
+		fprintf(stderr, "out of memory\n");
+		goto out;
+	}
+
+	for (i = 0, r = 1; i < n; i++) {
+		a_pow[i] = r;
+		a_log[r] = i;
+		r <<= 1;
+		if (r & (1 << m))
+			r ^= bch_prim_poly[m];
+	}
+
+	/*
+	 * The generator polynomial is the product of the minimal polynomials
+	 * of alpha^1 ... alpha^2t. An even power has the same minimal
+	 * polynomial as an odd one, so only the odd ones are looked at.
+	 */
+	g[0] = 1;
+	deg = 0;
+	for (i = 1; i < 2 * ecc_strength; i += 2) {
+		if (done[i])
+			continue;
+
+		/* product of (x + alpha^r) over the conjugates r of i */
+		p[0] = 1;
+		pdeg = 0;
+		r = i;
+		do {
+			done[r] = 1;
+			p[pdeg + 1] = p[pdeg];
+			for (j = pdeg; j > 0; j--)
+				p[j] = p[j - 1] ^ gf_mul_pow(a_pow, a_log, n, p[j], r);
+			p[0] = gf_mul_pow(a_pow, a_log, n, p[0], r);
+			pdeg++;
+			r = (2 * r) % n;
+		} while (r != i);
+
+		/* its coefficients are 0 or 1, multiply it into g */
+		for (k = deg + pdeg; k >= 0; k--) {
+			v = 0;
+			for (j = 0; j <= pdeg && j <= k; j++)
+				if (k - j <= deg)
+					v ^= g[k - j] & p[j];
+			g[k] = v;
+		}
+		deg += pdeg;
+	}
+
+	bch.words = (deg + 31) / 32;
+	ecc_bytes = (deg + 7) / 8;
+
+	/* g without its x^deg term, left aligned */
+	for (k = 0; k < deg; k++)
+		if (g[deg - 1 - k])
+			gen[k / 32] |= 1U << (31 - k % 32);
+
+	for (v = 0; v < 256; v++) {
+		tab = &bch.mod_tab[v * bch.words];
+		memset(tab, 0, bch.words * sizeof(*tab));
+		for (i = 7; i >= 0; i--) {
+			fb = (tab[0] >> 31) ^ ((v >> i) & 1);
+			for (j = 0; j < bch.words - 1; j++)
+				tab[j] = (tab[j] << 1) | (tab[j + 1] >> 31);
+			tab[j] <<= 1;
+			if (fb)
+				for (j = 0; j < bch.words; j++)
+					tab[j] ^= gen[j];
+		}
+	}
+
+	/* each further position is the previous one shifted by a byte */
+	for (k = 1; k < 4; k++) {
+		for (v = 0; v < 256; v++) {
+			uint32_t *prev = &bch.mod_tab[((k - 1) * 256 + v) * bch.words];
+			const uint32_t *red = &bch.mod_tab[(prev[0] >> 24) * bch.words];
+
+			tab = &bch.mod_tab[(k * 256 + v) * bch.words];
+			for (j = 0; j < bch.words - 1; j++)
+				tab[j] = ((prev[j] << 8) | (prev[j + 1] >> 24)) ^ red[j];
+			tab[j] = (prev[j] << 8) ^ red[j];
+		}
+	}
+
+	memset(erased, 0xff, step_size);
+	bch_calculate_ecc(erased, ecc);
+	for (i = 0; i < ecc_bytes; i++)
+		bch.eccmask[i] = ecc[i] ^ 0xff;
+
+	ret = 0;
+out:
+	free(a_pow);
+	free(a_log);
+	free(p);
+	free(g);
+	free(done);
+	free(erased);
+	return ret;
+}
+
+static void process_pages(const uint8_t *in, uint8_t *out, size_t pages)
+{
+	uint8_t *ecc_data;
+	size_t i;
+	int j;
+
+	for (i = 0; i < pages; i++) {
+		memcpy(out, in, page_size);
+
+		ecc_data = out + page_size + ecc_offset;
+		for (j = 0; j < page_size; j += step_size) {
+			if (ecc_strength)
+				bch_calculate_ecc(in + j, ecc_data);
+			else
+				nand_calculate_ecc(in + j, ecc_data);
+			ecc_data += ecc_bytes;
+		}
+
+		in += page_size;
+		out += page_size + oob_size;
+	}
+}
+
+static void *ecc_thread(void *arg)
+{
+	struct ecc_job *job = arg;
+
+	process_pages(job->in, job->out, job->pages);
+	return NULL;
+}
+
+/* pages are independent, give each thread a contiguous range of them */
+static void process_image(const uint8_t *in, uint8_t *out, size_t pages)
+{
+	struct ecc_job jobs[num_threads];
+	size_t first = 0, count;
+	int n = num_threads, i;
+
+	if (pages < (size_t) n * 64)
+		n = pages / 64 + 1;
+
+	for (i = 0; i < n; i++) {
+		count = pages / n + ((size_t) i < pages % n);
+		jobs[i].in = in + first * page_size;
+		jobs[i].out = out + first * (page_size + oob_size);
+		jobs[i].pages = count;
+		first += count;
+
+		if (i == n - 1 ||
+		    pthread_create(&jobs[i].thread, NULL, ecc_thread, &jobs[i])) {
+			ecc_thread(&jobs[i]);
+			jobs[i].pages = 0;
+		}
+	}
+
+	for (i = 0; i < n; i++)
+		if (jobs[i].pages)
+			pthread_join(jobs[i].thread, NULL);
+}
+
+static int benchmark(size_t size)
+{
+	struct timespec start, end;
+	size_t pages = size / page_size, i;
+	uint8_t *in, *out;
+	uint32_t x = 0x12345678;
+	double t;
+
+	in = malloc(pages * page_size);
+	out = calloc(pages, page_size + oob_size);
+	if (!pages || !in || !out) {
+		fprintf(stderr, "could not allocate %zu pages\n", pages);
+		return 1;
+	}
+
+	for (i = 0; i < pages * page_size; i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		in[i] = x;
+	}
+
+	/* fault in the output pages first */
+	process_image(in, out, pages);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	process_image(in, out, pages);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	t = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%s ECC, %d byte steps, %d threads: %zu pages in %.3f s, "
+	       "%.1f MiB/s\n", ecc_strength ? "BCH" : "Hamming", step_size,
+	       num_threads, pages, t, pages * page_size / t / (1024 * 1024));
+
+	free(in);
+	free(out);
+	return 0;
+}
+
 /*
  *  usage: bb-nandflash-ecc    start_address  size
  */
 void usage(const char *prog)
 {
 	fprintf(stderr, "Usage: %s [options] <input> <output>\n"
+		"       %s [options] -B <MiB>\n"
 		"Options:\n"
 		"    -p <pagesize>      NAND page size (default: %d)\n"
 		"    -o <oobsize>       NAND OOB size (default: %d)\n"
 		"    -e <offset>        NAND ECC offset (default: %d)\n"
-		"\n", prog, DEF_NAND_PAGE_SIZE, DEF_NAND_OOB_SIZE,
+		"    -t <strength>      use BCH ECC correcting <strength> bits per step\n"
+		"                       (default: 1 bit Hamming ECC per 256 bytes)\n"
+		"    -s <stepsize>      BCH ECC step size (default: 512)\n"
+		"    -j <threads>       number of threads (default: number of CPUs)\n"
+		"    -B <MiB>           measure the throughput on <MiB> of random data\n"
+		"\n", prog, prog, DEF_NAND_PAGE_SIZE, DEF_NAND_OOB_SIZE,
 		DEF_NAND_ECC_OFFSET);
 	exit(1);
 }
 
+/* map regular files, read anything else into memory */
+static uint8_t *read_input(int fd, size_t *len, int *mapped)
+{
+	struct stat st;
+	uint8_t *buf = NULL, *tmp;
+	size_t size = 0, alloc = 0;
+	ssize_t bytes;
+	void *map;
+
+	*mapped = 0;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (map != MAP_FAILED) {
+			madvise(map, st.st_size, MADV_SEQUENTIAL);
+			*mapped = 1;
+			*len = st.st_size;
+			return map;
+		}
+	}
+
+	do {
+		if (size == alloc) {
+			alloc = alloc ? 2 * alloc : 1024 * 1024;
+			tmp = realloc(buf, alloc);
+			if (!tmp) {
+				fprintf(stderr, "out of memory\n");
+				free(buf);
+				return NULL;
+			}
+			buf = tmp;
+		}
+
+		bytes = read(fd, buf + size, alloc - size);
+		if (bytes < 0 && errno == EINTR)
+			continue;
+		if (bytes < 0) {
+			perror("read input file");
+			free(buf);
+			return NULL;
+		}
+		size += bytes;
+	} while (bytes > 0);
+
+	*len = size;
+	return buf ? buf : malloc(1);
+}
+
+static int write_all(int fd, const uint8_t *buf, size_t len)
+{
+	ssize_t bytes;
+
+	while (len) {
+		bytes = write(fd, buf, len);
+		if (bytes < 0 && errno == EINTR)
+			continue;
+		if (bytes <= 0)
+			return -1;
+		buf += bytes;
+		len -= bytes;
+	}
+
+	return 0;
+}
+
 /*start_address/size does not include oob
   */
 int main(int argc, char **argv)
 {
-	uint8_t *page_data = NULL;
-	uint8_t *ecc_data;
+	uint8_t *in_data = NULL, *out_data = NULL;
+	size_t in_len = 0, out_len, pages;
+	int in_mapped = 0, out_mapped = 0;
 	int infd = -1, outfd = -1;
+	size_t bench_size = 0;
+	struct stat st;
 	int ret = 1;
-	ssize_t bytes;
 	int ch;
 
-	while ((ch = getopt(argc, argv, "e:o:p:")) != -1) {
+	while ((ch = getopt(argc, argv, "e:o:p:t:s:j:B:")) != -1) {
 		switch(ch) {
 		case 'p':
 			page_size = strtoul(optarg, NULL, 0);
@@ -155,50 +582,122 @@ int main(int argc, char **argv)
 		case 'e':
 			ecc_offset = strtoul(optarg, NULL, 0);
 			break;
+		case 't':
+			ecc_strength = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			step_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'j':
+			num_threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'B':
+			bench_size = strtoul(optarg, NULL, 0) << 20;
+			break;
 		default:
 			usage(argv[0]);
 		}
 	}
 	argc -= optind;
-	if (argc < 2)
+	if (argc < 2 && !bench_size)
 		usage(argv[0]);
 
 	argv += optind;
 
+	if (ecc_strength) {
+		if (!step_size)
+			step_size = 512;
+		if (bch_init())
+			goto out;
+	} else {
+		step_size = HAMMING_STEP_SIZE;
+	}
+
+	if (page_size <= 0 || page_size % step_size) {
+		fprintf(stderr, "page size %d is not a multiple of the %d byte "
+			"ECC step size\n", page_size, step_size);
+		goto out;
+	}
+
+	if (ecc_offset < 0 ||
+	    ecc_offset + page_size / step_size * ecc_bytes > oob_size) {
+		fprintf(stderr, "%d bytes of ECC at offset %d do not fit into "
+			"%d bytes of OOB\n", page_size / step_size * ecc_bytes,
+			ecc_offset, oob_size);
+		goto out;
+	}
+
+	if (num_threads <= 0)
+		num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_threads <= 0)
+		num_threads = 1;
+
+	if (bench_size) {
+		ret = benchmark(bench_size);
+		goto out;
+	}
+
 	infd = open(argv[0], O_RDONLY, 0);
 	if (infd < 0) {
 		perror("open input file");
 		goto out;
 	}
 
-	outfd = open(argv[1], O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	outfd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0644);
 	if (outfd < 0) {
 		perror("open output file");
 		goto out;
 	}
 
-	page_data = malloc(page_size + oob_size);
+	in_data = read_input(infd, &in_len, &in_mapped);
+	if (!in_data)
+		goto out;
 
-	while ((bytes = read(infd, page_data, page_size)) == page_size) {
-		int j;
+	/* a partial page at the end is dropped */
+	pages = in_len / page_size;
+	out_len = pages * (page_size + oob_size);
+	if (!out_len) {
+		ret = 0;
+		goto out;
+	}
 
-		ecc_data = page_data + page_size + ecc_offset;
-		for (j = 0; j < page_size / 256; j++)
-		{
-			nand_calculate_ecc(page_data + j * 256, ecc_data);
-			ecc_data += 3;
-		}
-		write(outfd, page_data, page_size + oob_size);
+	/* write regular files through a shared mapping, pipes from memory */
+	if (fstat(outfd, &st) == 0 && S_ISREG(st.st_mode) &&
+	    ftruncate(outfd, out_len) == 0) {
+		out_data = mmap(NULL, out_len, PROT_READ|PROT_WRITE,
+				MAP_SHARED, outfd, 0);
+		if (out_data == MAP_FAILED)
+			out_data = NULL;
+		else
+			out_mapped = 1;
+	}
+	if (!out_data)
+		out_data = calloc(1, out_len);
+	if (!out_data) {
+		fprintf(stderr, "out of memory\n");
+		goto out;
+	}
+
+	process_image(in_data, out_data, pages);
+
+	if (!out_mapped && write_all(outfd, out_data, out_len)) {
+		perror("write output file");
+		goto out;
 	}
 
 	ret = 0;
 out:
+	if (out_data && out_mapped)
+		munmap(out_data, out_len);
+	else
+		free(out_data);
+	if (in_data && in_mapped)
+		munmap(in_data, in_len);
+	else
+		free(in_data);
 	if (infd >= 0)
 		close(infd);
 	if (outfd >= 0)
 		close(outfd);
-	if (page_data)
-		free(page_data);
 	return ret;
 }
-
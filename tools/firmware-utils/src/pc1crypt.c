@@ -24,25 +24,20 @@
 #include <getopt.h>     /* for getopt() */
 #include <stdarg.h>
 #include <errno.h>
+#include <time.h>
 #include <sys/stat.h>
 
+/*
+ * Every byte mixes the plaintext into all 16 key bytes the same way, so
+ * the key is the initial one XORed with the XOR of all plaintext bytes so
+ * far, and only that byte has to be tracked. The eight rounds per byte
+ * run on local variables, a buffer at a time.
+ */
 struct pc1_ctx {
-	unsigned short	ax;
-	unsigned short	bx;
-	unsigned short	cx;
-	unsigned short	dx;
-	unsigned short	si;
-	unsigned short	tmp;
-	unsigned short	x1a2;
-	unsigned short	x1a0[8];
-	unsigned short	res;
-	unsigned short	i;
-	unsigned short	inter;
-	unsigned short	cfc;
-	unsigned short	cfd;
-	unsigned short	compte;
-	unsigned char	cle[17];
-	short		c;
+	uint16_t	si;
+	uint16_t	x1a2;
+	uint16_t	key[8];		/* initial key as big endian words */
+	uint8_t		mix;		/* XOR of all plaintext bytes */
 };
 
 static void pc1_finish(struct pc1_ctx *pc1)
@@ -51,141 +46,155 @@ static void pc1_finish(struct pc1_ctx *pc1)
 	memset(pc1, 0, sizeof(struct pc1_ctx));
 }
 
-static void pc1_code(struct pc1_ctx *pc1)
+static inline uint8_t pc1_keystream(uint16_t *si, uint16_t *x1a2,
+				    const uint16_t *key, uint8_t mix)
 {
-	pc1->dx = pc1->x1a2 + pc1->i;
-	pc1->ax = pc1->x1a0[pc1->i];
-	pc1->cx = 0x015a;
-	pc1->bx = 0x4e35;
-
-	pc1->tmp = pc1->ax;
-	pc1->ax = pc1->si;
-	pc1->si = pc1->tmp;
-
-	pc1->tmp = pc1->ax;
-	pc1->ax = pc1->dx;
-	pc1->dx = pc1->tmp;
-
-	if (pc1->ax != 0) {
-		pc1->ax = pc1->ax * pc1->bx;
-	}
-
-	pc1->tmp = pc1->ax;
-	pc1->ax = pc1->cx;
-	pc1->cx = pc1->tmp;
-
-	if (pc1->ax != 0) {
-		pc1->ax = pc1->ax * pc1->si;
-		pc1->cx = pc1->ax + pc1->cx;
+	uint16_t m = mix * 0x0101;
+	uint16_t x = 0, a, dx, inter = 0;
+	uint16_t s = *si, d = *x1a2;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		a = x ^ key[i] ^ m;
+		dx = (uint16_t) (0x015a * (unsigned) a) +
+		     (uint16_t) (0x4e35 * (unsigned) (uint16_t) (d + i)) + s;
+		x = (uint16_t) (0x4e35 * (unsigned) a) + 1;
+		s = 0x015a * (unsigned) a;
+		d = dx;
+		inter ^= x ^ dx;
 	}
 
-	pc1->tmp = pc1->ax;
-	pc1->ax = pc1->si;
-	pc1->si = pc1->tmp;
-	pc1->ax = pc1->ax * pc1->bx;
-	pc1->dx = pc1->cx + pc1->dx;
+	*si = s;
+	*x1a2 = d;
 
-	pc1->ax = pc1->ax + 1;
-
-	pc1->x1a2 = pc1->dx;
-	pc1->x1a0[pc1->i] = pc1->ax;
-
-	pc1->res = pc1->ax ^ pc1->dx;
-	pc1->i = pc1->i + 1;
+	/* cfc^cfd = random byte */
+	return (inter >> 8) ^ (inter & 255);
 }
 
-static void pc1_assemble(struct pc1_ctx *pc1)
+static void pc1_init(struct pc1_ctx *pc1)
 {
-	pc1->x1a0[0] = (pc1->cle[0] * 256) + pc1->cle[1];
+	/* ('Remsaalps!123456') is the key used, you can change it */
+	static const unsigned char cle[] = "Remsaalps!123456";
+	int i;
 
-	pc1_code(pc1);
-	pc1->inter = pc1->res;
+	memset(pc1, 0, sizeof(struct pc1_ctx));
 
-	pc1->x1a0[1] = pc1->x1a0[0] ^ ((pc1->cle[2]*256) + pc1->cle[3]);
-	pc1_code(pc1);
-	pc1->inter = pc1->inter ^ pc1->res;
+	for (i = 0; i < 8; i++)
+		pc1->key[i] = (cle[2 * i] << 8) | cle[2 * i + 1];
+}
 
-	pc1->x1a0[2] = pc1->x1a0[1] ^ ((pc1->cle[4]*256) + pc1->cle[5]);
-	pc1_code(pc1);
-	pc1->inter = pc1->inter ^ pc1->res;
+static void pc1_decrypt_buf(struct pc1_ctx *pc1, unsigned char *buf,
+			    unsigned len)
+{
+	uint16_t si = pc1->si, x1a2 = pc1->x1a2;
+	uint8_t mix = pc1->mix;
+	unsigned i;
 
-	pc1->x1a0[3] = pc1->x1a0[2] ^ ((pc1->cle[6]*256) + pc1->cle[7]);
-	pc1_code(pc1);
-	pc1->inter = pc1->inter ^ pc1->res;
+	for (i = 0; i < len; i++) {
+		buf[i] ^= pc1_keystream(&si, &x1a2, pc1->key, mix);
+		mix ^= buf[i];
+	}
 
-	pc1->x1a0[4] = pc1->x1a0[3] ^ ((pc1->cle[8]*256) + pc1->cle[9]);
-	pc1_code(pc1);
-	pc1->inter = pc1->inter ^ pc1->res;
+	pc1->si = si;
+	pc1->x1a2 = x1a2;
+	pc1->mix = mix;
+}
 
-	pc1->x1a0[5] = pc1->x1a0[4] ^ ((pc1->cle[10]*256) + pc1->cle[11]);
-	pc1_code(pc1);
-	pc1->inter = pc1->inter ^ pc1->res;
+static void pc1_encrypt_buf(struct pc1_ctx *pc1, unsigned char *buf,
+			    unsigned len)
+{
+	uint16_t si = pc1->si, x1a2 = pc1->x1a2;
+	uint8_t mix = pc1->mix;
+	unsigned i;
 
-	pc1->x1a0[6] = pc1->x1a0[5] ^ ((pc1->cle[12]*256) + pc1->cle[13]);
-	pc1_code(pc1);
-	pc1->inter = pc1->inter ^ pc1->res;
+	for (i = 0; i < len; i++) {
+		uint8_t c = buf[i];
 
-	pc1->x1a0[7] = pc1->x1a0[6] ^ ((pc1->cle[14]*256) + pc1->cle[15]);
-	pc1_code(pc1);
-	pc1->inter = pc1->inter ^ pc1->res;
+		buf[i] ^= pc1_keystream(&si, &x1a2, pc1->key, mix);
+		mix ^= c;
+	}
 
-	pc1->i = 0;
+	pc1->si = si;
+	pc1->x1a2 = x1a2;
+	pc1->mix = mix;
 }
 
-static unsigned char pc1_decrypt(struct pc1_ctx *pc1, short c)
-{
-	pc1_assemble(pc1);
-	pc1->cfc = pc1->inter >> 8;
-	pc1->cfd = pc1->inter & 255; /* cfc^cfd = random byte */
-
-	c = c ^ (pc1->cfc ^ pc1->cfd);
-	for (pc1->compte = 0; pc1->compte <= 15; pc1->compte++) {
-		/* we mix the plaintext byte with the key */
-		pc1->cle[pc1->compte] = pc1->cle[pc1->compte] ^ c;
-	}
+#define BUFSIZE		(64 * 1024)
 
-	return c;
-}
+/* known ciphertext of the bytes (i * 31 + 7) & 0xff */
+static const unsigned char pc1_test_vec[64] = {
+	0xfe, 0x67, 0x9f, 0xe6, 0x2f, 0xed, 0xdb, 0xc4,
+	0xf8, 0x32, 0x27, 0x02, 0x52, 0x07, 0x09, 0xd3,
+	0x7c, 0xc2, 0x6a, 0x8c, 0xb5, 0x4e, 0x07, 0x47,
+	0x64, 0x86, 0x40, 0xb0, 0x34, 0x48, 0xc3, 0x0e,
+	0x08, 0xea, 0x8b, 0x55, 0x9d, 0x13, 0x57, 0x99,
+	0x42, 0xf4, 0x29, 0xde, 0x96, 0xac, 0xba, 0xe1,
+	0x5e, 0xe3, 0x95, 0xa1, 0x75, 0xdc, 0x08, 0xba,
+	0xf8, 0x69, 0x5f, 0xf6, 0xfc, 0x8a, 0x07, 0xcf,
+};
 
-static unsigned char pc1_encrypt(struct pc1_ctx *pc1, short c)
+static int self_test(void)
 {
-	pc1_assemble(pc1);
-	pc1->cfc = pc1->inter >> 8;
-	pc1->cfd = pc1->inter & 255; /* cfc^cfd = random byte */
+	struct pc1_ctx pc1;
+	unsigned char ref[4096], buf[4096];
+	unsigned i, n;
 
-	for (pc1->compte = 0; pc1->compte <= 15; pc1->compte++) {
-		/* we mix the plaintext byte with the key */
-		pc1->cle[pc1->compte] = pc1->cle[pc1->compte] ^ c;
+	for (i = 0; i < sizeof(ref); i++)
+		ref[i] = (i * 31 + 7) & 0xff;
+
+	/* encrypt in odd sized pieces to check the state carried over */
+	memcpy(buf, ref, sizeof(buf));
+	pc1_init(&pc1);
+	for (i = 0; i < sizeof(buf); i += n) {
+		n = (i % 7) * 13 + 1;
+		if (n > sizeof(buf) - i)
+			n = sizeof(buf) - i;
+		pc1_encrypt_buf(&pc1, buf + i, n);
 	}
-	c = c ^ (pc1->cfc ^ pc1->cfd);
 
-	return c;
-}
+	if (memcmp(buf, pc1_test_vec, sizeof(pc1_test_vec))) {
+		fprintf(stderr, "self-test failed: wrong ciphertext\n");
+		return EXIT_FAILURE;
+	}
 
-static void pc1_init(struct pc1_ctx *pc1)
-{
-	memset(pc1, 0, sizeof(struct pc1_ctx));
+	pc1_init(&pc1);
+	pc1_decrypt_buf(&pc1, buf, sizeof(buf));
+	if (memcmp(buf, ref, sizeof(ref))) {
+		fprintf(stderr, "self-test failed: decryption mismatch\n");
+		return EXIT_FAILURE;
+	}
 
-	/* ('Remsaalps!123456') is the key used, you can change it */
-	strcpy(pc1->cle, "Remsaalps!123456");
+	fprintf(stderr, "self-test passed\n");
+	return EXIT_SUCCESS;
 }
 
-static void pc1_decrypt_buf(struct pc1_ctx *pc1, unsigned char *buf,
-			    unsigned len)
+/* encrypt one I/O buffer over and over until size bytes are done */
+static int benchmark(size_t size)
 {
-	unsigned i;
+	struct timespec start, end;
+	struct pc1_ctx pc1;
+	unsigned char *buf;
+	size_t done;
+	double t;
 
-	for (i = 0; i < len; i++)
-		buf[i] = pc1_decrypt(pc1, buf[i]);
-}
+	buf = malloc(BUFSIZE);
+	if (!buf) {
+		fprintf(stderr, "out of memory\n");
+		return EXIT_FAILURE;
+	}
+	memset(buf, 0, BUFSIZE);
 
-static void pc1_encrypt_buf(struct pc1_ctx *pc1, unsigned char *buf,
-			    unsigned len)
-{
-	unsigned i;
+	pc1_init(&pc1);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (done = 0; done < size; done += BUFSIZE)
+		pc1_encrypt_buf(&pc1, buf, BUFSIZE);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	t = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("PC1 encrypt: %.1f MiB/s\n", done / t / (1024 * 1024));
 
-	for (i = 0; i < len; i++)
-		buf[i] = pc1_encrypt(pc1, buf[i]);
+	free(buf);
+	return EXIT_SUCCESS;
 }
 
 /*
@@ -224,21 +233,21 @@ void usage(int status)
 "  -d              decrypt instead of encrypt"
 "  -i <file>       read input from the file <file>\n"
 "  -o <file>       write output to the file <file>\n"
+"  -T              run a self-test and exit\n"
+"  -B <MiB>        measure the encryption speed over <MiB> of data and exit\n"
 "  -h              show this screen\n"
 	);
 
 	exit(status);
 }
 
-#define BUFSIZE		(64 * 1024)
-
 int main(int argc, char *argv[])
 {
 	struct pc1_ctx pc1;
 	int res = EXIT_FAILURE;
 	int err;
 	struct stat st;
-	char *buf;
+	unsigned char *buf;
 	unsigned total;
 
 	FILE *outfile, *infile;
@@ -248,7 +257,7 @@ int main(int argc, char *argv[])
 	while ( 1 ) {
 		int c;
 
-		c = getopt(argc, argv, "di:o:h");
+		c = getopt(argc, argv, "di:o:TB:h");
 		if (c == -1)
 			break;
 
@@ -262,6 +271,10 @@ int main(int argc, char *argv[])
 		case 'o':
 			ofname = optarg;
 			break;
+		case 'T':
+			return self_test();
+		case 'B':
+			return benchmark(strtoul(optarg, NULL, 0) << 20);
 		case 'h':
 			usage(EXIT_SUCCESS);
 			break;
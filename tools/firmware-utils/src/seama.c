@@ -189,7 +189,7 @@ static int verify_seama(const char * fname, int msg)
 	seamahdr_t shdr;
 	uint8_t checksum[16];
 	uint8_t digest[16];
-	uint8_t buf[MAX_SEAMA_META_SIZE];
+	uint8_t buf[MAX_SEAMA_META_SIZE + 1];
 	size_t msize, isize, i;
 	int ret = -1;
 
@@ -224,11 +224,12 @@ static int verify_seama(const char * fname, int msg)
 			}
 
 			/* Check the META size. */
-			if (msize > sizeof(buf)) ERRBREAK("META data in SEAMA header is too large!\n");
+			if (msize > MAX_SEAMA_META_SIZE) ERRBREAK("META data in SEAMA header is too large!\n");
 
-			/* Read META data. */
+			/* Read META data, terminate the last string in case it is not. */
 			if (fread(buf, sizeof(char), msize, fh) != msize)
 				ERRBREAK("Unable to read SEAMA META data!\n");
+			buf[msize] = '\0';
 
 			/* dump header */
 			if (msg)
@@ -424,7 +425,7 @@ static void extract_file(const char * output)
 	FILE * ofh = NULL;
 	size_t msize, isize, i, m;
 	seamahdr_t shdr;
-	uint8_t buf[MAX_SEAMA_META_SIZE];
+	uint8_t buf[MAX_SEAMA_META_SIZE + 1];
 	int done = 0;
 
 	/* We need meta for searching the target image. */
@@ -450,7 +451,7 @@ static void extract_file(const char * output)
 		while (!feof(ifh) && !ferror(ifh))
 		{
 			/* read header */
-			fread(&shdr, sizeof(shdr), 1, ifh);
+			if (fread(&shdr, sizeof(shdr), 1, ifh) != 1) break;
 			if (shdr.magic != htonl(SEAMA_MAGIC)) break;
 			/* Get the size */
 			isize = ntohl(shdr.size);
@@ -466,11 +467,13 @@ static void extract_file(const char * output)
 				continue;
 			}
 			/* read checksum */
-			fread(buf, sizeof(char), 16, ifh);
+			if (fread(buf, sizeof(char), 16, ifh) != 16) break;
+			if (msize > MAX_SEAMA_META_SIZE) break;
 			if (msize > 0)
 			{
 				/* read META */
-				fread(buf, sizeof(char), msize, ifh);
+				if (fread(buf, sizeof(char), msize, ifh) != msize) break;
+				buf[msize] = '\0';
 				if (match_meta((const char *)buf, msize))
 				{
 					printf("SEAMA: found image @ '%s', image size: %d\n", o_images[i], isize);
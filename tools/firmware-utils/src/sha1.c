@@ -30,6 +30,12 @@
 #include <string.h>
 #include <stdio.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA1_SHANI
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
 #include "sha1.h"
 
 /* 
@@ -225,6 +231,103 @@ void sha1_process( sha1_context *ctx, uchar data[64] )
     ctx->state[4] += E;
 }
 
+#ifdef SHA1_SHANI
+/*
+ * SHA-1 using the x86 SHA extensions. Each step does four rounds and
+ * computes the message words needed four steps later.
+ */
+#define SHANI_STEP(i)                                                   \
+{                                                                       \
+    if( (i) == 0 )                                                      \
+        E[0] = _mm_add_epi32( E[0], W[0] );                             \
+    else                                                                \
+        E[(i) & 1] = _mm_sha1nexte_epu32( E[(i) & 1], W[(i) & 3] );     \
+    E[((i) & 1) ^ 1] = ABCD;                                            \
+    ABCD = _mm_sha1rnds4_epu32( ABCD, E[(i) & 1], (i) / 5 );            \
+    if( (i) < 16 )                                                      \
+        W[(i) & 3] = _mm_sha1msg2_epu32( _mm_xor_si128(                 \
+                _mm_sha1msg1_epu32( W[(i) & 3], W[((i) + 1) & 3] ),     \
+                W[((i) + 2) & 3] ), W[((i) + 3) & 3] );                 \
+}
+
+__attribute__((target("sha,sse4.1")))
+static void sha1_process_shani( sha1_context *ctx, uchar *data, uint blocks )
+{
+    const __m128i mask = _mm_set_epi64x( 0x0001020304050607ULL,
+                                         0x08090a0b0c0d0e0fULL );
+    __m128i ABCD, ABCD_SAVE, E_SAVE, E[2], W[4];
+    int i;
+
+    ABCD = _mm_set_epi32( ctx->state[0], ctx->state[1],
+                          ctx->state[2], ctx->state[3] );
+    E[0] = _mm_set_epi32( ctx->state[4], 0, 0, 0 );
+
+    while( blocks-- )
+    {
+        ABCD_SAVE = ABCD;
+        E_SAVE = E[0];
+
+        for( i = 0; i < 4; i++ )
+            W[i] = _mm_shuffle_epi8( _mm_loadu_si128(
+                        (const __m128i *) (data + 16 * i) ), mask );
+
+        SHANI_STEP(  0 ); SHANI_STEP(  1 ); SHANI_STEP(  2 ); SHANI_STEP(  3 );
+        SHANI_STEP(  4 ); SHANI_STEP(  5 ); SHANI_STEP(  6 ); SHANI_STEP(  7 );
+        SHANI_STEP(  8 ); SHANI_STEP(  9 ); SHANI_STEP( 10 ); SHANI_STEP( 11 );
+        SHANI_STEP( 12 ); SHANI_STEP( 13 ); SHANI_STEP( 14 ); SHANI_STEP( 15 );
+        SHANI_STEP( 16 ); SHANI_STEP( 17 ); SHANI_STEP( 18 ); SHANI_STEP( 19 );
+
+        E[0] = _mm_sha1nexte_epu32( E[0], E_SAVE );
+        ABCD = _mm_add_epi32( ABCD, ABCD_SAVE );
+        data += 64;
+    }
+
+    ctx->state[0] = (uint) _mm_extract_epi32( ABCD, 3 );
+    ctx->state[1] = (uint) _mm_extract_epi32( ABCD, 2 );
+    ctx->state[2] = (uint) _mm_extract_epi32( ABCD, 1 );
+    ctx->state[3] = (uint) _mm_extract_epi32( ABCD, 0 );
+    ctx->state[4] = (uint) _mm_extract_epi32( E[0], 3 );
+}
+
+#undef SHANI_STEP
+
+static int sha1_have_shani( void )
+{
+    static int have = -1;
+    uint a, b, c, d;
+
+    if( have < 0 )
+    {
+        have = 0;
+        if( __get_cpuid( 1, &a, &b, &c, &d ) && ( c & bit_SSE4_1 ) &&
+            ( c & bit_SSSE3 ) && __get_cpuid_max( 0, NULL ) >= 7 )
+        {
+            __cpuid_count( 7, 0, a, b, c, d );
+            have = ( b & bit_SHA ) != 0;
+        }
+    }
+
+    return( have );
+}
+#endif
+
+static void sha1_process_blocks( sha1_context *ctx, uchar *data, uint blocks )
+{
+#ifdef SHA1_SHANI
+    if( sha1_have_shani() )
+    {
+        sha1_process_shani( ctx, data, blocks );
+        return;
+    }
+#endif
+
+    while( blocks-- )
+    {
+        sha1_process( ctx, data );
+        data += 64;
+    }
+}
+
 void sha1_update( sha1_context *ctx, uchar *input, uint length )
 {
     ulong left, fill;
@@ -244,17 +347,17 @@ void sha1_update( sha1_context *ctx, uchar *input, uint length )
     {
         memcpy( (void *) (ctx->buffer + left),
                 (void *) input, fill );
-        sha1_process( ctx, ctx->buffer );
+        sha1_process_blocks( ctx, ctx->buffer, 1 );
         length -= fill;
         input  += fill;
         left = 0;
     }
 
-    while( length >= 64 )
+    if( length >= 64 )
     {
-        sha1_process( ctx, input );
-        length -= 64;
-        input  += 64;
+        sha1_process_blocks( ctx, input, length / 64 );
+        input  += length & ~0x3F;
+        length &= 0x3F;
     }
 
     if( length )
@@ -1,524 +1,587 @@
+/*
+ * srec2bin - convert Motorola S-records to the AR7 boot loader format
+ *
+ * Rev 0.1 Original
+ * 8 Jan 2001  MJH  Added code to write data to Binary file
+ *
+ *   srec2bin [OPTIONS...] <input SREC file> [<output binary file> [big]]
+ *
+ * File Structure
+ *
+ *   TAG    :   32 Bits   0xDEADBE42 if "big" is given, 0xFEEDFA42 otherwise
+ *   [DATA RECORDS]
+ *
+ * Data Records Structure
+ *
+ *   LENGTH  :  32 Bits    <- Length of DATA, excludes ADDRESS and CHECKSUM
+ *   ADDRESS :  32 Bits
+ *   DATA    :  8 Bits * LENGTH
+ *   CHECKSUM:  32 Bits    <-  0 - (Sum of Length --> End of Data)
+ *
+ * Note : If Length == 0, Address will be Program Start
+ *
+ * All 32 bit fields are stored little endian. Every run of contiguous
+ * addresses in the S-records becomes one data record. Runs are assembled
+ * in memory and written out with a single write once they end, so the
+ * input is parsed in one pass and the output is never seeked.
+ */
+
 #include <stdio.h>
-#include <ctype.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
-
-//Rev 0.1 Original
-// 8 Jan 2001  MJH  Added code to write data to Binary file
-//                  note: outputfile is name.bin, where name is first part
-//                  of input file.  ie tmp.rec -> tmp.bin
-//
-//   srec2bin <input SREC file> <Output Binary File> <If Present, Big Endian>
-//
-//   TAG   
-//        bit32u TAG_BIG     = 0xDEADBE42;
-//        bit32u TAG_LITTLE  = 0xFEEDFA42;
-//
-//  File Structure
-//
-//  TAG    :   32 Bits
-//  [DATA RECORDS]
-//
-//  Data Records Structure
-//
-//  LENGTH  :  32 Bits    <- Length of DATA, excludes ADDRESS and CHECKSUM
-//  ADDRESS :  32 Bits
-//  DATA    :  8 Bits * LENGTH
-//  CHECKSUM:  32 Bits    <-  0 - (Sum of Length --> End of Data)
-//
-//  Note : If Length == 0, Address will be Program Start
-//
-//
-//  
-//
-//
-
-#define MajRevNum 0
-#define MinRevNum 2
-
-
-#define EndianSwitch(x) ((x >> 24) | (x << 24) | ((x << 8) & (0x00FF0000)) | ((x >> 8) & (0x0000FF00)) )
-
-typedef unsigned char bit8u;
-typedef unsigned int bit32u;
-typedef int bit32;
-
-#define FALSE 0
-#define TRUE (!FALSE)
-
-
-bit32u CheckSum;
-int RecStart;
-int debug;
-int verbose;
-
-FILE *OpenOutputFile( char *Name );
-FILE *fOut;
-bit32u RecLength=0;
-
-bit32u AddressCurrent;
-
-bit32u gh(char *cp,int nibs);
-
-int BigEndian;
-
-int inputline;
-
-// char buf[16*1024];
-
-char buffer[2048];
-char *cur_ptr;
-int cur_line=0;
-int cur_len=0;
-
-int s1s2s3_total=0;
-
-bit32u PBVal;
-int    PBValid;
-bit32u PBAdr;
-
-
-void dumpfTell(char *s, bit32u Value)
+#include <unistd.h>
+#include <libgen.h>
+#include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "md5.h"
+
+#define TAG_BIG		0xDEADBE42
+#define TAG_LITTLE	0xFEEDFA42
+
+#define INBUF_SIZE	(1024 * 1024)
+#define REC_HDR_LEN	8
+#define REC_CSUM_LEN	4
+
+/* a run of contiguous addresses, the sparse map of the image */
+struct range {
+	uint32_t addr;
+	uint32_t len;
+	uint8_t md5[16];
+};
+
+static char *progname;
+static char *ifname;
+static char *ofname;
+static char *split_prefix;
+static char *manifest_name;
+static int big_endian;
+static int verbose;
+
+/* digit values, HEX_BAD for anything else */
+#define HEX_BAD		0x10
+static uint8_t hexval[256];
+
+static int out_fd = -1;
+
+/* the run being assembled: header, data and room for the checksum */
+static uint8_t *rec_buf;
+static size_t rec_size;
+static int rec_open;
+static uint32_t rec_addr;
+static uint32_t rec_len;
+static uint32_t rec_sum;
+static uint32_t next_addr;
+
+static struct range *ranges;
+static int num_ranges;
+
+static unsigned data_records;
+
+#define ERR(fmt, ...) do { \
+	fflush(0); \
+	fprintf(stderr, "[%s] *** error: " fmt "\n", \
+			progname, ## __VA_ARGS__ ); \
+} while (0)
+
+#define ERRS(fmt, ...) do { \
+	int save = errno; \
+	fflush(0); \
+	fprintf(stderr, "[%s] *** error: " fmt ": %s\n", \
+			progname, ## __VA_ARGS__, strerror(save)); \
+} while (0)
+
+static void usage(int status)
 {
-    int Length;
-    Length = (int) RecLength;
-    if (debug)
-          printf("[%s  ] ftell()[0x%08lX] Length[0x%4X] Length[%4d] Value[0x%08x]\n",
-                s, ftell(fOut), Length, Length, Value);
+	FILE *stream = (status != EXIT_SUCCESS) ? stderr : stdout;
+
+	fprintf(stream, "Usage: %s [OPTIONS...] <input> [<output> [big]]\n",
+		progname);
+	fprintf(stream,
+"\n"
+"Options:\n"
+"  -s <prefix>     write the data of each address range to its own file\n"
+"                  named <prefix>-<address>.bin\n"
+"  -m <file>       write a manifest with the address, length and MD5 of\n"
+"                  each address range to <file>\n"
+"  -v              verbose\n"
+"  -h              show this screen\n"
+"\n"
+"The output file uses the big endian tag if a third argument is given.\n"
+	);
+
+	exit(status);
 }
 
-void DispHex(bit32u Hex)
+static void hex_init(void)
 {
-//    printf("%X", Hex);
+	int i;
+
+	memset(hexval, HEX_BAD, sizeof(hexval));
+	for (i = 0; i < 10; i++)
+		hexval['0' + i] = i;
+	for (i = 0; i < 6; i++) {
+		hexval['a' + i] = 10 + i;
+		hexval['A' + i] = 10 + i;
+	}
 }
 
-void WaitDisplay(void)
+/* decode len bytes, returns -1 on invalid digits */
+static int hex_decode(const char *s, uint8_t *buf, unsigned len)
 {
-   static int Count=0;
-   static int Index=0;
-   char iline[]={"-\\|/"};
-
-   Count++;
-   if ((Count % 32)==0)
-   {
-     if (verbose)
-        printf("%c%c",iline[Index++],8);
-     Index &= 3;
-   }
+	const uint8_t *p = (const uint8_t *) s;
+	uint8_t hi, lo, bad = 0;
+	unsigned i;
+
+	for (i = 0; i < len; i++, p += 2) {
+		hi = hexval[p[0]];
+		lo = hexval[p[1]];
+		bad |= hi | lo;
+		buf[i] = (hi << 4) | lo;
+	}
+
+	return (bad & HEX_BAD) ? -1 : 0;
 }
 
-
-void binOut32 ( bit32u Data )
+static void put_le32(uint8_t *p, uint32_t v)
 {
-// On UNIX machine all 32bit writes need ENDIAN switched
-//    Data = EndianSwitch(Data);
-//    fwrite( &Data, sizeof(bit32u), 1, fOut);
-
-   char sdat[4];
-   int i;
-
-   for(i=0;i<4;i++)
-    sdat[i]=(char)(Data>>(i*8));
-   fwrite( sdat, 1, 4, fOut);
-   dumpfTell("Out32" , Data);
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
 }
 
-// Only update RecLength on Byte Writes
-// All 32 bit writes will be for Length etc
-
-void binOut8 ( bit8u Data )
+static int write_all(int fd, const uint8_t *buf, size_t len)
 {
-    int n;
-    dumpfTell("B4Data" , (bit32u) (Data & 0xFF) );
-    n = fwrite( &Data, sizeof(bit8u), 1, fOut);
-    if (n != 1)
-        printf("Error in writing %X for Address 0x%8X\n", Data, AddressCurrent);
-    RecLength += 1;
-}
+	ssize_t ret;
 
-//  Currently ONLY used for outputting Program Start
+	while (len) {
+		ret = write(fd, buf, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
 
-void binRecStart(bit32u Address)
-{
-    RecLength      = 0;
-    CheckSum       = Address;
-    RecStart       = TRUE;
+		buf += ret;
+		len -= ret;
+	}
 
-    if (debug)
-          printf("[RecStart] CheckSum[0x%08X] Length[%4d] Address[0x%08X]\n",
-                CheckSum, RecLength, Address);
-
-
-    dumpfTell("RecLength", RecLength);
-    binOut32( RecLength );
-    dumpfTell("Address", Address);
-    binOut32( Address );
+	return 0;
 }
 
-void binRecEnd(void)
+static int write_file(const char *name, const uint8_t *buf, size_t len)
 {
-    long RecEnd;
-
-    if (!RecStart)   //  if no record started, do not end it
-    {
-        return;
-    }
-
-    RecStart = FALSE;
-
-
-    RecEnd = ftell(fOut);         // Save Current position
-
-    if (debug)
-          printf("[RecEnd  ] CheckSum[0x%08X] Length[%4d] Length[0x%X] RecEnd[0x%08lX]\n",
-                CheckSum, RecLength, RecLength, RecEnd);
+	int fd, ret;
 
-    fseek( fOut, -((long) RecLength), SEEK_CUR);  // move back Start Of Data
+	fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		ERRS("could not open \"%s\" for writing", name);
+		return -1;
+	}
 
-    dumpfTell("Data   ", -1);
+	ret = write_all(fd, buf, len);
+	if (close(fd))
+		ret = -1;
 
-    fseek( fOut, -4, SEEK_CUR);  // move back Start Of Address
+	if (ret) {
+		ERRS("unable to write to file \"%s\"", name);
+		unlink(name);
+	}
 
-    dumpfTell("Address   ", -1);
-
-    fseek( fOut, -4, SEEK_CUR);  // move back Start Of Length
-
-    dumpfTell("Length   ", -1);
-
-    binOut32( RecLength );
+	return ret;
+}
 
-    fseek( fOut, RecEnd, SEEK_SET);  // move to end of Record
+static int rec_reserve(size_t len)
+{
+	size_t need = REC_HDR_LEN + rec_len + len + REC_CSUM_LEN;
+	size_t size = rec_size ? rec_size : 64 * 1024;
+	uint8_t *buf;
 
-    CheckSum += RecLength;
+	if (need <= rec_size)
+		return 0;
 
-    CheckSum =  ~CheckSum + 1;  // Two's complement
+	while (size < need)
+		size *= 2;
 
-    binOut32( CheckSum );
+	buf = realloc(rec_buf, size);
+	if (!buf) {
+		ERR("out of memory");
+		return -1;
+	}
 
-    if (verbose)
-        printf("[Created Record of %d Bytes with CheckSum [0x%8X]\n", RecLength, CheckSum);
+	rec_buf = buf;
+	rec_size = size;
+	return 0;
 }
 
-void binRecOutProgramStart(bit32u Address)
+static int rec_end(void)
 {
-    if (Address != (AddressCurrent+1))
-    {
-        binRecEnd();
-        binRecStart(Address);
-    }
-    AddressCurrent = Address;
+	struct range *r;
+	MD5_CTX ctx;
+	char name[4096];
+	uint32_t csum;
+
+	if (!rec_open)
+		return 0;
+
+	rec_open = 0;
+
+	csum = ~(rec_addr + rec_sum + rec_len) + 1;
+	put_le32(rec_buf, rec_len);
+	put_le32(rec_buf + 4, rec_addr);
+	put_le32(rec_buf + REC_HDR_LEN + rec_len, csum);
+
+	if (out_fd >= 0 &&
+	    write_all(out_fd, rec_buf, REC_HDR_LEN + rec_len + REC_CSUM_LEN)) {
+		ERRS("unable to write to file \"%s\"", ofname);
+		return -1;
+	}
+
+	if (verbose)
+		printf("[Created Record of %d Bytes with CheckSum [0x%8X]\n",
+		       rec_len, csum);
+
+	if (manifest_name) {
+		r = realloc(ranges, (num_ranges + 1) * sizeof(*ranges));
+		if (!r) {
+			ERR("out of memory");
+			return -1;
+		}
+		ranges = r;
+		r = &ranges[num_ranges++];
+
+		r->addr = rec_addr;
+		r->len = rec_len;
+		MD5_Init(&ctx);
+		MD5_Update(&ctx, rec_buf + REC_HDR_LEN, rec_len);
+		MD5_Final(r->md5, &ctx);
+	}
+
+	if (split_prefix && rec_len) {
+		snprintf(name, sizeof(name), "%s-%08x.bin", split_prefix,
+			 rec_addr);
+		if (write_file(name, rec_buf + REC_HDR_LEN, rec_len))
+			return -1;
+	}
+
+	return 0;
 }
-void binRecOutByte(bit32u Address, bit8u Data)
+
+static int rec_start(uint32_t addr)
 {
-    //  If Address is one after Current Address, output Byte
-    //  If not, close out last record, update Length, write checksum
-    //  Then Start New Record, updating Current Address
-
-    if (Address != (AddressCurrent+1))
-    {
-        binRecEnd();
-        binRecStart(Address);
-    }
-    AddressCurrent = Address;
-    CheckSum += Data;
-    binOut8( Data );
+	if (rec_end())
+		return -1;
+
+	rec_addr = addr;
+	rec_len = 0;
+	rec_sum = 0;
+	if (rec_reserve(0))
+		return -1;
+
+	rec_open = 1;
+	return 0;
 }
 
-//=============================================================================
-//       SUPPORT FUNCTIONS
-//=============================================================================
-int readline(FILE *fil,char *buf,int len)
+static int add_data(uint32_t addr, const uint8_t *data, unsigned len)
 {
-    int rlen;
-    
-    rlen=0;
-    if (len==0)  return(0);
-    while(1)
-    {
-      if (cur_len==0)
-      {
-        cur_len=fread(buffer, 1, sizeof(buffer), fil);
-        if (cur_len==0)
-        {
-          if (rlen)
-          {
-            *buf=0;
-            return(rlen);
-          }
-          return(-1);
-        }
-        cur_ptr=buffer;
-      }
-      if (cur_len)
-      {
-        if (*cur_ptr=='\n')
-        {
-          *buf=0;
-          cur_ptr++;
-          cur_len--;
-          return(rlen);
-        }
-         else
-         {
-           if ((len>1)&&(*cur_ptr!='\r'))
-           {
-             *buf++=*cur_ptr++;
-             len--;
-           }
-           else
-             cur_ptr++;
-
-           rlen++;
-           cur_len--;
-         }
-      }
-      else
-      {
-        *buf=0;
-        cur_ptr++;
-        cur_len--;
-        return(rlen);
-      }
-    }
-}
+	unsigned i;
 
+	if ((!rec_open || addr != next_addr) && rec_start(addr))
+		return -1;
 
-int SRLerrorout(char *c1,char *c2)
-{
-  printf("\nERROR: %s - '%s'.",c1,c2);
-  return(FALSE);
-}
+	if (rec_reserve(len))
+		return -1;
 
+	memcpy(rec_buf + REC_HDR_LEN + rec_len, data, len);
+	for (i = 0; i < len; i++)
+		rec_sum += data[i];
+	rec_len += len;
+	next_addr = addr + len;
 
-int checksum(char *cp,int count)
-{
-  char *scp;
-  int cksum;
-  int dum;
-
-  scp=cp;
-  while(*scp)
-  {
-    if (!isxdigit(*scp++))
-      return(SRLerrorout("Invalid hex digits",cp));
-  }
-  scp=cp;
-
-  cksum=count;
-
-  while(count)
-  {
-    cksum += gh(scp,2);
-    if (count == 2)
-        dum = ~cksum;
-    scp += 2;
-    count--;
-  }
-  cksum&=0x0ff; 
-  //  printf("\nCk:%02x",cksum);
-  return(cksum==0x0ff);
+	return 0;
 }
 
-bit32u gh(char *cp,int nibs)
+/*
+ * The program start becomes an empty record, unless it directly follows
+ * the data. Like the original tool, the record then only continues with
+ * data one byte past the start address.
+ */
+static int program_start(uint32_t addr)
 {
-  int i;
-  bit32u j;
-
-  j=0;
-
-  for(i=0;i<nibs;i++)
-  {
-    j<<=4;
-    if ((*cp>='a')&&(*cp<='z')) *cp &= 0x5f;
-    if ((*cp>='0')&&(*cp<='9')) 
-      j += (*cp-0x30);
-     else
-      if ((*cp>='A')&&(*cp<='F'))
-        j += (*cp-0x37);
-       else
-        SRLerrorout("Bad Hex char", cp);
-    cp++;
-  }
-  return(j);
-}
-
+	if ((!rec_open || addr != next_addr) && rec_start(addr))
+		return -1;
 
-//=============================================================================
-//       PROCESS SREC LINE
-//=============================================================================
+	next_addr = addr + 1;
+	return 0;
+}
 
-int srecLine(char *pSrecLine)
+static int parse_line(const char *line, unsigned len, int lineno)
 {
-    char *scp,ch;
-    int  itmp,count,dat;
-    bit32u adr;
-    static bit32u RecordCounter=0;
-
-    cur_line++;
-    scp=pSrecLine;
-  
-    if (*pSrecLine!='S')
-      return(SRLerrorout("Not an Srecord file",scp));
-    pSrecLine++;
-    if (strlen(pSrecLine)<4)
-      return(SRLerrorout("Srecord too short",scp));
-  
-    ch=*pSrecLine++;
-  
-    count=gh(pSrecLine,2);
-  
-    pSrecLine += 2;
-  
-  //  if(debug)
-  //        printf("count %d, strlen(pSrecLine) = %d, pSrecLine =[%s]\n", count, strlen(pSrecLine), pSrecLine);
-     RecordCounter++;
-     DispHex(RecordCounter);
-  
-    if ((count*2) != strlen(pSrecLine)) return(SRLerrorout("Count field larger than record",scp));
-  
-    if (!checksum(pSrecLine, count)) return(SRLerrorout("Bad Checksum",scp));
-  
-    switch(ch)
-    {
-        case '0': if (count<3) return(SRLerrorout("Invalid Srecord count field",scp));
-                  itmp=gh(pSrecLine,4); pSrecLine+=4; count-=2;
-                  if (itmp) return(SRLerrorout("Srecord 1 address not zero",scp));
-        break;
-        case '1': if (count<3) return(SRLerrorout("Invalid Srecord count field",scp));
-                  return(SRLerrorout("Srecord Not valid for MIPS",scp));
-        break;
-        case '2': if (count<4) return(SRLerrorout("Invalid Srecord count field",scp));
-                  return(SRLerrorout("Srecord Not valid for MIPS",scp));
-        break;
-        case '3': if (count<5) return(SRLerrorout("Invalid Srecord count field",scp));
-                  adr=gh(pSrecLine,8); pSrecLine+=8; count-=4;
-                  count--;
-                  while(count)
-                  {
-                    dat=gh(pSrecLine,2); pSrecLine+=2; count--;
-                    binRecOutByte(adr, (char) (dat & 0xFF));
-                    adr++;
-                  }
-                  s1s2s3_total++;
-        break;
-        case '4': return(SRLerrorout("Invalid Srecord type",scp));
-        break;
-        case '5': if (count<3) return(SRLerrorout("Invalid Srecord count field",scp));
-                  itmp=gh(pSrecLine,4); pSrecLine+=4; count-=2;
-                  if (itmp|=s1s2s3_total) return(SRLerrorout("Incorrect number of S3 Record processed",scp));
-        break;
-        case '6': return(SRLerrorout("Invalid Srecord type",scp));
-        break;
-        case '7': // PROGRAM START
-                  if (count<5) return(SRLerrorout("Invalid Srecord count field",scp));
-                  adr=gh(pSrecLine,8); pSrecLine+=8; count-=4;
-                  if (count!=1) return(SRLerrorout("Invalid Srecord count field",scp));
-                  binRecOutProgramStart(adr);
-        break;
-        case '8': if (count<4) return(SRLerrorout("Invalid Srecord count field",scp));
-                  return(SRLerrorout("Srecord Not valid for MIPS",scp));
-        break;
-        case '9': if (count<3) return(SRLerrorout("Invalid Srecord count field",scp));
-                  return(SRLerrorout("Srecord Not valid for MIPS",scp));
-        break;
-        default:
-        break;
-    }
-    return(TRUE);
+	uint8_t rec[256];
+	unsigned count, sum, i;
+	char type;
+
+#define LINE_ERR(msg) do { \
+	ERR("line %d: %s - '%.*s'", lineno, msg, len, line); \
+	return -1; \
+} while (0)
+
+	if (line[0] != 'S')
+		LINE_ERR("Not an Srecord file");
+
+	if (len < 5)
+		LINE_ERR("Srecord too short");
+
+	type = line[1];
+	if (hex_decode(line + 2, rec, 1))
+		LINE_ERR("Invalid hex digits");
+
+	count = rec[0];
+	if (len - 4 != count * 2)
+		LINE_ERR("Count field does not match record length");
+
+	if (hex_decode(line + 4, rec + 1, count))
+		LINE_ERR("Invalid hex digits");
+
+	for (sum = 0, i = 0; i <= count; i++)
+		sum += rec[i];
+	if ((sum & 0xff) != 0xff)
+		LINE_ERR("Bad Checksum");
+
+	switch (type) {
+	case '0':
+		if (count < 3)
+			LINE_ERR("Invalid Srecord count field");
+		if (rec[1] || rec[2])
+			LINE_ERR("Srecord 0 address not zero");
+		break;
+	case '1':
+	case '2':
+	case '8':
+	case '9':
+		LINE_ERR("Srecord Not valid for MIPS");
+		break;
+	case '3':
+		if (count < 5)
+			LINE_ERR("Invalid Srecord count field");
+		if (add_data((rec[1] << 24) | (rec[2] << 16) | (rec[3] << 8) | rec[4],
+			     rec + 5, count - 5))
+			return -1;
+		data_records++;
+		break;
+	case '5':
+		if (count < 3)
+			LINE_ERR("Invalid Srecord count field");
+		if (((rec[1] << 8) | rec[2]) != (data_records & 0xffff))
+			LINE_ERR("Incorrect number of S3 Record processed");
+		break;
+	case '7':
+		if (count != 5)
+			LINE_ERR("Invalid Srecord count field");
+		if (program_start((rec[1] << 24) | (rec[2] << 16) |
+				  (rec[3] << 8) | rec[4]))
+			return -1;
+		break;
+	case '4':
+	case '6':
+		LINE_ERR("Invalid Srecord type");
+		break;
+	default:
+		break;
+	}
+
+#undef LINE_ERR
+
+	return 0;
 }
- 
 
-//=============================================================================
-//       MAIN LOGIC, READS IN LINE AND OUTPUTS BINARY
-//=============================================================================
-
-int srec2bin(int argc,char *argv[],int verbose)
+static int parse_file(int fd)
 {
-    int i,rlen,sts;
-    FILE *fp;
-    char ac;
-    char buff[256];
-    bit32u TAG_BIG     = 0xDEADBE42;
-    bit32u TAG_LITTLE  = 0xFEEDFA42;
-
-    bit32u Tag;
-
-  
-    if(argc < 3)
-    {
-      printf("\nError: <srec2bin <srec input file> <bin output file>\n\n");
-      return(0);
-    }
-  
-    if (argc > 3) BigEndian=TRUE; else BigEndian=FALSE;
-
-    if (BigEndian)
-        Tag = TAG_BIG;
-    else
-        Tag = TAG_LITTLE;
-
-    if (verbose)
-       printf("\nEndian: %s, Tag is 0x%8X\n",(BigEndian)?"BIG":"LITTLE", Tag);
-
-    fp = fopen(argv[1],"rt");
-
-    if (fp==NULL)
-    {
-      printf("\nError: Opening input file, %s.", argv[1]);
-      return(0);
-    }
-  
-    fOut = fopen( argv[2], "wb");
-    
-    if (fOut==NULL)
-    {
-      printf("\nError: Opening Output file, %s.", argv[2]);
-      if(fp) fclose(fp);
-      return(0);
-    }
- 
-    RecStart = FALSE;
-
-    AddressCurrent = 0xFFFFFFFFL;
-
-    // Setup Tag 
-  
-    dumpfTell("Tag", Tag);
-
-    binOut32(Tag);
-
-  
-    inputline=0;
-    sts=TRUE;
-
-    rlen = readline(fp,buff,sizeof buff);
-
-    while( (sts) && (rlen != -1))
-    {
-        if (strlen(buff))
-        {
-            sts &= srecLine(buff);
-            WaitDisplay();
-        }
-       rlen = readline(fp,buff,sizeof buff);
-    }
-
-  
-  //  printf("PC: 0x%08X, Length 0x%08X, Tag 0x%08X\n", ProgramStart, RecLength, TAG_LITTLE);
-  
-    binRecEnd();
-
-    if(fp) fclose(fp);
-    if(fOut) fclose(fOut);
-
-    return(1);
+	char *buf, *line, *end, *nl;
+	size_t fill = 0;
+	unsigned len;
+	ssize_t n;
+	int lineno = 0;
+	int eof = 0;
+	int ret = -1;
+
+	buf = malloc(INBUF_SIZE);
+	if (!buf) {
+		ERR("out of memory");
+		return -1;
+	}
+
+	while (!eof) {
+		n = read(fd, buf + fill, INBUF_SIZE - fill);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			ERRS("unable to read from file \"%s\"", ifname);
+			goto out;
+		}
+
+		fill += n;
+		if (n == 0) {
+			/* terminate a last line without newline */
+			if (!fill)
+				break;
+			buf[fill++] = '\n';
+			eof = 1;
+		}
+
+		line = buf;
+		end = buf + fill;
+		while ((nl = memchr(line, '\n', end - line)) != NULL) {
+			lineno++;
+			len = nl - line;
+			while (len && line[len - 1] == '\r')
+				len--;
+
+			if (len && parse_line(line, len, lineno))
+				goto out;
+
+			line = nl + 1;
+		}
+
+		fill = end - line;
+		if (fill == INBUF_SIZE) {
+			ERR("line %d: line too long", lineno + 1);
+			goto out;
+		}
+		memmove(buf, line, fill);
+	}
+
+	ret = rec_end();
+
+out:
+	free(buf);
+	return ret;
 }
 
-main(int argc, char *argv[])
+static int write_manifest(void)
 {
-    debug = TRUE;
-    debug = FALSE;
-    verbose = FALSE;
-    srec2bin(argc,argv,verbose);
-    return 0;
+	FILE *f;
+	int i, j;
+
+	f = fopen(manifest_name, "w");
+	if (!f) {
+		ERRS("could not open \"%s\" for writing", manifest_name);
+		return -1;
+	}
+
+	for (i = 0; i < num_ranges; i++) {
+		fprintf(f, "0x%08x %u ", ranges[i].addr, ranges[i].len);
+		for (j = 0; j < 16; j++)
+			fprintf(f, "%02x", ranges[i].md5[j]);
+		if (split_prefix && ranges[i].len)
+			fprintf(f, " %s-%08x.bin", split_prefix, ranges[i].addr);
+		fprintf(f, "\n");
+	}
+
+	if (fclose(f)) {
+		ERRS("unable to write to file \"%s\"", manifest_name);
+		unlink(manifest_name);
+		return -1;
+	}
+
+	return 0;
 }
 
+int main(int argc, char *argv[])
+{
+	int res = EXIT_FAILURE;
+	uint8_t tag[4];
+	int in_fd;
+	int c;
+
+	progname = basename(argv[0]);
+
+	while ((c = getopt(argc, argv, "s:m:vh")) != -1) {
+		switch (c) {
+		case 's':
+			split_prefix = optarg;
+			break;
+		case 'm':
+			manifest_name = optarg;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'h':
+			usage(EXIT_SUCCESS);
+			break;
+		default:
+			usage(EXIT_FAILURE);
+			break;
+		}
+	}
+
+	if (optind >= argc)
+		usage(EXIT_FAILURE);
+
+	ifname = argv[optind++];
+	if (optind < argc)
+		ofname = argv[optind++];
+	if (optind < argc)
+		big_endian = 1;
+
+	if (!ofname && !split_prefix && !manifest_name) {
+		ERR("no output specified");
+		usage(EXIT_FAILURE);
+	}
+
+	hex_init();
+
+	in_fd = open(ifname, O_RDONLY);
+	if (in_fd < 0) {
+		ERRS("could not open \"%s\" for reading", ifname);
+		goto err;
+	}
+
+	if (ofname) {
+		out_fd = open(ofname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (out_fd < 0) {
+			ERRS("could not open \"%s\" for writing", ofname);
+			goto err_close_in;
+		}
+
+		put_le32(tag, big_endian ? TAG_BIG : TAG_LITTLE);
+		if (verbose)
+			printf("Endian: %s, Tag is 0x%8X\n",
+			       big_endian ? "BIG" : "LITTLE",
+			       big_endian ? TAG_BIG : TAG_LITTLE);
+
+		if (write_all(out_fd, tag, sizeof(tag))) {
+			ERRS("unable to write to file \"%s\"", ofname);
+			goto err_close_out;
+		}
+	}
+
+	if (parse_file(in_fd))
+		goto err_close_out;
+
+	if (manifest_name && write_manifest())
+		goto err_close_out;
+
+	res = EXIT_SUCCESS;
+
+err_close_out:
+	if (out_fd >= 0) {
+		if (close(out_fd) && res == EXIT_SUCCESS) {
+			ERRS("unable to write to file \"%s\"", ofname);
+			res = EXIT_FAILURE;
+		}
+		if (res != EXIT_SUCCESS)
+			unlink(ofname);
+	}
+
+err_close_in:
+	close(in_fd);
+
+err:
+	free(rec_buf);
+	free(ranges);
+	return res;
+}
@@ -48,6 +48,7 @@
 #include <sys/stat.h>
 
 #include "md5.h"
+#include "fwimage.h"
 
 
 #define ALIGN(x,a) ({ typeof(a) __a = (a); (((x) + __a - 1) & ~(__a - 1)); })
@@ -58,6 +59,10 @@ struct image_partition_entry {
 	const char *name;
 	size_t size;
 	uint8_t *data;
+
+	/* partitions read from a file are mapped instead of copied into data */
+	const char *file;
+	size_t file_size;
 };
 
 /** A flash partition table entry */
@@ -154,7 +159,7 @@ static const unsigned char cpe510_support_list[] =
 /** Allocates a new image partition */
 struct image_partition_entry alloc_image_partition(const char *name, size_t len) {
 	struct image_partition_entry entry = {name, len, malloc(len)};
-	if (!entry.data)
+	if (len && !entry.data)
 		error(1, errno, "malloc");
 
 	return entry;
@@ -251,25 +256,29 @@ struct image_partition_entry read_file(const char *part_name, const char *filena
 	if (add_jffs2_eof)
 		len = ALIGN(len, 0x10000) + sizeof(jffs2_eof_mark);
 
-	struct image_partition_entry entry = alloc_image_partition(part_name, len);
-
-	FILE *file = fopen(filename, "rb");
-	if (!file)
-		error(1, errno, "unable to open file `%s'", filename);
+	struct image_partition_entry entry = alloc_image_partition(part_name, 0);
+	entry.size = len;
+	entry.file = filename;
+	entry.file_size = statbuf.st_size;
 
-	if (fread(entry.data, statbuf.st_size, 1, file) != 1)
-		error(1, errno, "unable to read file `%s'", filename);
-
-	if (add_jffs2_eof) {
-		uint8_t *eof = entry.data + statbuf.st_size, *end = entry.data+entry.size;
+	return entry;
+}
 
-		memset(eof, 0xff, end - eof - sizeof(jffs2_eof_mark));
-		memcpy(end - sizeof(jffs2_eof_mark), jffs2_eof_mark, sizeof(jffs2_eof_mark));
+/** Places an image partition at the given offset of the image */
+void put_partition(struct fwimage *img, size_t offset, const struct image_partition_entry *part) {
+	if (!part->file) {
+		if (fwimage_add_data(img, offset, part->data, part->size))
+			error(1, 0, "unable to add partition `%s'", part->name);
+		return;
 	}
 
-	fclose(file);
+	if (fwimage_add_file(img, offset, part->file, NULL))
+		error(1, 0, "unable to read file `%s'", part->file);
 
-	return entry;
+	/* the space between the file data and the jffs2 marker reads as 0xff */
+	if (part->size > part->file_size &&
+	    fwimage_add_data(img, offset + part->size - sizeof(jffs2_eof_mark), jffs2_eof_mark, sizeof(jffs2_eof_mark)))
+		error(1, 0, "unable to add partition `%s'", part->name);
 }
 
 
@@ -300,13 +309,13 @@ struct image_partition_entry read_file(const char *part_name, const char *filena
 
    I think partition-table must be the first partition in the firmware image.
 */
-void put_partitions(uint8_t *buffer, const struct image_partition_entry *parts) {
+void put_partitions(struct fwimage *img, uint8_t *buffer, size_t offset, const struct image_partition_entry *parts) {
 	size_t i;
 	char *image_pt = (char *)buffer, *end = image_pt + 0x800;
 
 	size_t base = 0x800;
 	for (i = 0; parts[i].name; i++) {
-		memcpy(buffer + base, parts[i].data, parts[i].size);
+		put_partition(img, offset + base, &parts[i]);
 
 		size_t len = end-image_pt;
 		size_t w = snprintf(image_pt, len, "fwup-ptn %s base 0x%05x size 0x%05x\t\r\n", parts[i].name, (unsigned)base, (unsigned)parts[i].size);
@@ -324,13 +333,17 @@ void put_partitions(uint8_t *buffer, const struct image_partition_entry *parts)
 	memset(image_pt, 0xff, end-image_pt);
 }
 
+static void md5_update(void *ctx, const void *buf, size_t len) {
+	MD5_Update(ctx, buf, len);
+}
+
 /** Generates and writes the image MD5 checksum */
-void put_md5(uint8_t *md5, uint8_t *buffer, unsigned int len) {
+void put_md5(uint8_t *md5, struct fwimage *img, size_t offset, size_t len) {
 	MD5_CTX ctx;
 
 	MD5_Init(&ctx);
 	MD5_Update(&ctx, md5_salt, (unsigned int)sizeof(md5_salt));
-	MD5_Update(&ctx, buffer, len);
+	fwimage_hash(img, offset, len, md5_update, &ctx);
 	MD5_Final(md5, &ctx);
 }
 
@@ -349,14 +362,15 @@ void put_md5(uint8_t *md5, uint8_t *buffer, unsigned int len) {
      1014-1813    Image partition table (2048 bytes, padded with 0xff)
      1814-xxxx    Firmware partitions
 */
-void * generate_factory_image(const unsigned char *vendor, size_t vendor_len, const struct image_partition_entry *parts, size_t *len) {
+void * generate_factory_image(struct fwimage *img, const unsigned char *vendor, size_t vendor_len, const struct image_partition_entry *parts, size_t *len) {
 	*len = 0x1814;
 
 	size_t i;
 	for (i = 0; parts[i].name; i++)
 		*len += parts[i].size;
 
-	uint8_t *image = malloc(*len);
+	/* only the header is kept in memory, the partitions are added to img */
+	uint8_t *image = malloc(0x1814);
 	if (!image)
 		error(1, errno, "malloc");
 
@@ -368,8 +382,11 @@ void * generate_factory_image(const unsigned char *vendor, size_t vendor_len, co
 	memcpy(image+0x14, vendor, vendor_len);
 	memset(image+0x14+vendor_len, 0xff, 4096-vendor_len);
 
-	put_partitions(image + 0x1014, parts);
-	put_md5(image+0x04, image+0x14, *len-0x14);
+	if (fwimage_add_data(img, 0, image, 0x1814))
+		error(1, 0, "unable to add image header");
+
+	put_partitions(img, image + 0x1014, 0x1014, parts);
+	put_md5(image+0x04, img, 0x14, *len-0x14);
 
 	return image;
 }
@@ -381,7 +398,7 @@ void * generate_factory_image(const unsigned char *vendor, size_t vendor_len, co
    should be generalized when TP-LINK starts building its safeloader into hardware with
    different flash layouts.
 */
-void * generate_sysupgrade_image(const struct flash_partition_entry *flash_parts, const struct image_partition_entry *image_parts, size_t *len) {
+void * generate_sysupgrade_image(struct fwimage *img, const struct flash_partition_entry *flash_parts, const struct image_partition_entry *image_parts, size_t *len) {
 	const struct flash_partition_entry *flash_os_image = &flash_parts[5];
 	const struct flash_partition_entry *flash_soft_version = &flash_parts[6];
 	const struct flash_partition_entry *flash_support_list = &flash_parts[7];
@@ -409,18 +426,12 @@ void * generate_sysupgrade_image(const struct flash_partition_entry *flash_parts
 
 	*len = flash_file_system->base - flash_os_image->base + image_file_system->size;
 
-	uint8_t *image = malloc(*len);
-	if (!image)
-		error(1, errno, "malloc");
-
-	memset(image, 0xff, *len);
+	put_partition(img, 0, image_os_image);
+	put_partition(img, flash_soft_version->base - flash_os_image->base, image_soft_version);
+	put_partition(img, flash_support_list->base - flash_os_image->base, image_support_list);
+	put_partition(img, flash_file_system->base - flash_os_image->base, image_file_system);
 
-	memcpy(image, image_os_image->data, image_os_image->size);
-	memcpy(image + flash_soft_version->base - flash_os_image->base, image_soft_version->data, image_soft_version->size);
-	memcpy(image + flash_support_list->base - flash_os_image->base, image_support_list->data, image_support_list->size);
-	memcpy(image + flash_file_system->base - flash_os_image->base, image_file_system->data, image_file_system->size);
-
-	return image;
+	return NULL;
 }
 
 
@@ -434,21 +445,20 @@ static void do_cpe510(const char *output, const char *kernel_image, const char *
 	parts[3] = read_file("os-image", kernel_image, false);
 	parts[4] = read_file("file-system", rootfs_image, add_jffs2_eof);
 
+	struct fwimage img;
+	fwimage_init(&img, 0xff);
+
 	size_t len;
 	void *image;
 	if (sysupgrade)
-		image = generate_sysupgrade_image(cpe510_partitions, parts, &len);
+		image = generate_sysupgrade_image(&img, cpe510_partitions, parts, &len);
 	else
-		image = generate_factory_image(cpe510_vendor, sizeof(cpe510_vendor)-1, parts, &len);
-
-	FILE *file = fopen(output, "wb");
-	if (!file)
-		error(1, errno, "unable to open output file");
+		image = generate_factory_image(&img, cpe510_vendor, sizeof(cpe510_vendor)-1, parts, &len);
 
-	if (fwrite(image, len, 1, file) != 1)
+	if (fwimage_write(&img, output, len))
 		error(1, 0, "unable to write output file");
 
-	fclose(file);
+	fwimage_free(&img);
 
 	free(image);
 
@@ -25,10 +25,21 @@
 #include <unistd.h>
 #include <sys/stat.h>
 
+#define BUFSIZE		(1024 * 1024)
+#define PATTERN_REP	4096
+
 static char default_pattern[] = "12345678";
 
+/*
+ * The pattern repeated to a multiple of its length of at least PATTERN_REP
+ * bytes, so that whole runs of data can be XORed against it word by word.
+ */
+static uint8_t *rep_pattern;
+static const uint8_t *rep_source;
+static int rep_len;
 
-int xor_data(uint8_t *data, size_t len, const uint8_t *pattern, int p_len, int p_off)
+static int xor_data_bytewise(uint8_t *data, size_t len, const uint8_t *pattern,
+			     int p_len, int p_off)
 {
 	int offset = p_off;
 	while (len--) {
@@ -39,30 +50,160 @@ int xor_data(uint8_t *data, size_t len, const uint8_t *pattern, int p_len, int p
 	return offset;
 }
 
+static void xor_words(uint8_t *data, const uint8_t *pattern, size_t len)
+{
+	uint64_t d[4], p[4];
+	int i;
+
+	for (; len >= 32; len -= 32, data += 32, pattern += 32) {
+		memcpy(d, data, 32);
+		memcpy(p, pattern, 32);
+		for (i = 0; i < 4; i++)
+			d[i] ^= p[i];
+		memcpy(data, d, 32);
+	}
+
+	for (; len >= 8; len -= 8, data += 8, pattern += 8) {
+		memcpy(d, data, 8);
+		memcpy(p, pattern, 8);
+		d[0] ^= p[0];
+		memcpy(data, d, 8);
+	}
+
+	while (len--)
+		*data++ ^= *pattern++;
+}
+
+int xor_data(uint8_t *data, size_t len, const uint8_t *pattern, int p_len, int p_off)
+{
+	size_t n;
+	int i;
+
+	if (rep_source != pattern || rep_len % p_len) {
+		free(rep_pattern);
+		rep_len = (PATTERN_REP + p_len - 1) / p_len * p_len;
+		rep_pattern = malloc(rep_len);
+		rep_source = pattern;
+		if (!rep_pattern) {
+			rep_source = NULL;
+			return xor_data_bytewise(data, len, pattern, p_len, p_off);
+		}
+
+		for (i = 0; i < rep_len; i++)
+			rep_pattern[i] = pattern[i % p_len];
+	}
+
+	while (len) {
+		n = rep_len - p_off;
+		if (n > len)
+			n = len;
+
+		xor_words(data, rep_pattern + p_off, n);
+		data += n;
+		len -= n;
+		p_off = (p_off + n) % p_len;
+	}
+
+	return p_off;
+}
+
+static int self_test(void)
+{
+	static const char *patterns[] = { "12345678", "a", "xyz", "0123456789abcdefghijklmnopqrstuvwxyz" };
+	uint8_t ref[8192], buf[8192];
+	int i, j, len, off, r1, r2, p_len;
+
+	for (i = 0; i < sizeof(ref); i++)
+		ref[i] = i * 7 + (i >> 8);
+
+	for (i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+		p_len = strlen(patterns[i]);
+		for (j = 0; j < 200; j++) {
+			len = (j * 997) % sizeof(ref);
+			off = j % p_len;
+
+			memcpy(buf, ref, len);
+			r1 = xor_data_bytewise(ref, len, (const uint8_t *) patterns[i], p_len, off);
+			r2 = xor_data(buf, len, (const uint8_t *) patterns[i], p_len, off);
+			if (r1 != r2 || memcmp(ref, buf, len)) {
+				fprintf(stderr, "self-test failed for pattern \"%s\", "
+					"length %d, offset %d\n", patterns[i], len, off);
+				return EXIT_FAILURE;
+			}
+		}
+	}
+
+	fprintf(stderr, "self-test passed\n");
+	return EXIT_SUCCESS;
+}
+
+/* run both versions over one I/O buffer until size bytes are done */
+static int benchmark(const char *pattern, size_t size)
+{
+	struct timespec start, end;
+	int p_len = strlen(pattern);
+	int p_off = 0;
+	uint8_t *buf;
+	size_t done;
+	double t;
+	int i;
+
+	buf = malloc(BUFSIZE);
+	if (!buf) {
+		fprintf(stderr, "out of memory\n");
+		return EXIT_FAILURE;
+	}
+	memset(buf, 0, BUFSIZE);
+
+	for (i = 0; i < 2; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (done = 0; done < size; done += BUFSIZE) {
+			if (i == 0)
+				p_off = xor_data(buf, BUFSIZE, (const uint8_t *) pattern,
+						 p_len, p_off);
+			else
+				p_off = xor_data_bytewise(buf, BUFSIZE,
+							  (const uint8_t *) pattern,
+							  p_len, p_off);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		t = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		printf("%s XOR: %.1f MiB/s\n", i ? "byte" : "word",
+		       done / t / (1024 * 1024));
+	}
+
+	free(buf);
+	return EXIT_SUCCESS;
+}
+
 
 void usage(void) __attribute__ (( __noreturn__ ));
 
 void usage(void)
 {
 	fprintf(stderr, "Usage: xorimage [-i infile] [-o outfile] [-p <pattern>]\n");
+	fprintf(stderr, "       xorimage -T\n");
+	fprintf(stderr, "       xorimage [-p <pattern>] -B <MiB>\n");
 	exit(EXIT_FAILURE);
 }
 
 
 int main(int argc, char **argv)
 {
-	char buf[1024];	/* keep this at 1k or adjust garbage calc below */
+	uint8_t *buf;
 	FILE *in = stdin;
 	FILE *out = stdout;
 	char *ifn = NULL;
 	char *ofn = NULL;
 	const char *pattern = default_pattern;
 	int c;
-	int v0, v1, v2;
 	size_t n;
 	int p_len, p_off = 0;
+	int test = 0;
+	size_t bench_size = 0;
 
-	while ((c = getopt(argc, argv, "i:o:p:h")) != -1) {
+	while ((c = getopt(argc, argv, "i:o:p:TB:h")) != -1) {
 		switch (c) {
 			case 'i':
 				ifn = optarg;
@@ -73,12 +214,21 @@ int main(int argc, char **argv)
 			case 'p':
 				pattern = optarg;
 				break;
+			case 'T':
+				test = 1;
+				break;
+			case 'B':
+				bench_size = strtoul(optarg, NULL, 0) << 20;
+				break;
 			case 'h':
 			default:
 				usage();
 		}
 	}
 
+	if (test)
+		return self_test();
+
 	if (optind != argc || optind == 1) {
 		fprintf(stderr, "illegal arg \"%s\"\n", argv[optind]);
 		usage();
@@ -101,9 +251,17 @@ int main(int argc, char **argv)
 		usage();
 	}
 
+	if (bench_size)
+		return benchmark(pattern, bench_size);
+
+	buf = malloc(BUFSIZE);
+	if (!buf) {
+		fprintf(stderr, "out of memory\n");
+		return EXIT_FAILURE;
+	}
 
-	while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
-		if (n < sizeof(buf)) {
+	while ((n = fread(buf, 1, BUFSIZE, in)) > 0) {
+		if (n < BUFSIZE) {
 			if (ferror(in)) {
 			FREAD_ERROR:
 				fprintf(stderr, "fread error\n");